@@ -70,6 +70,25 @@ WITH_PYTHON:=yes
 # Build with SRV lookup support.
 WITH_SRV:=yes
 
+# Resolve bridge addresses in the background using getaddrinfo_a(), so that a
+# slow DNS server cannot stall the broker. Only used on Linux, and requires
+# glibc. Comment out to use the blocking getaddrinfo() instead.
+WITH_ADNS:=yes
+
+# Uncomment to allow bridges to compress batches of messages with zlib, and to
+# accept compressed batches from other brokers. See batch_compression.
+#WITH_ZLIB:=yes
+
+# Uncomment to allow TLS handshakes for incoming connections to be done by a
+# pool of worker threads instead of the main loop. See tls_handshake_threads.
+# Requires WITH_TLS=yes and pthreads.
+#WITH_TLS_THREADS:=yes
+
+# Uncomment to allow log messages to be written by a separate thread, so that
+# slow log destinations don't hold up the broker. See log_queue_size.
+# Requires pthreads.
+#WITH_LOG_THREAD:=yes
+
 # =============================================================================
 # End of user configuration
 # =============================================================================
@@ -206,6 +225,30 @@ ifeq ($(WITH_SRV),yes)
 	LIB_LIBS:=$(LIB_LIBS) -lcares
 endif
 
+ifeq ($(WITH_ADNS),yes)
+ifeq ($(UNAME),Linux)
+	BROKER_LIBS:=$(BROKER_LIBS) -lanl
+	BROKER_CFLAGS:=$(BROKER_CFLAGS) -DWITH_ADNS
+endif
+endif
+
+ifeq ($(WITH_ZLIB),yes)
+	BROKER_LIBS:=$(BROKER_LIBS) -lz
+	BROKER_CFLAGS:=$(BROKER_CFLAGS) -DWITH_ZLIB
+endif
+
+ifeq ($(WITH_TLS),yes)
+	ifeq ($(WITH_TLS_THREADS),yes)
+		BROKER_LIBS:=$(BROKER_LIBS) -lpthread
+		BROKER_CFLAGS:=$(BROKER_CFLAGS) -DWITH_TLS_THREADS
+	endif
+endif
+
+ifeq ($(WITH_LOG_THREAD),yes)
+	BROKER_LIBS:=$(BROKER_LIBS) -lpthread
+	BROKER_CFLAGS:=$(BROKER_CFLAGS) -DWITH_LOG_THREAD
+endif
+
 ifeq ($(UNAME),SunOS)
 	BROKER_LIBS:=$(BROKER_LIBS) -lsocket -lnsl
 	LIB_LIBS:=$(LIB_LIBS) -lsocket -lnsl
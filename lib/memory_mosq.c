@@ -29,106 +29,497 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include "config.h"
 
+#include <assert.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "memory_mosq.h"
 
 #ifdef REAL_WITH_MEMORY_TRACKING
-#  if defined(__APPLE__)
-#    include <malloc/malloc.h>
-#    define malloc_usable_size malloc_size
-#  elif defined(__FreeBSD__)
-#    include <malloc_np.h>
-#  else
-#    include <malloc.h>
-#  endif
-#endif
+/* Every tracked allocation is preceded by a header recording its size and
+ * the subsystem it is accounted against, so freeing it doesn't need to ask
+ * the allocator how large the block was. */
+union _mosquitto_mem_header {
+	struct _mosquitto_mem_header_data {
+		size_t size;
+		uint32_t type;
+	} h;
+	double align;
+};
+
+/* Memory that is counted in the heap total but not against a subsystem,
+ * used for pool slabs whose objects are accounted for individually. */
+#define MEM_TYPE_UNATTRIBUTED mosq_mt_count
 
-#ifdef REAL_WITH_MEMORY_TRACKING
 static unsigned long memcount = 0;
 static unsigned long max_memcount = 0;
+static unsigned long memcount_type[mosq_mt_count];
+
+#ifdef WITH_TLS_THREADS
+/* OpenSSL allocates through here from the TLS handshake threads. */
+#  define MEM_ADD(var, n) __sync_add_and_fetch(&(var), (n))
+#  define MEM_SUB(var, n) __sync_sub_and_fetch(&(var), (n))
+#  define MEM_GET(var) __sync_add_and_fetch(&(var), 0)
+#else
+#  define MEM_ADD(var, n) ((var) += (n))
+#  define MEM_SUB(var, n) ((var) -= (n))
+#  define MEM_GET(var) (var)
 #endif
 
-void *_mosquitto_calloc(size_t nmemb, size_t size)
+static void _mem_max_update(unsigned long count)
 {
-	void *mem = calloc(nmemb, size);
+#ifdef WITH_TLS_THREADS
+	unsigned long max;
+
+	while(count > (max = MEM_GET(max_memcount))){
+		if(__sync_bool_compare_and_swap(&max_memcount, max, count)) break;
+	}
+#else
+	if(count > max_memcount){
+		max_memcount = count;
+	}
+#endif
+}
 
+static void *_mem_track(union _mosquitto_mem_header *hdr, size_t size, uint32_t type)
+{
+	unsigned long count;
+
+	if(!hdr) return NULL;
+
+	hdr->h.size = size;
+	hdr->h.type = type;
+	count = MEM_ADD(memcount, size + sizeof(union _mosquitto_mem_header));
+	_mem_max_update(count);
+	if(type < mosq_mt_count){
+		MEM_ADD(memcount_type[type], size);
+	}
+	return (uint8_t *)hdr + sizeof(union _mosquitto_mem_header);
+}
+
+static union _mosquitto_mem_header *_mem_untrack(void *mem)
+{
+	union _mosquitto_mem_header *hdr;
+
+	hdr = (union _mosquitto_mem_header *)((uint8_t *)mem - sizeof(union _mosquitto_mem_header));
+	MEM_SUB(memcount, hdr->h.size + sizeof(union _mosquitto_mem_header));
+	if(hdr->h.type < mosq_mt_count){
+		MEM_SUB(memcount_type[hdr->h.type], hdr->h.size);
+	}
+	return hdr;
+}
+
+static void *_mosquitto_malloc_internal(size_t size, uint32_t type)
+{
+	return _mem_track(malloc(size + sizeof(union _mosquitto_mem_header)), size, type);
+}
+#endif
+
+void *_mosquitto_calloc_typed(size_t nmemb, size_t size, enum mosquitto_mem_type type)
+{
 #ifdef REAL_WITH_MEMORY_TRACKING
-	memcount += malloc_usable_size(mem);
-	if(memcount > max_memcount){
-		max_memcount = memcount;
+	if(size && nmemb > (SIZE_MAX - sizeof(union _mosquitto_mem_header))/size){
+		return NULL;
 	}
+	return _mem_track(calloc(1, nmemb*size + sizeof(union _mosquitto_mem_header)), nmemb*size, type);
+#else
+	return calloc(nmemb, size);
 #endif
+}
 
-	return mem;
+void *_mosquitto_calloc(size_t nmemb, size_t size)
+{
+	return _mosquitto_calloc_typed(nmemb, size, mosq_mt_other);
 }
 
 void _mosquitto_free(void *mem)
 {
 #ifdef REAL_WITH_MEMORY_TRACKING
-	memcount -= malloc_usable_size(mem);
-#endif
+	if(!mem) return;
+	free(_mem_untrack(mem));
+#else
 	free(mem);
+#endif
 }
 
-void *_mosquitto_malloc(size_t size)
+void *_mosquitto_malloc_typed(size_t size, enum mosquitto_mem_type type)
 {
-	void *mem = malloc(size);
-
 #ifdef REAL_WITH_MEMORY_TRACKING
-	memcount += malloc_usable_size(mem);
-	if(memcount > max_memcount){
-		max_memcount = memcount;
-	}
+	return _mosquitto_malloc_internal(size, type);
+#else
+	return malloc(size);
 #endif
+}
 
-	return mem;
+void *_mosquitto_malloc(size_t size)
+{
+	return _mosquitto_malloc_typed(size, mosq_mt_other);
 }
 
 #ifdef REAL_WITH_MEMORY_TRACKING
 unsigned long _mosquitto_memory_used(void)
 {
-	return memcount;
+	return MEM_GET(memcount);
 }
 
 unsigned long _mosquitto_max_memory_used(void)
 {
-	return max_memcount;
+	return MEM_GET(max_memcount);
+}
+
+unsigned long _mosquitto_memory_type_used(enum mosquitto_mem_type type)
+{
+	assert(type >= 0 && type < mosq_mt_count);
+	return MEM_GET(memcount_type[type]);
+}
+#endif
+
+/* Move the accounting for memory that has changed role, for example a stored
+ * message that has become the retained message for a topic, without
+ * reallocating it. */
+void _mosquitto_memory_transfer(enum mosquitto_mem_type from, enum mosquitto_mem_type to, size_t size)
+{
+#ifdef REAL_WITH_MEMORY_TRACKING
+	assert(from >= 0 && from < mosq_mt_count);
+	assert(to >= 0 && to < mosq_mt_count);
+	MEM_SUB(memcount_type[from], size);
+	MEM_ADD(memcount_type[to], size);
+#endif
 }
+
+/* The amount accounted against a subsystem for mem, which must have come from
+ * one of the _mosquitto_*alloc*() functions. Used with
+ * _mosquitto_memory_transfer() so that exactly what was charged is moved. */
+size_t _mosquitto_memory_charged(void *mem)
+{
+#ifdef REAL_WITH_MEMORY_TRACKING
+	union _mosquitto_mem_header *hdr;
+
+	if(!mem) return 0;
+	hdr = (union _mosquitto_mem_header *)((uint8_t *)mem - sizeof(union _mosquitto_mem_header));
+	return hdr->h.size;
+#else
+	return 0;
+#endif
+}
+
+void *_mosquitto_realloc_typed(void *ptr, size_t size, enum mosquitto_mem_type type)
+{
+#ifdef REAL_WITH_MEMORY_TRACKING
+	union _mosquitto_mem_header *hdr, *mem;
+	size_t old_size;
+
+	if(!ptr){
+		return _mosquitto_malloc_internal(size, type);
+	}
+	hdr = _mem_untrack(ptr);
+	old_size = hdr->h.size;
+	mem = realloc(hdr, size + sizeof(union _mosquitto_mem_header));
+	if(!mem){
+		_mem_track(hdr, old_size, type);
+		return NULL;
+	}
+	return _mem_track(mem, size, type);
+#else
+	return realloc(ptr, size);
 #endif
+}
 
 void *_mosquitto_realloc(void *ptr, size_t size)
 {
-	void *mem;
 #ifdef REAL_WITH_MEMORY_TRACKING
+	union _mosquitto_mem_header *hdr;
+
 	if(ptr){
-		memcount -= malloc_usable_size(ptr);
+		/* Keep the existing accounting */
+		hdr = (union _mosquitto_mem_header *)((uint8_t *)ptr - sizeof(union _mosquitto_mem_header));
+		return _mosquitto_realloc_typed(ptr, size, hdr->h.type);
 	}
 #endif
-	mem = realloc(ptr, size);
+	return _mosquitto_realloc_typed(ptr, size, mosq_mt_other);
+}
+
+char *_mosquitto_strdup_typed(const char *s, enum mosquitto_mem_type type)
+{
+#ifdef REAL_WITH_MEMORY_TRACKING
+	char *str;
+	size_t len;
+
+	len = strlen(s);
+	str = _mosquitto_malloc_internal(len+1, type);
+	if(!str) return NULL;
+	memcpy(str, s, len+1);
+	return str;
+#else
+	return strdup(s);
+#endif
+}
+
+char *_mosquitto_strdup(const char *s)
+{
+	return _mosquitto_strdup_typed(s, mosq_mt_other);
+}
+
+#ifdef WITH_BROKER
+/* Size of each block of memory requested from malloc when a pool runs out of
+ * free objects. Slabs are kept for the lifetime of the broker. */
+#define POOL_SLAB_SIZE 16384
+#define POOL_MIN_OBJECTS 16
+
+/* Header placed at the start of every slab, and at the start of every
+ * buffer handed out by _mosquitto_buf_malloc(). Sized to keep the following
+ * memory suitably aligned. */
+union _mosquitto_pool_header {
+	struct _mosquitto_pool_header_data {
+		union _mosquitto_pool_header *next;
+		uint32_t type;
+		uint32_t mem_type;
+	} h;
+	double align;
+};
+
+struct _mosquitto_pool {
+	const char *name;
+	size_t obj_size;
+	enum mosquitto_mem_type mem_type;
+	void *free_list;
+	union _mosquitto_pool_header *slabs;
+	unsigned long in_use;
+	unsigned long free;
+	unsigned long slab_count;
+};
+
+static struct _mosquitto_pool pools[mosq_pt_count] = {
+	{"client messages", 0, mosq_mt_messages, NULL, NULL, 0, 0, 0},
+	{"stored messages", 0, mosq_mt_messages, NULL, NULL, 0, 0, 0},
+	{"packets", 0, mosq_mt_packets, NULL, NULL, 0, 0, 0},
+	{"subscriptions", 0, mosq_mt_subscriptions, NULL, NULL, 0, 0, 0},
+	{"topic tokens", 0, mosq_mt_subscriptions, NULL, NULL, 0, 0, 0},
+	/* Buffers are accounted to the subsystem that requested them. */
+	{"buffers/32", 32, mosq_mt_other, NULL, NULL, 0, 0, 0},
+	{"buffers/64", 64, mosq_mt_other, NULL, NULL, 0, 0, 0},
+	{"buffers/128", 128, mosq_mt_other, NULL, NULL, 0, 0, 0},
+	{"buffers/256", 256, mosq_mt_other, NULL, NULL, 0, 0, 0},
+	{"buffers/512", 512, mosq_mt_other, NULL, NULL, 0, 0, 0},
+	{"buffers/1024", 1024, mosq_mt_other, NULL, NULL, 0, 0, 0},
+};
+
+static int _pool_grow(struct _mosquitto_pool *pool)
+{
+	union _mosquitto_pool_header *slab;
+	size_t slab_size;
+	unsigned long count, i;
+	uint8_t *obj;
+
+	count = (POOL_SLAB_SIZE - sizeof(union _mosquitto_pool_header))/pool->obj_size;
+	if(count < POOL_MIN_OBJECTS){
+		count = POOL_MIN_OBJECTS;
+	}
+	slab_size = sizeof(union _mosquitto_pool_header) + count*pool->obj_size;
 
 #ifdef REAL_WITH_MEMORY_TRACKING
-	memcount += malloc_usable_size(mem);
-	if(memcount > max_memcount){
-		max_memcount = memcount;
+	slab = _mosquitto_malloc_internal(slab_size, MEM_TYPE_UNATTRIBUTED);
+#else
+	slab = _mosquitto_malloc(slab_size);
+#endif
+	if(!slab) return 1;
+
+	slab->h.next = pool->slabs;
+	pool->slabs = slab;
+	pool->slab_count++;
+
+	obj = (uint8_t *)slab + sizeof(union _mosquitto_pool_header);
+	for(i=0; i<count; i++){
+		*(void **)obj = pool->free_list;
+		pool->free_list = obj;
+		obj += pool->obj_size;
+	}
+	pool->free += count;
+	return 0;
+}
+
+static void *_pool_get(struct _mosquitto_pool *pool)
+{
+	void *mem;
+
+	if(!pool->free_list){
+		if(_pool_grow(pool)) return NULL;
 	}
+	mem = pool->free_list;
+	pool->free_list = *(void **)mem;
+	pool->free--;
+	pool->in_use++;
+	return mem;
+}
+
+static void _pool_put(struct _mosquitto_pool *pool, void *mem)
+{
+	*(void **)mem = pool->free_list;
+	pool->free_list = mem;
+	pool->free++;
+	pool->in_use--;
+}
 #endif
 
+void *_mosquitto_pool_calloc(enum mosquitto_pool_type type, size_t size)
+{
+#ifdef WITH_BROKER
+	struct _mosquitto_pool *pool;
+	void *mem;
+
+	assert(type >= 0 && type < mosq_pt_count);
+	pool = &pools[type];
+	if(!pool->obj_size){
+		/* First use of this pool, round the object size up so that each
+		 * object is pointer aligned and can hold the free list link. */
+		pool->obj_size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	}
+	assert(size <= pool->obj_size);
+
+	mem = _pool_get(pool);
+	if(mem){
+		memset(mem, 0, size);
+#ifdef REAL_WITH_MEMORY_TRACKING
+		MEM_ADD(memcount_type[pool->mem_type], pool->obj_size);
+#endif
+	}
 	return mem;
+#else
+	return _mosquitto_calloc(1, size);
+#endif
 }
 
-char *_mosquitto_strdup(const char *s)
+void _mosquitto_pool_free(enum mosquitto_pool_type type, void *mem)
 {
-	char *str = strdup(s);
+#ifdef WITH_BROKER
+	if(!mem) return;
+	assert(type >= 0 && type < mosq_pt_count);
+	_pool_put(&pools[type], mem);
+#ifdef REAL_WITH_MEMORY_TRACKING
+	MEM_SUB(memcount_type[pools[type].mem_type], pools[type].obj_size);
+#endif
+#else
+	_mosquitto_free(mem);
+#endif
+}
+
+/* The amount accounted against a subsystem for each object from pool type. */
+size_t _mosquitto_pool_charged(enum mosquitto_pool_type type)
+{
+	assert(type >= 0 && type < mosq_pt_count);
+#if defined(WITH_BROKER) && defined(REAL_WITH_MEMORY_TRACKING)
+	return pools[type].obj_size;
+#else
+	return 0;
+#endif
+}
+
+void _mosquitto_pool_stats(enum mosquitto_pool_type type, struct mosquitto_pool_stats *stats)
+{
+	assert(type >= 0 && type < mosq_pt_count);
+	assert(stats);
+
+#ifdef WITH_BROKER
+	stats->name = pools[type].name;
+	stats->obj_size = pools[type].obj_size;
+	stats->in_use = pools[type].in_use;
+	stats->free = pools[type].free;
+	stats->slabs = pools[type].slab_count;
+#else
+	memset(stats, 0, sizeof(struct mosquitto_pool_stats));
+#endif
+}
+
+void _mosquitto_pool_cleanup(void)
+{
+#ifdef WITH_BROKER
+	union _mosquitto_pool_header *slab;
+	int i;
+
+	for(i=0; i<mosq_pt_count; i++){
+		while(pools[i].slabs){
+			slab = pools[i].slabs;
+			pools[i].slabs = slab->h.next;
+			_mosquitto_free(slab);
+		}
+		pools[i].free_list = NULL;
+		pools[i].in_use = 0;
+		pools[i].free = 0;
+		pools[i].slab_count = 0;
+	}
+#endif
+}
+
+void *_mosquitto_buf_malloc(size_t size, enum mosquitto_mem_type type)
+{
+#ifdef WITH_BROKER
+	union _mosquitto_pool_header *hdr = NULL;
+	int i;
 
+	for(i=mosq_pt_buf_32; i<=mosq_pt_buf_1024; i++){
+		if(size + sizeof(union _mosquitto_pool_header) <= pools[i].obj_size){
+			hdr = _pool_get(&pools[i]);
 #ifdef REAL_WITH_MEMORY_TRACKING
-	memcount += malloc_usable_size(str);
-	if(memcount > max_memcount){
-		max_memcount = memcount;
+			if(hdr){
+				MEM_ADD(memcount_type[type], pools[i].obj_size);
+			}
+#endif
+			break;
+		}
+	}
+	if(i > mosq_pt_buf_1024){
+		hdr = _mosquitto_malloc_typed(size + sizeof(union _mosquitto_pool_header), type);
 	}
+	if(!hdr) return NULL;
+
+	hdr->h.type = i;
+	hdr->h.mem_type = type;
+	return (uint8_t *)hdr + sizeof(union _mosquitto_pool_header);
+#else
+	return _mosquitto_malloc_typed(size, type);
 #endif
+}
 
-	return str;
+void _mosquitto_buf_free(void *mem)
+{
+#ifdef WITH_BROKER
+	union _mosquitto_pool_header *hdr;
+
+	if(!mem) return;
+	hdr = (union _mosquitto_pool_header *)((uint8_t *)mem - sizeof(union _mosquitto_pool_header));
+	if(hdr->h.type >= mosq_pt_buf_32 && hdr->h.type <= mosq_pt_buf_1024){
+#ifdef REAL_WITH_MEMORY_TRACKING
+		MEM_SUB(memcount_type[hdr->h.mem_type], pools[hdr->h.type].obj_size);
+#endif
+		_pool_put(&pools[hdr->h.type], hdr);
+	}else{
+		_mosquitto_free(hdr);
+	}
+#else
+	_mosquitto_free(mem);
+#endif
 }
 
+/* The amount accounted against a subsystem for mem, which must have come from
+ * _mosquitto_buf_malloc(). */
+size_t _mosquitto_buf_charged(void *mem)
+{
+#ifdef WITH_BROKER
+	union _mosquitto_pool_header *hdr;
+
+	if(!mem) return 0;
+	hdr = (union _mosquitto_pool_header *)((uint8_t *)mem - sizeof(union _mosquitto_pool_header));
+	if(hdr->h.type >= mosq_pt_buf_32 && hdr->h.type <= mosq_pt_buf_1024){
+#ifdef REAL_WITH_MEMORY_TRACKING
+		return pools[hdr->h.type].obj_size;
+#else
+		return 0;
+#endif
+	}else{
+		return _mosquitto_memory_charged(hdr);
+	}
+#else
+	return _mosquitto_memory_charged(mem);
+#endif
+}
@@ -37,14 +37,76 @@ POSSIBILITY OF SUCH DAMAGE.
 #define REAL_WITH_MEMORY_TRACKING
 #endif
 
+/* Subsystems that memory is accounted against when memory tracking is
+ * enabled. The untyped allocation functions account against mosq_mt_other. */
+enum mosquitto_mem_type {
+	mosq_mt_other = 0,
+	mosq_mt_messages = 1,
+	mosq_mt_retained = 2,
+	mosq_mt_subscriptions = 3,
+	mosq_mt_contexts = 4,
+	mosq_mt_packets = 5,
+	mosq_mt_tls = 6,
+	mosq_mt_count = 7
+};
+
 void *_mosquitto_calloc(size_t nmemb, size_t size);
+void *_mosquitto_calloc_typed(size_t nmemb, size_t size, enum mosquitto_mem_type type);
 void _mosquitto_free(void *mem);
 void *_mosquitto_malloc(size_t size);
+void *_mosquitto_malloc_typed(size_t size, enum mosquitto_mem_type type);
 #ifdef REAL_WITH_MEMORY_TRACKING
 unsigned long _mosquitto_memory_used(void);
 unsigned long _mosquitto_max_memory_used(void);
+unsigned long _mosquitto_memory_type_used(enum mosquitto_mem_type type);
 #endif
+void _mosquitto_memory_transfer(enum mosquitto_mem_type from, enum mosquitto_mem_type to, size_t size);
+size_t _mosquitto_memory_charged(void *mem);
 void *_mosquitto_realloc(void *ptr, size_t size);
+void *_mosquitto_realloc_typed(void *ptr, size_t size, enum mosquitto_mem_type type);
 char *_mosquitto_strdup(const char *s);
+char *_mosquitto_strdup_typed(const char *s, enum mosquitto_mem_type type);
+
+/* Fixed size object pools. In the broker these are carved out of slabs and
+ * recycled through a free list rather than being returned to malloc. In the
+ * client library they are plain calloc()/free() because the library may be
+ * used from several threads. */
+enum mosquitto_pool_type {
+	mosq_pt_client_msg = 0,
+	mosq_pt_msg_store = 1,
+	mosq_pt_packet = 2,
+	mosq_pt_subleaf = 3,
+	mosq_pt_sub_token = 4,
+	mosq_pt_buf_32 = 5,
+	mosq_pt_buf_64 = 6,
+	mosq_pt_buf_128 = 7,
+	mosq_pt_buf_256 = 8,
+	mosq_pt_buf_512 = 9,
+	mosq_pt_buf_1024 = 10,
+	mosq_pt_count = 11
+};
+
+struct mosquitto_pool_stats {
+	const char *name;
+	size_t obj_size;
+	unsigned long in_use;
+	unsigned long free;
+	unsigned long slabs;
+};
+
+void *_mosquitto_pool_calloc(enum mosquitto_pool_type type, size_t size);
+void _mosquitto_pool_free(enum mosquitto_pool_type type, void *mem);
+size_t _mosquitto_pool_charged(enum mosquitto_pool_type type);
+void _mosquitto_pool_stats(enum mosquitto_pool_type type, struct mosquitto_pool_stats *stats);
+void _mosquitto_pool_cleanup(void);
+
+/* Variable size buffers (packet and message payloads). Small buffers come
+ * from the mosq_pt_buf_* size classes, larger ones from _mosquitto_malloc().
+ * The memory is accounted against 'type'.
+ * Memory from _mosquitto_buf_malloc() must only be released with
+ * _mosquitto_buf_free(). */
+void *_mosquitto_buf_malloc(size_t size, enum mosquitto_mem_type type);
+void _mosquitto_buf_free(void *mem);
+size_t _mosquitto_buf_charged(void *mem);
 
 #endif
@@ -367,7 +367,7 @@ void _mosquitto_destroy(struct mosquitto *mosq)
 		}
 
 		_mosquitto_packet_cleanup(packet);
-		_mosquitto_free(packet);
+		_mosquitto_pool_free(mosq_pt_packet, packet);
 	}
 
 	_mosquitto_packet_cleanup(&mosq->in_packet);
@@ -503,7 +503,7 @@ static int _mosquitto_reconnect(struct mosquitto *mosq, bool blocking)
 		}
 
 		_mosquitto_packet_cleanup(packet);
-		_mosquitto_free(packet);
+		_mosquitto_pool_free(mosq_pt_packet, packet);
 	}
 	pthread_mutex_unlock(&mosq->out_packet_mutex);
 	pthread_mutex_unlock(&mosq->current_out_packet_mutex);
@@ -817,6 +817,7 @@ int mosquitto_loop(struct mosquitto *mosq, int timeout, int max_packets)
 	int rc;
 	char pairbuf;
 	int maxfd = 0;
+	bool tls_pending = false;
 
 	if(!mosq || max_packets < 1) return MOSQ_ERR_INVAL;
 
@@ -863,6 +864,14 @@ int mosquitto_loop(struct mosquitto *mosq, int timeout, int max_packets)
 		}
 	}
 
+#ifdef WITH_TLS
+	if(mosq->ssl && SSL_pending(mosq->ssl)){
+		/* The broker may send several packets in one TLS record. Those
+		 * after the first are already decrypted and won't wake select(). */
+		tls_pending = true;
+		timeout = 0;
+	}
+#endif
 	if(timeout >= 0){
 		local_timeout.tv_sec = timeout/1000;
 #ifdef HAVE_PSELECT
@@ -895,7 +904,7 @@ int mosquitto_loop(struct mosquitto *mosq, int timeout, int max_packets)
 		}
 	}else{
 		if(mosq->sock != INVALID_SOCKET){
-			if(FD_ISSET(mosq->sock, &readfds)){
+			if(FD_ISSET(mosq->sock, &readfds) || tls_pending){
 				rc = mosquitto_loop_read(mosq, max_packets);
 				if(rc || mosq->sock == INVALID_SOCKET){
 					return rc;
@@ -68,6 +68,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "time_mosq.h"
 #ifdef WITH_BROKER
 struct mosquitto_client_msg;
+struct _mosquitto_retain_cursor;
 #endif
 
 enum mosquitto_msg_direction {
@@ -90,6 +91,16 @@ enum mosquitto_msg_state {
 	mosq_ms_queued = 11
 };
 
+#ifdef WITH_TLS_THREADS
+enum mosquitto_tls_handshake {
+	mosq_th_none = 0,
+	mosq_th_want_read = 1,
+	mosq_th_want_write = 2,
+	mosq_th_queued = 3,
+	mosq_th_failed = 4
+};
+#endif
+
 enum mosquitto_client_state {
 	mosq_cs_new = 0,
 	mosq_cs_connected = 1,
@@ -125,6 +136,9 @@ struct _mosquitto_packet{
 	uint32_t pos;
 	uint8_t *payload;
 	struct _mosquitto_packet *next;
+#ifdef WITH_BROKER
+	uint64_t store_time;
+#endif
 };
 
 struct mosquitto_message_all{
@@ -137,6 +151,10 @@ struct mosquitto_message_all{
 };
 
 struct mosquitto {
+	/* The broker visits every context on each pass of its main loop, so the
+	 * fields it needs for an idle client are kept together at the start of
+	 * the structure. Fields that are only used when a client connects, sends
+	 * data or disconnects follow. */
 #ifndef WIN32
 	int sock;
 #  ifndef WITH_BROKER
@@ -148,21 +166,40 @@ struct mosquitto {
 	SOCKET sockpairR, sockpairW;
 #  endif
 #endif
-	enum _mosquitto_protocol protocol;
-	char *address;
-	char *id;
-	char *username;
-	char *password;
+	enum mosquitto_client_state state;
 	uint16_t keepalive;
 	bool clean_session;
-	enum mosquitto_client_state state;
+	bool want_write;
+#ifdef WITH_BROKER
+	bool read_paused;
+	bool has_published;
+	bool is_dropping;
+	int pollfd_index;
+	int db_index;
+#endif
 	time_t last_msg_in;
+#ifdef WITH_BROKER
+	struct _mqtt3_bridge *bridge;
+	struct mosquitto_client_msg *msgs;
+#endif
+	struct _mosquitto_packet *current_out_packet;
+	char *id;
+#ifdef WITH_BROKER
+	unsigned long out_packet_bytes;
+	struct mosquitto *flow_blocker;
+	int flow_blocker_index;
+	time_t disconnect_t;
+#endif
 	time_t last_msg_out;
+	struct _mosquitto_packet *out_packet;
+
+	enum _mosquitto_protocol protocol;
+	char *address;
+	char *username;
+	char *password;
 	time_t ping_t;
 	uint16_t last_mid;
 	struct _mosquitto_packet in_packet;
-	struct _mosquitto_packet *current_out_packet;
-	struct _mosquitto_packet *out_packet;
 	struct mosquitto_message *will;
 #ifdef WITH_TLS
 	SSL *ssl;
@@ -179,7 +216,6 @@ struct mosquitto {
 	char *tls_psk_identity;
 	bool tls_insecure;
 #endif
-	bool want_write;
 #if defined(WITH_THREADING) && !defined(WITH_BROKER)
 	pthread_mutex_t callback_mutex;
 	pthread_mutex_t log_callback_mutex;
@@ -193,18 +229,21 @@ struct mosquitto {
 #endif
 #ifdef WITH_BROKER
 	bool is_bridge;
-	struct _mqtt3_bridge *bridge;
-	struct mosquitto_client_msg *msgs;
+	bool origin_tagging;
 	struct mosquitto_client_msg *last_msg;
 	int msg_count;
 	int msg_count12;
+	struct _mosquitto_retain_cursor *retain_cursors;
 	struct _mosquitto_acl_user *acl_list;
 	struct _mqtt3_listener *listener;
-	time_t disconnect_t;
-	int pollfd_index;
-	int db_index;
 	struct _mosquitto_packet *out_packet_last;
-	bool is_dropping;
+	uint64_t publish_store_time;
+#  ifdef WITH_TLS_THREADS
+	enum mosquitto_tls_handshake tls_handshake;
+	enum mosquitto_tls_handshake tls_handshake_result;
+	unsigned long tls_error;
+	struct mosquitto *tls_handshake_next;
+#  endif
 #else
 	void *userdata;
 	bool in_callback;
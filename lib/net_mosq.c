@@ -77,6 +77,7 @@ POSSIBILITY OF SUCH DAMAGE.
    extern unsigned long g_msgs_sent;
    extern unsigned long g_pub_msgs_received;
    extern unsigned long g_pub_msgs_sent;
+   extern struct _mqtt3_histogram g_latency_delivery;
 #  endif
 #else
 #  include <read_handle.h>
@@ -93,6 +94,66 @@ POSSIBILITY OF SUCH DAMAGE.
 int tls_ex_index_mosq = -1;
 #endif
 
+#if defined(WITH_BROKER) && defined(WITH_SYS_TREE)
+/* The listener or bridge that traffic on mosq should be counted against. */
+static struct _mqtt3_traffic *_mosquitto_traffic(struct mosquitto *mosq)
+{
+	if(mosq->listener){
+		return &mosq->listener->traffic;
+	}else if(mosq->bridge){
+		return &mosq->bridge->traffic;
+	}
+	return NULL;
+}
+#endif
+
+#if defined(WITH_BROKER) && defined(WITH_TLS)
+/* Whether packets for mosq are written several to a TLS record. This is only
+ * done on listeners with tls_coalesce_writes set, because clients that wait
+ * on their socket without checking SSL_pending() don't see the packets after
+ * the first in a record until more data arrives. */
+static bool _mosquitto_tls_coalesce(struct mosquitto *mosq)
+{
+	return mosq->ssl && mosq->listener && mosq->listener->tls_coalesce_writes;
+}
+#endif
+
+#if defined(WITH_TLS) && defined(REAL_WITH_MEMORY_TRACKING)
+/* Route OpenSSL allocations through the broker allocator so they are
+ * accounted as TLS memory. */
+#  if OPENSSL_VERSION_NUMBER >= 0x10100000L
+static void *_tls_malloc(size_t num, const char *file, int line)
+{
+	return _mosquitto_malloc_typed(num, mosq_mt_tls);
+}
+
+static void *_tls_realloc(void *ptr, size_t num, const char *file, int line)
+{
+	return _mosquitto_realloc_typed(ptr, num, mosq_mt_tls);
+}
+
+static void _tls_free(void *ptr, const char *file, int line)
+{
+	_mosquitto_free(ptr);
+}
+#  else
+static void *_tls_malloc(size_t num)
+{
+	return _mosquitto_malloc_typed(num, mosq_mt_tls);
+}
+
+static void *_tls_realloc(void *ptr, size_t num)
+{
+	return _mosquitto_realloc_typed(ptr, num, mosq_mt_tls);
+}
+
+static void _tls_free(void *ptr)
+{
+	_mosquitto_free(ptr);
+}
+#  endif
+#endif
+
 void _mosquitto_net_init(void)
 {
 #ifdef WIN32
@@ -105,6 +166,11 @@ void _mosquitto_net_init(void)
 #endif
 
 #ifdef WITH_TLS
+#  ifdef REAL_WITH_MEMORY_TRACKING
+	/* This only succeeds if OpenSSL hasn't allocated anything yet, otherwise
+	 * the default allocator stays in place and TLS memory is untracked. */
+	CRYPTO_set_mem_functions(_tls_malloc, _tls_realloc, _tls_free);
+#  endif
 	SSL_load_error_strings();
 	SSL_library_init();
 	OpenSSL_add_all_algorithms();
@@ -141,12 +207,31 @@ void _mosquitto_packet_cleanup(struct _mosquitto_packet *packet)
 	packet->remaining_count = 0;
 	packet->remaining_mult = 1;
 	packet->remaining_length = 0;
-	if(packet->payload) _mosquitto_free(packet->payload);
+	if(packet->payload) _mosquitto_buf_free(packet->payload);
 	packet->payload = NULL;
 	packet->to_process = 0;
 	packet->pos = 0;
 }
 
+#ifdef WITH_BROKER
+/* Keep count of the bytes that have been serialised into packets for a
+ * client but not yet written to its socket, both per client and for the
+ * whole broker. Must be called once with add==true when a packet is queued
+ * and once with add==false when it is written or discarded. */
+void _mosquitto_out_packet_account(struct mosquitto *mosq, struct _mosquitto_packet *packet, bool add)
+{
+	struct mosquitto_db *db = _mosquitto_get_db();
+
+	if(add){
+		mosq->out_packet_bytes += packet->packet_length;
+		db->out_packet_bytes += packet->packet_length;
+	}else{
+		mosq->out_packet_bytes -= packet->packet_length;
+		db->out_packet_bytes -= packet->packet_length;
+	}
+}
+#endif
+
 int _mosquitto_packet_queue(struct mosquitto *mosq, struct _mosquitto_packet *packet)
 {
 #ifndef WITH_BROKER
@@ -168,6 +253,15 @@ int _mosquitto_packet_queue(struct mosquitto *mosq, struct _mosquitto_packet *pa
 	mosq->out_packet_last = packet;
 	pthread_mutex_unlock(&mosq->out_packet_mutex);
 #ifdef WITH_BROKER
+	_mosquitto_out_packet_account(mosq, packet, true);
+#  ifdef WITH_TLS
+	if(_mosquitto_tls_coalesce(mosq)){
+		/* Left for the main loop to write along with anything else queued
+		 * for this client in the same iteration, so that several packets
+		 * share a TLS record. */
+		return MOSQ_ERR_SUCCESS;
+	}
+#  endif
 	return _mosquitto_packet_write(mosq);
 #else
 
@@ -200,6 +294,13 @@ int _mosquitto_socket_close(struct mosquitto *mosq)
 
 	assert(mosq);
 #ifdef WITH_TLS
+#  ifdef WITH_BROKER
+	if(_mosquitto_tls_coalesce(mosq) && mosq->out_packet && !mosq->current_out_packet){
+		/* Best effort at sending packets held back by _mosquitto_packet_queue(),
+		 * such as a CONNACK refusing the connection. */
+		_mosquitto_packet_write(mosq);
+	}
+#  endif
 	if(mosq->ssl){
 		SSL_shutdown(mosq->ssl);
 		SSL_free(mosq->ssl);
@@ -238,38 +339,14 @@ static unsigned int psk_client_callback(SSL *ssl, const char *hint,
 }
 #endif
 
-int _mosquitto_try_connect(const char *host, uint16_t port, int *sock, const char *bind_address, bool blocking)
+/* Try each address in ainfo in turn until a connection is started. A
+ * non-blocking connect may still be in progress on return. */
+static int _mosquitto_try_connect_ainfo(struct addrinfo *ainfo, struct addrinfo *ainfo_bind, uint16_t port, int *sock, bool blocking)
 {
-	struct addrinfo hints;
-	struct addrinfo *ainfo, *rp;
-	struct addrinfo *ainfo_bind, *rp_bind;
-	int s;
+	struct addrinfo *rp, *rp_bind;
 	int rc;
-#ifdef WIN32
-	uint32_t val = 1;
-#endif
 
 	*sock = INVALID_SOCKET;
-	memset(&hints, 0, sizeof(struct addrinfo));
-	hints.ai_family = PF_UNSPEC;
-	hints.ai_flags = AI_ADDRCONFIG;
-	hints.ai_socktype = SOCK_STREAM;
-
-	s = getaddrinfo(host, NULL, &hints, &ainfo);
-	if(s){
-		errno = s;
-		return MOSQ_ERR_EAI;
-	}
-
-	if(bind_address){
-		s = getaddrinfo(bind_address, NULL, &hints, &ainfo_bind);
-		if(s){
-			freeaddrinfo(ainfo);
-			errno = s;
-			return MOSQ_ERR_EAI;
-		}
-	}
-
 	for(rp = ainfo; rp != NULL; rp = rp->ai_next){
 		*sock = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
 		if(*sock == INVALID_SOCKET) continue;
@@ -279,10 +356,12 @@ int _mosquitto_try_connect(const char *host, uint16_t port, int *sock, const cha
 		}else if(rp->ai_family == PF_INET6){
 			((struct sockaddr_in6 *)rp->ai_addr)->sin6_port = htons(port);
 		}else{
+			COMPAT_CLOSE(*sock);
+			*sock = INVALID_SOCKET;
 			continue;
 		}
 
-		if(bind_address){
+		if(ainfo_bind){
 			for(rp_bind = ainfo_bind; rp_bind != NULL; rp_bind = rp_bind->ai_next){
 				if(bind(*sock, rp_bind->ai_addr, rp_bind->ai_addrlen) == 0){
 					break;
@@ -290,6 +369,7 @@ int _mosquitto_try_connect(const char *host, uint16_t port, int *sock, const cha
 			}
 			if(!rp_bind){
 				COMPAT_CLOSE(*sock);
+				*sock = INVALID_SOCKET;
 				continue;
 			}
 		}
@@ -297,7 +377,7 @@ int _mosquitto_try_connect(const char *host, uint16_t port, int *sock, const cha
 		if(!blocking){
 			/* Set non-blocking */
 			if(_mosquitto_socket_nonblock(*sock)){
-				COMPAT_CLOSE(*sock);
+				*sock = INVALID_SOCKET;
 				continue;
 			}
 		}
@@ -310,7 +390,7 @@ int _mosquitto_try_connect(const char *host, uint16_t port, int *sock, const cha
 			if(blocking){
 				/* Set non-blocking */
 				if(_mosquitto_socket_nonblock(*sock)){
-					COMPAT_CLOSE(*sock);
+					*sock = INVALID_SOCKET;
 					continue;
 				}
 			}
@@ -320,32 +400,68 @@ int _mosquitto_try_connect(const char *host, uint16_t port, int *sock, const cha
 		COMPAT_CLOSE(*sock);
 		*sock = INVALID_SOCKET;
 	}
-	freeaddrinfo(ainfo);
-	if(bind_address){
-		freeaddrinfo(ainfo_bind);
-	}
 	if(!rp){
 		return MOSQ_ERR_ERRNO;
 	}
 	return MOSQ_ERR_SUCCESS;
 }
 
-/* Create a socket and connect it to 'ip' on port 'port'.
- * Returns -1 on failure (ip is NULL, socket creation/connection error)
- * Returns sock number on success.
- */
+#ifdef WITH_BROKER
+/* Start a non-blocking connection to an address that has already been
+ * resolved, for example by an asynchronous lookup. */
+int _mosquitto_try_connect_addrinfo(struct addrinfo *ainfo, uint16_t port, int *sock)
+{
+	return _mosquitto_try_connect_ainfo(ainfo, NULL, port, sock, false);
+}
+#endif
+
+int _mosquitto_try_connect(const char *host, uint16_t port, int *sock, const char *bind_address, bool blocking)
+{
+	struct addrinfo hints;
+	struct addrinfo *ainfo;
+	struct addrinfo *ainfo_bind = NULL;
+	int s;
+	int rc;
+
+	*sock = INVALID_SOCKET;
+	memset(&hints, 0, sizeof(struct addrinfo));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_flags = AI_ADDRCONFIG;
+	hints.ai_socktype = SOCK_STREAM;
+
+	s = getaddrinfo(host, NULL, &hints, &ainfo);
+	if(s){
+		errno = s;
+		return MOSQ_ERR_EAI;
+	}
+
+	if(bind_address){
+		s = getaddrinfo(bind_address, NULL, &hints, &ainfo_bind);
+		if(s){
+			freeaddrinfo(ainfo);
+			errno = s;
+			return MOSQ_ERR_EAI;
+		}
+	}
+
+	rc = _mosquitto_try_connect_ainfo(ainfo, ainfo_bind, port, sock, blocking);
+
+	freeaddrinfo(ainfo);
+	if(bind_address){
+		freeaddrinfo(ainfo_bind);
+	}
+	return rc;
+}
+
 int _mosquitto_socket_connect(struct mosquitto *mosq, const char *host, uint16_t port, const char *bind_address, bool blocking)
 {
 	int sock = INVALID_SOCKET;
 	int rc;
-#ifdef WITH_TLS
-	int ret;
-	BIO *bio;
-#endif
 
 	if(!mosq || !host || !port) return MOSQ_ERR_INVAL;
 
-#ifdef WITH_TLS
+#if defined(WITH_TLS) && !defined(WITH_BROKER)
+	/* The broker carries on the handshake from its main loop instead. */
 	if(mosq->tls_cafile || mosq->tls_capath || mosq->tls_psk){
 		blocking = true;
 	}
@@ -354,6 +470,18 @@ int _mosquitto_socket_connect(struct mosquitto *mosq, const char *host, uint16_t
 	rc = _mosquitto_try_connect(host, port, &sock, bind_address, blocking);
 	if(rc != MOSQ_ERR_SUCCESS) return rc;
 
+	return _mosquitto_socket_connect_finish(mosq, sock);
+}
+
+/* Attach a newly connected (or connecting) socket to mosq, starting the TLS
+ * handshake if required. The socket is closed on error. */
+int _mosquitto_socket_connect_finish(struct mosquitto *mosq, int sock)
+{
+#ifdef WITH_TLS
+	int ret;
+	BIO *bio;
+#endif
+
 #ifdef WITH_TLS
 	if(mosq->tls_cafile || mosq->tls_capath || mosq->tls_psk){
 #if OPENSSL_VERSION_NUMBER >= 0x10001000L
@@ -655,6 +783,8 @@ ssize_t _mosquitto_net_write(struct mosquitto *mosq, void *buf, size_t count)
 
 	errno = 0;
 #ifdef WITH_TLS
+	/* With kernel TLS enabled, openssl passes records to the kernel for
+	 * encryption itself, so SSL_write() is still the right call. */
 	if(mosq->ssl){
 		ret = SSL_write(mosq->ssl, buf, count);
 		if(ret < 0){
@@ -691,10 +821,68 @@ ssize_t _mosquitto_net_write(struct mosquitto *mosq, void *buf, size_t count)
 #endif
 }
 
+#if defined(WITH_BROKER) && defined(WITH_TLS)
+/* Every SSL_write() produces at least one record with its own header, MAC
+ * and padding, so small packets queued for a TLS client are copied into a
+ * single buffer of up to one full record and written together. */
+#define TLS_STAGE_SIZE 16384
+static uint8_t tls_stage[TLS_STAGE_SIZE];
+
+/* Write the remainder of packet, followed by as much of the packets queued
+ * behind it as fits in the staging buffer. The bytes written beyond the end
+ * of packet are consumed from the queued packets here. Returns the number of
+ * bytes written from packet itself, or the _mosquitto_net_write() result on
+ * failure.
+ *
+ * A write that has to be retried is always rebuilt from the same packets at
+ * the same positions, so it starts with the same bytes and is at least as
+ * long, as OpenSSL requires. */
+static ssize_t _mosquitto_tls_stage_write(struct mosquitto *mosq, struct _mosquitto_packet *packet)
+{
+	struct _mosquitto_packet *p;
+	ssize_t write_length;
+	uint32_t len, n, extra;
+
+	len = packet->to_process;
+	memcpy(tls_stage, &(packet->payload[packet->pos]), len);
+	pthread_mutex_lock(&mosq->out_packet_mutex);
+	for(p=mosq->out_packet; p && len < TLS_STAGE_SIZE; p=p->next){
+		n = p->to_process;
+		if(n > TLS_STAGE_SIZE - len) n = TLS_STAGE_SIZE - len;
+		memcpy(&(tls_stage[len]), &(p->payload[p->pos]), n);
+		len += n;
+	}
+	pthread_mutex_unlock(&mosq->out_packet_mutex);
+
+	write_length = _mosquitto_net_write(mosq, tls_stage, len);
+	if(write_length <= (ssize_t)packet->to_process){
+		return write_length;
+	}
+
+	extra = write_length - packet->to_process;
+#ifdef WITH_SYS_TREE
+	g_bytes_sent += extra;
+#endif
+	pthread_mutex_lock(&mosq->out_packet_mutex);
+	for(p=mosq->out_packet; p && extra > 0; p=p->next){
+		n = p->to_process;
+		if(n > extra) n = extra;
+		p->to_process -= n;
+		p->pos += n;
+		extra -= n;
+	}
+	pthread_mutex_unlock(&mosq->out_packet_mutex);
+	return packet->to_process;
+}
+#endif
+
 int _mosquitto_packet_write(struct mosquitto *mosq)
 {
 	ssize_t write_length;
 	struct _mosquitto_packet *packet;
+#if defined(WITH_BROKER) && defined(WITH_SYS_TREE)
+	struct _mqtt3_traffic *traffic;
+#endif
 
 	if(!mosq) return MOSQ_ERR_INVAL;
 	if(mosq->sock == INVALID_SOCKET) return MOSQ_ERR_NO_CONN;
@@ -714,6 +902,11 @@ int _mosquitto_packet_write(struct mosquitto *mosq)
 		packet = mosq->current_out_packet;
 
 		while(packet->to_process > 0){
+#if defined(WITH_BROKER) && defined(WITH_TLS)
+			if(mosq->out_packet && packet->to_process < TLS_STAGE_SIZE && _mosquitto_tls_coalesce(mosq)){
+				write_length = _mosquitto_tls_stage_write(mosq, packet);
+			}else
+#endif
 			write_length = _mosquitto_net_write(mosq, &(packet->payload[packet->pos]), packet->to_process);
 			if(write_length > 0){
 #if defined(WITH_BROKER) && defined(WITH_SYS_TREE)
@@ -743,8 +936,19 @@ int _mosquitto_packet_write(struct mosquitto *mosq)
 #ifdef WITH_BROKER
 #  ifdef WITH_SYS_TREE
 		g_msgs_sent++;
-		if(((packet->command)&0xF6) == PUBLISH){
+		traffic = _mosquitto_traffic(mosq);
+		if(traffic){
+			traffic->msgs_sent++;
+			traffic->bytes_sent += packet->packet_length;
+		}
+		if(((packet->command)&0xF0) == PUBLISH){
 			g_pub_msgs_sent++;
+			if(traffic){
+				traffic->pub_msgs_sent++;
+			}
+			if(packet->store_time){
+				mqtt3_histogram_record(&g_latency_delivery, mosquitto_time_us() - packet->store_time);
+			}
 		}
 #  endif
 #else
@@ -776,7 +980,7 @@ int _mosquitto_packet_write(struct mosquitto *mosq)
 			pthread_mutex_unlock(&mosq->out_packet_mutex);
 
 			_mosquitto_packet_cleanup(packet);
-			_mosquitto_free(packet);
+			_mosquitto_pool_free(mosq_pt_packet, packet);
 
 			pthread_mutex_lock(&mosq->msgtime_mutex);
 			mosq->last_msg_out = mosquitto_time();
@@ -806,8 +1010,11 @@ int _mosquitto_packet_write(struct mosquitto *mosq)
 		}
 		pthread_mutex_unlock(&mosq->out_packet_mutex);
 
+#ifdef WITH_BROKER
+		_mosquitto_out_packet_account(mosq, packet, false);
+#endif
 		_mosquitto_packet_cleanup(packet);
-		_mosquitto_free(packet);
+		_mosquitto_pool_free(mosq_pt_packet, packet);
 
 		pthread_mutex_lock(&mosq->msgtime_mutex);
 		mosq->last_msg_out = mosquitto_time();
@@ -826,6 +1033,9 @@ int _mosquitto_packet_read(struct mosquitto *mosq)
 	uint8_t byte;
 	ssize_t read_length;
 	int rc = 0;
+#if defined(WITH_BROKER) && defined(WITH_SYS_TREE)
+	struct _mqtt3_traffic *traffic;
+#endif
 
 	if(!mosq) return MOSQ_ERR_INVAL;
 	if(mosq->sock == INVALID_SOCKET) return MOSQ_ERR_NO_CONN;
@@ -905,7 +1115,7 @@ int _mosquitto_packet_read(struct mosquitto *mosq)
 		}while((byte & 128) != 0);
 
 		if(mosq->in_packet.remaining_length > 0){
-			mosq->in_packet.payload = _mosquitto_malloc(mosq->in_packet.remaining_length*sizeof(uint8_t));
+			mosq->in_packet.payload = _mosquitto_buf_malloc(mosq->in_packet.remaining_length*sizeof(uint8_t), mosq_mt_packets);
 			if(!mosq->in_packet.payload) return MOSQ_ERR_NOMEM;
 			mosq->in_packet.to_process = mosq->in_packet.remaining_length;
 		}
@@ -951,8 +1161,16 @@ int _mosquitto_packet_read(struct mosquitto *mosq)
 #ifdef WITH_BROKER
 #  ifdef WITH_SYS_TREE
 	g_msgs_received++;
-	if(((mosq->in_packet.command)&0xF5) == PUBLISH){
+	traffic = _mosquitto_traffic(mosq);
+	if(traffic){
+		traffic->msgs_received++;
+		traffic->bytes_received += 1 + mosq->in_packet.remaining_count + mosq->in_packet.remaining_length;
+	}
+	if(((mosq->in_packet.command)&0xF0) == PUBLISH){
 		g_pub_msgs_received++;
+		if(traffic){
+			traffic->pub_msgs_received++;
+		}
 	}
 #  endif
 	rc = mqtt3_packet_handle(db, mosq);
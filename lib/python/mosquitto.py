@@ -709,6 +709,12 @@ class Mosquitto:
         self._out_packet_mutex.release()
         self._current_out_packet_mutex.release()
 
+        # The broker may send several packets in one TLS record. Those after
+        # the first are already decrypted and won't wake select().
+        tls_pending = self._ssl is not None and self._ssl.pending() > 0
+        if tls_pending:
+            timeout = 0.0
+
         rlist = [self.socket()]
         try:
             socklist = select.select(rlist, wlist, [], timeout)
@@ -716,7 +722,7 @@ class Mosquitto:
             # Socket isn't correct type, in likelihood connection is lost
             return MOSQ_ERR_CONN_LOST
 
-        if self.socket() in socklist[0]:
+        if tls_pending or self.socket() in socklist[0]:
             rc = self.loop_read(max_packets)
             if rc or (self._ssl is None and self._sock is None):
                 return rc
@@ -99,12 +99,8 @@ int _mosquitto_send_publish(struct mosquitto *mosq, uint16_t mid, const char *to
 #ifdef WITH_BROKER
 	size_t len;
 #ifdef WITH_BRIDGE
-	int i;
-	struct _mqtt3_bridge_topic *cur_topic;
-	bool match;
-	int rc;
-	char *mapped_topic = NULL;
-	char *topic_temp = NULL;
+	const char *prefix = NULL;
+	const char *suffix;
 #endif
 #endif
 	assert(mosq);
@@ -122,54 +118,14 @@ int _mosquitto_send_publish(struct mosquitto *mosq, uint16_t mid, const char *to
 		}
 	}
 #ifdef WITH_BRIDGE
-	if(mosq->bridge && mosq->bridge->topics && mosq->bridge->topic_remapping){
-		for(i=0; i<mosq->bridge->topic_count; i++){
-			cur_topic = &mosq->bridge->topics[i];
-			if((cur_topic->direction == bd_both || cur_topic->direction == bd_out) 
-					&& (cur_topic->remote_prefix || cur_topic->local_prefix)){
-				/* Topic mapping required on this topic if the message matches */
-
-				rc = mosquitto_topic_matches_sub(cur_topic->local_topic, topic, &match);
-				if(rc){
-					return rc;
-				}
-				if(match){
-					mapped_topic = _mosquitto_strdup(topic);
-					if(!mapped_topic) return MOSQ_ERR_NOMEM;
-					if(cur_topic->local_prefix){
-						/* This prefix needs removing. */
-						if(!strncmp(cur_topic->local_prefix, mapped_topic, strlen(cur_topic->local_prefix))){
-							topic_temp = _mosquitto_strdup(mapped_topic+strlen(cur_topic->local_prefix));
-							_mosquitto_free(mapped_topic);
-							if(!topic_temp){
-								return MOSQ_ERR_NOMEM;
-							}
-							mapped_topic = topic_temp;
-						}
-					}
-
-					if(cur_topic->remote_prefix){
-						/* This prefix needs adding. */
-						len = strlen(mapped_topic) + strlen(cur_topic->remote_prefix)+1;
-						topic_temp = _mosquitto_calloc(len+1, sizeof(char));
-						if(!topic_temp){
-							_mosquitto_free(mapped_topic);
-							return MOSQ_ERR_NOMEM;
-						}
-						snprintf(topic_temp, len, "%s%s", cur_topic->remote_prefix, mapped_topic);
-						_mosquitto_free(mapped_topic);
-						mapped_topic = topic_temp;
-					}
-					_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Sending PUBLISH to %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", mosq->id, dup, qos, retain, mid, mapped_topic, (long)payloadlen);
+	if(mosq->bridge && mosq->bridge->topic_remapping
+			&& mqtt3_bridge_remap(mosq->bridge, bd_out, topic, &prefix, &suffix)){
+
+		_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Sending PUBLISH to %s (d%d, q%d, r%d, m%d, '%s%s', ... (%ld bytes))", mosq->id, dup, qos, retain, mid, prefix?prefix:"", suffix, (long)payloadlen);
 #ifdef WITH_SYS_TREE
-					g_pub_bytes_sent += payloadlen;
+		g_pub_bytes_sent += payloadlen;
 #endif
-					rc =  _mosquitto_send_real_publish(mosq, mid, mapped_topic, payloadlen, payload, qos, retain, dup);
-					_mosquitto_free(mapped_topic);
-					return rc;
-				}
-			}
-		}
+		return _mosquitto_send_real_publish_prefixed(mosq, mid, NULL, prefix, suffix, payloadlen, payload, qos, retain, dup);
 	}
 #endif
 	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Sending PUBLISH to %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", mosq->id, dup, qos, retain, mid, topic, (long)payloadlen);
@@ -210,7 +166,7 @@ int _mosquitto_send_command_with_mid(struct mosquitto *mosq, uint8_t command, ui
 	int rc;
 
 	assert(mosq);
-	packet = _mosquitto_calloc(1, sizeof(struct _mosquitto_packet));
+	packet = _mosquitto_pool_calloc(mosq_pt_packet, sizeof(struct _mosquitto_packet));
 	if(!packet) return MOSQ_ERR_NOMEM;
 
 	packet->command = command;
@@ -220,7 +176,7 @@ int _mosquitto_send_command_with_mid(struct mosquitto *mosq, uint8_t command, ui
 	packet->remaining_length = 2;
 	rc = _mosquitto_packet_alloc(packet);
 	if(rc){
-		_mosquitto_free(packet);
+		_mosquitto_pool_free(mosq_pt_packet, packet);
 		return rc;
 	}
 
@@ -237,7 +193,7 @@ int _mosquitto_send_simple_command(struct mosquitto *mosq, uint8_t command)
 	int rc;
 
 	assert(mosq);
-	packet = _mosquitto_calloc(1, sizeof(struct _mosquitto_packet));
+	packet = _mosquitto_pool_calloc(mosq_pt_packet, sizeof(struct _mosquitto_packet));
 	if(!packet) return MOSQ_ERR_NOMEM;
 
 	packet->command = command;
@@ -245,7 +201,7 @@ int _mosquitto_send_simple_command(struct mosquitto *mosq, uint8_t command)
 
 	rc = _mosquitto_packet_alloc(packet);
 	if(rc){
-		_mosquitto_free(packet);
+		_mosquitto_pool_free(mosq_pt_packet, packet);
 		return rc;
 	}
 
@@ -253,29 +209,55 @@ int _mosquitto_send_simple_command(struct mosquitto *mosq, uint8_t command)
 }
 
 int _mosquitto_send_real_publish(struct mosquitto *mosq, uint16_t mid, const char *topic, uint32_t payloadlen, const void *payload, int qos, bool retain, bool dup)
+{
+	return _mosquitto_send_real_publish_prefixed(mosq, mid, NULL, NULL, topic, payloadlen, payload, qos, retain, dup);
+}
+
+/* As _mosquitto_send_real_publish(), but the topic is tag, then prefix, then
+ * topic. This lets a bridge write an origin tag and a remapped topic straight
+ * into the packet. tag and prefix may be NULL. */
+int _mosquitto_send_real_publish_prefixed(struct mosquitto *mosq, uint16_t mid, const char *tag, const char *prefix, const char *topic, uint32_t payloadlen, const void *payload, int qos, bool retain, bool dup)
 {
 	struct _mosquitto_packet *packet = NULL;
 	int packetlen;
+	size_t taglen = 0;
+	size_t prefixlen = 0;
+	size_t topiclen;
 	int rc;
 
 	assert(mosq);
 	assert(topic);
 
-	packetlen = 2+strlen(topic) + payloadlen;
+	if(tag) taglen = strlen(tag);
+	if(prefix) prefixlen = strlen(prefix);
+	topiclen = strlen(topic);
+	if(taglen + prefixlen + topiclen > 65535) return MOSQ_ERR_INVAL;
+
+	packetlen = 2+taglen+prefixlen+topiclen + payloadlen;
 	if(qos > 0) packetlen += 2; /* For message id */
-	packet = _mosquitto_calloc(1, sizeof(struct _mosquitto_packet));
+	packet = _mosquitto_pool_calloc(mosq_pt_packet, sizeof(struct _mosquitto_packet));
 	if(!packet) return MOSQ_ERR_NOMEM;
 
 	packet->mid = mid;
 	packet->command = PUBLISH | ((dup&0x1)<<3) | (qos<<1) | retain;
 	packet->remaining_length = packetlen;
+#ifdef WITH_BROKER
+	packet->store_time = mosq->publish_store_time;
+#endif
 	rc = _mosquitto_packet_alloc(packet);
 	if(rc){
-		_mosquitto_free(packet);
+		_mosquitto_pool_free(mosq_pt_packet, packet);
 		return rc;
 	}
 	/* Variable header (topic string) */
-	_mosquitto_write_string(packet, topic, strlen(topic));
+	_mosquitto_write_uint16(packet, taglen+prefixlen+topiclen);
+	if(taglen){
+		_mosquitto_write_bytes(packet, tag, taglen);
+	}
+	if(prefixlen){
+		_mosquitto_write_bytes(packet, prefix, prefixlen);
+	}
+	_mosquitto_write_bytes(packet, topic, topiclen);
 	if(qos > 0){
 		_mosquitto_write_uint16(packet, mid);
 	}
@@ -34,6 +34,7 @@ POSSIBILITY OF SUCH DAMAGE.
 int _mosquitto_send_simple_command(struct mosquitto *mosq, uint8_t command);
 int _mosquitto_send_command_with_mid(struct mosquitto *mosq, uint8_t command, uint16_t mid, bool dup);
 int _mosquitto_send_real_publish(struct mosquitto *mosq, uint16_t mid, const char *topic, uint32_t payloadlen, const void *payload, int qos, bool retain, bool dup);
+int _mosquitto_send_real_publish_prefixed(struct mosquitto *mosq, uint16_t mid, const char *tag, const char *prefix, const char *topic, uint32_t payloadlen, const void *payload, int qos, bool retain, bool dup);
 
 int _mosquitto_send_connect(struct mosquitto *mosq, uint16_t keepalive, bool clean_session);
 int _mosquitto_send_disconnect(struct mosquitto *mosq);
@@ -36,6 +36,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #  define _WIN32_WINNT _WIN32_WINNT_VISTA
 #  include <windows.h>
 #else
+#  include <sys/time.h>
 #  include <unistd.h>
 #endif
 #include <time.h>
@@ -93,3 +94,71 @@ time_t mosquitto_time(void)
 #endif
 }
 
+/* Milliseconds from an arbitrary fixed point, for measuring short
+ * intervals. */
+uint64_t mosquitto_time_ms(void)
+{
+#ifdef WIN32
+	if(tick64){
+		return GetTickCount64();
+	}else{
+		return GetTickCount();
+	}
+#elif _POSIX_TIMERS>0 && defined(_POSIX_MONOTONIC_CLOCK)
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (uint64_t)tp.tv_sec*1000 + tp.tv_nsec/1000000;
+#elif defined(__APPLE__)
+	static mach_timebase_info_data_t tb;
+	uint64_t ticks;
+
+	ticks = mach_absolute_time();
+
+	if(tb.denom == 0){
+		mach_timebase_info(&tb);
+	}
+	return ticks*tb.numer/tb.denom/1000000;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec*1000 + tv.tv_usec/1000;
+#endif
+}
+
+/* Microseconds from an arbitrary fixed point, for timing latencies. */
+uint64_t mosquitto_time_us(void)
+{
+#ifdef WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER count;
+
+	if(freq.QuadPart == 0){
+		QueryPerformanceFrequency(&freq);
+	}
+	QueryPerformanceCounter(&count);
+	return (uint64_t)(count.QuadPart/freq.QuadPart)*1000000
+			+ (uint64_t)(count.QuadPart%freq.QuadPart)*1000000/freq.QuadPart;
+#elif _POSIX_TIMERS>0 && defined(_POSIX_MONOTONIC_CLOCK)
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (uint64_t)tp.tv_sec*1000000 + tp.tv_nsec/1000;
+#elif defined(__APPLE__)
+	static mach_timebase_info_data_t tb;
+	uint64_t ticks;
+
+	ticks = mach_absolute_time();
+
+	if(tb.denom == 0){
+		mach_timebase_info(&tb);
+	}
+	return ticks*tb.numer/tb.denom/1000;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec*1000000 + tv.tv_usec;
+#endif
+}
@@ -30,6 +30,10 @@ POSSIBILITY OF SUCH DAMAGE.
 #ifndef _TIME_MOSQ_H_
 #define _TIME_MOSQ_H_
 
+#include <stdint.h>
+
 time_t mosquitto_time(void);
+uint64_t mosquitto_time_ms(void);
+uint64_t mosquitto_time_us(void);
 
 #endif
@@ -41,6 +41,12 @@ POSSIBILITY OF SUCH DAMAGE.
 #  endif
 #endif
 
+/* Kernel TLS needs Linux and openssl 3.0 built with ktls support. Whether it
+ * is actually used also depends on the kernel and the cipher negotiated. */
+#if defined(__linux__) && OPENSSL_VERSION_NUMBER >= 0x30000000L && !defined(OPENSSL_NO_KTLS)
+#  define REAL_WITH_KTLS
+#endif
+
 int _mosquitto_server_certificate_verify(int preverify_ok, X509_STORE_CTX *ctx);
 int _mosquitto_verify_certificate_hostname(X509 *cert, const char *hostname);
 
@@ -70,7 +70,7 @@ int _mosquitto_packet_alloc(struct _mosquitto_packet *packet)
 	}while(remaining_length > 0 && packet->remaining_count < 5);
 	if(packet->remaining_count == 5) return MOSQ_ERR_PAYLOAD_SIZE;
 	packet->packet_length = packet->remaining_length + 1 + packet->remaining_count;
-	packet->payload = _mosquitto_malloc(sizeof(uint8_t)*packet->packet_length);
+	packet->payload = _mosquitto_buf_malloc(sizeof(uint8_t)*packet->packet_length, mosq_mt_packets);
 	if(!packet->payload) return MOSQ_ERR_NOMEM;
 
 	packet->payload[0] = packet->command;
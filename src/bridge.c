@@ -27,6 +27,10 @@ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
 POSSIBILITY OF SUCH DAMAGE.
 */
 
+#ifdef WITH_ADNS
+#  define _GNU_SOURCE
+#endif
+
 #include <assert.h>
 #include <errno.h>
 #include <stdio.h>
@@ -34,12 +38,18 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #ifndef WIN32
 #include <netdb.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <unistd.h>
 #else
 #include <winsock2.h>
 #include <ws2tcpip.h>
 #endif
 
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
+
 #include <config.h>
 
 #include <mosquitto.h>
@@ -53,17 +63,41 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <util_mosq.h>
 #include <will_mosq.h>
 
+#ifdef WITH_SYS_TREE
+extern uint64_t g_pub_bytes_sent;
+#endif
+
+/* Write the origin tag for stored into buf and return its length. */
+static int _origin_tag(char *buf, size_t len, const struct mosquitto_msg_store *stored)
+{
+	return snprintf(buf, len, MQTT3_ORIGIN_PREFIX "%llx/%llx/",
+			(unsigned long long)stored->origin_id, (unsigned long long)stored->origin_seq);
+}
+
 #ifdef WITH_BRIDGE
 
+/* Seconds between attempts to return to the primary address, and how long
+ * each attempt may take. */
+#define BRIDGE_PROBE_INTERVAL 5
+
+/* A message batch is sent once it holds at least this many bytes. */
+#define BRIDGE_BATCH_MAX 65536
+
+static int _bridge_send_connect(struct mosquitto *context);
+#ifdef WITH_ADNS
+static int _bridge_lookup_start(struct gaicb **adns, const char *host);
+static int _bridge_lookup_check(struct gaicb **adns, struct addrinfo **ainfo);
+static void _bridge_lookup_cancel(struct gaicb **adns);
+#endif
+
 int mqtt3_bridge_new(struct mosquitto_db *db, struct _mqtt3_bridge *bridge)
 {
 	int i;
 	struct mosquitto *new_context = NULL;
-	int null_index = -1;
-	struct mosquitto **tmp_contexts;
 	char hostname[256];
 	int len;
 	char *id;
+	char *shard_id;
 
 	assert(db);
 	assert(bridge);
@@ -85,17 +119,23 @@ int mqtt3_bridge_new(struct mosquitto_db *db, struct _mqtt3_bridge *bridge)
 	if(!id){
 		return MOSQ_ERR_NOMEM;
 	}
+	if(bridge->connection_index > 0){
+		/* Extra parallel connections need their own client id. */
+		len = strlen(id) + 12;
+		shard_id = _mosquitto_malloc(len);
+		if(!shard_id){
+			_mosquitto_free(id);
+			return MOSQ_ERR_NOMEM;
+		}
+		snprintf(shard_id, len, "%s.%d", id, bridge->connection_index);
+		_mosquitto_free(id);
+		id = shard_id;
+	}
 
-	/* Search for existing id (possible from persistent db) and also look for a
-	 * gap in the db->contexts[] array in case the id isn't found. */
+	/* Search for existing id (possible from persistent db). */
 	for(i=0; i<db->context_count; i++){
-		if(db->contexts[i]){
-			if(!strcmp(db->contexts[i]->id, id)){
-				new_context = db->contexts[i];
-				break;
-			}
-		}else if(db->contexts[i] == NULL && null_index == -1){
-			null_index = i;
+		if(db->contexts[i] && !strcmp(db->contexts[i]->id, id)){
+			new_context = db->contexts[i];
 			break;
 		}
 	}
@@ -105,19 +145,9 @@ int mqtt3_bridge_new(struct mosquitto_db *db, struct _mqtt3_bridge *bridge)
 		if(!new_context){
 			return MOSQ_ERR_NOMEM;
 		}
-		if(null_index == -1){
-			/* There were no gaps in the db->contexts[] array, so need to append. */
-			db->context_count++;
-			tmp_contexts = _mosquitto_realloc(db->contexts, sizeof(struct mosquitto*)*db->context_count);
-			if(tmp_contexts){
-				db->contexts = tmp_contexts;
-				db->contexts[db->context_count-1] = new_context;
-			}else{
-				_mosquitto_free(new_context);
-				return MOSQ_ERR_NOMEM;
-			}
-		}else{
-			db->contexts[null_index] = new_context;
+		if(mqtt3_db_context_add(db, new_context)){
+			_mosquitto_free(new_context);
+			return MOSQ_ERR_NOMEM;
 		}
 		new_context->id = id;
 	}else{
@@ -149,6 +179,111 @@ int mqtt3_bridge_new(struct mosquitto_db *db, struct _mqtt3_bridge *bridge)
 	return mqtt3_bridge_connect(db, new_context);
 }
 
+#ifdef WITH_ADNS
+/* A lookup request, with the hints and host name it points to, so that the
+ * resolver thread never depends on memory owned by the bridge. */
+struct _bridge_lookup {
+	struct gaicb req;
+	struct addrinfo hints;
+	struct _bridge_lookup *next;
+	char host[];
+};
+
+/* Lookups that were cancelled while the resolver thread was still working on
+ * them. They are freed once the resolver has finished with them. */
+static struct _bridge_lookup *abandoned_lookups = NULL;
+
+static void _bridge_lookup_free(struct _bridge_lookup *lookup)
+{
+	if(lookup->req.ar_result){
+		freeaddrinfo(lookup->req.ar_result);
+	}
+	_mosquitto_free(lookup);
+}
+
+static void _bridge_lookup_reap(void)
+{
+	struct _bridge_lookup **prev, *lookup;
+
+	prev = &abandoned_lookups;
+	while(*prev){
+		lookup = *prev;
+		if(gai_error(&lookup->req) == EAI_INPROGRESS){
+			prev = &lookup->next;
+		}else{
+			*prev = lookup->next;
+			_bridge_lookup_free(lookup);
+		}
+	}
+}
+
+/* Start resolving host without blocking. */
+static int _bridge_lookup_start(struct gaicb **adns, const char *host)
+{
+	struct _bridge_lookup *lookup;
+	struct gaicb *req;
+	int rc;
+
+	_bridge_lookup_cancel(adns);
+	_bridge_lookup_reap();
+
+	lookup = _mosquitto_calloc(1, sizeof(struct _bridge_lookup) + strlen(host) + 1);
+	if(!lookup) return EAI_MEMORY;
+
+	strcpy(lookup->host, host);
+	lookup->hints.ai_family = PF_UNSPEC;
+	lookup->hints.ai_flags = AI_ADDRCONFIG;
+	lookup->hints.ai_socktype = SOCK_STREAM;
+	req = &lookup->req;
+	req->ar_name = lookup->host;
+	req->ar_request = &lookup->hints;
+
+	rc = getaddrinfo_a(GAI_NOWAIT, &req, 1, NULL);
+	if(rc){
+		_mosquitto_free(lookup);
+		return rc;
+	}
+	*adns = req;
+	return 0;
+}
+
+/* Returns EAI_INPROGRESS until the lookup started by _bridge_lookup_start()
+ * has finished. On success *ainfo must be freed with freeaddrinfo(). */
+static int _bridge_lookup_check(struct gaicb **adns, struct addrinfo **ainfo)
+{
+	int rc;
+
+	rc = gai_error(*adns);
+	if(rc == EAI_INPROGRESS){
+		return rc;
+	}
+	*ainfo = (*adns)->ar_result;
+	(*adns)->ar_result = NULL;
+	_bridge_lookup_free((struct _bridge_lookup *)(*adns));
+	*adns = NULL;
+
+	return rc;
+}
+
+static void _bridge_lookup_cancel(struct gaicb **adns)
+{
+	struct _bridge_lookup *lookup;
+
+	if(!*adns) return;
+
+	lookup = (struct _bridge_lookup *)(*adns);
+	*adns = NULL;
+	if(gai_cancel(&lookup->req) == EAI_NOTCANCELED){
+		/* The resolver thread still owns the request, so free it later
+		 * rather than waiting for a slow DNS server here. */
+		lookup->next = abandoned_lookups;
+		abandoned_lookups = lookup;
+		return;
+	}
+	_bridge_lookup_free(lookup);
+}
+#endif
+
 int mqtt3_bridge_connect(struct mosquitto_db *db, struct mosquitto *context)
 {
 	int rc;
@@ -168,7 +303,11 @@ int mqtt3_bridge_connect(struct mosquitto_db *db, struct mosquitto *context)
 	context->in_packet.payload = NULL;
 	context->ping_t = 0;
 	context->bridge->lazy_reconnect = false;
+	mqtt3_bridge_probe_cleanup(context->bridge);
 	mqtt3_bridge_packet_cleanup(context);
+	context->bridge->batch_len = 0;
+	context->bridge->batch_count = 0;
+	context->origin_tagging = false;
 	mqtt3_db_message_reconnect_reset(context);
 
 	if(context->clean_session){
@@ -182,7 +321,11 @@ int mqtt3_bridge_connect(struct mosquitto_db *db, struct mosquitto *context)
 	mqtt3_subs_clean_session(db, context, &db->subs);
 
 	for(i=0; i<context->bridge->topic_count; i++){
-		if(context->bridge->topics[i].direction == bd_out || context->bridge->topics[i].direction == bd_both){
+		if(context->bridge->topics[i].sharded){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Bridge %s doing local SUBSCRIBE on topic %s", context->id, context->bridge->topics[i].local_topic);
+			if(mqtt3_sub_add_sharded(db, context, context->bridge->topics[i].local_topic, context->bridge->topics[i].qos, &db->subs)) return 1;
+		}else if(context->bridge->topics[i].direction != bd_in && context->bridge->connection_index == 0){
+			/* Topics that aren't sharded stay on the first connection. */
 			_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Bridge %s doing local SUBSCRIBE on topic %s", context->id, context->bridge->topics[i].local_topic);
 			if(mqtt3_sub_add(db, context, context->bridge->topics[i].local_topic, context->bridge->topics[i].qos, &db->subs)) return 1;
 		}
@@ -213,7 +356,17 @@ int mqtt3_bridge_connect(struct mosquitto_db *db, struct mosquitto *context)
 	}
 
 	_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "Connecting bridge %s (%s:%d)", context->bridge->name, context->bridge->addresses[context->bridge->cur_address].address, context->bridge->addresses[context->bridge->cur_address].port);
-	rc = _mosquitto_socket_connect(context, context->bridge->addresses[context->bridge->cur_address].address, context->bridge->addresses[context->bridge->cur_address].port, NULL, true);
+#ifdef WITH_ADNS
+	/* The connection is completed by mqtt3_bridge_connect_step2() once the
+	 * address lookup has finished. */
+	rc = _bridge_lookup_start(&context->bridge->adns, context->bridge->addresses[context->bridge->cur_address].address);
+	if(rc){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error creating bridge: %s.", gai_strerror(rc));
+		return MOSQ_ERR_EAI;
+	}
+	return MOSQ_ERR_SUCCESS;
+#else
+	rc = _mosquitto_socket_connect(context, context->bridge->addresses[context->bridge->cur_address].address, context->bridge->addresses[context->bridge->cur_address].port, NULL, false);
 	if(rc != MOSQ_ERR_SUCCESS){
 		if(rc == MOSQ_ERR_TLS){
 			return rc; /* Error already printed */
@@ -226,6 +379,51 @@ int mqtt3_bridge_connect(struct mosquitto_db *db, struct mosquitto *context)
 		return rc;
 	}
 
+	return _bridge_send_connect(context);
+#endif
+}
+
+#ifdef WITH_ADNS
+/* Continue a bridge connection started by mqtt3_bridge_connect(). Returns
+ * MOSQ_ERR_SUCCESS while the lookup is still in progress, in which case
+ * context->sock is still INVALID_SOCKET. */
+int mqtt3_bridge_connect_step2(struct mosquitto_db *db, struct mosquitto *context)
+{
+	struct addrinfo *ainfo;
+	int sock;
+	int rc;
+
+	if(!context || !context->bridge || !context->bridge->adns) return MOSQ_ERR_INVAL;
+
+	rc = _bridge_lookup_check(&context->bridge->adns, &ainfo);
+	if(rc == EAI_INPROGRESS){
+		return MOSQ_ERR_SUCCESS;
+	}else if(rc){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error creating bridge: %s.", gai_strerror(rc));
+		return MOSQ_ERR_EAI;
+	}
+
+	rc = _mosquitto_try_connect_addrinfo(ainfo, context->bridge->addresses[context->bridge->cur_address].port, &sock);
+	freeaddrinfo(ainfo);
+	if(rc){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error creating bridge: %s.", strerror(errno));
+		return rc;
+	}
+	rc = _mosquitto_socket_connect_finish(context, sock);
+	if(rc){
+		return rc; /* Error already printed */
+	}
+
+	return _bridge_send_connect(context);
+}
+#endif
+
+/* Queue the CONNECT for a bridge whose socket connection has been started.
+ * It is sent when the socket becomes writable. */
+static int _bridge_send_connect(struct mosquitto *context)
+{
+	int rc;
+
 	rc = _mosquitto_send_connect(context, context->keepalive, context->clean_session);
 	if(rc == MOSQ_ERR_SUCCESS){
 		return MOSQ_ERR_SUCCESS;
@@ -244,20 +442,679 @@ int mqtt3_bridge_connect(struct mosquitto_db *db, struct mosquitto *context)
 	}
 }
 
+/* Close any connection attempt to the primary address. */
+void mqtt3_bridge_probe_cleanup(struct _mqtt3_bridge *bridge)
+{
+	if(bridge->primary_probe_sock != INVALID_SOCKET){
+		COMPAT_CLOSE(bridge->primary_probe_sock);
+		bridge->primary_probe_sock = INVALID_SOCKET;
+	}
+#ifdef WITH_ADNS
+	_bridge_lookup_cancel(&bridge->probe_adns);
+#endif
+}
+
+/* Release everything the bridge holds outside of its context. */
+void mqtt3_bridge_cleanup(struct _mqtt3_bridge *bridge)
+{
+	mqtt3_bridge_probe_cleanup(bridge);
+	if(bridge->batch){
+		_mosquitto_free(bridge->batch);
+		bridge->batch = NULL;
+	}
+#ifdef WITH_ADNS
+	_bridge_lookup_cancel(&bridge->adns);
+#endif
+}
+
+/* For a connected bridge that is not using its primary address, start or
+ * continue a non-blocking connection to the primary address. Attempts are
+ * made at most every BRIDGE_PROBE_INTERVAL seconds and each is given the same
+ * time to complete. Returns the socket that should be polled for writing, or
+ * INVALID_SOCKET if there is nothing to poll. */
+int mqtt3_bridge_probe_update(struct _mqtt3_bridge *bridge, time_t now)
+{
+#ifdef WITH_ADNS
+	struct addrinfo *ainfo;
+	int rc;
+
+	if(bridge->probe_adns){
+		rc = _bridge_lookup_check(&bridge->probe_adns, &ainfo);
+		if(rc == EAI_INPROGRESS){
+			return INVALID_SOCKET;
+		}else if(rc == 0){
+			rc = _mosquitto_try_connect_addrinfo(ainfo, bridge->addresses[0].port, &bridge->primary_probe_sock);
+			freeaddrinfo(ainfo);
+		}
+		if(rc){
+			bridge->primary_retry = now + BRIDGE_PROBE_INTERVAL;
+			return INVALID_SOCKET;
+		}
+		bridge->primary_probe_t = now + BRIDGE_PROBE_INTERVAL;
+	}else
+#endif
+	if(bridge->primary_probe_sock == INVALID_SOCKET){
+		if(now <= bridge->primary_retry){
+			return INVALID_SOCKET;
+		}
+#ifdef WITH_ADNS
+		if(_bridge_lookup_start(&bridge->probe_adns, bridge->addresses[0].address)){
+			bridge->primary_retry = now + BRIDGE_PROBE_INTERVAL;
+		}
+		return INVALID_SOCKET;
+#else
+		if(_mosquitto_try_connect(bridge->addresses[0].address, bridge->addresses[0].port, &bridge->primary_probe_sock, NULL, false)){
+			bridge->primary_retry = now + BRIDGE_PROBE_INTERVAL;
+			return INVALID_SOCKET;
+		}
+		bridge->primary_probe_t = now + BRIDGE_PROBE_INTERVAL;
+#endif
+	}else if(now > bridge->primary_probe_t){
+		mqtt3_bridge_probe_cleanup(bridge);
+		bridge->primary_retry = now + BRIDGE_PROBE_INTERVAL;
+		return INVALID_SOCKET;
+	}
+	return bridge->primary_probe_sock;
+}
+
+/* Check the result of poll() on the socket returned by
+ * mqtt3_bridge_probe_update(). Returns true if the connection to the primary
+ * address succeeded, in which case the caller should move the bridge back to
+ * it. */
+bool mqtt3_bridge_probe_check(struct _mqtt3_bridge *bridge, short revents)
+{
+	int err = 0;
+	socklen_t len = sizeof(err);
+
+	if(bridge->primary_probe_sock == INVALID_SOCKET
+			|| !(revents & (POLLOUT | POLLERR | POLLHUP))){
+		return false;
+	}
+
+	if(getsockopt(bridge->primary_probe_sock, SOL_SOCKET, SO_ERROR, (char *)&err, &len) || err){
+		mqtt3_bridge_probe_cleanup(bridge);
+		bridge->primary_retry = mosquitto_time() + BRIDGE_PROBE_INTERVAL;
+		return false;
+	}
+	mqtt3_bridge_probe_cleanup(bridge);
+	return true;
+}
+
+/* For a bridge with parallel connections, decide whether a message on topic
+ * that matched one of the bridge's sharded subscriptions should be sent over
+ * this connection. Outgoing topics are spread across the connections by a
+ * hash of the topic, so all messages on one topic use the same connection
+ * and stay in order. */
+bool mqtt3_bridge_shard_match(struct _mqtt3_bridge *bridge, const char *topic)
+{
+	uint32_t hash = 2166136261UL;
+	const unsigned char *c;
+
+	if(bridge->connection_count < 2) return true;
+
+	/* FNV-1a */
+	for(c=(const unsigned char *)topic; *c; c++){
+		hash = (hash ^ *c) * 16777619UL;
+	}
+	return hash % bridge->connection_count == bridge->connection_index;
+}
+
+static void _remap_node_free(struct _mqtt3_bridge_topic_node *node)
+{
+	struct _mqtt3_bridge_topic_node *next;
+
+	while(node){
+		next = node->next;
+		_remap_node_free(node->children);
+		if(node->token) _mosquitto_free(node->token);
+		_mosquitto_free(node);
+		node = next;
+	}
+}
+
+static struct _mqtt3_bridge_topic_node *_remap_node_new(const char *token, int len)
+{
+	struct _mqtt3_bridge_topic_node *node;
+
+	node = _mosquitto_calloc(1, sizeof(struct _mqtt3_bridge_topic_node));
+	if(!node) return NULL;
+
+	if(token){
+		node->token = _mosquitto_malloc(len+1);
+		if(!node->token){
+			_mosquitto_free(node);
+			return NULL;
+		}
+		memcpy(node->token, token, len);
+		node->token[len] = '\0';
+	}
+	node->topic_index = -1;
+	node->multi_index = -1;
+	return node;
+}
+
+/* Add the subscription pattern sub for bridge topic index to the tree. Where
+ * two bridge topics have the same pattern the first one is kept, as it is
+ * the one that would match first. */
+static int _remap_add(struct _mqtt3_bridge_topic_node **root, const char *sub, int index)
+{
+	struct _mqtt3_bridge_topic_node *node, *child;
+	const char *end;
+	int len;
+
+	if(!*root){
+		*root = _remap_node_new(NULL, 0);
+		if(!*root) return MOSQ_ERR_NOMEM;
+	}
+	node = *root;
+	while(1){
+		end = strchr(sub, '/');
+		len = end ? end-sub : strlen(sub);
+
+		if(len == 1 && sub[0] == '#'){
+			if(node->multi_index == -1) node->multi_index = index;
+			return MOSQ_ERR_SUCCESS;
+		}
+		for(child=node->children; child; child=child->next){
+			if(!strncmp(child->token, sub, len) && child->token[len] == '\0'){
+				break;
+			}
+		}
+		if(!child){
+			child = _remap_node_new(sub, len);
+			if(!child) return MOSQ_ERR_NOMEM;
+			child->next = node->children;
+			node->children = child;
+		}
+		node = child;
+		if(!end){
+			if(node->topic_index == -1) node->topic_index = index;
+			return MOSQ_ERR_SUCCESS;
+		}
+		sub = end+1;
+	}
+}
+
+/* Find the lowest numbered bridge topic below node that matches topic, which
+ * is the remainder of the full topic after the levels node represents. topic
+ * is NULL once all levels have been used. Follows the rules of
+ * mosquitto_topic_matches_sub(), including "a/#" matching "a". */
+static int _remap_search(struct _mqtt3_bridge_topic_node *node, const char *topic, bool top)
+{
+	struct _mqtt3_bridge_topic_node *child;
+	const char *end;
+	const char *rest;
+	int len;
+	int best = -1;
+	int found;
+
+	if(!(top && topic && topic[0] == '$')){
+		best = node->multi_index;
+	}
+	if(!topic){
+		if(node->topic_index != -1 && (best == -1 || node->topic_index < best)){
+			best = node->topic_index;
+		}
+		return best;
+	}
+
+	end = strchr(topic, '/');
+	if(end){
+		len = end-topic;
+		rest = end+1;
+	}else{
+		len = strlen(topic);
+		rest = NULL;
+	}
+	for(child=node->children; child; child=child->next){
+		if(!strcmp(child->token, "+")){
+			if(top && topic[0] == '$') continue;
+		}else if(strncmp(child->token, topic, len) || child->token[len] != '\0'){
+			continue;
+		}
+		found = _remap_search(child, rest, false);
+		if(found != -1 && (best == -1 || found < best)){
+			best = found;
+		}
+	}
+	return best;
+}
+
+/* Compile the bridge topics that change the topic prefix into a tree for
+ * each direction, so that remapping a message doesn't need to try every
+ * bridge topic in turn. */
+int mqtt3_bridge_remap_build(struct _mqtt3_bridge *bridge)
+{
+	struct _mqtt3_bridge_topic *cur_topic;
+	int i;
+
+	mqtt3_bridge_remap_free(bridge);
+	if(!bridge->topic_remapping) return MOSQ_ERR_SUCCESS;
+
+	for(i=0; i<bridge->topic_count; i++){
+		cur_topic = &bridge->topics[i];
+		if(!cur_topic->remote_prefix && !cur_topic->local_prefix) continue;
+
+		if(cur_topic->direction == bd_out || cur_topic->direction == bd_both){
+			if(_remap_add(&bridge->remap_out, cur_topic->local_topic, i)) return MOSQ_ERR_NOMEM;
+		}
+		if(cur_topic->direction == bd_in || cur_topic->direction == bd_both){
+			if(_remap_add(&bridge->remap_in, cur_topic->remote_topic, i)) return MOSQ_ERR_NOMEM;
+		}
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+void mqtt3_bridge_remap_free(struct _mqtt3_bridge *bridge)
+{
+	_remap_node_free(bridge->remap_out);
+	bridge->remap_out = NULL;
+	_remap_node_free(bridge->remap_in);
+	bridge->remap_in = NULL;
+}
+
+/* Work out how topic changes when it crosses the bridge in direction, which
+ * is bd_out or bd_in. Returns false if the topic is not remapped. Otherwise
+ * the new topic is *prefix, which may be NULL, followed by *suffix, which
+ * points into topic. */
+bool mqtt3_bridge_remap(struct _mqtt3_bridge *bridge, enum mqtt3_bridge_direction direction, const char *topic, const char **prefix, const char **suffix)
+{
+	struct _mqtt3_bridge_topic *cur_topic;
+	const char *strip;
+	size_t len;
+	int index;
+
+	if(direction == bd_out){
+		if(!bridge->remap_out) return false;
+		index = _remap_search(bridge->remap_out, topic, true);
+	}else{
+		if(!bridge->remap_in) return false;
+		index = _remap_search(bridge->remap_in, topic, true);
+	}
+	if(index == -1) return false;
+
+	cur_topic = &bridge->topics[index];
+	if(direction == bd_out){
+		strip = cur_topic->local_prefix;
+		*prefix = cur_topic->remote_prefix;
+	}else{
+		strip = cur_topic->remote_prefix;
+		*prefix = cur_topic->local_prefix;
+	}
+	*suffix = topic;
+	if(strip){
+		len = strlen(strip);
+		if(!strncmp(strip, topic, len)){
+			*suffix = topic + len;
+		}
+	}
+	return true;
+}
+
+/* Add a QoS 0 message to the batch waiting to be sent on this bridge
+ * connection. The batch is sent when it reaches BRIDGE_BATCH_MAX bytes, or
+ * when mqtt3_bridge_batch_flush() is called once batch_delay has passed. */
+int mqtt3_bridge_batch_add(struct mosquitto *context, struct mosquitto_msg_store *stored, int qos, bool retain)
+{
+	struct _mqtt3_bridge *bridge = context->bridge;
+	const char *topic = stored->msg.topic;
+	uint32_t payloadlen = stored->msg.payloadlen;
+	char tag[MQTT3_ORIGIN_TAG_MAX+1];
+	uint32_t taglen = 0;
+	const char *prefix = NULL;
+	uint32_t prefixlen = 0;
+	uint8_t *batch;
+	uint8_t *pos;
+	uint32_t topiclen;
+	uint32_t len;
+	uint32_t size;
+
+	if(context->origin_tagging){
+		taglen = _origin_tag(tag, sizeof(tag), stored);
+	}
+	if(bridge->topic_remapping && mqtt3_bridge_remap(bridge, bd_out, topic, &prefix, &topic)){
+		if(prefix) prefixlen = strlen(prefix);
+	}
+	topiclen = taglen + prefixlen + strlen(topic);
+	if(topiclen > 65535){
+		/* The remapped topic is too long to send. */
+		return MOSQ_ERR_SUCCESS;
+	}
+	if(payloadlen > MQTT3_BATCH_MAX - (1 + 2 + topiclen + 1 + 4)){
+		/* Too large for any batch, send it on its own after the messages
+		 * that are already waiting. */
+		if(mqtt3_bridge_batch_flush(context)) return MOSQ_ERR_NOMEM;
+		return mqtt3_bridge_send_publish(context, 0, stored, qos, retain, false);
+	}
+	len = 2 + topiclen + 1 + 4 + payloadlen;
+	if(bridge->batch_len + len > MQTT3_BATCH_MAX){
+		if(mqtt3_bridge_batch_flush(context)) return MOSQ_ERR_NOMEM;
+	}
+
+	if(bridge->batch_len == 0){
+		/* Leave room for the flags byte. */
+		bridge->batch_len = 1;
+		bridge->batch_deadline = mosquitto_time_ms() + bridge->batch_delay;
+	}
+	if(bridge->batch_len + len > bridge->batch_size){
+		size = bridge->batch_len + len;
+		if(size < BRIDGE_BATCH_MAX*2){
+			size = BRIDGE_BATCH_MAX*2;
+		}
+		batch = _mosquitto_realloc_typed(bridge->batch, size, mosq_mt_packets);
+		if(!batch) return MOSQ_ERR_NOMEM;
+		bridge->batch = batch;
+		bridge->batch_size = size;
+	}
+
+	pos = &bridge->batch[bridge->batch_len];
+	*pos++ = MOSQ_MSB(topiclen);
+	*pos++ = MOSQ_LSB(topiclen);
+	if(taglen){
+		memcpy(pos, tag, taglen);
+		pos += taglen;
+	}
+	if(prefixlen){
+		memcpy(pos, prefix, prefixlen);
+		pos += prefixlen;
+	}
+	memcpy(pos, topic, topiclen-taglen-prefixlen);
+	pos += topiclen-taglen-prefixlen;
+	*pos++ = (qos<<1) | (retain?1:0);
+	*pos++ = (payloadlen>>24) & 0xFF;
+	*pos++ = (payloadlen>>16) & 0xFF;
+	*pos++ = (payloadlen>>8) & 0xFF;
+	*pos++ = payloadlen & 0xFF;
+	if(payloadlen){
+		memcpy(pos, stored->msg.payload, payloadlen);
+	}
+	bridge->batch_len += len;
+	bridge->batch_count++;
+
+	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Batching PUBLISH to %s (q%d, r%d, '%s%s', ... (%ld bytes))", context->id, qos, retain, prefix?prefix:"", topic, (long)payloadlen);
+#ifdef WITH_SYS_TREE
+	g_pub_bytes_sent += payloadlen;
+#endif
+
+	if(bridge->batch_len >= BRIDGE_BATCH_MAX){
+		return mqtt3_bridge_batch_flush(context);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Send any messages waiting in the batch for this bridge connection as a
+ * single PUBLISH, compressing them if batch_compression is set. */
+int mqtt3_bridge_batch_flush(struct mosquitto *context)
+{
+	struct _mqtt3_bridge *bridge = context->bridge;
+	const uint8_t *payload;
+	uint32_t payloadlen;
+	int rc;
+#ifdef WITH_ZLIB
+	uint8_t *packed = NULL;
+	uLongf packedlen;
+	uint32_t len;
+#endif
+
+	if(!bridge->batch_count) return MOSQ_ERR_SUCCESS;
+
+	bridge->batch[0] = 0;
+	payload = bridge->batch;
+	payloadlen = bridge->batch_len;
+#ifdef WITH_ZLIB
+	if(bridge->batch_compression > 0){
+		len = bridge->batch_len - 1;
+		packedlen = compressBound(len);
+		packed = _mosquitto_malloc_typed(5 + packedlen, mosq_mt_packets);
+		if(!packed) return MOSQ_ERR_NOMEM;
+
+		if(compress2(&packed[5], &packedlen, &bridge->batch[1], len, bridge->batch_compression) == Z_OK
+				&& 5 + packedlen < payloadlen){
+
+			packed[0] = MQTT3_BATCH_ZLIB;
+			packed[1] = (len>>24) & 0xFF;
+			packed[2] = (len>>16) & 0xFF;
+			packed[3] = (len>>8) & 0xFF;
+			packed[4] = len & 0xFF;
+			payload = packed;
+			payloadlen = 5 + packedlen;
+		}
+	}
+#endif
+
+	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Sending batch of %d messages to %s (%ld bytes, %ld sent)",
+			bridge->batch_count, context->id, (long)bridge->batch_len-1, (long)payloadlen);
+	rc = _mosquitto_send_real_publish(context, 0, MQTT3_BATCH_TOPIC, payloadlen, payload, 0, false, false);
+#ifdef WITH_ZLIB
+	if(packed) _mosquitto_free(packed);
+#endif
+
+	bridge->batch_len = 0;
+	bridge->batch_count = 0;
+	if(bridge->batch_size > BRIDGE_BATCH_MAX*2){
+		/* Don't hold on to the space used by an unusually large message. */
+		_mosquitto_free(bridge->batch);
+		bridge->batch = NULL;
+		bridge->batch_size = 0;
+	}
+	return rc;
+}
+
+/* Tell the remote broker that this connection will carry origin tagged
+ * messages in both directions, see MQTT3_ORIGIN_TOPIC. */
+int mqtt3_bridge_origin_announce(struct mosquitto_db *db, struct mosquitto *context)
+{
+	char payload[17];
+
+	snprintf(payload, sizeof(payload), "%016llx", (unsigned long long)db->origin_id);
+	if(_mosquitto_send_real_publish(context, 0, MQTT3_ORIGIN_TOPIC, strlen(payload), payload, 0, false, false)){
+		return 1;
+	}
+	context->origin_tagging = true;
+	return MOSQ_ERR_SUCCESS;
+}
+
 void mqtt3_bridge_packet_cleanup(struct mosquitto *context)
 {
 	struct _mosquitto_packet *packet;
 	if(!context) return;
 
-	_mosquitto_packet_cleanup(context->current_out_packet);
-    while(context->out_packet){
+	if(context->current_out_packet){
+		_mosquitto_out_packet_account(context, context->current_out_packet, false);
+		_mosquitto_packet_cleanup(context->current_out_packet);
+		_mosquitto_pool_free(mosq_pt_packet, context->current_out_packet);
+		context->current_out_packet = NULL;
+	}
+	while(context->out_packet){
+		_mosquitto_out_packet_account(context, context->out_packet, false);
 		_mosquitto_packet_cleanup(context->out_packet);
 		packet = context->out_packet;
 		context->out_packet = context->out_packet->next;
-		_mosquitto_free(packet);
+		_mosquitto_pool_free(mosq_pt_packet, packet);
 	}
+	context->out_packet_last = NULL;
 
 	_mosquitto_packet_cleanup(&(context->in_packet));
 }
 
 #endif
+
+/* Pick a random id for this broker. A new id is used each time the broker
+ * starts, so sequence numbers never need to be saved. */
+uint64_t mqtt3_bridge_origin_id_generate(void)
+{
+	uint64_t id = 0;
+#ifndef WIN32
+	FILE *fptr;
+
+	fptr = fopen("/dev/urandom", "rb");
+	if(fptr){
+		if(fread(&id, sizeof(id), 1, fptr) != 1){
+			id = 0;
+		}
+		fclose(fptr);
+	}
+#endif
+	if(!id){
+		id = ((uint64_t)mosquitto_time_ms()<<20) ^ ((uint64_t)getpid()<<1) ^ (uint64_t)rand();
+	}
+	return id;
+}
+
+static int _origin_hex(const char **str, uint64_t *value)
+{
+	const char *s = *str;
+	int digits = 0;
+	int c;
+
+	*value = 0;
+	while(*s != '/'){
+		c = *s;
+		if(c >= '0' && c <= '9'){
+			c -= '0';
+		}else if(c >= 'a' && c <= 'f'){
+			c -= 'a'-10;
+		}else{
+			return MOSQ_ERR_PROTOCOL;
+		}
+		if(++digits > 16) return MOSQ_ERR_PROTOCOL;
+		*value = (*value<<4) | c;
+		s++;
+	}
+	if(!digits) return MOSQ_ERR_PROTOCOL;
+	*str = s+1;
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Remove the origin tag from the start of topic, which must begin with
+ * MQTT3_ORIGIN_PREFIX, and return the origin id and sequence number it held. */
+int mqtt3_bridge_origin_strip(char *topic, uint64_t *id, uint64_t *seq)
+{
+	const char *s = topic + strlen(MQTT3_ORIGIN_PREFIX);
+
+	if(_origin_hex(&s, id) || _origin_hex(&s, seq) || *s == '\0'){
+		return MOSQ_ERR_PROTOCOL;
+	}
+	memmove(topic, s, strlen(s)+1);
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Record that the message with sequence number seq from origin id has arrived,
+ * and return true if it has arrived before. Messages that this broker
+ * published itself, and messages that are too far behind the newest one from
+ * their origin to be checked, are always treated as having been seen. */
+bool mqtt3_bridge_origin_seen(struct mosquitto_db *db, uint64_t id, uint64_t seq)
+{
+	struct _mqtt3_origin *origin;
+	uint64_t i;
+	uint32_t bit;
+	time_t now;
+
+	if(id == db->origin_id) return true;
+
+	now = mosquitto_time();
+	HASH_FIND(hh, db->origins, &id, sizeof(id), origin);
+	if(!origin){
+		if(HASH_COUNT(db->origins) >= MQTT3_ORIGIN_MAX){
+			/* Forget the origin that has been quiet for longest. */
+			origin = db->origins;
+			HASH_DELETE(hh, db->origins, origin);
+			memset(origin, 0, sizeof(struct _mqtt3_origin));
+		}else{
+			origin = _mosquitto_calloc(1, sizeof(struct _mqtt3_origin));
+			if(!origin) return false;
+		}
+		origin->id = id;
+		origin->seq_max = seq;
+		origin->last_seen = now;
+		HASH_ADD(hh, db->origins, id, sizeof(origin->id), origin);
+	}else if(origin->last_seen != now){
+		/* Keep the table in order of last_seen, oldest first. */
+		HASH_DELETE(hh, db->origins, origin);
+		origin->last_seen = now;
+		HASH_ADD(hh, db->origins, id, sizeof(origin->id), origin);
+	}
+	if(seq > origin->seq_max){
+		if(seq - origin->seq_max >= MQTT3_ORIGIN_WINDOW){
+			memset(origin->window, 0, sizeof(origin->window));
+		}else{
+			for(i=origin->seq_max+1; i<seq; i++){
+				bit = i % MQTT3_ORIGIN_WINDOW;
+				origin->window[bit/32] &= ~(1U<<(bit%32));
+			}
+		}
+		origin->seq_max = seq;
+	}else if(origin->seq_max - seq >= MQTT3_ORIGIN_WINDOW){
+		return true;
+	}else{
+		bit = seq % MQTT3_ORIGIN_WINDOW;
+		if(origin->window[bit/32] & (1U<<(bit%32))){
+			return true;
+		}
+	}
+	bit = seq % MQTT3_ORIGIN_WINDOW;
+	origin->window[bit/32] |= 1U<<(bit%32);
+	return false;
+}
+
+/* Forget origins that have sent nothing for MQTT3_ORIGIN_EXPIRY seconds. */
+void mqtt3_bridge_origin_expire(struct mosquitto_db *db, time_t now)
+{
+	struct _mqtt3_origin *origin;
+
+	while(db->origins && now - db->origins->last_seen > MQTT3_ORIGIN_EXPIRY){
+		origin = db->origins;
+		HASH_DELETE(hh, db->origins, origin);
+		_mosquitto_free(origin);
+	}
+}
+
+void mqtt3_bridge_origin_cleanup(struct mosquitto_db *db)
+{
+	struct _mqtt3_origin *origin, *tmp;
+
+	HASH_ITER(hh, db->origins, origin, tmp){
+		HASH_DELETE(hh, db->origins, origin);
+		_mosquitto_free(origin);
+	}
+}
+
+/* As _mosquitto_send_publish(), for a stored message sent by the broker. If
+ * the context tags messages with their origin, the tag for stored is added to
+ * the start of the topic. */
+int mqtt3_bridge_send_publish(struct mosquitto *context, uint16_t mid, struct mosquitto_msg_store *stored, int qos, bool retain, bool dup)
+{
+	char tag[MQTT3_ORIGIN_TAG_MAX+1];
+	const char *prefix = NULL;
+	const char *topic = stored->msg.topic;
+	int rc;
+
+#ifdef WITH_SYS_TREE
+	/* Picked up by the PUBLISH packet so $SYS/broker/latency/delivery can be
+	 * updated once it has been written. Retained messages sent for a new
+	 * subscription and resends aren't counted. */
+	if(!retain && !dup){
+		context->publish_store_time = stored->store_time;
+	}
+#endif
+	if(!context->origin_tagging){
+		rc = _mosquitto_send_publish(context, mid, topic, stored->msg.payloadlen, stored->msg.payload, qos, retain, dup);
+		context->publish_store_time = 0;
+		return rc;
+	}
+
+	_origin_tag(tag, sizeof(tag), stored);
+#ifdef WITH_BRIDGE
+	if(context->bridge && context->bridge->topic_remapping){
+		mqtt3_bridge_remap(context->bridge, bd_out, topic, &prefix, &topic);
+	}
+#endif
+	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Sending PUBLISH to %s (d%d, q%d, r%d, m%d, '%s%s%s', ... (%ld bytes))",
+			context->id, dup, qos, retain, mid, tag, prefix?prefix:"", topic, (long)stored->msg.payloadlen);
+#ifdef WITH_SYS_TREE
+	g_pub_bytes_sent += stored->msg.payloadlen;
+#endif
+	rc = _mosquitto_send_real_publish_prefixed(context, mid, tag, prefix, topic, stored->msg.payloadlen, stored->msg.payload, qos, retain, dup);
+	context->publish_store_time = 0;
+	return rc;
+}
@@ -72,6 +72,9 @@ static int _conf_parse_bool(char **token, const char *name, bool *value, char *s
 static int _conf_parse_int(char **token, const char *name, int *value, char *saveptr);
 static int _conf_parse_string(char **token, const char *name, char **value, char *saveptr);
 static int _config_read_file(struct mqtt3_config *config, bool reload, const char *file, struct config_recurse *config_tmp, int level, int *lineno);
+#ifdef WITH_BRIDGE
+static int _config_bridges_expand(struct mqtt3_config *config);
+#endif
 
 static int _conf_attempt_resolve(const char *host, const char *text, int log, const char *msg)
 {
@@ -151,6 +154,15 @@ static void _config_init_reload(struct mqtt3_config *config)
 	}
 #endif
 	config->log_timestamp = true;
+	config->log_queue_size = 0;
+	config->client_output_high_water = 0;
+	config->client_output_limit = 0;
+	config->client_output_low_water = 0;
+	config->memory_limit = 0;
+	config->output_high_water = 0;
+	config->output_low_water = 0;
+	config->slow_client_policy = scp_park;
+	config->shared_subscription_policy = ssp_round_robin;
 	if(config->password_file) _mosquitto_free(config->password_file);
 	config->password_file = NULL;
 	config->persistence = false;
@@ -162,9 +174,12 @@ static void _config_init_reload(struct mqtt3_config *config)
 	if(config->psk_file) _mosquitto_free(config->psk_file);
 	config->psk_file = NULL;
 	config->queue_qos0_messages = false;
+	config->retained_delivery_batch = 100;
 	config->retry_interval = 20;
 	config->store_clean_interval = 10;
 	config->sys_interval = 10;
+	config->top_count = 0;
+	config->top_sample = 1;
 	config->upgrade_outgoing_qos = false;
 	if(config->auth_options){
 		for(i=0; i<config->auth_option_count; i++){
@@ -183,6 +198,7 @@ void mqtt3_config_init(struct mqtt3_config *config)
 	_config_init_reload(config);
 	config->config_file = NULL;
 	config->daemon = false;
+	config->tls_handshake_threads = 0;
 	config->default_listener.host = NULL;
 	config->default_listener.port = 0;
 	config->default_listener.max_connections = -1;
@@ -201,6 +217,14 @@ void mqtt3_config_init(struct mqtt3_config *config)
 	config->default_listener.require_certificate = false;
 	config->default_listener.crlfile = NULL;
 	config->default_listener.use_identity_as_username = false;
+	config->default_listener.tls_coalesce_writes = false;
+	config->default_listener.tls_kernel_offload = false;
+	config->default_listener.tls_session_cache_size = -1;
+	config->default_listener.tls_session_timeout = 0;
+	config->default_listener.tls_session_tickets = true;
+	config->default_listener.tls_ticket_keyfile = NULL;
+	config->default_listener.ticket_keys = NULL;
+	config->default_listener.ticket_key_count = 0;
 #endif
 	config->listeners = NULL;
 	config->listener_count = 0;
@@ -245,6 +269,8 @@ void mqtt3_config_cleanup(struct mqtt3_config *config)
 			if(config->listeners[i].psk_hint) _mosquitto_free(config->listeners[i].psk_hint);
 			if(config->listeners[i].crlfile) _mosquitto_free(config->listeners[i].crlfile);
 			if(config->listeners[i].tls_version) _mosquitto_free(config->listeners[i].tls_version);
+			if(config->listeners[i].tls_ticket_keyfile) _mosquitto_free(config->listeners[i].tls_ticket_keyfile);
+			if(config->listeners[i].ticket_keys) _mosquitto_free(config->listeners[i].ticket_keys);
 			if(config->listeners[i].ssl_ctx) SSL_CTX_free(config->listeners[i].ssl_ctx);
 #endif
 		}
@@ -253,6 +279,13 @@ void mqtt3_config_cleanup(struct mqtt3_config *config)
 #ifdef WITH_BRIDGE
 	if(config->bridges){
 		for(i=0; i<config->bridge_count; i++){
+			mqtt3_bridge_cleanup(&config->bridges[i]);
+			if(config->bridges[i].connection_index > 0){
+				/* Extra parallel connections share their strings with the
+				 * first connection of the bridge. */
+				continue;
+			}
+			mqtt3_bridge_remap_free(&config->bridges[i]);
 			if(config->bridges[i].name) _mosquitto_free(config->bridges[i].name);
 			if(config->bridges[i].addresses){
 				for(j=0; j<config->bridges[i].address_count; j++){
@@ -382,6 +415,12 @@ int mqtt3_config_parse_args(struct mqtt3_config *config, int argc, char *argv[])
 			|| config->default_listener.require_certificate
 			|| config->default_listener.crlfile
 			|| config->default_listener.use_identity_as_username
+			|| config->default_listener.tls_coalesce_writes
+			|| config->default_listener.tls_kernel_offload
+			|| config->default_listener.tls_session_cache_size != -1
+			|| config->default_listener.tls_session_timeout
+			|| !config->default_listener.tls_session_tickets
+			|| config->default_listener.tls_ticket_keyfile
 #endif
 			|| config->default_listener.host
 			|| config->default_listener.port
@@ -414,6 +453,11 @@ int mqtt3_config_parse_args(struct mqtt3_config *config, int argc, char *argv[])
 		config->listeners[config->listener_count-1].socks = NULL;
 		config->listeners[config->listener_count-1].sock_count = 0;
 		config->listeners[config->listener_count-1].client_count = 0;
+		config->listeners[config->listener_count-1].protocol = mp_mqtt;
+#ifdef WITH_SYS_TREE
+		memset(&config->listeners[config->listener_count-1].traffic, 0, sizeof(struct _mqtt3_traffic));
+		memset(&config->listeners[config->listener_count-1].traffic_published, 0, sizeof(struct _mqtt3_traffic));
+#endif
 #ifdef WITH_TLS
 		config->listeners[config->listener_count-1].tls_version = config->default_listener.tls_version;
 		config->listeners[config->listener_count-1].cafile = config->default_listener.cafile;
@@ -426,6 +470,14 @@ int mqtt3_config_parse_args(struct mqtt3_config *config, int argc, char *argv[])
 		config->listeners[config->listener_count-1].ssl_ctx = NULL;
 		config->listeners[config->listener_count-1].crlfile = config->default_listener.crlfile;
 		config->listeners[config->listener_count-1].use_identity_as_username = config->default_listener.use_identity_as_username;
+		config->listeners[config->listener_count-1].tls_coalesce_writes = config->default_listener.tls_coalesce_writes;
+		config->listeners[config->listener_count-1].tls_kernel_offload = config->default_listener.tls_kernel_offload;
+		config->listeners[config->listener_count-1].tls_session_cache_size = config->default_listener.tls_session_cache_size;
+		config->listeners[config->listener_count-1].tls_session_timeout = config->default_listener.tls_session_timeout;
+		config->listeners[config->listener_count-1].tls_session_tickets = config->default_listener.tls_session_tickets;
+		config->listeners[config->listener_count-1].tls_ticket_keyfile = config->default_listener.tls_ticket_keyfile;
+		config->listeners[config->listener_count-1].ticket_keys = NULL;
+		config->listeners[config->listener_count-1].ticket_key_count = 0;
 #endif
 	}
 
@@ -501,6 +553,14 @@ int mqtt3_config_read(struct mqtt3_config *config, bool reload)
 			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid bridge configuration.");
 			return MOSQ_ERR_INVAL;
 		}
+		if(config->bridges[i].batch_messages && !config->bridges[i].try_private){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid bridge configuration: batch_messages requires try_private.");
+			return MOSQ_ERR_INVAL;
+		}
+		if(config->bridges[i].loop_detection && !config->bridges[i].try_private){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid bridge configuration: loop_detection requires try_private.");
+			return MOSQ_ERR_INVAL;
+		}
 #ifdef REAL_WITH_TLS_PSK
 		if(config->bridges[i].tls_psk && !config->bridges[i].tls_psk_identity){
 			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid bridge configuration: missing bridge_identity.\n");
@@ -511,6 +571,14 @@ int mqtt3_config_read(struct mqtt3_config *config, bool reload)
 			return MOSQ_ERR_INVAL;
 		}
 #endif
+		if(!reload && mqtt3_bridge_remap_build(&config->bridges[i])){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+			return MOSQ_ERR_NOMEM;
+		}
+	}
+	if(!reload && _config_bridges_expand(config)){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return MOSQ_ERR_NOMEM;
 	}
 #endif
 
@@ -674,6 +742,53 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 					if(config->autosave_interval < 0) config->autosave_interval = 0;
 				}else if(!strcmp(token, "autosave_on_changes")){
 					if(_conf_parse_bool(&token, "autosave_on_changes", &config->autosave_on_changes, saveptr)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "batch_compression")){
+#ifdef WITH_BRIDGE
+					if(reload) continue; // FIXME
+					if(!cur_bridge){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid bridge configuration.");
+						return MOSQ_ERR_INVAL;
+					}
+					if(_conf_parse_int(&token, "batch_compression", &cur_bridge->batch_compression, saveptr)) return MOSQ_ERR_INVAL;
+					if(cur_bridge->batch_compression < 0 || cur_bridge->batch_compression > 9){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid batch_compression value (%d).", cur_bridge->batch_compression);
+						return MOSQ_ERR_INVAL;
+					}
+#  ifndef WITH_ZLIB
+					if(cur_bridge->batch_compression > 0){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: zlib support not available, batch_compression ignored.");
+						cur_bridge->batch_compression = 0;
+					}
+#  endif
+#else
+					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
+#endif
+				}else if(!strcmp(token, "batch_delay")){
+#ifdef WITH_BRIDGE
+					if(reload) continue; // FIXME
+					if(!cur_bridge){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid bridge configuration.");
+						return MOSQ_ERR_INVAL;
+					}
+					if(_conf_parse_int(&token, "batch_delay", &cur_bridge->batch_delay, saveptr)) return MOSQ_ERR_INVAL;
+					if(cur_bridge->batch_delay < 0 || cur_bridge->batch_delay > 10000){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid batch_delay value (%d).", cur_bridge->batch_delay);
+						return MOSQ_ERR_INVAL;
+					}
+#else
+					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
+#endif
+				}else if(!strcmp(token, "batch_messages")){
+#ifdef WITH_BRIDGE
+					if(reload) continue; // FIXME
+					if(!cur_bridge){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid bridge configuration.");
+						return MOSQ_ERR_INVAL;
+					}
+					if(_conf_parse_bool(&token, "batch_messages", &cur_bridge->batch_messages, saveptr)) return MOSQ_ERR_INVAL;
+#else
+					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
+#endif
 				}else if(!strcmp(token, "bind_address")){
 					if(reload) continue; // Listener not valid for reloading.
 					if(_conf_parse_string(&token, "default listener bind_address", &config->default_listener.host, saveptr)) return MOSQ_ERR_INVAL;
@@ -981,6 +1096,27 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 						}
 					}
 					if(_conf_parse_string(&token, "clientid_prefixes", &config->clientid_prefixes, saveptr)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "client_output_high_water")){
+					token = strtok_r(NULL, " ", &saveptr);
+					if(token){
+						config->client_output_high_water = strtoul(token, NULL, 10);
+					}else{
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty client_output_high_water value in configuration.");
+					}
+				}else if(!strcmp(token, "client_output_limit")){
+					token = strtok_r(NULL, " ", &saveptr);
+					if(token){
+						config->client_output_limit = strtoul(token, NULL, 10);
+					}else{
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty client_output_limit value in configuration.");
+					}
+				}else if(!strcmp(token, "client_output_low_water")){
+					token = strtok_r(NULL, " ", &saveptr);
+					if(token){
+						config->client_output_low_water = strtoul(token, NULL, 10);
+					}else{
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty client_output_low_water value in configuration.");
+					}
 				}else if(!strcmp(token, "connection")){
 #ifdef WITH_BRIDGE
 					if(reload) continue; // FIXME
@@ -1006,6 +1142,10 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 						cur_bridge->restart_timeout = 30;
 						cur_bridge->threshold = 10;
 						cur_bridge->try_private = true;
+						cur_bridge->primary_probe_sock = INVALID_SOCKET;
+						cur_bridge->primary_probe_pollfd_index = -1;
+						cur_bridge->connection_count = 1;
+						cur_bridge->batch_delay = 10;
 					}else{
 						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty connection value in configuration.");
 						return MOSQ_ERR_INVAL;
@@ -1143,6 +1283,10 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 						cur_listener = &config->listeners[config->listener_count-1];
 						memset(cur_listener, 0, sizeof(struct _mqtt3_listener));
 						cur_listener->port = port_tmp;
+#ifdef WITH_TLS
+						cur_listener->tls_session_cache_size = -1;
+						cur_listener->tls_session_tickets = true;
+#endif
 						token = strtok_r(NULL, " ", &saveptr);
 						if(token){
 							cur_listener->host = _mosquitto_strdup(token);
@@ -1209,6 +1353,16 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty log_dest value in configuration.");
 						return MOSQ_ERR_INVAL;
 					}
+				}else if(!strcmp(token, "log_queue_size")){
+#ifdef WITH_LOG_THREAD
+					if(_conf_parse_int(&token, "log_queue_size", &config->log_queue_size, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->log_queue_size < 0 || config->log_queue_size > 1000000){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid log_queue_size value (%d).", config->log_queue_size);
+						return MOSQ_ERR_INVAL;
+					}
+#else
+					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Log thread support not available.");
+#endif
 				}else if(!strcmp(token, "log_timestamp")){
 					if(_conf_parse_bool(&token, token, &config->log_timestamp, saveptr)) return MOSQ_ERR_INVAL;
 				}else if(!strcmp(token, "log_type")){
@@ -1240,6 +1394,17 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 					}else{
 						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty log_type value in configuration.");
 					}
+				}else if(!strcmp(token, "loop_detection")){
+#ifdef WITH_BRIDGE
+					if(reload) continue; // FIXME
+					if(!cur_bridge){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid bridge configuration.");
+						return MOSQ_ERR_INVAL;
+					}
+					if(_conf_parse_bool(&token, "loop_detection", &cur_bridge->loop_detection, saveptr)) return MOSQ_ERR_INVAL;
+#else
+					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
+#endif
 				}else if(!strcmp(token, "max_connections")){
 					if(reload) continue; // Listeners not valid for reloading.
 					token = strtok_r(NULL, " ", &saveptr);
@@ -1265,6 +1430,17 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 					}else{
 						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty max_queued_messages value in configuration.");
 					}
+				}else if(!strcmp(token, "memory_limit")){
+					token = strtok_r(NULL, " ", &saveptr);
+					if(token){
+#ifdef REAL_WITH_MEMORY_TRACKING
+						config->memory_limit = strtoul(token, NULL, 10);
+#else
+						_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: memory_limit is not available, memory tracking support is not compiled in.");
+#endif
+					}else{
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty memory_limit value in configuration.");
+					}
 				}else if(!strcmp(token, "message_size_limit")){
 					if(_conf_parse_int(&token, "message_size_limit", &config->message_size_limit, saveptr)) return MOSQ_ERR_INVAL;
 					if(config->message_size_limit < 0 || config->message_size_limit > MQTT_MAX_PAYLOAD){
@@ -1305,6 +1481,35 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 					if(_conf_parse_string(&token, "notification_topic", &cur_bridge->notification_topic, saveptr)) return MOSQ_ERR_INVAL;
 #else
 					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
+#endif
+				}else if(!strcmp(token, "output_high_water")){
+					token = strtok_r(NULL, " ", &saveptr);
+					if(token){
+						config->output_high_water = strtoul(token, NULL, 10);
+					}else{
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty output_high_water value in configuration.");
+					}
+				}else if(!strcmp(token, "output_low_water")){
+					token = strtok_r(NULL, " ", &saveptr);
+					if(token){
+						config->output_low_water = strtoul(token, NULL, 10);
+					}else{
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty output_low_water value in configuration.");
+					}
+				}else if(!strcmp(token, "parallel_connections")){
+#ifdef WITH_BRIDGE
+					if(reload) continue; // FIXME
+					if(!cur_bridge){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid bridge configuration.");
+						return MOSQ_ERR_INVAL;
+					}
+					if(_conf_parse_int(&token, "parallel_connections", &cur_bridge->connection_count, saveptr)) return MOSQ_ERR_INVAL;
+					if(cur_bridge->connection_count < 1 || cur_bridge->connection_count > 64){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid parallel_connections value (%d).", cur_bridge->connection_count);
+						return MOSQ_ERR_INVAL;
+					}
+#else
+					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
 #endif
 				}else if(!strcmp(token, "password")){
 #ifdef WITH_BRIDGE
@@ -1388,6 +1593,31 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 						return MOSQ_ERR_INVAL;
 					}
 					config->default_listener.port = port_tmp;
+				}else if(!strcmp(token, "protocol")){
+					if(reload) continue; // Listeners not valid for reloading.
+					if(config->listener_count == 0){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: You must use create a listener before using the protocol option in the configuration file.");
+						return MOSQ_ERR_INVAL;
+					}
+					token = strtok_r(NULL, " ", &saveptr);
+					if(token){
+						if(!strcmp(token, "mqtt")){
+							cur_listener->protocol = mp_mqtt;
+						}else if(!strcmp(token, "metrics")){
+#ifdef WITH_SYS_TREE
+							cur_listener->protocol = mp_metrics;
+#else
+							_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Metrics listeners need $SYS support, which is not available.");
+							return MOSQ_ERR_INVAL;
+#endif
+						}else{
+							_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid protocol value (%s).", token);
+							return MOSQ_ERR_INVAL;
+						}
+					}else{
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty protocol value in configuration.");
+						return MOSQ_ERR_INVAL;
+					}
 				}else if(!strcmp(token, "psk_file")){
 #ifdef REAL_WITH_TLS_PSK
 					if(reload){
@@ -1431,6 +1661,12 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 #else
 					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
 #endif
+				}else if(!strcmp(token, "retained_delivery_batch")){
+					if(_conf_parse_int(&token, "retained_delivery_batch", &config->retained_delivery_batch, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->retained_delivery_batch < 0){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid retained_delivery_batch value (%d).", config->retained_delivery_batch);
+						return MOSQ_ERR_INVAL;
+					}
 				}else if(!strcmp(token, "retry_interval")){
 					if(_conf_parse_int(&token, "retry_interval", &config->retry_interval, saveptr)) return MOSQ_ERR_INVAL;
 					if(config->retry_interval < 1 || config->retry_interval > 3600){
@@ -1448,6 +1684,38 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 #else
 					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
 #endif
+				}else if(!strcmp(token, "shared_subscription_policy")){
+					token = strtok_r(NULL, " ", &saveptr);
+					if(token){
+						if(!strcmp(token, "round_robin")){
+							config->shared_subscription_policy = ssp_round_robin;
+						}else if(!strcmp(token, "least_queued")){
+							config->shared_subscription_policy = ssp_least_queued;
+						}else{
+							_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid shared_subscription_policy value in configuration (%s).", token);
+							return MOSQ_ERR_INVAL;
+						}
+					}else{
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty shared_subscription_policy value in configuration.");
+						return MOSQ_ERR_INVAL;
+					}
+				}else if(!strcmp(token, "slow_client_policy")){
+					token = strtok_r(NULL, " ", &saveptr);
+					if(token){
+						if(!strcmp(token, "park")){
+							config->slow_client_policy = scp_park;
+						}else if(!strcmp(token, "drop_qos0")){
+							config->slow_client_policy = scp_drop_qos0;
+						}else if(!strcmp(token, "disconnect")){
+							config->slow_client_policy = scp_disconnect;
+						}else{
+							_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid slow_client_policy value in configuration (%s).", token);
+							return MOSQ_ERR_INVAL;
+						}
+					}else{
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty slow_client_policy value in configuration.");
+						return MOSQ_ERR_INVAL;
+					}
 				}else if(!strcmp(token, "start_type")){
 #ifdef WITH_BRIDGE
 					if(reload) continue; // FIXME
@@ -1503,6 +1771,67 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 					}
 #else
 					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
+#endif
+				}else if(!strcmp(token, "tls_handshake_threads")){
+#ifdef WITH_TLS_THREADS
+					if(reload) continue; // Threads are only started once.
+					if(_conf_parse_int(&token, "tls_handshake_threads", &config->tls_handshake_threads, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->tls_handshake_threads < 0 || config->tls_handshake_threads > 1024){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid tls_handshake_threads value (%d).", config->tls_handshake_threads);
+						return MOSQ_ERR_INVAL;
+					}
+#else
+					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: TLS handshake thread support not available.");
+#endif
+				}else if(!strcmp(token, "tls_coalesce_writes")){
+#ifdef WITH_TLS
+					if(reload) continue; // Listeners not valid for reloading.
+					if(_conf_parse_bool(&token, "tls_coalesce_writes", &cur_listener->tls_coalesce_writes, saveptr)) return MOSQ_ERR_INVAL;
+#else
+					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: TLS support not available.");
+#endif
+				}else if(!strcmp(token, "tls_kernel_offload")){
+#ifdef REAL_WITH_KTLS
+					if(reload) continue; // Listeners not valid for reloading.
+					if(_conf_parse_bool(&token, "tls_kernel_offload", &cur_listener->tls_kernel_offload, saveptr)) return MOSQ_ERR_INVAL;
+#else
+					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Kernel TLS support not available.");
+#endif
+				}else if(!strcmp(token, "tls_session_cache_size")){
+#ifdef WITH_TLS
+					if(reload) continue; // Listeners not valid for reloading.
+					if(_conf_parse_int(&token, "tls_session_cache_size", &cur_listener->tls_session_cache_size, saveptr)) return MOSQ_ERR_INVAL;
+					if(cur_listener->tls_session_cache_size < 0){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid tls_session_cache_size value (%d).", cur_listener->tls_session_cache_size);
+						return MOSQ_ERR_INVAL;
+					}
+#else
+					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: TLS support not available.");
+#endif
+				}else if(!strcmp(token, "tls_session_tickets")){
+#ifdef WITH_TLS
+					if(reload) continue; // Listeners not valid for reloading.
+					if(_conf_parse_bool(&token, "tls_session_tickets", &cur_listener->tls_session_tickets, saveptr)) return MOSQ_ERR_INVAL;
+#else
+					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: TLS support not available.");
+#endif
+				}else if(!strcmp(token, "tls_session_timeout")){
+#ifdef WITH_TLS
+					if(reload) continue; // Listeners not valid for reloading.
+					if(_conf_parse_int(&token, "tls_session_timeout", &cur_listener->tls_session_timeout, saveptr)) return MOSQ_ERR_INVAL;
+					if(cur_listener->tls_session_timeout < 1){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid tls_session_timeout value (%d).", cur_listener->tls_session_timeout);
+						return MOSQ_ERR_INVAL;
+					}
+#else
+					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: TLS support not available.");
+#endif
+				}else if(!strcmp(token, "tls_ticket_keyfile")){
+#ifdef WITH_TLS
+					if(reload) continue; // The file itself is reread by mqtt3_tls_ticket_keys_reload().
+					if(_conf_parse_string(&token, "tls_ticket_keyfile", &cur_listener->tls_ticket_keyfile, saveptr)) return MOSQ_ERR_INVAL;
+#else
+					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: TLS support not available.");
 #endif
 				}else if(!strcmp(token, "tls_version")){
 #if defined(WITH_TLS)
@@ -1511,6 +1840,18 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 #else
 					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: TLS support not available.");
 #endif
+				}else if(!strcmp(token, "top_count")){
+					if(_conf_parse_int(&token, "top_count", &config->top_count, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->top_count < 0 || config->top_count > 1000){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid top_count value (%d).", config->top_count);
+						return MOSQ_ERR_INVAL;
+					}
+				}else if(!strcmp(token, "top_sample")){
+					if(_conf_parse_int(&token, "top_sample", &config->top_sample, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->top_sample < 1){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid top_sample value (%d).", config->top_sample);
+						return MOSQ_ERR_INVAL;
+					}
 				}else if(!strcmp(token, "topic")){
 #ifdef WITH_BRIDGE
 					if(reload) continue; // FIXME
@@ -1722,6 +2063,103 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 	return MOSQ_ERR_SUCCESS;
 }
 
+#ifdef WITH_BRIDGE
+/* Returns true if some topic could match both subscriptions a and b. */
+static bool _config_subs_overlap(const char *a, const char *b)
+{
+	size_t la, lb;
+
+	while(1){
+		la = strcspn(a, "/");
+		lb = strcspn(b, "/");
+		if((la == 1 && a[0] == '#') || (lb == 1 && b[0] == '#')){
+			return true;
+		}
+		if(!(la == 1 && a[0] == '+') && !(lb == 1 && b[0] == '+')
+				&& (la != lb || strncmp(a, b, la))){
+			return false;
+		}
+		a += la;
+		b += lb;
+		if(!a[0] || !b[0]){
+			/* "a/#" also matches "a". */
+			return (!a[0] && !b[0]) || !strcmp(a, "/#") || !strcmp(b, "/#");
+		}
+		a++;
+		b++;
+	}
+}
+
+/* Decide which outgoing topics of a bridge with parallel connections are
+ * spread across the connections. Topics in both directions stay on the first
+ * connection, because the remote broker would echo messages sent on another
+ * connection back to the first one. So does any outgoing topic that a message
+ * could match together with a topic on the first connection, otherwise the
+ * message would be sent by two connections. */
+static void _config_bridge_shard(struct _mqtt3_bridge *bridge)
+{
+	bool changed;
+	int i, j;
+
+	for(i=0; i<bridge->topic_count; i++){
+		bridge->topics[i].sharded = (bridge->connection_count > 1
+				&& bridge->topics[i].direction == bd_out);
+	}
+	do{
+		changed = false;
+		for(i=0; i<bridge->topic_count; i++){
+			if(!bridge->topics[i].sharded) continue;
+			for(j=0; j<bridge->topic_count; j++){
+				if(bridge->topics[j].direction != bd_in && !bridge->topics[j].sharded
+						&& _config_subs_overlap(bridge->topics[i].local_topic, bridge->topics[j].local_topic)){
+
+					bridge->topics[i].sharded = false;
+					changed = true;
+					break;
+				}
+			}
+		}
+	}while(changed);
+}
+
+/* Give each extra parallel connection of a bridge its own entry in the bridge
+ * list. The entries share the configuration strings of the first one. */
+static int _config_bridges_expand(struct mqtt3_config *config)
+{
+	struct _mqtt3_bridge *bridges;
+	int count;
+	int i, j, k;
+
+	count = 0;
+	for(i=0; i<config->bridge_count; i++){
+		_config_bridge_shard(&config->bridges[i]);
+		count += config->bridges[i].connection_count;
+	}
+	if(count == config->bridge_count) return MOSQ_ERR_SUCCESS;
+
+	bridges = _mosquitto_calloc(count, sizeof(struct _mqtt3_bridge));
+	if(!bridges) return MOSQ_ERR_NOMEM;
+
+	k = 0;
+	for(i=0; i<config->bridge_count; i++){
+		for(j=0; j<config->bridges[i].connection_count; j++){
+			memcpy(&bridges[k], &config->bridges[i], sizeof(struct _mqtt3_bridge));
+			bridges[k].connection_index = j;
+			if(j > 0){
+				/* Only the first connection reports the bridge state. */
+				bridges[k].notifications = false;
+			}
+			k++;
+		}
+	}
+	_mosquitto_free(config->bridges);
+	config->bridges = bridges;
+	config->bridge_count = count;
+
+	return MOSQ_ERR_SUCCESS;
+}
+#endif
+
 static int _conf_parse_bool(char **token, const char *name, bool *value, char *saveptr)
 {
 	*token = strtok_r(NULL, " ", &saveptr);
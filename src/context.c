@@ -42,11 +42,12 @@ struct mosquitto *mqtt3_context_init(int sock)
 	struct mosquitto *context;
 	char address[1024];
 
-	context = _mosquitto_calloc(1, sizeof(struct mosquitto));
+	context = _mosquitto_calloc_typed(1, sizeof(struct mosquitto), mosq_mt_contexts);
 	if(!context) return NULL;
 	
 	context->state = mosq_cs_new;
 	context->sock = sock;
+	context->db_index = -1;
 	context->last_msg_in = mosquitto_time();
 	context->last_msg_out = mosquitto_time();
 	context->keepalive = 60; /* Default to 60s */
@@ -63,6 +64,7 @@ struct mosquitto *mqtt3_context_init(int sock)
 	 * done by looking at context->bridge for bridges that we create ourself,
 	 * but incoming bridges need some other way of being recorded. */
 	context->is_bridge = false;
+	context->origin_tagging = false;
 
 	context->in_packet.payload = NULL;
 	_mosquitto_packet_cleanup(&context->in_packet);
@@ -72,7 +74,7 @@ struct mosquitto *mqtt3_context_init(int sock)
 	context->address = NULL;
 	if(sock != -1){
 		if(!_mosquitto_socket_get_address(sock, address, 1024)){
-			context->address = _mosquitto_strdup(address);
+			context->address = _mosquitto_strdup_typed(address, mosq_mt_contexts);
 		}
 		if(!context->address){
 			/* getpeername and inet_ntop failed and not a bridge */
@@ -85,9 +87,16 @@ struct mosquitto *mqtt3_context_init(int sock)
 	context->last_msg = NULL;
 	context->msg_count = 0;
 	context->msg_count12 = 0;
+	context->retain_cursors = NULL;
 #ifdef WITH_TLS
 	context->ssl = NULL;
 #endif
+#ifdef WITH_TLS_THREADS
+	context->tls_handshake = mosq_th_none;
+	context->tls_handshake_result = mosq_th_none;
+	context->tls_error = 0;
+	context->tls_handshake_next = NULL;
+#endif
 
 	return context;
 }
@@ -138,6 +147,11 @@ void mqtt3_context_cleanup(struct mosquitto_db *db, struct mosquitto *context, b
 		_mosquitto_socket_close(context);
 		context->listener = NULL;
 	}
+	if(do_free || context->clean_session){
+		/* A persistent session carries on receiving its retained messages
+		 * when it reconnects. */
+		mqtt3_retain_cursor_remove(context, NULL);
+	}
 	if(context->clean_session && db){
 		mqtt3_subs_clean_session(db, context, &db->subs);
 		mqtt3_db_messages_delete(context);
@@ -163,13 +177,18 @@ void mqtt3_context_cleanup(struct mosquitto_db *db, struct mosquitto *context, b
 		context->id = NULL;
 	}
 	_mosquitto_packet_cleanup(&(context->in_packet));
-	_mosquitto_packet_cleanup(context->current_out_packet);
-	context->current_out_packet = NULL;
+	if(context->current_out_packet){
+		_mosquitto_out_packet_account(context, context->current_out_packet, false);
+		_mosquitto_packet_cleanup(context->current_out_packet);
+		_mosquitto_pool_free(mosq_pt_packet, context->current_out_packet);
+		context->current_out_packet = NULL;
+	}
 	while(context->out_packet){
+		_mosquitto_out_packet_account(context, context->out_packet, false);
 		_mosquitto_packet_cleanup(context->out_packet);
 		packet = context->out_packet;
 		context->out_packet = context->out_packet->next;
-		_mosquitto_free(packet);
+		_mosquitto_pool_free(mosq_pt_packet, packet);
 	}
 	if(context->will){
 		if(context->will->topic) _mosquitto_free(context->will->topic);
@@ -182,7 +201,7 @@ void mqtt3_context_cleanup(struct mosquitto_db *db, struct mosquitto *context, b
 		while(msg){
 			next = msg->next;
 			msg->store->ref_count--;
-			_mosquitto_free(msg);
+			_mosquitto_pool_free(mosq_pt_client_msg, msg);
 			msg = next;
 		}
 		context->msgs = NULL;
@@ -210,6 +229,9 @@ void mqtt3_context_disconnect(struct mosquitto_db *db, struct mosquitto *ctxt)
 		assert(ctxt->listener->client_count >= 0);
 		ctxt->listener = NULL;
 	}
+	if(ctxt->clean_session){
+		mqtt3_retain_cursor_remove(ctxt, NULL);
+	}
 	ctxt->disconnect_t = mosquitto_time();
 	_mosquitto_socket_close(ctxt);
 }
@@ -41,6 +41,9 @@ static int max_inflight = 20;
 static int max_queued = 100;
 #ifdef WITH_SYS_TREE
 extern unsigned long g_msgs_dropped;
+extern unsigned long g_memory_qos0_dropped;
+extern unsigned long g_memory_refused;
+extern unsigned long g_slow_qos0_dropped;
 #endif
 
 int mqtt3_db_open(struct mqtt3_config *config, struct mosquitto_db *db)
@@ -51,19 +54,30 @@ int mqtt3_db_open(struct mqtt3_config *config, struct mosquitto_db *db)
 	if(!config || !db) return MOSQ_ERR_INVAL;
 
 	db->last_db_id = 0;
+	db->origin_id = mqtt3_bridge_origin_id_generate();
+	db->origin_seq = 0;
+	db->origins = NULL;
 
-	db->context_count = 1;
-	db->contexts = _mosquitto_malloc(sizeof(struct mosquitto*)*db->context_count);
+	db->context_count = 0;
+	db->context_alloc = 64;
+	db->contexts = _mosquitto_malloc_typed(sizeof(struct mosquitto*)*db->context_alloc, mosq_mt_contexts);
 	if(!db->contexts) return MOSQ_ERR_NOMEM;
-	db->contexts[0] = NULL;
+	db->context_free = _mosquitto_malloc_typed(sizeof(int)*db->context_alloc, mosq_mt_contexts);
+	if(!db->context_free) return MOSQ_ERR_NOMEM;
+	db->context_free_count = 0;
+	db->context_active = 0;
 	// Initialize the hashtable
 	db->clientid_index_hash = NULL;
 
 	db->subs.next = NULL;
 	db->subs.subs = NULL;
 	db->subs.topic = "";
+	db->retains.children = NULL;
+	db->retains.next = NULL;
+	db->retains.topic = "";
+	db->retains.retained = NULL;
 
-	child = _mosquitto_malloc(sizeof(struct _mosquitto_subhier));
+	child = _mosquitto_malloc_typed(sizeof(struct _mosquitto_subhier), mosq_mt_subscriptions);
 	if(!child){
 		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
 		return MOSQ_ERR_NOMEM;
@@ -76,10 +90,10 @@ int mqtt3_db_open(struct mqtt3_config *config, struct mosquitto_db *db)
 	}
 	child->subs = NULL;
 	child->children = NULL;
-	child->retained = NULL;
+	child->shared = NULL;
 	db->subs.children = child;
 
-	child = _mosquitto_malloc(sizeof(struct _mosquitto_subhier));
+	child = _mosquitto_malloc_typed(sizeof(struct _mosquitto_subhier), mosq_mt_subscriptions);
 	if(!child){
 		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
 		return MOSQ_ERR_NOMEM;
@@ -92,7 +106,7 @@ int mqtt3_db_open(struct mqtt3_config *config, struct mosquitto_db *db)
 	}
 	child->subs = NULL;
 	child->children = NULL;
-	child->retained = NULL;
+	child->shared = NULL;
 	db->subs.children->next = child;
 
 	db->unpwd = NULL;
@@ -110,17 +124,27 @@ static void subhier_clean(struct _mosquitto_subhier *subhier)
 {
 	struct _mosquitto_subhier *next;
 	struct _mosquitto_subleaf *leaf, *nextleaf;
+	struct _mosquitto_subshared *shared;
 
 	while(subhier){
 		next = subhier->next;
 		leaf = subhier->subs;
 		while(leaf){
 			nextleaf = leaf->next;
-			_mosquitto_free(leaf);
+			_mosquitto_pool_free(mosq_pt_subleaf, leaf);
 			leaf = nextleaf;
 		}
-		if(subhier->retained){
-			subhier->retained->ref_count--;
+		while(subhier->shared){
+			shared = subhier->shared;
+			subhier->shared = shared->next;
+			leaf = shared->subs;
+			while(leaf){
+				nextleaf = leaf->next;
+				_mosquitto_pool_free(mosq_pt_subleaf, leaf);
+				leaf = nextleaf;
+			}
+			_mosquitto_free(shared->name);
+			_mosquitto_free(shared);
 		}
 		subhier_clean(subhier->children);
 		if(subhier->topic) _mosquitto_free(subhier->topic);
@@ -130,10 +154,32 @@ static void subhier_clean(struct _mosquitto_subhier *subhier)
 	}
 }
 
+static void retainhier_clean(struct _mosquitto_retainhier *retainhier)
+{
+	struct _mosquitto_retainhier *next;
+
+	while(retainhier){
+		next = retainhier->next;
+		if(retainhier->retained){
+			retainhier->retained->ref_count--;
+			retainhier->retained->retained = false;
+		}
+		retainhier_clean(retainhier->children);
+		_mosquitto_free(retainhier->topic);
+		_mosquitto_free(retainhier);
+		retainhier = next;
+	}
+}
+
 int mqtt3_db_close(struct mosquitto_db *db)
 {
 	subhier_clean(db->subs.children);
+	retainhier_clean(db->retains.children);
+#ifdef WITH_SYS_TREE
+	mqtt3_sys_metrics_cleanup(db);
+#endif
 	mqtt3_db_store_clean(db);
+	mqtt3_bridge_origin_cleanup(db);
 
 	return MOSQ_ERR_SUCCESS;
 }
@@ -143,26 +189,67 @@ int mqtt3_db_close(struct mosquitto_db *db)
  * Returns 1 on failure (count is NULL)
  * Returns 0 on success.
  */
+/* The number of active contexts is counted by the main loop as it visits
+ * every context, so this reflects the state at the last loop iteration. */
 int mqtt3_db_client_count(struct mosquitto_db *db, unsigned int *count, unsigned int *inactive_count)
 {
-	int i;
-
 	if(!db || !count || !inactive_count) return MOSQ_ERR_INVAL;
 
-	*count = 0;
-	*inactive_count = 0;
-	for(i=0; i<db->context_count; i++){
-		if(db->contexts[i]){
-			(*count)++;
-			if(db->contexts[i]->sock == INVALID_SOCKET){
-				(*inactive_count)++;
-			}
+	*count = db->context_count - db->context_free_count;
+	if(db->context_active < *count){
+		*inactive_count = *count - db->context_active;
+	}else{
+		*inactive_count = 0;
+	}
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Place a context in db->contexts[], reusing the most recently freed slot if
+ * there is one, and set its db_index. */
+int mqtt3_db_context_add(struct mosquitto_db *db, struct mosquitto *context)
+{
+	struct mosquitto **tmp_contexts;
+	int *tmp_free;
+	int alloc;
+	int i;
+
+	if(db->context_free_count > 0){
+		db->context_free_count--;
+		i = db->context_free[db->context_free_count];
+	}else{
+		if(db->context_count == db->context_alloc){
+			alloc = db->context_alloc*2;
+			tmp_contexts = _mosquitto_realloc(db->contexts, sizeof(struct mosquitto*)*alloc);
+			if(!tmp_contexts) return MOSQ_ERR_NOMEM;
+			db->contexts = tmp_contexts;
+			tmp_free = _mosquitto_realloc(db->context_free, sizeof(int)*alloc);
+			if(!tmp_free) return MOSQ_ERR_NOMEM;
+			db->context_free = tmp_free;
+			db->context_alloc = alloc;
 		}
+		i = db->context_count;
+		db->context_count++;
 	}
+	db->contexts[i] = context;
+	context->db_index = i;
 
 	return MOSQ_ERR_SUCCESS;
 }
 
+/* Remove a context from db->contexts[] and make its slot available for
+ * reuse. The context itself is not freed. */
+void mqtt3_db_context_remove(struct mosquitto_db *db, struct mosquitto *context)
+{
+	int i = context->db_index;
+
+	if(i < 0 || i >= db->context_count || db->contexts[i] != context) return;
+
+	db->contexts[i] = NULL;
+	db->context_free[db->context_free_count] = i;
+	db->context_free_count++;
+}
+
 static void _message_remove(struct mosquitto *context, struct mosquitto_client_msg **msg, struct mosquitto_client_msg *last)
 {
 	if(!context || !msg || !(*msg)){
@@ -186,7 +273,7 @@ static void _message_remove(struct mosquitto *context, struct mosquitto_client_m
 	if((*msg)->qos > 0){
 		context->msg_count12--;
 	}
-	_mosquitto_free(*msg);
+	_mosquitto_pool_free(mosq_pt_client_msg, *msg);
 	if(last){
 		*msg = last->next;
 	}else{
@@ -241,6 +328,90 @@ int mqtt3_db_message_delete(struct mosquitto *context, uint16_t mid, enum mosqui
 	return MOSQ_ERR_SUCCESS;
 }
 
+/* Find how close we are to the global memory_limit. Restrictions begin at
+ * 80% of the limit. */
+enum mosquitto_memory_stage mqtt3_db_memory_stage(struct mosquitto_db *db)
+{
+#ifdef REAL_WITH_MEMORY_TRACKING
+	unsigned long used;
+	unsigned long limit = db->config->memory_limit;
+
+	if(limit){
+		used = _mosquitto_memory_used();
+		if(used >= limit){
+			return mosq_mls_refuse;
+		}else if(used >= limit/10*9){
+			return mosq_mls_drop_qos0;
+		}else if(used >= limit/10*8){
+			return mosq_mls_pause_reads;
+		}
+	}
+#endif
+	return mosq_mls_normal;
+}
+
+static unsigned long _db_low_water(unsigned long high, unsigned long low)
+{
+	if(low == 0 || low >= high){
+		return high/2;
+	}
+	return low;
+}
+
+/* Update db->flow_paused from the total number of bytes waiting to be
+ * written to clients, with hysteresis between output_high_water and
+ * output_low_water. */
+void mqtt3_db_flow_update(struct mosquitto_db *db)
+{
+	unsigned long high = db->config->output_high_water;
+
+	if(!high){
+		db->flow_paused = false;
+	}else if(db->flow_paused){
+		if(db->out_packet_bytes <= _db_low_water(high, db->config->output_low_water)){
+			db->flow_paused = false;
+		}
+	}else if(db->out_packet_bytes >= high){
+		db->flow_paused = true;
+	}
+}
+
+/* Returns true if a client has passed client_output_high_water. */
+bool mqtt3_db_client_congested(struct mosquitto_db *db, struct mosquitto *context)
+{
+	unsigned long high = db->config->client_output_high_water;
+
+	return high && context->out_packet_bytes >= high;
+}
+
+/* Returns true if a client has reached client_output_limit, in which case no
+ * more PUBLISH packets are generated for it until its output has been
+ * written. */
+bool mqtt3_db_client_output_limited(struct mosquitto_db *db, struct mosquitto *context)
+{
+	unsigned long limit = db->config->client_output_limit;
+
+	return limit && context->out_packet_bytes >= limit;
+}
+
+/* Returns true if a congested client has drained below
+ * client_output_low_water. */
+bool mqtt3_db_client_drained(struct mosquitto_db *db, struct mosquitto *context)
+{
+	unsigned long high = db->config->client_output_high_water;
+
+	return !high || context->out_packet_bytes <= _db_low_water(high, db->config->client_output_low_water);
+}
+
+/* Returns true if a client already has as many messages waiting to be sent or
+ * acknowledged as it may have in flight, or has reached client_output_limit,
+ * so any more would only be queued or dropped. */
+bool mqtt3_db_client_window_full(struct mosquitto_db *db, struct mosquitto *context)
+{
+	if(mqtt3_db_client_output_limited(db, context)) return true;
+	return max_inflight && context->msg_count >= max_inflight;
+}
+
 int mqtt3_db_message_insert(struct mosquitto_db *db, struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir, int qos, bool retain, struct mosquitto_msg_store *stored)
 {
 	struct mosquitto_client_msg *msg;
@@ -337,13 +508,58 @@ int mqtt3_db_message_insert(struct mosquitto_db *db, struct mosquitto *context,
 	}
 	assert(state != mosq_ms_invalid);
 
+	if(dir == mosq_md_out && context->sock != INVALID_SOCKET){
+		if(mqtt3_db_client_congested(db, context)){
+			/* Let the publisher that caused this be throttled. */
+			db->flow_congested = context;
+		}
+		/* A parked client keeps its QoS 0 backlog within max_queued, so a
+		 * client that never catches up can't grow its queue without bound. */
+		if(qos == 0 && mqtt3_db_client_output_limited(db, context)
+				&& (db->config->slow_client_policy == scp_drop_qos0
+					|| max_queued == 0
+					|| context->msg_count - context->msg_count12 >= max_queued)){
+#ifdef WITH_SYS_TREE
+			g_msgs_dropped++;
+			g_slow_qos0_dropped++;
+#endif
+			return 2;
+		}
+	}
+
+	if(dir == mosq_md_out && db->config->memory_limit){
+		switch(mqtt3_db_memory_stage(db)){
+			case mosq_mls_refuse:
+				if(state == mosq_ms_queued){
+#ifdef WITH_SYS_TREE
+					g_msgs_dropped++;
+					g_memory_refused++;
+#endif
+					return 2;
+				}
+				/* Fall through */
+			case mosq_mls_drop_qos0:
+				/* Only drop for clients that already have a backlog. */
+				if(qos == 0 && (context->msgs || context->current_out_packet)){
+#ifdef WITH_SYS_TREE
+					g_msgs_dropped++;
+					g_memory_qos0_dropped++;
+#endif
+					return 2;
+				}
+				break;
+			default:
+				break;
+		}
+	}
+
 #ifdef WITH_PERSISTENCE
 	if(state == mosq_ms_queued){
 		db->persistence_changes++;
 	}
 #endif
 
-	msg = _mosquitto_malloc(sizeof(struct mosquitto_client_msg));
+	msg = _mosquitto_pool_calloc(mosq_pt_client_msg, sizeof(struct mosquitto_client_msg));
 	if(!msg) return MOSQ_ERR_NOMEM;
 	msg->next = NULL;
 	msg->store = stored;
@@ -375,11 +591,11 @@ int mqtt3_db_message_insert(struct mosquitto_db *db, struct mosquitto *context,
 		 * multiple times for overlapping subscriptions, although this is only the
 		 * case for SUBSCRIPTION with multiple subs in so is a minor concern.
 		 */
-		dest_ids = _mosquitto_realloc(stored->dest_ids, sizeof(char *)*(stored->dest_id_count+1));
+		dest_ids = _mosquitto_realloc_typed(stored->dest_ids, sizeof(char *)*(stored->dest_id_count+1), mosq_mt_messages);
 		if(dest_ids){
 			stored->dest_ids = dest_ids;
 			stored->dest_id_count++;
-			stored->dest_ids[stored->dest_id_count-1] = _mosquitto_strdup(context->id);
+			stored->dest_ids[stored->dest_id_count-1] = _mosquitto_strdup_typed(context->id, mosq_mt_messages);
 			if(!stored->dest_ids[stored->dest_id_count-1]){
 				return MOSQ_ERR_NOMEM;
 			}
@@ -426,7 +642,7 @@ int mqtt3_db_messages_delete(struct mosquitto *context)
 		/* FIXME - it would be nice to be able to remove the stored message here if rec_count==0 */
 		tail->store->ref_count--;
 		next = tail->next;
-		_mosquitto_free(tail);
+		_mosquitto_pool_free(mosq_pt_client_msg, tail);
 		tail = next;
 	}
 	context->msgs = NULL;
@@ -456,6 +672,16 @@ int mqtt3_db_messages_easy_queue(struct mosquitto_db *db, struct mosquitto *cont
 	return mqtt3_db_messages_queue(db, source_id, topic, qos, retain, stored);
 }
 
+/* Record how much memory was accounted for stored when it was allocated, so
+ * that exactly that can be moved between subsystems later. */
+void mqtt3_db_message_store_charged(struct mosquitto_msg_store *stored)
+{
+	stored->mem_charged = _mosquitto_pool_charged(mosq_pt_msg_store)
+			+ _mosquitto_memory_charged(stored->source_id)
+			+ _mosquitto_memory_charged(stored->msg.topic)
+			+ _mosquitto_buf_charged(stored->msg.payload);
+}
+
 int mqtt3_db_message_store(struct mosquitto_db *db, const char *source, uint16_t source_mid, const char *topic, int qos, uint32_t payloadlen, const void *payload, int retain, struct mosquitto_msg_store **stored, dbid_t store_id)
 {
 	struct mosquitto_msg_store *temp;
@@ -463,18 +689,19 @@ int mqtt3_db_message_store(struct mosquitto_db *db, const char *source, uint16_t
 	assert(db);
 	assert(stored);
 
-	temp = _mosquitto_malloc(sizeof(struct mosquitto_msg_store));
+	temp = _mosquitto_pool_calloc(mosq_pt_msg_store, sizeof(struct mosquitto_msg_store));
 	if(!temp) return MOSQ_ERR_NOMEM;
 
 	temp->next = db->msg_store;
 	temp->ref_count = 0;
+	temp->retained = false;
 	if(source){
-		temp->source_id = _mosquitto_strdup(source);
+		temp->source_id = _mosquitto_strdup_typed(source, mosq_mt_messages);
 	}else{
-		temp->source_id = _mosquitto_strdup("");
+		temp->source_id = _mosquitto_strdup_typed("", mosq_mt_messages);
 	}
 	if(!temp->source_id){
-		_mosquitto_free(temp);
+		_mosquitto_pool_free(mosq_pt_msg_store, temp);
 		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
 		return MOSQ_ERR_NOMEM;
 	}
@@ -483,10 +710,10 @@ int mqtt3_db_message_store(struct mosquitto_db *db, const char *source, uint16_t
 	temp->msg.qos = qos;
 	temp->msg.retain = retain;
 	if(topic){
-		temp->msg.topic = _mosquitto_strdup(topic);
+		temp->msg.topic = _mosquitto_strdup_typed(topic, mosq_mt_messages);
 		if(!temp->msg.topic){
 			_mosquitto_free(temp->source_id);
-			_mosquitto_free(temp);
+			_mosquitto_pool_free(mosq_pt_msg_store, temp);
 			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
 			return MOSQ_ERR_NOMEM;
 		}
@@ -495,12 +722,12 @@ int mqtt3_db_message_store(struct mosquitto_db *db, const char *source, uint16_t
 	}
 	temp->msg.payloadlen = payloadlen;
 	if(payloadlen){
-		temp->msg.payload = _mosquitto_malloc(sizeof(char)*payloadlen);
+		temp->msg.payload = _mosquitto_buf_malloc(sizeof(char)*payloadlen, mosq_mt_messages);
 		if(!temp->msg.payload){
 			if(temp->source_id) _mosquitto_free(temp->source_id);
 			if(temp->msg.topic) _mosquitto_free(temp->msg.topic);
-			if(temp->msg.payload) _mosquitto_free(temp->msg.payload);
-			_mosquitto_free(temp);
+			if(temp->msg.payload) _mosquitto_buf_free(temp->msg.payload);
+			_mosquitto_pool_free(mosq_pt_msg_store, temp);
 			return MOSQ_ERR_NOMEM;
 		}
 		memcpy(temp->msg.payload, payload, sizeof(char)*payloadlen);
@@ -511,12 +738,19 @@ int mqtt3_db_message_store(struct mosquitto_db *db, const char *source, uint16_t
 	if(!temp->source_id || (payloadlen && !temp->msg.payload)){
 		if(temp->source_id) _mosquitto_free(temp->source_id);
 		if(temp->msg.topic) _mosquitto_free(temp->msg.topic);
-		if(temp->msg.payload) _mosquitto_free(temp->msg.payload);
-		_mosquitto_free(temp);
+		if(temp->msg.payload) _mosquitto_buf_free(temp->msg.payload);
+		_mosquitto_pool_free(mosq_pt_msg_store, temp);
 		return 1;
 	}
+	mqtt3_db_message_store_charged(temp);
 	temp->dest_ids = NULL;
 	temp->dest_id_count = 0;
+	/* Messages that arrive tagged with another origin have this replaced. */
+	temp->origin_id = db->origin_id;
+	temp->origin_seq = ++db->origin_seq;
+#ifdef WITH_SYS_TREE
+	temp->store_time = mosquitto_time_us();
+#endif
 	db->msg_store_count++;
 	db->msg_store = temp;
 	(*stored) = temp;
@@ -751,34 +985,57 @@ int mqtt3_db_message_write(struct mosquitto *context)
 	uint16_t mid;
 	int retries;
 	int retain;
-	const char *topic;
 	int qos;
-	uint32_t payloadlen;
-	const void *payload;
 	int msg_count = 0;
+	struct mosquitto_db *db;
 
 	if(!context || context->sock == -1
 			|| (context->state == mosq_cs_connected && !context->id)){
 		return MOSQ_ERR_INVAL;
 	}
+	db = _mosquitto_get_db();
 
 	tail = context->msgs;
 	while(tail){
 		if(tail->direction == mosq_md_in){
 			msg_count++;
 		}
-		if(tail->state != mosq_ms_queued){
+		if((tail->state == mosq_ms_publish_qos0
+					|| tail->state == mosq_ms_publish_qos1
+					|| tail->state == mosq_ms_publish_qos2)
+				&& mqtt3_db_client_output_limited(db, context)){
+
+			/* Leave the message where it is until the client has caught up
+			 * with what it has already been sent. */
+			last = tail;
+			tail = tail->next;
+		}else if(tail->state != mosq_ms_queued){
 			mid = tail->mid;
 			retries = tail->dup;
 			retain = tail->retain;
-			topic = tail->store->msg.topic;
 			qos = tail->qos;
-			payloadlen = tail->store->msg.payloadlen;
-			payload = tail->store->msg.payload;
 
+#ifdef WITH_BRIDGE
+			if((tail->state == mosq_ms_publish_qos1 || tail->state == mosq_ms_publish_qos2)
+					&& context->bridge && context->bridge->batch_count){
+
+				/* Keep batched messages in order with everything else. */
+				rc = mqtt3_bridge_batch_flush(context);
+				if(rc) return rc;
+			}
+#endif
 			switch(tail->state){
 				case mosq_ms_publish_qos0:
-					rc = _mosquitto_send_publish(context, mid, topic, payloadlen, payload, qos, retain, retries);
+#ifdef WITH_BRIDGE
+					if(context->bridge && context->bridge->batch_messages
+							&& context->bridge->try_private_accepted){
+
+						rc = mqtt3_bridge_batch_add(context, tail->store, qos, retain);
+					}else
+#endif
+					{
+						rc = mqtt3_bridge_send_publish(context, mid, tail->store, qos, retain, retries);
+					}
 					if(!rc){
 						_message_remove(context, &tail, last);
 					}else{
@@ -787,7 +1044,7 @@ int mqtt3_db_message_write(struct mosquitto *context)
 					break;
 
 				case mosq_ms_publish_qos1:
-					rc = _mosquitto_send_publish(context, mid, topic, payloadlen, payload, qos, retain, retries);
+					rc = mqtt3_bridge_send_publish(context, mid, tail->store, qos, retain, retries);
 					if(!rc){
 						tail->timestamp = mosquitto_time();
 						tail->dup = 1; /* Any retry attempts are a duplicate. */
@@ -800,7 +1057,7 @@ int mqtt3_db_message_write(struct mosquitto *context)
 					break;
 
 				case mosq_ms_publish_qos2:
-					rc = _mosquitto_send_publish(context, mid, topic, payloadlen, payload, qos, retain, retries);
+					rc = mqtt3_bridge_send_publish(context, mid, tail->store, qos, retain, retries);
 					if(!rc){
 						tail->timestamp = mosquitto_time();
 						tail->dup = 1; /* Any retry attempts are a duplicate. */
@@ -862,6 +1119,16 @@ int mqtt3_db_message_write(struct mosquitto *context)
 			}
 		}
 	}
+#ifdef WITH_BRIDGE
+	if(context->bridge && context->bridge->batch_count && !context->current_out_packet
+			&& mosquitto_time_ms() >= context->bridge->batch_deadline){
+
+		/* While batch_delay hasn't passed, or earlier packets are still
+		 * waiting for the network, let the batch keep growing. It is sent
+		 * anyway once it is full. */
+		return mqtt3_bridge_batch_flush(context);
+	}
+#endif
 
 	return MOSQ_ERR_SUCCESS;
 }
@@ -884,14 +1151,14 @@ void mqtt3_db_store_clean(struct mosquitto_db *db)
 				_mosquitto_free(tail->dest_ids);
 			}
 			if(tail->msg.topic) _mosquitto_free(tail->msg.topic);
-			if(tail->msg.payload) _mosquitto_free(tail->msg.payload);
+			if(tail->msg.payload) _mosquitto_buf_free(tail->msg.payload);
 			if(last){
 				last->next = tail->next;
-				_mosquitto_free(tail);
+				_mosquitto_pool_free(mosq_pt_msg_store, tail);
 				tail = last->next;
 			}else{
 				db->msg_store = tail->next;
-				_mosquitto_free(tail);
+				_mosquitto_pool_free(mosq_pt_msg_store, tail);
 				tail = db->msg_store;
 			}
 			db->msg_store_count--;
@@ -32,6 +32,10 @@ POSSIBILITY OF SUCH DAMAGE.
 #ifndef WIN32
 #include <syslog.h>
 #endif
+#ifdef WITH_LOG_THREAD
+#include <pthread.h>
+#include <signal.h>
+#endif
 
 #ifndef CMAKE
 #include <config.h>
@@ -40,6 +44,18 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <mosquitto_broker.h>
 #include <memory_mosq.h>
 
+#ifdef WITH_LOG_THREAD
+/* mosquitto_internal.h replaces the pthread functions with empty macros in
+ * the broker, which is not otherwise threaded. */
+#undef pthread_create
+#undef pthread_join
+#undef pthread_cancel
+#undef pthread_mutex_init
+#undef pthread_mutex_destroy
+#undef pthread_mutex_lock
+#undef pthread_mutex_unlock
+#endif
+
 extern struct mosquitto_db int_db;
 
 #ifdef WIN32
@@ -61,10 +77,44 @@ HANDLE syslog_h;
 static int log_destinations = MQTT3_LOG_STDERR;
 static int log_priorities = MOSQ_LOG_ERR | MOSQ_LOG_WARNING | MOSQ_LOG_NOTICE | MOSQ_LOG_INFO;
 
+#ifdef WITH_LOG_THREAD
+/* With log_queue_size set, messages for every destination other than topics
+ * are passed to a log thread through a ring of log_queue_size entries, so
+ * that slow writes to a file, a terminal or syslog don't hold up the main
+ * loop. Messages are only ever logged from the main loop, so the ring has a
+ * single producer and a single consumer and needs no lock: log_head is only
+ * written by the main loop and log_tail only by the log thread. The mutex is
+ * only used to wake the log thread when it has run out of work. If the ring
+ * is full the message is dropped rather than waiting for the log thread. */
+
+/* Longer messages are truncated when the log thread is in use. */
+#define MQTT3_LOG_LINE_MAX 1024
+
+struct _mqtt3_log_entry {
+	time_t time;
+	int syslog_priority;
+	char line[MQTT3_LOG_LINE_MAX];
+};
+
+static struct _mqtt3_log_entry *log_ring = NULL;
+static unsigned long log_ring_size = 0;
+static unsigned long log_head = 0;
+static unsigned long log_tail = 0;
+static bool log_thread_waiting = false;
+static bool log_thread_stop = false;
+static bool log_thread_running = false;
+static pthread_t log_thread;
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+
+unsigned long g_log_dropped = 0;
+#endif
+
 int mqtt3_log_init(int priorities, int destinations)
 {
-	int rc = 0;
-
+#ifdef WITH_LOG_THREAD
+	mqtt3_log_thread_stop();
+#endif
 	log_priorities = priorities;
 	log_destinations = destinations;
 
@@ -76,11 +126,14 @@ int mqtt3_log_init(int priorities, int destinations)
 #endif
 	}
 
-	return rc;
+	return MOSQ_ERR_SUCCESS;
 }
 
 int mqtt3_log_close(void)
 {
+#ifdef WITH_LOG_THREAD
+	mqtt3_log_thread_stop();
+#endif
 	if(log_destinations & MQTT3_LOG_SYSLOG){
 #ifndef WIN32
 		closelog();
@@ -93,143 +146,351 @@ int mqtt3_log_close(void)
 	return MOSQ_ERR_SUCCESS;
 }
 
+/* Write a formatted message to every destination other than topics. */
+static void _log_output(time_t now, int syslog_priority, char *s)
+{
+	if(log_destinations & MQTT3_LOG_STDOUT){
+		if(int_db.config && int_db.config->log_timestamp){
+			fprintf(stdout, "%d: %s\n", (int)now, s);
+		}else{
+			fprintf(stdout, "%s\n", s);
+		}
+	}
+	if(log_destinations & MQTT3_LOG_STDERR){
+		if(int_db.config && int_db.config->log_timestamp){
+			fprintf(stderr, "%d: %s\n", (int)now, s);
+		}else{
+			fprintf(stderr, "%s\n", s);
+		}
+	}
+	if(log_destinations & MQTT3_LOG_FILE && int_db.config->log_fptr){
+		if(int_db.config && int_db.config->log_timestamp){
+			fprintf(int_db.config->log_fptr, "%d: %s\n", (int)now, s);
+		}else{
+			fprintf(int_db.config->log_fptr, "%s\n", s);
+		}
+	}
+	if(log_destinations & MQTT3_LOG_SYSLOG){
+#ifndef WIN32
+		syslog(syslog_priority, "%s", s);
+#else
+		ReportEvent(syslog_h, syslog_priority, 0, 0, NULL, 1, 0, &s, NULL);
+#endif
+	}
+}
+
+static void _log_flush(bool file)
+{
+	if(log_destinations & MQTT3_LOG_STDOUT){
+		fflush(stdout);
+	}
+	if(log_destinations & MQTT3_LOG_STDERR){
+		fflush(stderr);
+	}
+	if(file && log_destinations & MQTT3_LOG_FILE && int_db.config->log_fptr){
+		fflush(int_db.config->log_fptr);
+	}
+}
+
+static int _log_topic(time_t now, const char *topic, const char *s)
+{
+	char *st;
+	int len;
+
+	if(int_db.config && int_db.config->log_timestamp){
+		len = strlen(s) + 30;
+		st = _mosquitto_malloc(len*sizeof(char));
+		if(!st){
+			return MOSQ_ERR_NOMEM;
+		}
+		snprintf(st, len, "%d: %s", (int)now, s);
+		mqtt3_db_messages_easy_queue(&int_db, NULL, topic, 2, strlen(st), st, 0);
+		_mosquitto_free(st);
+	}else{
+		mqtt3_db_messages_easy_queue(&int_db, NULL, topic, 2, strlen(s), s, 0);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+#ifdef WITH_LOG_THREAD
+static void *_log_thread_main(void *arg)
+{
+	struct _mqtt3_log_entry *entry;
+	unsigned long head, tail;
+	unsigned long dropped, reported;
+	char line[100];
+
+	tail = log_tail;
+	reported = __atomic_load_n(&g_log_dropped, __ATOMIC_RELAXED);
+	while(1){
+		head = __atomic_load_n(&log_head, __ATOMIC_ACQUIRE);
+		if(head == tail){
+			/* The main loop stores log_head and then reads
+			 * log_thread_waiting, this is the other way round, so at least
+			 * one of them sees the other's change. */
+			pthread_mutex_lock(&log_mutex);
+			__atomic_store_n(&log_thread_waiting, true, __ATOMIC_SEQ_CST);
+			while(__atomic_load_n(&log_head, __ATOMIC_SEQ_CST) == tail && !log_thread_stop){
+				pthread_cond_wait(&log_cond, &log_mutex);
+			}
+			__atomic_store_n(&log_thread_waiting, false, __ATOMIC_RELAXED);
+			if(__atomic_load_n(&log_head, __ATOMIC_ACQUIRE) == tail){
+				/* Only reached once stopping and the ring is empty. */
+				pthread_mutex_unlock(&log_mutex);
+				break;
+			}
+			pthread_mutex_unlock(&log_mutex);
+			continue;
+		}
+
+		/* Write everything that is waiting before flushing, so a burst of
+		 * messages costs one flush rather than one each. */
+		while(tail != head){
+			entry = &log_ring[tail % log_ring_size];
+			_log_output(entry->time, entry->syslog_priority, entry->line);
+			tail++;
+		}
+		/* The messages are buffered by now, so the entries can be reused. */
+		__atomic_store_n(&log_tail, tail, __ATOMIC_RELEASE);
+
+		dropped = __atomic_load_n(&g_log_dropped, __ATOMIC_RELAXED);
+		if(dropped != reported && (log_priorities & MOSQ_LOG_WARNING)){
+			snprintf(line, sizeof(line), "Warning: %lu log messages dropped because the log queue was full.", dropped-reported);
+			_log_output(time(NULL), LOG_WARNING, line);
+		}
+		reported = dropped;
+		_log_flush(true);
+	}
+	return NULL;
+}
+
+static int _log_thread_start(int size)
+{
+	sigset_t sigblock, origsig;
+	int rc;
+
+	log_ring = _mosquitto_malloc(sizeof(struct _mqtt3_log_entry)*size);
+	if(!log_ring){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return MOSQ_ERR_NOMEM;
+	}
+	log_ring_size = size;
+	log_head = 0;
+	log_tail = 0;
+	log_thread_stop = false;
+
+	/* Signals are handled by the main thread only. */
+	sigfillset(&sigblock);
+	pthread_sigmask(SIG_SETMASK, &sigblock, &origsig);
+	rc = pthread_create(&log_thread, NULL, _log_thread_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &origsig, NULL);
+	if(rc){
+		_mosquitto_free(log_ring);
+		log_ring = NULL;
+		log_ring_size = 0;
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to start log thread.");
+		return MOSQ_ERR_UNKNOWN;
+	}
+	log_thread_running = true;
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Start the log thread if log_queue_size is set. This is only done once the
+ * broker is about to run the main loop, so that messages logged while it
+ * starts up, such as the reason it is about to exit, are written straight
+ * away rather than left in the ring. */
+int mqtt3_log_thread_start(void)
+{
+	if(log_thread_running) return MOSQ_ERR_SUCCESS;
+
+	/* Topics are always written from the main loop, so there is no point in
+	 * a thread if they are the only destination. */
+	if(int_db.config && int_db.config->log_queue_size > 0
+			&& (log_destinations & ~MQTT3_LOG_TOPIC)){
+
+		return _log_thread_start(int_db.config->log_queue_size);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Stop the log thread once it has written everything in the ring. Logging
+ * carries on in the main loop until mqtt3_log_thread_start() is called
+ * again. This must be called before anything the log thread uses, such as
+ * the log file, is changed. */
+void mqtt3_log_thread_stop(void)
+{
+	if(!log_thread_running) return;
+
+	pthread_mutex_lock(&log_mutex);
+	log_thread_stop = true;
+	pthread_cond_signal(&log_cond);
+	pthread_mutex_unlock(&log_mutex);
+	pthread_join(log_thread, NULL);
+
+	log_thread_running = false;
+	_mosquitto_free(log_ring);
+	log_ring = NULL;
+	log_ring_size = 0;
+}
+
+static int _log_queue(time_t now, int syslog_priority, int destinations, const char *topic, const char *fmt, va_list va)
+{
+	struct _mqtt3_log_entry *entry = NULL;
+	char line[MQTT3_LOG_LINE_MAX];
+	unsigned long head = log_head;
+	char *s;
+
+	if(head - __atomic_load_n(&log_tail, __ATOMIC_ACQUIRE) < log_ring_size){
+		entry = &log_ring[head % log_ring_size];
+	}else{
+		__atomic_store_n(&g_log_dropped, g_log_dropped+1, __ATOMIC_RELAXED);
+		if(!(destinations & MQTT3_LOG_TOPIC)) return MOSQ_ERR_SUCCESS;
+	}
+
+	/* Publishing to a topic can log messages of its own, so the entry must
+	 * be handed over before then and can't be used to publish from. */
+	if(destinations & MQTT3_LOG_TOPIC){
+		s = line;
+	}else{
+		s = entry->line;
+	}
+	vsnprintf(s, MQTT3_LOG_LINE_MAX, fmt, va);
+	s[MQTT3_LOG_LINE_MAX-1] = '\0'; /* Ensure string is null terminated. */
+
+	if(entry){
+		if(s != entry->line){
+			memcpy(entry->line, s, strlen(s)+1);
+		}
+		entry->time = now;
+		entry->syslog_priority = syslog_priority;
+		__atomic_store_n(&log_head, head + 1, __ATOMIC_SEQ_CST);
+		if(__atomic_load_n(&log_thread_waiting, __ATOMIC_SEQ_CST)){
+			pthread_mutex_lock(&log_mutex);
+			pthread_cond_signal(&log_cond);
+			pthread_mutex_unlock(&log_mutex);
+		}
+	}
+
+	if(destinations & MQTT3_LOG_TOPIC){
+		return _log_topic(now, topic, s);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+#endif
+
 int _mosquitto_log_printf(struct mosquitto *mosq, int priority, const char *fmt, ...)
 {
 	va_list va;
 	char *s;
-	char *st;
 	int len;
-#ifdef WIN32
-	char *sp;
-#endif
 	const char *topic;
 	int syslog_priority;
-	time_t now = time(NULL);
+	int destinations;
+	int rc = MOSQ_ERR_SUCCESS;
+	time_t now;
+
+	/* Debug messages are never published to topics. If nothing wants this
+	 * message, don't spend any time formatting it. */
+	destinations = log_destinations;
+	if(priority == MOSQ_LOG_DEBUG){
+		destinations &= ~MQTT3_LOG_TOPIC;
+	}
+	if(!(log_priorities & priority) || destinations == MQTT3_LOG_NONE){
+		return MOSQ_ERR_SUCCESS;
+	}
 
-	if((log_priorities & priority) && log_destinations != MQTT3_LOG_NONE){
-		switch(priority){
-			case MOSQ_LOG_SUBSCRIBE:
-				topic = "$SYS/broker/log/M/subscribe";
+	now = time(NULL);
+	switch(priority){
+		case MOSQ_LOG_SUBSCRIBE:
+			topic = "$SYS/broker/log/M/subscribe";
 #ifndef WIN32
-				syslog_priority = LOG_NOTICE;
+			syslog_priority = LOG_NOTICE;
 #else
-				syslog_priority = EVENTLOG_INFORMATION_TYPE;
+			syslog_priority = EVENTLOG_INFORMATION_TYPE;
 #endif
-				break;
-			case MOSQ_LOG_UNSUBSCRIBE:
-				topic = "$SYS/broker/log/M/unsubscribe";
+			break;
+		case MOSQ_LOG_UNSUBSCRIBE:
+			topic = "$SYS/broker/log/M/unsubscribe";
 #ifndef WIN32
-				syslog_priority = LOG_NOTICE;
+			syslog_priority = LOG_NOTICE;
 #else
-				syslog_priority = EVENTLOG_INFORMATION_TYPE;
+			syslog_priority = EVENTLOG_INFORMATION_TYPE;
 #endif
-				break;
-			case MOSQ_LOG_DEBUG:
-				topic = "$SYS/broker/log/D";
+			break;
+		case MOSQ_LOG_DEBUG:
+			topic = "$SYS/broker/log/D";
 #ifndef WIN32
-				syslog_priority = LOG_DEBUG;
+			syslog_priority = LOG_DEBUG;
 #else
-				syslog_priority = EVENTLOG_INFORMATION_TYPE;
+			syslog_priority = EVENTLOG_INFORMATION_TYPE;
 #endif
-				break;
-			case MOSQ_LOG_ERR:
-				topic = "$SYS/broker/log/E";
+			break;
+		case MOSQ_LOG_ERR:
+			topic = "$SYS/broker/log/E";
 #ifndef WIN32
-				syslog_priority = LOG_ERR;
+			syslog_priority = LOG_ERR;
 #else
-				syslog_priority = EVENTLOG_ERROR_TYPE;
+			syslog_priority = EVENTLOG_ERROR_TYPE;
 #endif
-				break;
-			case MOSQ_LOG_WARNING:
-				topic = "$SYS/broker/log/W";
+			break;
+		case MOSQ_LOG_WARNING:
+			topic = "$SYS/broker/log/W";
 #ifndef WIN32
-				syslog_priority = LOG_WARNING;
+			syslog_priority = LOG_WARNING;
 #else
-				syslog_priority = EVENTLOG_WARNING_TYPE;
+			syslog_priority = EVENTLOG_WARNING_TYPE;
 #endif
-				break;
-			case MOSQ_LOG_NOTICE:
-				topic = "$SYS/broker/log/N";
+			break;
+		case MOSQ_LOG_NOTICE:
+			topic = "$SYS/broker/log/N";
 #ifndef WIN32
-				syslog_priority = LOG_NOTICE;
+			syslog_priority = LOG_NOTICE;
 #else
-				syslog_priority = EVENTLOG_INFORMATION_TYPE;
+			syslog_priority = EVENTLOG_INFORMATION_TYPE;
 #endif
-				break;
-			case MOSQ_LOG_INFO:
-				topic = "$SYS/broker/log/I";
+			break;
+		case MOSQ_LOG_INFO:
+			topic = "$SYS/broker/log/I";
 #ifndef WIN32
-				syslog_priority = LOG_INFO;
+			syslog_priority = LOG_INFO;
 #else
-				syslog_priority = EVENTLOG_INFORMATION_TYPE;
+			syslog_priority = EVENTLOG_INFORMATION_TYPE;
 #endif
-				break;
-			default:
-				topic = "$SYS/broker/log/E";
+			break;
+		default:
+			topic = "$SYS/broker/log/E";
 #ifndef WIN32
-				syslog_priority = LOG_ERR;
+			syslog_priority = LOG_ERR;
 #else
-				syslog_priority = EVENTLOG_ERROR_TYPE;
+			syslog_priority = EVENTLOG_ERROR_TYPE;
 #endif
-		}
-		len = strlen(fmt) + 500;
-		s = _mosquitto_malloc(len*sizeof(char));
-		if(!s) return MOSQ_ERR_NOMEM;
+	}
 
+#ifdef WITH_LOG_THREAD
+	if(log_thread_running){
 		va_start(va, fmt);
-		vsnprintf(s, len, fmt, va);
+		rc = _log_queue(now, syslog_priority, destinations, topic, fmt, va);
 		va_end(va);
-		s[len-1] = '\0'; /* Ensure string is null terminated. */
-
-		if(log_destinations & MQTT3_LOG_STDOUT){
-			if(int_db.config && int_db.config->log_timestamp){
-				fprintf(stdout, "%d: %s\n", (int)now, s);
-			}else{
-				fprintf(stdout, "%s\n", s);
-			}
-			fflush(stdout);
-		}
-		if(log_destinations & MQTT3_LOG_STDERR){
-			if(int_db.config && int_db.config->log_timestamp){
-				fprintf(stderr, "%d: %s\n", (int)now, s);
-			}else{
-				fprintf(stderr, "%s\n", s);
-			}
-			fflush(stderr);
-		}
-		if(log_destinations & MQTT3_LOG_FILE && int_db.config->log_fptr){
-			if(int_db.config && int_db.config->log_timestamp){
-				fprintf(int_db.config->log_fptr, "%d: %s\n", (int)now, s);
-			}else{
-				fprintf(int_db.config->log_fptr, "%s\n", s);
-			}
-		}
-		if(log_destinations & MQTT3_LOG_SYSLOG){
-#ifndef WIN32
-			syslog(syslog_priority, "%s", s);
-#else
-			sp = (char *)s;
-			ReportEvent(syslog_h, syslog_priority, 0, 0, NULL, 1, 0, &sp, NULL);
+		return rc;
+	}
 #endif
-		}
-		if(log_destinations & MQTT3_LOG_TOPIC && priority != MOSQ_LOG_DEBUG){
-			if(int_db.config && int_db.config->log_timestamp){
-				len += 30;
-				st = _mosquitto_malloc(len*sizeof(char));
-				if(!st){
-					_mosquitto_free(s);
-					return MOSQ_ERR_NOMEM;
-				}
-				snprintf(st, len, "%d: %s", (int)now, s);
-				mqtt3_db_messages_easy_queue(&int_db, NULL, topic, 2, strlen(st), st, 0);
-				_mosquitto_free(st);
-			}else{
-				mqtt3_db_messages_easy_queue(&int_db, NULL, topic, 2, strlen(s), s, 0);
-			}
-		}
-		_mosquitto_free(s);
+
+	len = strlen(fmt) + 500;
+	s = _mosquitto_malloc(len*sizeof(char));
+	if(!s) return MOSQ_ERR_NOMEM;
+
+	va_start(va, fmt);
+	vsnprintf(s, len, fmt, va);
+	va_end(va);
+	s[len-1] = '\0'; /* Ensure string is null terminated. */
+
+	_log_output(now, syslog_priority, s);
+	_log_flush(false);
+	if(destinations & MQTT3_LOG_TOPIC){
+		rc = _log_topic(now, topic, s);
 	}
+	_mosquitto_free(s);
 
-	return MOSQ_ERR_SUCCESS;
+	return rc;
 }
 
@@ -50,6 +50,10 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <time_mosq.h>
 #include <util_mosq.h>
 
+#ifdef WITH_TLS_THREADS
+#  include <openssl/err.h>
+#endif
+
 extern bool flag_reload;
 #ifdef WITH_PERSISTENCE
 extern bool flag_db_backup;
@@ -58,16 +62,28 @@ extern bool flag_tree_print;
 extern int run;
 #ifdef WITH_SYS_TREE
 extern int g_clients_expired;
+extern unsigned int g_memory_reads_paused;
+extern unsigned int g_flow_reads_paused;
+extern unsigned int g_slow_clients_limited;
+extern unsigned long g_slow_clients_disconnected;
+extern struct _mqtt3_histogram g_latency_loop;
 #endif
 
 static void loop_handle_errors(struct mosquitto_db *db, struct pollfd *pollfds);
 static void loop_handle_reads_writes(struct mosquitto_db *db, struct pollfd *pollfds);
+static int loop_read_pause_update(struct mosquitto_db *db, struct mosquitto *context, enum mosquitto_memory_stage mem_stage);
+static bool loop_output_limit_check(struct mosquitto_db *db, struct mosquitto *context, unsigned int *output_limited);
+static int loop_tls_flush(struct mosquitto *context);
+#ifdef WITH_TLS_THREADS
+static void loop_tls_handshakes_done(struct mosquitto_db *db);
+#endif
 
 int mosquitto_main_loop(struct mosquitto_db *db, int *listensock, int listensock_count, int listener_max)
 {
 	time_t start_time = mosquitto_time();
 	time_t last_backup = mosquitto_time();
 	time_t last_store_clean = mosquitto_time();
+	time_t last_origin_expire = mosquitto_time();
 	time_t now;
 	int time_count;
 	int fdcount;
@@ -77,10 +93,27 @@ int mosquitto_main_loop(struct mosquitto_db *db, int *listensock, int listensock
 	int i;
 	struct pollfd *pollfds = NULL;
 	int pollfd_count = 0;
+	int pollfd_needed;
 	int pollfd_index;
+	struct mosquitto *context;
+	unsigned int active;
+	enum mosquitto_memory_stage mem_stage;
+	unsigned int reads_paused;
+	unsigned int flow_paused;
+	unsigned int output_limited;
+	int pause;
+	int poll_timeout;
+#ifdef WITH_TLS_THREADS
+	int tls_pollfd_index;
+#endif
 #ifdef WITH_BRIDGE
 	int bridge_sock;
 	int rc;
+	uint64_t now_ms;
+#endif
+#ifdef WITH_SYS_TREE
+	uint64_t busy_start = 0;
+	struct _mqtt3_listener *metrics_listener;
 #endif
 
 #ifndef WIN32
@@ -95,8 +128,17 @@ int mosquitto_main_loop(struct mosquitto_db *db, int *listensock, int listensock
 		}
 #endif
 
-		if(listensock_count + db->context_count > pollfd_count || !pollfds){
-			pollfd_count = listensock_count + db->context_count;
+		pollfd_needed = listensock_count + db->context_count + 1;
+#ifdef WITH_BRIDGE
+		/* Bridges may also need a socket polled for probing their primary
+		 * address. */
+		pollfd_needed += db->config->bridge_count;
+#endif
+#ifdef WITH_SYS_TREE
+		pollfd_needed += db->metrics_conn_count;
+#endif
+		if(pollfd_needed > pollfd_count || !pollfds){
+			pollfd_count = pollfd_needed;
 			pollfds = _mosquitto_realloc(pollfds, sizeof(struct pollfd)*pollfd_count);
 			if(!pollfds){
 				_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
@@ -113,6 +155,24 @@ int mosquitto_main_loop(struct mosquitto_db *db, int *listensock, int listensock
 			pollfds[pollfd_index].revents = 0;
 			pollfd_index++;
 		}
+#ifdef WITH_TLS_THREADS
+		tls_pollfd_index = -1;
+		if(mqtt3_tls_workers_active()){
+			pollfds[pollfd_index].fd = mqtt3_tls_workers_sock();
+			pollfds[pollfd_index].events = POLLIN;
+			pollfds[pollfd_index].revents = 0;
+			tls_pollfd_index = pollfd_index;
+			pollfd_index++;
+		}
+#endif
+
+		mem_stage = mqtt3_db_memory_stage(db);
+		mqtt3_db_flow_update(db);
+		reads_paused = 0;
+		flow_paused = 0;
+		output_limited = 0;
+		active = 0;
+		poll_timeout = 100;
 
 		time_count = 0;
 		for(i=0; i<db->context_count; i++){
@@ -124,39 +184,111 @@ int mosquitto_main_loop(struct mosquitto_db *db, int *listensock, int listensock
 					now = mosquitto_time();
 				}
 				db->contexts[i]->pollfd_index = -1;
+#ifdef WITH_BRIDGE
+				if(db->contexts[i]->bridge){
+					db->contexts[i]->bridge->primary_probe_pollfd_index = -1;
+				}
+#endif
 
 				if(db->contexts[i]->sock != INVALID_SOCKET){
+					active++;
+#ifdef WITH_TLS_THREADS
+					if(db->contexts[i]->tls_handshake == mosq_th_queued){
+						/* A handshake thread has this client. */
+						continue;
+					}else if(db->contexts[i]->tls_handshake != mosq_th_none){
+						if(now - db->contexts[i]->last_msg_in >= (time_t)(db->contexts[i]->keepalive)*3/2){
+							mqtt3_context_disconnect(db, db->contexts[i]);
+							continue;
+						}
+						/* Wait until a handshake thread can make progress. */
+						pollfds[pollfd_index].fd = db->contexts[i]->sock;
+						if(db->contexts[i]->tls_handshake == mosq_th_want_write){
+							pollfds[pollfd_index].events = POLLOUT;
+						}else{
+							pollfds[pollfd_index].events = POLLIN;
+						}
+						pollfds[pollfd_index].revents = 0;
+						db->contexts[i]->pollfd_index = pollfd_index;
+						pollfd_index++;
+						continue;
+					}
+#endif
 #ifdef WITH_BRIDGE
 					if(db->contexts[i]->bridge){
 						_mosquitto_check_keepalive(db->contexts[i]);
 						if(db->contexts[i]->bridge->round_robin == false
-								&& db->contexts[i]->bridge->cur_address != 0
-								&& now > db->contexts[i]->bridge->primary_retry){
-
-							/* FIXME - this should be non-blocking */
-							if(_mosquitto_try_connect(db->contexts[i]->bridge->addresses[0].address, db->contexts[i]->bridge->addresses[0].port, &bridge_sock, NULL, true) == MOSQ_ERR_SUCCESS){
-								COMPAT_CLOSE(bridge_sock);
-								_mosquitto_socket_close(db->contexts[i]);
-								db->contexts[i]->bridge->cur_address = db->contexts[i]->bridge->address_count-1;
+								&& db->contexts[i]->bridge->cur_address != 0){
+
+							/* Check whether the primary address is back. The
+							 * result is handled in loop_handle_reads_writes(). */
+							bridge_sock = mqtt3_bridge_probe_update(db->contexts[i]->bridge, now);
+							if(bridge_sock != INVALID_SOCKET){
+								pollfds[pollfd_index].fd = bridge_sock;
+								pollfds[pollfd_index].events = POLLOUT;
+								pollfds[pollfd_index].revents = 0;
+								db->contexts[i]->bridge->primary_probe_pollfd_index = pollfd_index;
+								pollfd_index++;
 							}
 						}
 					}
 #endif
 
+					pause = loop_read_pause_update(db, db->contexts[i], mem_stage);
+					if(pause == 1){
+						reads_paused++;
+					}else if(pause == 2){
+						flow_paused++;
+					}
+
 					/* Local bridges never time out in this fashion. */
 					if(!(db->contexts[i]->keepalive) 
 							|| db->contexts[i]->bridge
 							|| now - db->contexts[i]->last_msg_in < (time_t)(db->contexts[i]->keepalive)*3/2){
 
-						if(mqtt3_db_message_write(db->contexts[i]) == MOSQ_ERR_SUCCESS){
+						if(db->contexts[i]->retain_cursors){
+							mqtt3_retain_feed(db, db->contexts[i]);
+						}
+						if(mqtt3_db_message_write(db->contexts[i]) == MOSQ_ERR_SUCCESS
+								&& loop_tls_flush(db->contexts[i]) == MOSQ_ERR_SUCCESS
+								&& !loop_output_limit_check(db, db->contexts[i], &output_limited)){
 							pollfds[pollfd_index].fd = db->contexts[i]->sock;
-							pollfds[pollfd_index].events = POLLIN;
+							if(db->contexts[i]->read_paused){
+								pollfds[pollfd_index].events = 0;
+							}else{
+								pollfds[pollfd_index].events = POLLIN;
+							}
 							pollfds[pollfd_index].revents = 0;
 							if(db->contexts[i]->current_out_packet){
 								pollfds[pollfd_index].events |= POLLOUT;
 							}
 							db->contexts[i]->pollfd_index = pollfd_index;
 							pollfd_index++;
+#ifdef WITH_TLS
+							if(db->contexts[i]->ssl && !db->contexts[i]->read_paused
+									&& SSL_pending(db->contexts[i]->ssl)){
+								/* Packets that arrived in the same TLS record as
+								 * the last one read are already decrypted, so
+								 * poll() won't report them. */
+								poll_timeout = 0;
+							}
+#endif
+							if(db->contexts[i]->retain_cursors
+									&& !mqtt3_db_client_window_full(db, db->contexts[i])){
+								/* More retained messages can be queued straight away. */
+								poll_timeout = 0;
+							}
+#ifdef WITH_BRIDGE
+							if(db->contexts[i]->bridge && db->contexts[i]->bridge->batch_count){
+								/* Wake up in time to send the batch. */
+								now_ms = mosquitto_time_ms();
+								if(db->contexts[i]->bridge->batch_deadline <= now_ms){
+									poll_timeout = 0;
+								}else if(db->contexts[i]->bridge->batch_deadline - now_ms < (uint64_t)poll_timeout){
+									poll_timeout = db->contexts[i]->bridge->batch_deadline - now_ms;
+								}
+							}
+#endif
 						}else{
 							mqtt3_context_disconnect(db, db->contexts[i]);
 						}
@@ -171,7 +303,34 @@ int mosquitto_main_loop(struct mosquitto_db *db, int *listensock, int listensock
 #ifdef WITH_BRIDGE
 					if(db->contexts[i]->bridge){
 						/* Want to try to restart the bridge connection */
+#ifdef WITH_ADNS
+						if(db->contexts[i]->bridge->adns){
+							/* Waiting for the address lookup to finish. */
+							rc = mqtt3_bridge_connect_step2(db, db->contexts[i]);
+							if(rc == MOSQ_ERR_SUCCESS){
+								if(db->contexts[i]->sock != INVALID_SOCKET){
+									pollfds[pollfd_index].fd = db->contexts[i]->sock;
+									pollfds[pollfd_index].events = POLLIN;
+									pollfds[pollfd_index].revents = 0;
+									if(db->contexts[i]->current_out_packet){
+										pollfds[pollfd_index].events |= POLLOUT;
+									}
+									db->contexts[i]->pollfd_index = pollfd_index;
+									pollfd_index++;
+								}
+							}else{
+								/* Retry later. */
+								db->contexts[i]->bridge->restart_t = now+db->contexts[i]->bridge->restart_timeout;
+
+								db->contexts[i]->bridge->cur_address++;
+								if(db->contexts[i]->bridge->cur_address == db->contexts[i]->bridge->address_count){
+									db->contexts[i]->bridge->cur_address = 0;
+								}
+							}
+						}else if(!db->contexts[i]->bridge->restart_t){
+#else
 						if(!db->contexts[i]->bridge->restart_t){
+#endif
 							db->contexts[i]->bridge->restart_t = now+db->contexts[i]->bridge->restart_timeout;
 							db->contexts[i]->bridge->cur_address++;
 							if(db->contexts[i]->bridge->cur_address == db->contexts[i]->bridge->address_count){
@@ -194,14 +353,16 @@ int mosquitto_main_loop(struct mosquitto_db *db, int *listensock, int listensock
 								db->contexts[i]->bridge->restart_t = 0;
 								rc = mqtt3_bridge_connect(db, db->contexts[i]);
 								if(rc == MOSQ_ERR_SUCCESS){
-									pollfds[pollfd_index].fd = db->contexts[i]->sock;
-									pollfds[pollfd_index].events = POLLIN;
-									pollfds[pollfd_index].revents = 0;
-									if(db->contexts[i]->current_out_packet){
-										pollfds[pollfd_index].events |= POLLOUT;
+									if(db->contexts[i]->sock != INVALID_SOCKET){
+										pollfds[pollfd_index].fd = db->contexts[i]->sock;
+										pollfds[pollfd_index].events = POLLIN;
+										pollfds[pollfd_index].revents = 0;
+										if(db->contexts[i]->current_out_packet){
+											pollfds[pollfd_index].events |= POLLOUT;
+										}
+										db->contexts[i]->pollfd_index = pollfd_index;
+										pollfd_index++;
 									}
-									db->contexts[i]->pollfd_index = pollfd_index;
-									pollfd_index++;
 								}else{
 									/* Retry later. */
 									db->contexts[i]->bridge->restart_t = now+db->contexts[i]->bridge->restart_timeout;
@@ -216,8 +377,9 @@ int mosquitto_main_loop(struct mosquitto_db *db, int *listensock, int listensock
 					}else{
 #endif
 						if(db->contexts[i]->clean_session == true){
-							mqtt3_context_cleanup(db, db->contexts[i], true);
-							db->contexts[i] = NULL;
+							context = db->contexts[i];
+							mqtt3_db_context_remove(db, context);
+							mqtt3_context_cleanup(db, context, true);
 						}else if(db->config->persistent_client_expiration > 0){
 							/* This is a persistent client, check to see if the
 							 * last time it connected was longer than
@@ -229,9 +391,10 @@ int mosquitto_main_loop(struct mosquitto_db *db, int *listensock, int listensock
 #ifdef WITH_SYS_TREE
 								g_clients_expired++;
 #endif
-								db->contexts[i]->clean_session = true;
-								mqtt3_context_cleanup(db, db->contexts[i], true);
-								db->contexts[i] = NULL;
+								context = db->contexts[i];
+								context->clean_session = true;
+								mqtt3_db_context_remove(db, context);
+								mqtt3_context_cleanup(db, context, true);
 							}
 						}
 #ifdef WITH_BRIDGE
@@ -241,22 +404,63 @@ int mosquitto_main_loop(struct mosquitto_db *db, int *listensock, int listensock
 			}
 		}
 
+#ifdef WITH_SYS_TREE
+		g_memory_reads_paused = reads_paused;
+		g_flow_reads_paused = flow_paused;
+		g_slow_clients_limited = output_limited;
+#endif
+		db->context_active = active;
+
+#ifdef WITH_SYS_TREE
+		if(db->metrics_conns){
+			mqtt3_metrics_pollfds(db, pollfds, &pollfd_index, mosquitto_time());
+		}
+#endif
+
 		mqtt3_db_message_timeout_check(db, db->config->retry_interval);
 
+#ifdef WITH_SYS_TREE
+		/* Time spent working between one poll() and the next. */
+		if(busy_start){
+			mqtt3_histogram_record(&g_latency_loop, mosquitto_time_us() - busy_start);
+		}
+#endif
 #ifndef WIN32
 		sigprocmask(SIG_SETMASK, &sigblock, &origsig);
-		fdcount = poll(pollfds, pollfd_index, 100);
+		fdcount = poll(pollfds, pollfd_index, poll_timeout);
 		sigprocmask(SIG_SETMASK, &origsig, NULL);
 #else
-		fdcount = WSAPoll(pollfds, pollfd_index, 100);
+		fdcount = WSAPoll(pollfds, pollfd_index, poll_timeout);
+#endif
+#ifdef WITH_SYS_TREE
+		busy_start = mosquitto_time_us();
 #endif
 		if(fdcount == -1){
 			loop_handle_errors(db, pollfds);
 		}else{
 			loop_handle_reads_writes(db, pollfds);
+#ifdef WITH_TLS_THREADS
+			if(tls_pollfd_index != -1 && pollfds[tls_pollfd_index].revents & POLLIN){
+				loop_tls_handshakes_done(db);
+			}
+#endif
+
+#ifdef WITH_SYS_TREE
+			if(db->metrics_conns){
+				mqtt3_metrics_handle(db, pollfds, start_time);
+			}
+#endif
 
 			for(i=0; i<listensock_count; i++){
 				if(pollfds[i].revents & (POLLIN | POLLPRI)){
+#ifdef WITH_SYS_TREE
+					metrics_listener = mqtt3_metrics_listener(db, listensock[i]);
+					if(metrics_listener){
+						while(mqtt3_metrics_accept(db, metrics_listener, listensock[i]) != -1){
+						}
+						continue;
+					}
+#endif
 					while(mqtt3_socket_accept(db, listensock[i]) != -1){
 					}
 				}
@@ -281,6 +485,10 @@ int mosquitto_main_loop(struct mosquitto_db *db, int *listensock, int listensock
 			mqtt3_db_store_clean(db);
 			last_store_clean = mosquitto_time();
 		}
+		if(db->origins && last_origin_expire + MQTT3_ORIGIN_EXPIRY/10 < mosquitto_time()){
+			mqtt3_bridge_origin_expire(db, mosquitto_time());
+			last_origin_expire = mosquitto_time();
+		}
 #ifdef WITH_PERSISTENCE
 		if(flag_db_backup){
 			mqtt3_db_backup(db, false, false);
@@ -289,15 +497,28 @@ int mosquitto_main_loop(struct mosquitto_db *db, int *listensock, int listensock
 #endif
 		if(flag_reload){
 			_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Reloading config.");
+#ifdef WITH_LOG_THREAD
+			/* The log file is reopened by the reload. */
+			mqtt3_log_thread_stop();
+#endif
 			mqtt3_config_read(db->config, true);
+#ifdef WITH_TLS
+			mqtt3_tls_ticket_keys_reload(db);
+#endif
 			mosquitto_security_cleanup(db, true);
 			mosquitto_security_init(db, true);
 			mosquitto_security_apply(db);
 			mqtt3_log_init(db->config->log_type, db->config->log_dest);
+#ifdef WITH_LOG_THREAD
+			mqtt3_log_thread_start();
+#endif
 			flag_reload = false;
 		}
 		if(flag_tree_print){
 			mqtt3_sub_tree_print(&db->subs, 0);
+#ifdef WITH_SYS_TREE
+			mqtt3_top_print(db);
+#endif
 			flag_tree_print = false;
 		}
 	}
@@ -306,6 +527,86 @@ int mosquitto_main_loop(struct mosquitto_db *db, int *listensock, int listensock
 	return MOSQ_ERR_SUCCESS;
 }
 
+/* Decide whether to stop reading from a client for this iteration of the
+ * loop. Once memory use passes the first stage of memory_limit we stop
+ * reading from clients that publish, unless they have messages of their own
+ * outstanding that we need their acknowledgements for. We also stop reading
+ * from publishers while the broker as a whole has too much output waiting
+ * (output_high_water), or while a client that one of their messages was
+ * queued for is above client_output_high_water. The same exception applies,
+ * and bridges and clients that are themselves over
+ * client_output_high_water are never paused for flow control, because the
+ * acknowledgements they send are what lets the output drain. Paused clients
+ * are still subject to their keepalive.
+ * Returns 0 if not paused, 1 if paused for memory and 2 if paused for
+ * output flow control. */
+static int loop_read_pause_update(struct mosquitto_db *db, struct mosquitto *context, enum mosquitto_memory_stage mem_stage)
+{
+	int pause = 0;
+	struct mosquitto *blocker;
+
+	if(context->flow_blocker){
+		blocker = context->flow_blocker;
+		if(context->flow_blocker_index < 0
+				|| context->flow_blocker_index >= db->context_count
+				|| db->contexts[context->flow_blocker_index] != blocker
+				|| blocker->sock == INVALID_SOCKET
+				|| mqtt3_db_client_drained(db, blocker)){
+
+			context->flow_blocker = NULL;
+		}
+	}
+
+	if(mem_stage >= mosq_mls_pause_reads && context->has_published && !context->msgs){
+		pause = 1;
+	}else if((context->flow_blocker || (db->flow_paused && context->has_published))
+			&& !context->msgs
+			&& !context->bridge
+			&& !mqtt3_db_client_congested(db, context)){
+
+		pause = 2;
+	}
+	context->read_paused = (pause != 0);
+
+	return pause;
+}
+
+/* Apply slow_client_policy to a client that has reached client_output_limit.
+ * Returns true if the client should be disconnected, which only happens with
+ * the "disconnect" policy once packets beyond the one currently being
+ * written are backed up. Bridges are never disconnected. */
+static bool loop_output_limit_check(struct mosquitto_db *db, struct mosquitto *context, unsigned int *output_limited)
+{
+	if(!mqtt3_db_client_output_limited(db, context)){
+		return false;
+	}
+	if(db->config->slow_client_policy == scp_disconnect
+			&& context->out_packet && !context->bridge){
+
+		_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE,
+				"Client %s has exceeded client_output_limit, disconnecting.", context->id);
+#ifdef WITH_SYS_TREE
+		g_slow_clients_disconnected++;
+#endif
+		return true;
+	}
+	(*output_limited)++;
+	return false;
+}
+
+/* Write the packets that _mosquitto_packet_queue() held back for a TLS
+ * client during this iteration. A client with a write already in progress
+ * picks them up when its socket becomes writable. */
+static int loop_tls_flush(struct mosquitto *context)
+{
+#ifdef WITH_TLS
+	if(context->ssl && context->out_packet && !context->current_out_packet){
+		return _mosquitto_packet_write(context);
+	}
+#endif
+	return MOSQ_ERR_SUCCESS;
+}
+
 static void do_disconnect(struct mosquitto_db *db, int context_index)
 {
 	if(db->config->connection_messages == true){
@@ -318,6 +619,33 @@ static void do_disconnect(struct mosquitto_db *db, int context_index)
 	mqtt3_context_disconnect(db, db->contexts[context_index]);
 }
 
+#ifdef WITH_TLS_THREADS
+/* Deal with clients that the handshake threads have finished a step for.
+ * Those that have completed their handshake carry on like any other client,
+ * and reading from them starts on the next iteration. */
+static void loop_tls_handshakes_done(struct mosquitto_db *db)
+{
+	struct mosquitto *context, *next;
+	char ebuf[256];
+
+	context = mqtt3_tls_workers_done();
+	while(context){
+		next = context->tls_handshake_next;
+		context->tls_handshake_next = NULL;
+		if(context->tls_handshake == mosq_th_failed){
+			context->tls_handshake = mosq_th_none;
+			if(context->tls_error){
+				_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE,
+						"Client connection from %s failed: %s.",
+						context->address, ERR_error_string(context->tls_error, ebuf));
+			}
+			mqtt3_context_disconnect(db, context);
+		}
+		context = next;
+	}
+}
+#endif
+
 /* Error ocurred, probably an fd has been closed. 
  * Loop through and check them all.
  */
@@ -326,7 +654,9 @@ static void loop_handle_errors(struct mosquitto_db *db, struct pollfd *pollfds)
 	int i;
 
 	for(i=0; i<db->context_count; i++){
-		if(db->contexts[i] && db->contexts[i]->sock != INVALID_SOCKET){
+		if(db->contexts[i] && db->contexts[i]->sock != INVALID_SOCKET
+				&& db->contexts[i]->pollfd_index != -1){
+
 			if(pollfds[db->contexts[i]->pollfd_index].revents & (POLLERR | POLLNVAL)){
 				do_disconnect(db, i);
 			}
@@ -339,6 +669,29 @@ static void loop_handle_reads_writes(struct mosquitto_db *db, struct pollfd *pol
 	int i;
 
 	for(i=0; i<db->context_count; i++){
+#ifdef WITH_BRIDGE
+		if(db->contexts[i] && db->contexts[i]->bridge
+				&& db->contexts[i]->bridge->primary_probe_pollfd_index != -1){
+
+			if(mqtt3_bridge_probe_check(db->contexts[i]->bridge, pollfds[db->contexts[i]->bridge->primary_probe_pollfd_index].revents)){
+				_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "Primary address for bridge %s is available, reconnecting.", db->contexts[i]->bridge->name);
+				_mosquitto_socket_close(db->contexts[i]);
+				db->contexts[i]->bridge->cur_address = db->contexts[i]->bridge->address_count-1;
+			}
+		}
+#endif
+#ifdef WITH_TLS_THREADS
+		if(db->contexts[i] && db->contexts[i]->sock != INVALID_SOCKET
+				&& db->contexts[i]->tls_handshake != mosq_th_none){
+
+			if(db->contexts[i]->pollfd_index != -1
+					&& pollfds[db->contexts[i]->pollfd_index].revents){
+
+				mqtt3_tls_workers_queue(db->contexts[i]);
+			}
+			continue;
+		}
+#endif
 		if(db->contexts[i] && db->contexts[i]->sock != INVALID_SOCKET){
 			assert(pollfds[db->contexts[i]->pollfd_index].fd == db->contexts[i]->sock);
 #ifdef WITH_TLS
@@ -357,13 +710,19 @@ static void loop_handle_reads_writes(struct mosquitto_db *db, struct pollfd *pol
 			assert(pollfds[db->contexts[i]->pollfd_index].fd == db->contexts[i]->sock);
 #ifdef WITH_TLS
 			if(pollfds[db->contexts[i]->pollfd_index].revents & POLLIN ||
-					(db->contexts[i]->ssl && db->contexts[i]->state == mosq_cs_new)){
+					(db->contexts[i]->ssl && db->contexts[i]->state == mosq_cs_new) ||
+					(db->contexts[i]->ssl && !db->contexts[i]->read_paused && SSL_pending(db->contexts[i]->ssl))){
 #else
 			if(pollfds[db->contexts[i]->pollfd_index].revents & POLLIN){
 #endif
+				db->flow_congested = NULL;
 				if(_mosquitto_packet_read(db, db->contexts[i])){
 					do_disconnect(db, i);
+				}else if(db->flow_congested && db->flow_congested != db->contexts[i]){
+					db->contexts[i]->flow_blocker = db->flow_congested;
+					db->contexts[i]->flow_blocker_index = db->flow_congested->db_index;
 				}
+				db->flow_congested = NULL;
 			}
 		}
 		if(db->contexts[i] && db->contexts[i]->sock != INVALID_SOCKET){
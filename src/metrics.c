@@ -0,0 +1,609 @@
+/*
+Copyright (c) 2014 Roger Light <roger@atchoo.org>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of mosquitto nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* A listener with "protocol metrics" answers plain HTTP requests with the
+ * broker counters in the Prometheus text exposition format, so that a
+ * monitoring system can scrape the broker without being an MQTT client.
+ *
+ * The values are read straight from the same variables that the $SYS tree
+ * is built from, at the time of the request, so the answer doesn't depend on
+ * sys_interval. Only GET and HEAD are supported and every connection is
+ * closed once its response has been written. There is no authentication, so
+ * the listener should be bound to a local or otherwise trusted address.
+ */
+
+#ifdef WITH_SYS_TREE
+
+#ifndef WIN32
+#include <poll.h>
+#include <sys/socket.h>
+#else
+#include <winsock2.h>
+#endif
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <config.h>
+
+#include <mosquitto_broker.h>
+#include <memory_mosq.h>
+#include <net_mosq.h>
+#include <time_mosq.h>
+
+/* Connections that haven't finished within this many seconds are closed. */
+#define METRICS_TIMEOUT 10
+
+extern uint64_t g_bytes_received;
+extern uint64_t g_bytes_sent;
+extern uint64_t g_pub_bytes_received;
+extern uint64_t g_pub_bytes_sent;
+extern unsigned long g_msgs_received;
+extern unsigned long g_msgs_sent;
+extern unsigned long g_pub_msgs_received;
+extern unsigned long g_pub_msgs_sent;
+extern unsigned long g_msgs_dropped;
+extern int g_clients_expired;
+extern unsigned int g_socket_connections;
+extern unsigned int g_connection_count;
+extern unsigned int g_memory_reads_paused;
+extern unsigned long g_memory_qos0_dropped;
+extern unsigned long g_memory_refused;
+extern unsigned int g_flow_reads_paused;
+extern unsigned int g_slow_clients_limited;
+extern unsigned long g_slow_clients_disconnected;
+extern unsigned long g_slow_qos0_dropped;
+#ifdef WITH_TLS
+extern unsigned long g_tls_handshakes_full;
+extern unsigned long g_tls_handshakes_resumed;
+#endif
+#ifdef WITH_LOG_THREAD
+extern unsigned long g_log_dropped;
+#endif
+
+struct _metrics_buf {
+	char *data;
+	int len;
+	int size;
+	bool error;
+};
+
+#ifdef REAL_WITH_MEMORY_TRACKING
+static const char *heap_types[mosq_mt_count] = {
+	"other",
+	"messages",
+	"retained",
+	"subscriptions",
+	"contexts",
+	"packets",
+	"tls",
+};
+#endif
+
+/* Per listener and per bridge values, which are exported with a
+ * mosquitto_listener_ or mosquitto_bridge_ prefix. */
+static const struct {
+	const char *name;
+	const char *type;
+	const char *help;
+	size_t offset;
+} traffic_fields[] = {
+	{"bytes_received_total", "counter", "Bytes received.", offsetof(struct _mqtt3_traffic, bytes_received)},
+	{"bytes_sent_total", "counter", "Bytes sent.", offsetof(struct _mqtt3_traffic, bytes_sent)},
+	{"messages_received_total", "counter", "MQTT packets received.", offsetof(struct _mqtt3_traffic, msgs_received)},
+	{"messages_sent_total", "counter", "MQTT packets sent.", offsetof(struct _mqtt3_traffic, msgs_sent)},
+	{"publish_messages_received_total", "counter", "PUBLISH packets received.", offsetof(struct _mqtt3_traffic, pub_msgs_received)},
+	{"publish_messages_sent_total", "counter", "PUBLISH packets sent.", offsetof(struct _mqtt3_traffic, pub_msgs_sent)},
+	{"connections_total", "counter", "Connections made.", offsetof(struct _mqtt3_traffic, connections_total)},
+	{"connections", "gauge", "Connections open.", offsetof(struct _mqtt3_traffic, connections)},
+	{"queued_messages", "gauge", "Messages queued for connected clients.", offsetof(struct _mqtt3_traffic, queued_messages)},
+};
+#define TRAFFIC_FIELDS (int)(sizeof(traffic_fields)/sizeof(traffic_fields[0]))
+#define TRAFFIC_VALUE(traffic, i) (*(uint64_t *)((char *)(traffic) + traffic_fields[i].offset))
+
+static void _buf_printf(struct _metrics_buf *buf, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void _buf_printf(struct _metrics_buf *buf, const char *fmt, ...)
+{
+	va_list va;
+	int len;
+	int size;
+	char *data;
+
+	if(buf->error) return;
+
+	va_start(va, fmt);
+	len = vsnprintf(buf->data+buf->len, buf->size-buf->len, fmt, va);
+	va_end(va);
+	if(len < 0){
+		buf->error = true;
+		return;
+	}
+	if(buf->len + len >= buf->size){
+		size = buf->size;
+		while(buf->len + len >= size){
+			size *= 2;
+		}
+		data = _mosquitto_realloc(buf->data, size);
+		if(!data){
+			buf->error = true;
+			return;
+		}
+		buf->data = data;
+		buf->size = size;
+		va_start(va, fmt);
+		vsnprintf(buf->data+buf->len, buf->size-buf->len, fmt, va);
+		va_end(va);
+	}
+	buf->len += len;
+}
+
+/* Append value as the contents of a quoted label value. */
+static void _buf_label(struct _metrics_buf *buf, const char *value)
+{
+	for(; *value; value++){
+		if(*value == '\\'){
+			_buf_printf(buf, "\\\\");
+		}else if(*value == '"'){
+			_buf_printf(buf, "\\\"");
+		}else if(*value == '\n'){
+			_buf_printf(buf, "\\n");
+		}else{
+			_buf_printf(buf, "%c", *value);
+		}
+	}
+}
+
+static void _metric_header(struct _metrics_buf *buf, const char *name, const char *type, const char *help)
+{
+	_buf_printf(buf, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void _metric(struct _metrics_buf *buf, const char *name, const char *type, const char *help, unsigned long long value)
+{
+	_metric_header(buf, name, type, help);
+	_buf_printf(buf, "%s %llu\n", name, value);
+}
+
+static void _metrics_generate(struct mosquitto_db *db, struct _metrics_buf *buf, time_t start_time)
+{
+	struct mosquitto_pool_stats stats;
+	struct _mqtt3_listener *listener;
+	unsigned int count;
+	unsigned int inactive;
+	int i;
+	int j;
+#ifdef WITH_BRIDGE
+	struct _mqtt3_bridge *bridge;
+	unsigned long long value;
+	int k;
+#endif
+
+	_metric(buf, "mosquitto_uptime_seconds", "gauge", "Time since the broker started.",
+			mosquitto_time() - start_time);
+
+	if(!mqtt3_db_client_count(db, &count, &inactive)){
+		_metric_header(buf, "mosquitto_clients", "gauge", "Clients known to the broker.");
+		_buf_printf(buf, "mosquitto_clients{state=\"active\"} %u\n", count - inactive);
+		_buf_printf(buf, "mosquitto_clients{state=\"inactive\"} %u\n", inactive);
+	}
+	_metric(buf, "mosquitto_clients_expired_total", "counter", "Persistent clients expired by persistent_client_expiration.",
+			g_clients_expired);
+	_metric(buf, "mosquitto_sockets_accepted_total", "counter", "Network connections accepted.",
+			g_socket_connections);
+	_metric(buf, "mosquitto_connections_total", "counter", "MQTT CONNECT commands handled.",
+			g_connection_count);
+
+	_metric(buf, "mosquitto_messages_received_total", "counter", "MQTT packets received.",
+			g_msgs_received);
+	_metric(buf, "mosquitto_messages_sent_total", "counter", "MQTT packets sent.",
+			g_msgs_sent);
+	_metric(buf, "mosquitto_publish_messages_received_total", "counter", "PUBLISH packets received.",
+			g_pub_msgs_received);
+	_metric(buf, "mosquitto_publish_messages_sent_total", "counter", "PUBLISH packets sent.",
+			g_pub_msgs_sent);
+	_metric(buf, "mosquitto_publish_messages_dropped_total", "counter", "PUBLISH messages dropped because of queue limits.",
+			g_msgs_dropped);
+	_metric(buf, "mosquitto_bytes_received_total", "counter", "Bytes received on all network connections.",
+			(unsigned long long)g_bytes_received);
+	_metric(buf, "mosquitto_bytes_sent_total", "counter", "Bytes sent on all network connections.",
+			(unsigned long long)g_bytes_sent);
+	_metric(buf, "mosquitto_publish_bytes_received_total", "counter", "PUBLISH payload bytes received.",
+			(unsigned long long)g_pub_bytes_received);
+	_metric(buf, "mosquitto_publish_bytes_sent_total", "counter", "PUBLISH payload bytes sent.",
+			(unsigned long long)g_pub_bytes_sent);
+
+	_metric(buf, "mosquitto_messages_stored", "gauge", "Messages held in the message store.",
+			db->msg_store_count);
+	_metric(buf, "mosquitto_subscriptions", "gauge", "Active subscriptions.",
+			db->subscription_count);
+	_metric(buf, "mosquitto_retained_messages", "gauge", "Retained messages.",
+			db->retained_count);
+	_metric(buf, "mosquitto_queued_bytes", "gauge", "Bytes of packets waiting to be written to clients.",
+			db->out_packet_bytes);
+
+	_metric_header(buf, "mosquitto_clients_paused", "gauge", "Clients that are not being read from.");
+	_buf_printf(buf, "mosquitto_clients_paused{reason=\"memory\"} %u\n", g_memory_reads_paused);
+	_buf_printf(buf, "mosquitto_clients_paused{reason=\"flow\"} %u\n", g_flow_reads_paused);
+	_metric(buf, "mosquitto_slow_clients_limited", "gauge", "Clients over client_output_limit.",
+			g_slow_clients_limited);
+	_metric(buf, "mosquitto_slow_clients_disconnected_total", "counter", "Clients disconnected by slow_client_policy.",
+			g_slow_clients_disconnected);
+	_metric_header(buf, "mosquitto_qos0_dropped_total", "counter", "QoS 0 messages dropped instead of being queued.");
+	_buf_printf(buf, "mosquitto_qos0_dropped_total{reason=\"memory\"} %lu\n", g_memory_qos0_dropped);
+	_buf_printf(buf, "mosquitto_qos0_dropped_total{reason=\"slow client\"} %lu\n", g_slow_qos0_dropped);
+	_metric(buf, "mosquitto_memory_refused_total", "counter", "Messages refused because memory_limit was reached.",
+			g_memory_refused);
+#ifdef WITH_LOG_THREAD
+	_metric(buf, "mosquitto_log_dropped_total", "counter", "Log messages dropped because the log queue was full.",
+			g_log_dropped);
+#endif
+
+#ifdef REAL_WITH_MEMORY_TRACKING
+	_metric(buf, "mosquitto_heap_bytes", "gauge", "Heap memory in use.",
+			_mosquitto_memory_used());
+	_metric(buf, "mosquitto_heap_max_bytes", "gauge", "Largest heap memory use seen.",
+			_mosquitto_max_memory_used());
+	_metric_header(buf, "mosquitto_heap_type_bytes", "gauge", "Heap memory in use, by what it is used for.");
+	for(i=0; i<mosq_mt_count; i++){
+		_buf_printf(buf, "mosquitto_heap_type_bytes{type=\"%s\"} %lu\n", heap_types[i], _mosquitto_memory_type_used(i));
+	}
+	if(db->config->memory_limit){
+		_metric(buf, "mosquitto_memory_limit_bytes", "gauge", "The memory_limit option.",
+				db->config->memory_limit);
+		_metric(buf, "mosquitto_memory_limit_stage", "gauge", "How close the broker is to memory_limit, from 0 to 3.",
+				mqtt3_db_memory_stage(db));
+	}
+#endif
+
+	_metric_header(buf, "mosquitto_pool_in_use", "gauge", "Pool objects in use.");
+	for(i=0; i<mosq_pt_count; i++){
+		_mosquitto_pool_stats(i, &stats);
+		_buf_printf(buf, "mosquitto_pool_in_use{pool=\"%s\"} %lu\n", stats.name, stats.in_use);
+	}
+	_metric_header(buf, "mosquitto_pool_free", "gauge", "Pool objects free for reuse.");
+	for(i=0; i<mosq_pt_count; i++){
+		_mosquitto_pool_stats(i, &stats);
+		_buf_printf(buf, "mosquitto_pool_free{pool=\"%s\"} %lu\n", stats.name, stats.free);
+	}
+
+#ifdef WITH_TLS
+	_metric_header(buf, "mosquitto_tls_handshakes_total", "counter", "Completed TLS handshakes.");
+	_buf_printf(buf, "mosquitto_tls_handshakes_total{type=\"full\"} %lu\n", g_tls_handshakes_full);
+	_buf_printf(buf, "mosquitto_tls_handshakes_total{type=\"resumed\"} %lu\n", g_tls_handshakes_resumed);
+#endif
+
+	mqtt3_sys_traffic_update(db);
+	for(j=0; j<TRAFFIC_FIELDS; j++){
+		_buf_printf(buf, "# HELP mosquitto_listener_%s %s\n# TYPE mosquitto_listener_%s %s\n",
+				traffic_fields[j].name, traffic_fields[j].help, traffic_fields[j].name, traffic_fields[j].type);
+		for(i=0; i<db->config->listener_count; i++){
+			listener = &db->config->listeners[i];
+			_buf_printf(buf, "mosquitto_listener_%s{port=\"%d\",address=\"", traffic_fields[j].name, listener->port);
+			if(listener->host){
+				_buf_label(buf, listener->host);
+			}
+			_buf_printf(buf, "\",protocol=\"%s\"} %llu\n",
+					listener->protocol == mp_metrics ? "metrics" : "mqtt",
+					(unsigned long long)TRAFFIC_VALUE(&listener->traffic, j));
+		}
+	}
+
+#ifdef WITH_BRIDGE
+	if(db->config->bridge_count){
+		for(j=0; j<TRAFFIC_FIELDS; j++){
+			_buf_printf(buf, "# HELP mosquitto_bridge_%s %s\n# TYPE mosquitto_bridge_%s %s\n",
+					traffic_fields[j].name, traffic_fields[j].help, traffic_fields[j].name, traffic_fields[j].type);
+			for(i=0; i<db->config->bridge_count; i++){
+				bridge = &db->config->bridges[i];
+				/* Parallel connections of a bridge follow the first one and
+				 * share its name, so give the total for all of them. */
+				if(bridge->connection_index > 0) continue;
+				value = 0;
+				for(k=0; k<bridge->connection_count && i+k<db->config->bridge_count; k++){
+					value += TRAFFIC_VALUE(&bridge[k].traffic, j);
+				}
+				_buf_printf(buf, "mosquitto_bridge_%s{bridge=\"", traffic_fields[j].name);
+				_buf_label(buf, bridge->name);
+				_buf_printf(buf, "\"} %llu\n", value);
+			}
+		}
+	}
+#endif
+}
+
+static void _metrics_conn_close(struct mosquitto_db *db, struct _mqtt3_metrics_conn *conn)
+{
+	struct _mqtt3_metrics_conn *prev;
+
+	if(db->metrics_conns == conn){
+		db->metrics_conns = conn->next;
+	}else{
+		prev = db->metrics_conns;
+		while(prev && prev->next != conn){
+			prev = prev->next;
+		}
+		if(prev){
+			prev->next = conn->next;
+		}
+	}
+	db->metrics_conn_count--;
+	conn->listener->client_count--;
+
+	COMPAT_CLOSE(conn->sock);
+	if(conn->response){
+		_mosquitto_free(conn->response);
+	}
+	_mosquitto_free(conn);
+}
+
+/* Build the whole response for a request whose headers have all arrived. */
+static int _metrics_respond(struct mosquitto_db *db, struct _mqtt3_metrics_conn *conn, time_t start_time)
+{
+	struct _metrics_buf body;
+	struct _metrics_buf response;
+	const char *status;
+	const char *path;
+	bool head = false;
+	int path_len;
+
+	memset(&body, 0, sizeof(struct _metrics_buf));
+	memset(&response, 0, sizeof(struct _metrics_buf));
+
+	body.size = 4096;
+	body.data = _mosquitto_malloc(body.size);
+	if(!body.data) return MOSQ_ERR_NOMEM;
+	body.data[0] = '\0';
+
+	if(!strncmp(conn->request, "GET ", 4)){
+		path = &conn->request[4];
+	}else if(!strncmp(conn->request, "HEAD ", 5)){
+		path = &conn->request[5];
+		head = true;
+	}else{
+		path = NULL;
+	}
+	if(path){
+		path_len = strcspn(path, " ?\r\n");
+		if((path_len == 1 && path[0] == '/')
+				|| (path_len == (int)strlen("/metrics") && !strncmp(path, "/metrics", path_len))){
+
+			status = "200 OK";
+			_metrics_generate(db, &body, start_time);
+		}else{
+			status = "404 Not Found";
+			_buf_printf(&body, "Not found. Metrics are at /metrics.\n");
+		}
+	}else{
+		status = "405 Method Not Allowed";
+		_buf_printf(&body, "Only GET and HEAD are supported.\n");
+	}
+
+	response.size = body.len + 256;
+	response.data = _mosquitto_malloc(response.size);
+	if(!response.data){
+		_mosquitto_free(body.data);
+		return MOSQ_ERR_NOMEM;
+	}
+	_buf_printf(&response,
+			"HTTP/1.0 %s\r\n"
+			"Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+			"Content-Length: %d\r\n"
+			"%s"
+			"Connection: close\r\n"
+			"\r\n",
+			status, body.len, path ? "" : "Allow: GET, HEAD\r\n");
+	if(!head){
+		_buf_printf(&response, "%s", body.data);
+	}
+	_mosquitto_free(body.data);
+	if(body.error || response.error){
+		_mosquitto_free(response.data);
+		return MOSQ_ERR_NOMEM;
+	}
+
+	conn->response = response.data;
+	conn->response_len = response.len;
+	conn->response_pos = 0;
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Returns 1 when the connection is finished with, either because the whole
+ * response has been written or because of an error. */
+static int _metrics_read(struct mosquitto_db *db, struct _mqtt3_metrics_conn *conn, time_t start_time)
+{
+	ssize_t len;
+
+	len = recv(conn->sock, &conn->request[conn->request_len], MQTT3_METRICS_REQUEST_MAX-1-conn->request_len, 0);
+	if(len == 0){
+		return 1;
+	}else if(len < 0){
+#ifdef WIN32
+		errno = WSAGetLastError();
+#endif
+		return errno != EAGAIN && errno != COMPAT_EWOULDBLOCK && errno != EINTR;
+	}
+	conn->request_len += len;
+	conn->request[conn->request_len] = '\0';
+
+	if(strstr(conn->request, "\r\n\r\n") || strstr(conn->request, "\n\n")){
+		if(_metrics_respond(db, conn, start_time)){
+			return 1;
+		}
+	}else if(conn->request_len == MQTT3_METRICS_REQUEST_MAX-1){
+		/* Requests from a scraper are small, so this is something else. */
+		return 1;
+	}
+	return 0;
+}
+
+static int _metrics_write(struct _mqtt3_metrics_conn *conn)
+{
+	ssize_t len;
+
+	while(conn->response_pos < conn->response_len){
+		len = send(conn->sock, &conn->response[conn->response_pos], conn->response_len-conn->response_pos, 0);
+		if(len < 0){
+#ifdef WIN32
+			errno = WSAGetLastError();
+#endif
+			if(errno == EAGAIN || errno == COMPAT_EWOULDBLOCK || errno == EINTR){
+				return 0;
+			}
+			return 1;
+		}
+		conn->response_pos += len;
+	}
+	return 1;
+}
+
+/* Returns the listener that listensock belongs to if it is a metrics
+ * listener, or NULL otherwise. */
+struct _mqtt3_listener *mqtt3_metrics_listener(struct mosquitto_db *db, int listensock)
+{
+	int i, j;
+
+	for(i=0; i<db->config->listener_count; i++){
+		if(db->config->listeners[i].protocol != mp_metrics) continue;
+		for(j=0; j<db->config->listeners[i].sock_count; j++){
+			if(db->config->listeners[i].socks[j] == listensock){
+				return &db->config->listeners[i];
+			}
+		}
+	}
+	return NULL;
+}
+
+int mqtt3_metrics_accept(struct mosquitto_db *db, struct _mqtt3_listener *listener, int listensock)
+{
+	struct _mqtt3_metrics_conn *conn;
+	int new_sock;
+
+	new_sock = accept(listensock, NULL, 0);
+	if(new_sock == INVALID_SOCKET) return -1;
+
+	if(_mosquitto_socket_nonblock(new_sock)){
+		return INVALID_SOCKET;
+	}
+	if(listener->max_connections > 0 && listener->client_count >= listener->max_connections){
+		COMPAT_CLOSE(new_sock);
+		return new_sock;
+	}
+
+	conn = _mosquitto_calloc(1, sizeof(struct _mqtt3_metrics_conn));
+	if(!conn){
+		COMPAT_CLOSE(new_sock);
+		return -1;
+	}
+	conn->sock = new_sock;
+	conn->listener = listener;
+	conn->pollfd_index = -1;
+	conn->start_t = mosquitto_time();
+
+	conn->next = db->metrics_conns;
+	db->metrics_conns = conn;
+	db->metrics_conn_count++;
+	listener->client_count++;
+
+	return new_sock;
+}
+
+/* Add the open metrics connections to pollfds, closing any that have taken
+ * too long. */
+void mqtt3_metrics_pollfds(struct mosquitto_db *db, struct pollfd *pollfds, int *pollfd_index, time_t now)
+{
+	struct _mqtt3_metrics_conn *conn, *next;
+
+	conn = db->metrics_conns;
+	while(conn){
+		next = conn->next;
+		if(now - conn->start_t > METRICS_TIMEOUT){
+			_metrics_conn_close(db, conn);
+		}else{
+			pollfds[*pollfd_index].fd = conn->sock;
+			if(conn->response){
+				pollfds[*pollfd_index].events = POLLOUT;
+			}else{
+				pollfds[*pollfd_index].events = POLLIN;
+			}
+			pollfds[*pollfd_index].revents = 0;
+			conn->pollfd_index = *pollfd_index;
+			(*pollfd_index)++;
+		}
+		conn = next;
+	}
+}
+
+void mqtt3_metrics_handle(struct mosquitto_db *db, struct pollfd *pollfds, time_t start_time)
+{
+	struct _mqtt3_metrics_conn *conn, *next;
+	short revents;
+	int done;
+
+	conn = db->metrics_conns;
+	while(conn){
+		next = conn->next;
+		if(conn->pollfd_index == -1){
+			conn = next;
+			continue;
+		}
+		revents = pollfds[conn->pollfd_index].revents;
+		conn->pollfd_index = -1;
+
+		done = 0;
+		if(revents & (POLLERR | POLLNVAL)){
+			done = 1;
+		}else if(!conn->response && revents & (POLLIN | POLLHUP)){
+			done = _metrics_read(db, conn, start_time);
+			if(!done && conn->response){
+				/* Most responses fit in the socket buffer, so try now rather
+				 * than waiting for the next poll(). */
+				done = _metrics_write(conn);
+			}
+		}else if(conn->response && revents & (POLLOUT | POLLHUP)){
+			done = _metrics_write(conn);
+		}
+		if(done){
+			_metrics_conn_close(db, conn);
+		}
+		conn = next;
+	}
+}
+
+void mqtt3_metrics_cleanup(struct mosquitto_db *db)
+{
+	while(db->metrics_conns){
+		_metrics_conn_close(db, db->metrics_conns);
+	}
+}
+
+#endif
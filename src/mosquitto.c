@@ -327,8 +327,30 @@ int main(int argc, char *argv[])
 	}
 #endif
 
+#ifdef WITH_TLS_THREADS
+	if(mqtt3_tls_workers_start(config.tls_handshake_threads)){
+		_mosquitto_free(int_db.contexts);
+		mqtt3_db_close(&int_db);
+		if(config.pid_file){
+			remove(config.pid_file);
+		}
+		return 1;
+	}
+#endif
+
+#ifdef WITH_LOG_THREAD
+	mqtt3_log_thread_start();
+#endif
+
 	run = 1;
 	rc = mosquitto_main_loop(&int_db, listensock, listensock_count, listener_max);
+#ifdef WITH_TLS_THREADS
+	mqtt3_tls_workers_stop();
+#endif
+#ifdef WITH_SYS_TREE
+	mqtt3_metrics_cleanup(&int_db);
+	mqtt3_top_cleanup();
+#endif
 
 	_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "mosquitto version %s terminating", VERSION);
 	mqtt3_log_close();
@@ -346,6 +368,8 @@ int main(int argc, char *argv[])
 	}
 	_mosquitto_free(int_db.contexts);
 	int_db.contexts = NULL;
+	_mosquitto_free(int_db.context_free);
+	int_db.context_free = NULL;
 	mqtt3_db_close(&int_db);
 
 	if(listensock){
@@ -369,6 +393,7 @@ int main(int argc, char *argv[])
 
 	_mosquitto_net_cleanup();
 	mqtt3_config_cleanup(int_db.config);
+	_mosquitto_pool_cleanup();
 
 	return rc;
 }
@@ -52,8 +52,102 @@ POSSIBILITY OF SUCH DAMAGE.
 #define MQTT3_LOG_TOPIC 0x10
 #define MQTT3_LOG_ALL 0xFF
 
+/* Bridges between mosquitto brokers may carry many QoS 0 messages in a single
+ * PUBLISH on this topic. The payload is a flags byte, then if
+ * MQTT3_BATCH_ZLIB is set a 32 bit uncompressed length followed by the
+ * deflated records. Each record is a 16 bit topic length, the topic, a byte
+ * holding the retain flag and QoS as in a PUBLISH header, a 32 bit payload
+ * length and the payload. All integers are big endian. */
+#define MQTT3_BATCH_TOPIC "$bridge/batch"
+#define MQTT3_BATCH_ZLIB 0x01
+/* The largest batch, before compression, that is sent or accepted. Messages
+ * too large to fit are sent on their own. */
+#define MQTT3_BATCH_MAX 1048576
+
+/* A mosquitto bridge with loop_detection enabled publishes its broker's
+ * origin id on this topic after connecting. From then on, both ends of the
+ * connection prefix the topic of every message they send with
+ * MQTT3_ORIGIN_PREFIX, the origin id of the broker where the message was
+ * first published and the message's sequence number on that broker, e.g.
+ * "$bridge/o/<id>/<seq>/a/topic". The numbers are in hex. */
+#define MQTT3_ORIGIN_TOPIC "$bridge/origin"
+#define MQTT3_ORIGIN_PREFIX "$bridge/o/"
+/* Length of the longest possible tag, including the trailing '/'. */
+#define MQTT3_ORIGIN_TAG_MAX (sizeof(MQTT3_ORIGIN_PREFIX)-1 + 16+1 + 16+1)
+/* Number of sequence numbers remembered for each origin, how long in seconds
+ * an origin is remembered for after its last message, and the most origins
+ * remembered at once. */
+#define MQTT3_ORIGIN_WINDOW 4096
+#define MQTT3_ORIGIN_EXPIRY 300
+#define MQTT3_ORIGIN_MAX 1024
+
 typedef uint64_t dbid_t;
 
+#ifdef WITH_TLS
+/* Session ticket keys are stored in a file as a sequence of these. */
+#define MQTT3_TICKET_KEY_LEN 80
+
+struct _mqtt3_ticket_key {
+	unsigned char name[16];
+	unsigned char hmac_key[32];
+	unsigned char aes_key[32];
+};
+#endif
+
+#ifdef WITH_SYS_TREE
+/* Histogram of the values behind one set of percentile topics. Values below
+ * 2^MQTT3_HISTOGRAM_SUB_BITS each have a bucket. Above that every power of two
+ * is split into 2^MQTT3_HISTOGRAM_SUB_BITS buckets, so a reported value is
+ * within about 6% of the real one. */
+#define MQTT3_HISTOGRAM_SUB_BITS 4
+#define MQTT3_HISTOGRAM_BUCKETS ((64-MQTT3_HISTOGRAM_SUB_BITS+1)<<MQTT3_HISTOGRAM_SUB_BITS)
+
+struct _mqtt3_histogram {
+	uint64_t count;
+	uint64_t max;
+	uint32_t buckets[MQTT3_HISTOGRAM_BUCKETS];
+};
+
+/* An HTTP connection to a metrics listener. The request is read until the
+ * end of its headers, then the whole response is generated at once and
+ * written out before the connection is closed. */
+#define MQTT3_METRICS_REQUEST_MAX 1024
+
+struct _mqtt3_metrics_conn {
+	struct _mqtt3_metrics_conn *next;
+	struct _mqtt3_listener *listener;
+	int sock;
+	int pollfd_index;
+	time_t start_t;
+	char request[MQTT3_METRICS_REQUEST_MAX];
+	int request_len;
+	char *response;
+	int response_len;
+	int response_pos;
+};
+
+/* Traffic through one listener or bridge. The counters are updated as each
+ * packet is completely read or written. connections and queued_messages are
+ * only filled in by mqtt3_sys_traffic_update(). */
+struct _mqtt3_traffic {
+	uint64_t bytes_received;
+	uint64_t bytes_sent;
+	uint64_t msgs_received;
+	uint64_t msgs_sent;
+	uint64_t pub_msgs_received;
+	uint64_t pub_msgs_sent;
+	uint64_t connections_total;
+	uint64_t connections;
+	uint64_t queued_messages;
+};
+#endif
+
+/* What a listener speaks. */
+enum mqtt3_listener_protocol {
+	mp_mqtt = 0,
+	mp_metrics = 1
+};
+
 struct _mqtt3_listener {
 	int fd;
 	char *host;
@@ -63,6 +157,7 @@ struct _mqtt3_listener {
 	int *socks;
 	int sock_count;
 	int client_count;
+	enum mqtt3_listener_protocol protocol;
 #ifdef WITH_TLS
 	char *cafile;
 	char *capath;
@@ -75,7 +170,32 @@ struct _mqtt3_listener {
 	char *crlfile;
 	bool use_identity_as_username;
 	char *tls_version;
+	bool tls_coalesce_writes;
+	bool tls_kernel_offload;
+	int tls_session_cache_size;
+	int tls_session_timeout;
+	bool tls_session_tickets;
+	char *tls_ticket_keyfile;
+	struct _mqtt3_ticket_key *ticket_keys;
+	int ticket_key_count;
 #endif
+#ifdef WITH_SYS_TREE
+	struct _mqtt3_traffic traffic;
+	struct _mqtt3_traffic traffic_published;
+#endif
+};
+
+/* What to do with a client that has reached client_output_limit. */
+enum mqtt3_slow_client_policy {
+	scp_park = 0,
+	scp_drop_qos0 = 1,
+	scp_disconnect = 2
+};
+
+/* How a member of a shared subscription group is chosen for each message. */
+enum mqtt3_shared_sub_policy {
+	ssp_round_robin = 0,
+	ssp_least_queued = 1
 };
 
 struct mqtt3_config {
@@ -88,6 +208,9 @@ struct mqtt3_config {
 	int auto_id_prefix_len;
 	int autosave_interval;
 	bool autosave_on_changes;
+	unsigned long client_output_high_water;
+	unsigned long client_output_limit;
+	unsigned long client_output_low_water;
 	char *clientid_prefixes;
 	bool connection_messages;
 	bool daemon;
@@ -99,7 +222,11 @@ struct mqtt3_config {
 	bool log_timestamp;
 	char *log_file;
 	FILE *log_fptr;
+	int log_queue_size;
+	unsigned long memory_limit;
 	int message_size_limit;
+	unsigned long output_high_water;
+	unsigned long output_low_water;
 	char *password_file;
 	bool persistence;
 	char *persistence_location;
@@ -109,9 +236,15 @@ struct mqtt3_config {
 	char *pid_file;
 	char *psk_file;
 	bool queue_qos0_messages;
+	int retained_delivery_batch;
 	int retry_interval;
+	enum mqtt3_slow_client_policy slow_client_policy;
+	enum mqtt3_shared_sub_policy shared_subscription_policy;
 	int store_clean_interval;
 	int sys_interval;
+	int top_count;
+	int top_sample;
+	int tls_handshake_threads;
 	bool upgrade_outgoing_qos;
 	char *user;
 	bool verbose;
@@ -129,16 +262,63 @@ struct _mosquitto_subleaf {
 	struct _mosquitto_subleaf *next;
 	struct mosquitto *context;
 	int qos;
+	bool shard; /* bridge connection only sends topics that hash to it */
+};
+
+/* Subscriptions of the form $share/<group>/<filter> are held as a group at
+ * the node for <filter>. Each matching message goes to one member. */
+#define MQTT3_SHARE_PREFIX "$share/"
+
+struct _mosquitto_subshared {
+	struct _mosquitto_subshared *next;
+	struct _mosquitto_subleaf *subs;
+	struct _mosquitto_subleaf *cursor; /* Where the next search for a member starts. */
+	char *name;
 };
 
 struct _mosquitto_subhier {
 	struct _mosquitto_subhier *children;
 	struct _mosquitto_subhier *next;
 	struct _mosquitto_subleaf *subs;
+	struct _mosquitto_subshared *shared;
+	char *topic;
+};
+
+/* Retained messages are indexed by topic in their own tree, separate from
+ * subscriptions, so the subscription tree only holds branches that have
+ * subscribers. Nodes are removed once they have no retained message and no
+ * children. */
+struct _mosquitto_retainhier {
+	struct _mosquitto_retainhier *children;
+	struct _mosquitto_retainhier *next;
 	char *topic;
 	struct mosquitto_msg_store *retained;
 };
 
+#ifdef WITH_SYS_TREE
+/* A topic published by the $SYS tree. The topic is split into tokens once,
+ * and the metric holds a reference on its current retained message so that
+ * the message can be updated in place. */
+struct _mosquitto_sys_metric {
+	char *topic;
+	struct _sub_token *tokens;
+	struct mosquitto_msg_store *stored;
+	UT_hash_handle hh;
+};
+#endif
+
+/* The retained messages matching a new subscription, waiting to be queued for
+ * the client a few at a time. Each message holds a reference on its store. */
+struct _mosquitto_retain_cursor {
+	struct _mosquitto_retain_cursor *next;
+	char *sub;
+	int qos;
+	struct mosquitto_msg_store **stores;
+	int count;
+	int alloc;
+	int pos;
+};
+
 struct mosquitto_msg_store{
 	struct mosquitto_msg_store *next;
 	dbid_t db_id;
@@ -147,9 +327,25 @@ struct mosquitto_msg_store{
 	char **dest_ids;
 	int dest_id_count;
 	uint16_t source_mid;
+	bool retained; /* Currently the retained message for its topic. */
+	uint64_t origin_id;
+	uint64_t origin_seq;
+	uint64_t store_time; /* mosquitto_time_us() when stored. */
+	size_t mem_charged; /* Memory accounted for the store, topic, source and payload. */
 	struct mosquitto_message msg;
 };
 
+/* The messages recently seen from a broker in a bridge mesh. Bit n of window
+ * is set if sequence number n mod MQTT3_ORIGIN_WINDOW has been seen, for
+ * numbers up to seq_max. */
+struct _mqtt3_origin{
+	uint64_t id;
+	uint64_t seq_max;
+	time_t last_seen;
+	uint32_t window[MQTT3_ORIGIN_WINDOW/32];
+	UT_hash_handle hh;
+};
+
 struct mosquitto_client_msg{
 	struct mosquitto_client_msg *next;
 	struct mosquitto_msg_store *store;
@@ -211,13 +407,18 @@ struct _clientid_index_hash{
 struct mosquitto_db{
 	dbid_t last_db_id;
 	struct _mosquitto_subhier subs;
+	struct _mosquitto_retainhier retains;
 	struct _mosquitto_unpwd *unpwd;
 	struct _mosquitto_acl_user *acl_list;
 	struct _mosquitto_acl *acl_patterns;
 	struct _mosquitto_unpwd *psk_id;
 	struct mosquitto **contexts;
 	struct _clientid_index_hash *clientid_index_hash;
-	int context_count;
+	int context_count; /* Number of slots of contexts[] in use, including gaps. */
+	int context_alloc; /* Allocated length of contexts[] and context_free[]. */
+	int *context_free; /* Stack of gaps in contexts[] below context_count. */
+	int context_free_count;
+	unsigned int context_active;
 	struct mosquitto_msg_store *msg_store;
 	int msg_store_count;
 	struct mqtt3_config *config;
@@ -225,6 +426,26 @@ struct mosquitto_db{
 	struct _mosquitto_auth_plugin auth_plugin;
 	int subscription_count;
 	int retained_count;
+	unsigned long out_packet_bytes;
+	struct mosquitto *flow_congested;
+	bool flow_paused;
+	uint64_t origin_id;
+	uint64_t origin_seq;
+	struct _mqtt3_origin *origins;
+#ifdef WITH_SYS_TREE
+	struct _mosquitto_sys_metric *sys_metrics;
+	struct _mqtt3_metrics_conn *metrics_conns;
+	int metrics_conn_count;
+#endif
+};
+
+/* How close the broker is to memory_limit. Each stage includes the
+ * restrictions of the stages below it. */
+enum mosquitto_memory_stage {
+	mosq_mls_normal = 0,
+	mosq_mls_pause_reads = 1,
+	mosq_mls_drop_qos0 = 2,
+	mosq_mls_refuse = 3
 };
 
 enum mqtt3_bridge_direction{
@@ -248,6 +469,17 @@ struct _mqtt3_bridge_topic{
 	char *remote_prefix;
 	char *local_topic; /* topic prefixed with local_prefix */
 	char *remote_topic; /* topic prefixed with remote_prefix */
+	bool sharded; /* spread across parallel connections */
+};
+
+/* One topic level in the tree used to find which bridge topic, if any,
+ * remaps a message. */
+struct _mqtt3_bridge_topic_node{
+	struct _mqtt3_bridge_topic_node *next;
+	struct _mqtt3_bridge_topic_node *children;
+	char *token;
+	int topic_index; /* Bridge topic that ends at this level, or -1. */
+	int multi_index; /* Bridge topic that ends with /# after this level, or -1. */
 };
 
 struct bridge_address{
@@ -268,6 +500,8 @@ struct _mqtt3_bridge{
 	struct _mqtt3_bridge_topic *topics;
 	int topic_count;
 	bool topic_remapping;
+	struct _mqtt3_bridge_topic_node *remap_out;
+	struct _mqtt3_bridge_topic_node *remap_in;
 	time_t restart_t;
 	char *username;
 	char *password;
@@ -280,6 +514,24 @@ struct _mqtt3_bridge{
 	bool lazy_reconnect;
 	bool try_private;
 	bool try_private_accepted;
+	int connection_count;
+	int connection_index;
+	bool batch_messages;
+	int batch_compression;
+	int batch_delay;
+	uint64_t batch_deadline;
+	uint8_t *batch;
+	uint32_t batch_len;
+	uint32_t batch_size;
+	int batch_count;
+	bool loop_detection;
+	int primary_probe_sock;
+	int primary_probe_pollfd_index;
+	time_t primary_probe_t;
+#ifdef WITH_ADNS
+	struct gaicb *adns;
+	struct gaicb *probe_adns;
+#endif
 #ifdef WITH_TLS
 	char *tls_cafile;
 	char *tls_capath;
@@ -292,6 +544,10 @@ struct _mqtt3_bridge{
 	char *tls_psk;
 #  endif
 #endif
+#ifdef WITH_SYS_TREE
+	struct _mqtt3_traffic traffic;
+	struct _mqtt3_traffic traffic_published;
+#endif
 };
 
 #include <net_mosq.h>
@@ -329,6 +585,23 @@ int _mosquitto_send_suback(struct mosquitto *context, uint16_t mid, uint32_t pay
 int mqtt3_socket_accept(struct mosquitto_db *db, int listensock);
 int mqtt3_socket_listen(struct _mqtt3_listener *listener);
 int _mosquitto_socket_get_address(int sock, char *buf, int len);
+#ifdef WITH_TLS
+void mqtt3_tls_ticket_keys_reload(struct mosquitto_db *db);
+#endif
+
+#ifdef WITH_TLS_THREADS
+/* ============================================================
+ * TLS handshake thread functions
+ * ============================================================ */
+int mqtt3_tls_workers_start(int count);
+void mqtt3_tls_workers_stop(void);
+bool mqtt3_tls_workers_active(void);
+int mqtt3_tls_workers_sock(void);
+void mqtt3_tls_workers_queue(struct mosquitto *context);
+struct mosquitto *mqtt3_tls_workers_done(void);
+void mqtt3_tls_workers_pause(void);
+void mqtt3_tls_workers_resume(void);
+#endif
 
 /* ============================================================
  * Read handling functions
@@ -338,6 +611,7 @@ int mqtt3_handle_connack(struct mosquitto_db *db, struct mosquitto *context);
 int mqtt3_handle_connect(struct mosquitto_db *db, struct mosquitto *context);
 int mqtt3_handle_disconnect(struct mosquitto_db *db, struct mosquitto *context);
 int mqtt3_handle_publish(struct mosquitto_db *db, struct mosquitto *context);
+int mqtt3_handle_batch(struct mosquitto_db *db, struct mosquitto *context, const uint8_t *payload, uint32_t payloadlen);
 int mqtt3_handle_subscribe(struct mosquitto_db *db, struct mosquitto *context);
 int mqtt3_handle_unsubscribe(struct mosquitto_db *db, struct mosquitto *context);
 
@@ -351,7 +625,15 @@ int mqtt3_db_backup(struct mosquitto_db *db, bool cleanup, bool shutdown);
 int mqtt3_db_restore(struct mosquitto_db *db);
 #endif
 int mqtt3_db_client_count(struct mosquitto_db *db, unsigned int *count, unsigned int *inactive_count);
+int mqtt3_db_context_add(struct mosquitto_db *db, struct mosquitto *context);
+void mqtt3_db_context_remove(struct mosquitto_db *db, struct mosquitto *context);
 void mqtt3_db_limits_set(int inflight, int queued);
+enum mosquitto_memory_stage mqtt3_db_memory_stage(struct mosquitto_db *db);
+void mqtt3_db_flow_update(struct mosquitto_db *db);
+bool mqtt3_db_client_congested(struct mosquitto_db *db, struct mosquitto *context);
+bool mqtt3_db_client_output_limited(struct mosquitto_db *db, struct mosquitto *context);
+bool mqtt3_db_client_drained(struct mosquitto_db *db, struct mosquitto *context);
+bool mqtt3_db_client_window_full(struct mosquitto_db *db, struct mosquitto *context);
 /* Return the number of in-flight messages in count. */
 int mqtt3_db_message_count(int *count);
 int mqtt3_db_message_delete(struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir);
@@ -363,23 +645,53 @@ int mqtt3_db_messages_delete(struct mosquitto *context);
 int mqtt3_db_messages_easy_queue(struct mosquitto_db *db, struct mosquitto *context, const char *topic, int qos, uint32_t payloadlen, const void *payload, int retain);
 int mqtt3_db_messages_queue(struct mosquitto_db *db, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored);
 int mqtt3_db_message_store(struct mosquitto_db *db, const char *source, uint16_t source_mid, const char *topic, int qos, uint32_t payloadlen, const void *payload, int retain, struct mosquitto_msg_store **stored, dbid_t store_id);
+void mqtt3_db_message_store_charged(struct mosquitto_msg_store *stored);
 int mqtt3_db_message_store_find(struct mosquitto *context, uint16_t mid, struct mosquitto_msg_store **stored);
 /* Check all messages waiting on a client reply and resend if timeout has been exceeded. */
 int mqtt3_db_message_timeout_check(struct mosquitto_db *db, unsigned int timeout);
 int mqtt3_db_message_reconnect_reset(struct mosquitto *context);
 int mqtt3_retain_queue(struct mosquitto_db *db, struct mosquitto *context, const char *sub, int sub_qos);
+void mqtt3_retain_feed(struct mosquitto_db *db, struct mosquitto *context);
+void mqtt3_retain_cursor_remove(struct mosquitto *context, const char *sub);
 void mqtt3_db_store_clean(struct mosquitto_db *db);
 void mqtt3_db_sys_update(struct mosquitto_db *db, int interval, time_t start_time);
+#ifdef WITH_SYS_TREE
+void mqtt3_histogram_record(struct _mqtt3_histogram *hist, uint64_t value);
+void mqtt3_sys_traffic_update(struct mosquitto_db *db);
+void mqtt3_top_publish_record(struct mosquitto_db *db, const char *client_id, const char *topic, uint32_t payloadlen);
+void mqtt3_top_fan_out_record(struct mosquitto_db *db, const char *topic, int count);
+void mqtt3_top_update(struct mosquitto_db *db);
+void mqtt3_top_print(struct mosquitto_db *db);
+void mqtt3_top_cleanup(void);
+#endif
 void mqtt3_db_vacuum(void);
 
 /* ============================================================
  * Subscription functions
  * ============================================================ */
 int mqtt3_sub_add(struct mosquitto_db *db, struct mosquitto *context, const char *sub, int qos, struct _mosquitto_subhier *root);
+int mqtt3_sub_add_sharded(struct mosquitto_db *db, struct mosquitto *context, const char *sub, int qos, struct _mosquitto_subhier *root);
 int mqtt3_sub_remove(struct mosquitto_db *db, struct mosquitto *context, const char *sub, struct _mosquitto_subhier *root);
+const char *mqtt3_sub_filter(const char *sub);
 int mqtt3_sub_search(struct mosquitto_db *db, struct _mosquitto_subhier *root, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored);
 void mqtt3_sub_tree_print(struct _mosquitto_subhier *root, int level);
 int mqtt3_subs_clean_session(struct mosquitto_db *db, struct mosquitto *context, struct _mosquitto_subhier *root);
+#ifdef WITH_SYS_TREE
+int mqtt3_sys_publish(struct mosquitto_db *db, const char *topic, uint32_t payloadlen, const void *payload);
+void mqtt3_sys_metrics_cleanup(struct mosquitto_db *db);
+#endif
+
+/* ============================================================
+ * Metrics listener related functions
+ * ============================================================ */
+#ifdef WITH_SYS_TREE
+struct pollfd;
+struct _mqtt3_listener *mqtt3_metrics_listener(struct mosquitto_db *db, int listensock);
+int mqtt3_metrics_accept(struct mosquitto_db *db, struct _mqtt3_listener *listener, int listensock);
+void mqtt3_metrics_pollfds(struct mosquitto_db *db, struct pollfd *pollfds, int *pollfd_index, time_t now);
+void mqtt3_metrics_handle(struct mosquitto_db *db, struct pollfd *pollfds, time_t start_time);
+void mqtt3_metrics_cleanup(struct mosquitto_db *db);
+#endif
 
 /* ============================================================
  * Context functions
@@ -393,6 +705,10 @@ void mqtt3_context_disconnect(struct mosquitto_db *db, struct mosquitto *context
  * ============================================================ */
 int mqtt3_log_init(int level, int destinations);
 int mqtt3_log_close(void);
+#ifdef WITH_LOG_THREAD
+int mqtt3_log_thread_start(void);
+void mqtt3_log_thread_stop(void);
+#endif
 int _mosquitto_log_printf(struct mosquitto *mosq, int level, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
 
 /* ============================================================
@@ -401,8 +717,28 @@ int _mosquitto_log_printf(struct mosquitto *mosq, int level, const char *fmt, ..
 #ifdef WITH_BRIDGE
 int mqtt3_bridge_new(struct mosquitto_db *db, struct _mqtt3_bridge *bridge);
 int mqtt3_bridge_connect(struct mosquitto_db *db, struct mosquitto *context);
+#ifdef WITH_ADNS
+int mqtt3_bridge_connect_step2(struct mosquitto_db *db, struct mosquitto *context);
+#endif
 void mqtt3_bridge_packet_cleanup(struct mosquitto *context);
+void mqtt3_bridge_cleanup(struct _mqtt3_bridge *bridge);
+int mqtt3_bridge_probe_update(struct _mqtt3_bridge *bridge, time_t now);
+bool mqtt3_bridge_probe_check(struct _mqtt3_bridge *bridge, short revents);
+void mqtt3_bridge_probe_cleanup(struct _mqtt3_bridge *bridge);
+bool mqtt3_bridge_shard_match(struct _mqtt3_bridge *bridge, const char *topic);
+int mqtt3_bridge_remap_build(struct _mqtt3_bridge *bridge);
+void mqtt3_bridge_remap_free(struct _mqtt3_bridge *bridge);
+bool mqtt3_bridge_remap(struct _mqtt3_bridge *bridge, enum mqtt3_bridge_direction direction, const char *topic, const char **prefix, const char **suffix);
+int mqtt3_bridge_batch_add(struct mosquitto *context, struct mosquitto_msg_store *stored, int qos, bool retain);
+int mqtt3_bridge_batch_flush(struct mosquitto *context);
+int mqtt3_bridge_origin_announce(struct mosquitto_db *db, struct mosquitto *context);
 #endif
+uint64_t mqtt3_bridge_origin_id_generate(void);
+int mqtt3_bridge_origin_strip(char *topic, uint64_t *id, uint64_t *seq);
+bool mqtt3_bridge_origin_seen(struct mosquitto_db *db, uint64_t id, uint64_t seq);
+void mqtt3_bridge_origin_expire(struct mosquitto_db *db, time_t now);
+void mqtt3_bridge_origin_cleanup(struct mosquitto_db *db);
+int mqtt3_bridge_send_publish(struct mosquitto *context, uint16_t mid, struct mosquitto_msg_store *stored, int qos, bool retain, bool dup);
 
 /* ============================================================
  * Security related functions
@@ -101,7 +101,7 @@ int output_new_password(FILE *fptr, const char *username, const char *password)
 	unsigned char hash[EVP_MAX_MD_SIZE];
 	unsigned int hash_len;
 	const EVP_MD *digest;
-	EVP_MD_CTX context;
+	EVP_MD_CTX *context;
 
 	rc = RAND_bytes(salt, SALT_LEN);
 	if(!rc){
@@ -123,12 +123,17 @@ int output_new_password(FILE *fptr, const char *username, const char *password)
 		return 1;
 	}
 
-	EVP_MD_CTX_init(&context);
-	EVP_DigestInit_ex(&context, digest, NULL);
-	EVP_DigestUpdate(&context, password, strlen(password));
-	EVP_DigestUpdate(&context, salt, SALT_LEN);
-	EVP_DigestFinal_ex(&context, hash, &hash_len);
-	EVP_MD_CTX_cleanup(&context);
+	context = EVP_MD_CTX_create();
+	if(!context){
+		if(salt64) free(salt64);
+		fprintf(stderr, "Error: Out of memory.\n");
+		return 1;
+	}
+	EVP_DigestInit_ex(context, digest, NULL);
+	EVP_DigestUpdate(context, password, strlen(password));
+	EVP_DigestUpdate(context, salt, SALT_LEN);
+	EVP_DigestFinal_ex(context, hash, &hash_len);
+	EVP_MD_CTX_destroy(context);
 
 	rc = base64_encode(hash, hash_len, &hash64);
 	if(rc){
@@ -68,6 +68,12 @@ POSSIBILITY OF SUCH DAMAGE.
 #ifdef WITH_TLS
 #include "tls_mosq.h"
 #include <openssl/err.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#endif
 static int tls_ex_index_context = -1;
 static int tls_ex_index_listener = -1;
 #endif
@@ -81,7 +87,6 @@ int mqtt3_socket_accept(struct mosquitto_db *db, int listensock)
 	int i;
 	int j;
 	int new_sock = -1;
-	struct mosquitto **tmp_contexts = NULL;
 	struct mosquitto *new_context;
 #ifdef WITH_TLS
 	BIO *bio;
@@ -142,6 +147,9 @@ int mqtt3_socket_accept(struct mosquitto_db *db, int listensock)
 			mqtt3_context_cleanup(NULL, new_context, true);
 			return -1;
 		}
+#ifdef WITH_SYS_TREE
+		new_context->listener->traffic.connections_total++;
+#endif
 
 #ifdef WITH_TLS
 		/* TLS init */
@@ -159,6 +167,20 @@ int mqtt3_socket_accept(struct mosquitto_db *db, int listensock)
 						new_context->want_write = true;
 						bio = BIO_new_socket(new_sock, BIO_NOCLOSE);
 						SSL_set_bio(new_context->ssl, bio, bio);
+#ifdef WITH_TLS_THREADS
+						/* PSK identities are looked up by the security code,
+						 * which only runs on the main thread. */
+						if(mqtt3_tls_workers_active() && !db->config->listeners[i].psk_hint){
+							/* Wait for the ClientHello, then let a worker
+							 * thread do the handshake. SSL_accept() would
+							 * have cleared the error queue, and anything left
+							 * on it would make SSL_get_error() report a
+							 * failure for the next read. */
+							ERR_clear_error();
+							new_context->tls_handshake = mosq_th_want_read;
+							continue;
+						}
+#endif
 						rc = SSL_accept(new_context->ssl);
 						if(rc != 1){
 							rc = SSL_get_error(new_context->ssl, rc);
@@ -185,26 +207,11 @@ int mqtt3_socket_accept(struct mosquitto_db *db, int listensock)
 #endif
 
 		_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "New connection from %s on port %d.", new_context->address, new_context->listener->port);
-		for(i=0; i<db->context_count; i++){
-			if(db->contexts[i] == NULL){
-				db->contexts[i] = new_context;
-				break;
-			}
-		}
-		if(i==db->context_count){
-			tmp_contexts = _mosquitto_realloc(db->contexts, sizeof(struct mosquitto*)*(db->context_count+1));
-			if(tmp_contexts){
-				db->context_count++;
-				db->contexts = tmp_contexts;
-				db->contexts[i] = new_context;
-			}else{
-				// Out of memory
-				mqtt3_context_cleanup(NULL, new_context, true);
-				return -1;
-			}
+		if(mqtt3_db_context_add(db, new_context)){
+			// Out of memory
+			mqtt3_context_cleanup(NULL, new_context, true);
+			return -1;
 		}
-		// If we got here then the context's DB index is "i" regardless of how we got here
-		new_context->db_index = i;
 
 #ifdef WITH_WRAP
 	}
@@ -263,6 +270,185 @@ static unsigned int psk_server_callback(SSL *ssl, const char *identity, unsigned
 }
 #endif
 
+#ifdef WITH_TLS
+/* Read a session ticket key file, which holds one or more keys of
+ * MQTT3_TICKET_KEY_LEN bytes each. The first key is used to issue new
+ * tickets and all of them are accepted, so keys can be rotated by adding a
+ * new one to the start of the file and dropping the oldest. */
+static int _tls_ticket_keys_load(const char *file, struct _mqtt3_ticket_key **keys, int *key_count)
+{
+	FILE *fptr;
+	long len;
+	int count;
+
+	fptr = _mosquitto_fopen(file, "rb");
+	if(!fptr){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to open session ticket key file \"%s\".", file);
+		return 1;
+	}
+	fseek(fptr, 0, SEEK_END);
+	len = ftell(fptr);
+	fseek(fptr, 0, SEEK_SET);
+	if(len <= 0 || len % MQTT3_TICKET_KEY_LEN){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Session ticket key file \"%s\" must contain one or more %d byte keys.", file, MQTT3_TICKET_KEY_LEN);
+		fclose(fptr);
+		return 1;
+	}
+	count = len / MQTT3_TICKET_KEY_LEN;
+
+	*keys = _mosquitto_calloc(count, sizeof(struct _mqtt3_ticket_key));
+	if(!(*keys)){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		fclose(fptr);
+		return 1;
+	}
+	if(fread(*keys, sizeof(struct _mqtt3_ticket_key), count, fptr) != count){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to read session ticket key file \"%s\".", file);
+		_mosquitto_free(*keys);
+		*keys = NULL;
+		fclose(fptr);
+		return 1;
+	}
+	fclose(fptr);
+	*key_count = count;
+	return 0;
+}
+
+static void _tls_ticket_keys_free(struct _mqtt3_ticket_key *keys, int key_count)
+{
+	if(keys){
+		memset(keys, 0, sizeof(struct _mqtt3_ticket_key)*key_count);
+		_mosquitto_free(keys);
+	}
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+/* HMAC_Init_ex() is deprecated from OpenSSL 3, which passes an EVP_MAC_CTX
+ * to the ticket callback instead. */
+typedef EVP_MAC_CTX _tls_ticket_mac_ctx;
+
+static int _tls_ticket_mac_init(EVP_MAC_CTX *hctx, struct _mqtt3_ticket_key *key)
+{
+	OSSL_PARAM params[2];
+
+	params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char *)"SHA256", 0);
+	params[1] = OSSL_PARAM_construct_end();
+	return EVP_MAC_init(hctx, key->hmac_key, sizeof(key->hmac_key), params);
+}
+#else
+typedef HMAC_CTX _tls_ticket_mac_ctx;
+
+static int _tls_ticket_mac_init(HMAC_CTX *hctx, struct _mqtt3_ticket_key *key)
+{
+	return HMAC_Init_ex(hctx, key->hmac_key, sizeof(key->hmac_key), EVP_sha256(), NULL);
+}
+#endif
+
+static int tls_ticket_key_callback(SSL *ssl, unsigned char *key_name, unsigned char *iv, EVP_CIPHER_CTX *ctx, _tls_ticket_mac_ctx *hctx, int enc)
+{
+	struct _mqtt3_listener *listener;
+	struct _mqtt3_ticket_key *key;
+	int i;
+
+	listener = SSL_get_ex_data(ssl, tls_ex_index_listener);
+	if(!listener || !listener->ticket_key_count) return 0;
+
+	if(enc){
+		key = &listener->ticket_keys[0];
+		if(RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1) return -1;
+		memcpy(key_name, key->name, sizeof(key->name));
+		if(!EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key->aes_key, iv)) return -1;
+		if(!_tls_ticket_mac_init(hctx, key)) return -1;
+		return 1;
+	}else{
+		for(i=0; i<listener->ticket_key_count; i++){
+			key = &listener->ticket_keys[i];
+			if(!memcmp(key_name, key->name, sizeof(key->name))){
+				if(!_tls_ticket_mac_init(hctx, key)) return -1;
+				if(!EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key->aes_key, iv)) return -1;
+				/* Tickets issued with an older key are accepted, but
+				 * replaced with one using the current key. */
+				return i == 0 ? 1 : 2;
+			}
+		}
+		/* Unknown key, so carry out a full handshake. */
+		return 0;
+	}
+}
+
+/* Apply the session cache, session ticket and kernel TLS options to a
+ * listener. */
+static int _tls_session_setup(struct _mqtt3_listener *listener)
+{
+	/* A write that has to be retried may be retried from the staging buffer
+	 * in _mosquitto_packet_write() rather than the packet itself. */
+	SSL_CTX_set_mode(listener->ssl_ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef REAL_WITH_KTLS
+	if(listener->tls_kernel_offload){
+		/* openssl quietly carries on in user space if the kernel can't
+		 * take the connection. */
+		SSL_CTX_set_options(listener->ssl_ctx, SSL_OP_ENABLE_KTLS);
+	}
+#endif
+	if(listener->tls_session_cache_size == 0){
+		SSL_CTX_set_session_cache_mode(listener->ssl_ctx, SSL_SESS_CACHE_OFF);
+	}else if(listener->tls_session_cache_size > 0){
+		SSL_CTX_sess_set_cache_size(listener->ssl_ctx, listener->tls_session_cache_size);
+	}
+	if(listener->tls_session_timeout > 0){
+		SSL_CTX_set_timeout(listener->ssl_ctx, listener->tls_session_timeout);
+	}
+
+	if(!listener->tls_session_tickets){
+		SSL_CTX_set_options(listener->ssl_ctx, SSL_OP_NO_TICKET);
+	}else if(listener->tls_ticket_keyfile){
+		/* Without a key file OpenSSL uses random keys, which are lost on
+		 * restart and differ between brokers. */
+		if(_tls_ticket_keys_load(listener->tls_ticket_keyfile, &listener->ticket_keys, &listener->ticket_key_count)){
+			return 1;
+		}
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		SSL_CTX_set_tlsext_ticket_key_evp_cb(listener->ssl_ctx, tls_ticket_key_callback);
+#else
+		SSL_CTX_set_tlsext_ticket_key_cb(listener->ssl_ctx, tls_ticket_key_callback);
+#endif
+	}
+	return 0;
+}
+
+/* Reread the session ticket key files for all listeners, called on the
+ * reload signal. A listener keeps its current keys if its file can't be
+ * read. */
+void mqtt3_tls_ticket_keys_reload(struct mosquitto_db *db)
+{
+	struct _mqtt3_listener *listener;
+	struct _mqtt3_ticket_key *keys, *old_keys;
+	int key_count, old_key_count;
+	int i;
+
+	for(i=0; i<db->config->listener_count; i++){
+		listener = &db->config->listeners[i];
+		if(!listener->ssl_ctx || !listener->ticket_keys) continue;
+
+		if(_tls_ticket_keys_load(listener->tls_ticket_keyfile, &keys, &key_count)){
+			continue;
+		}
+#ifdef WITH_TLS_THREADS
+		mqtt3_tls_workers_pause();
+#endif
+		old_keys = listener->ticket_keys;
+		old_key_count = listener->ticket_key_count;
+		listener->ticket_keys = keys;
+		listener->ticket_key_count = key_count;
+#ifdef WITH_TLS_THREADS
+		mqtt3_tls_workers_resume();
+#endif
+		_tls_ticket_keys_free(old_keys, old_key_count);
+		_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Loaded %d session ticket keys for port %d.", key_count, listener->port);
+	}
+}
+#endif
+
 /* Creates a socket and listens on port 'port'.
  * Returns 1 on failure
  * Returns 0 on success.
@@ -353,6 +539,12 @@ int mqtt3_socket_listen(struct _mqtt3_listener *listener)
 	if(listener->sock_count > 0){
 #ifdef WITH_TLS
 		if((listener->cafile || listener->capath) && listener->certfile && listener->keyfile){
+			if(tls_ex_index_context == -1){
+				tls_ex_index_context = SSL_get_ex_new_index(0, "client context", NULL, NULL, NULL);
+			}
+			if(tls_ex_index_listener == -1){
+				tls_ex_index_listener = SSL_get_ex_new_index(0, "listener", NULL, NULL, NULL);
+			}
 #if OPENSSL_VERSION_NUMBER >= 0x10001000L
 			if(listener->tls_version == NULL){
 				listener->ssl_ctx = SSL_CTX_new(TLSv1_2_server_method());
@@ -390,6 +582,10 @@ int mqtt3_socket_listen(struct _mqtt3_listener *listener)
 #endif
 			snprintf(buf, 256, "mosquitto-%d", listener->port);
 			SSL_CTX_set_session_id_context(listener->ssl_ctx, (unsigned char *)buf, strlen(buf));
+			if(_tls_session_setup(listener)){
+				COMPAT_CLOSE(sock);
+				return 1;
+			}
 
 			if(listener->ciphers){
 				rc = SSL_CTX_set_cipher_list(listener->ssl_ctx, listener->ciphers);
@@ -488,6 +684,10 @@ int mqtt3_socket_listen(struct _mqtt3_listener *listener)
 				return 1;
 			}
 			SSL_CTX_set_psk_server_callback(listener->ssl_ctx, psk_server_callback);
+			if(_tls_session_setup(listener)){
+				COMPAT_CLOSE(sock);
+				return 1;
+			}
 			if(listener->psk_hint){
 				rc = SSL_CTX_use_psk_identity_hint(listener->ssl_ctx, listener->psk_hint);
 				if(rc == 0){
@@ -55,7 +55,6 @@ static int _db_restore_sub(struct mosquitto_db *db, const char *client_id, const
 static struct mosquitto *_db_find_or_add_context(struct mosquitto_db *db, const char *client_id, uint16_t last_mid)
 {
 	struct mosquitto *context;
-	struct mosquitto **tmp_contexts;
 	int i;
 
 	context = NULL;
@@ -71,25 +70,11 @@ static struct mosquitto *_db_find_or_add_context(struct mosquitto_db *db, const
 
 		context->clean_session = false;
 
-		for(i=0; i<db->context_count; i++){
-			if(!db->contexts[i]){
-				db->contexts[i] = context;
-				break;
-			}
-		}
-		if(i==db->context_count){
-			db->context_count++;
-			tmp_contexts = _mosquitto_realloc(db->contexts, sizeof(struct mosquitto*)*db->context_count);
-			if(tmp_contexts){
-				db->contexts = tmp_contexts;
-				db->contexts[db->context_count-1] = context;
-			}else{
-				mqtt3_context_cleanup(db, context, true);
-				return NULL;
-			}
+		if(mqtt3_db_context_add(db, context)){
+			mqtt3_context_cleanup(db, context, true);
+			return NULL;
 		}
 		context->id = _mosquitto_strdup(client_id);
-		context->db_index = i;
 	}
 	if(last_mid){
 		context->last_mid = last_mid;
@@ -272,29 +257,15 @@ error:
 	return 1;
 }
 
-static int _db_subs_retain_write(struct mosquitto_db *db, FILE *db_fptr, struct _mosquitto_subhier *node, const char *topic)
+static int _db_subs_write(FILE *db_fptr, struct _mosquitto_subleaf *sub, const char *topic)
 {
-	struct _mosquitto_subhier *subhier;
-	struct _mosquitto_subleaf *sub;
-	char *thistopic;
 	uint32_t length;
 	uint16_t i16temp;
-	dbid_t i64temp;
 	size_t slen;
 
-	slen = strlen(topic) + strlen(node->topic) + 2;
-	thistopic = _mosquitto_malloc(sizeof(char)*slen);
-	if(!thistopic) return MOSQ_ERR_NOMEM;
-	if(strlen(topic)){
-		snprintf(thistopic, slen, "%s/%s", topic, node->topic);
-	}else{
-		snprintf(thistopic, slen, "%s", node->topic);
-	}
-
-	sub = node->subs;
 	while(sub){
 		if(sub->context->clean_session == false){
-			length = htonl(2+strlen(sub->context->id) + 2+strlen(thistopic) + sizeof(uint8_t));
+			length = htonl(2+strlen(sub->context->id) + 2+strlen(topic) + sizeof(uint8_t));
 
 			i16temp = htons(DB_CHUNK_SUB);
 			write_e(db_fptr, &i16temp, sizeof(uint16_t));
@@ -305,15 +276,71 @@ static int _db_subs_retain_write(struct mosquitto_db *db, FILE *db_fptr, struct
 			write_e(db_fptr, &i16temp, sizeof(uint16_t));
 			write_e(db_fptr, sub->context->id, slen);
 
-			slen = strlen(thistopic);
+			slen = strlen(topic);
 			i16temp = htons(slen);
 			write_e(db_fptr, &i16temp, sizeof(uint16_t));
-			write_e(db_fptr, thistopic, slen);
+			write_e(db_fptr, topic, slen);
 
 			write_e(db_fptr, &sub->qos, sizeof(uint8_t));
 		}
 		sub = sub->next;
 	}
+	return MOSQ_ERR_SUCCESS;
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+	return 1;
+}
+
+static int _db_subs_tree_write(struct mosquitto_db *db, FILE *db_fptr, struct _mosquitto_subhier *node, const char *topic)
+{
+	struct _mosquitto_subhier *subhier;
+	struct _mosquitto_subshared *shared;
+	char *thistopic;
+	char *sharedtopic;
+	size_t slen;
+
+	slen = strlen(topic) + strlen(node->topic) + 2;
+	thistopic = _mosquitto_malloc(sizeof(char)*slen);
+	if(!thistopic) return MOSQ_ERR_NOMEM;
+	if(strlen(topic)){
+		snprintf(thistopic, slen, "%s/%s", topic, node->topic);
+	}else{
+		snprintf(thistopic, slen, "%s", node->topic);
+	}
+
+	_db_subs_write(db_fptr, node->subs, thistopic);
+	shared = node->shared;
+	while(shared){
+		/* Saved in the same form as they were subscribed, so they are
+		 * restored into the same group. */
+		slen = strlen(MQTT3_SHARE_PREFIX) + strlen(shared->name) + 1 + strlen(thistopic) + 1;
+		sharedtopic = _mosquitto_malloc(slen);
+		if(!sharedtopic){
+			_mosquitto_free(thistopic);
+			return MOSQ_ERR_NOMEM;
+		}
+		snprintf(sharedtopic, slen, "%s%s/%s", MQTT3_SHARE_PREFIX, shared->name, thistopic);
+		_db_subs_write(db_fptr, shared->subs, sharedtopic);
+		_mosquitto_free(sharedtopic);
+		shared = shared->next;
+	}
+
+	subhier = node->children;
+	while(subhier){
+		_db_subs_tree_write(db, db_fptr, subhier, thistopic);
+		subhier = subhier->next;
+	}
+	_mosquitto_free(thistopic);
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int _db_retain_tree_write(struct mosquitto_db *db, FILE *db_fptr, struct _mosquitto_retainhier *node)
+{
+	struct _mosquitto_retainhier *retainhier;
+	uint32_t length;
+	uint16_t i16temp;
+	dbid_t i64temp;
+
 	if(node->retained){
 		if(strncmp(node->retained->msg.topic, "$SYS", 4)){
 			/* Don't save $SYS messages. */
@@ -328,12 +355,11 @@ static int _db_subs_retain_write(struct mosquitto_db *db, FILE *db_fptr, struct
 		}
 	}
 
-	subhier = node->children;
-	while(subhier){
-		_db_subs_retain_write(db, db_fptr, subhier, thistopic);
-		subhier = subhier->next;
+	retainhier = node->children;
+	while(retainhier){
+		if(_db_retain_tree_write(db, db_fptr, retainhier)) return 1;
+		retainhier = retainhier->next;
 	}
-	_mosquitto_free(thistopic);
 	return MOSQ_ERR_SUCCESS;
 error:
 	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
@@ -346,11 +372,10 @@ static int mqtt3_db_subs_retain_write(struct mosquitto_db *db, FILE *db_fptr)
 
 	subhier = db->subs.children;
 	while(subhier){
-		_db_subs_retain_write(db, db_fptr, subhier, "");
+		_db_subs_tree_write(db, db_fptr, subhier, "");
 		subhier = subhier->next;
 	}
-	
-	return MOSQ_ERR_SUCCESS;
+	return _db_retain_tree_write(db, db_fptr, &db->retains);
 }
 
 int mqtt3_db_backup(struct mosquitto_db *db, bool cleanup, bool shutdown)
@@ -440,7 +465,7 @@ static int _db_client_msg_restore(struct mosquitto_db *db, const char *client_id
 	struct mosquitto_msg_store *store;
 	struct mosquitto *context;
 
-	cmsg = _mosquitto_calloc(1, sizeof(struct mosquitto_client_msg));
+	cmsg = _mosquitto_pool_calloc(mosq_pt_client_msg, sizeof(struct mosquitto_client_msg));
 	if(!cmsg){
 		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
 		return MOSQ_ERR_NOMEM;
@@ -464,13 +489,13 @@ static int _db_client_msg_restore(struct mosquitto_db *db, const char *client_id
 		store = store->next;
 	}
 	if(!cmsg->store){
-		_mosquitto_free(cmsg);
+		_mosquitto_pool_free(mosq_pt_client_msg, cmsg);
 		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error restoring persistent database, message store corrupt.");
 		return 1;
 	}
 	context = _db_find_or_add_context(db, client_id, 0);
 	if(!context){
-		_mosquitto_free(cmsg);
+		_mosquitto_pool_free(mosq_pt_client_msg, cmsg);
 		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error restoring persistent database, message store corrupt.");
 		return 1;
 	}
@@ -40,8 +40,14 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <send_mosq.h>
 #include <util_mosq.h>
 
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
+
 #ifdef WITH_SYS_TREE
 extern uint64_t g_pub_bytes_received;
+extern struct _mqtt3_histogram g_publish_payload_size;
+extern unsigned long g_memory_refused;
 #endif
 
 int mqtt3_packet_handle(struct mosquitto_db *db, struct mosquitto *context)
@@ -98,11 +104,13 @@ int mqtt3_handle_publish(struct mosquitto_db *db, struct mosquitto *context)
 	struct mosquitto_msg_store *stored = NULL;
 	int len;
 	char *topic_mount;
+	bool tagged = false;
+	uint64_t origin_id = 0;
+	uint64_t origin_seq = 0;
 #ifdef WITH_BRIDGE
 	char *topic_temp;
-	int i;
-	struct _mqtt3_bridge_topic *cur_topic;
-	bool match;
+	const char *prefix = NULL;
+	const char *suffix;
 #endif
 
 	dup = (header & 0x08)>>3;
@@ -113,6 +121,7 @@ int mqtt3_handle_publish(struct mosquitto_db *db, struct mosquitto *context)
 		return 1;
 	}
 	retain = (header & 0x01);
+	context->has_published = true;
 
 	if(_mosquitto_read_string(&context->in_packet, &topic)) return 1;
 	if(strlen(topic) == 0){
@@ -124,50 +133,48 @@ int mqtt3_handle_publish(struct mosquitto_db *db, struct mosquitto *context)
 		_mosquitto_free(topic);
 		return 1;
 	}
-#ifdef WITH_BRIDGE
-	if(context->bridge && context->bridge->topics && context->bridge->topic_remapping){
-		for(i=0; i<context->bridge->topic_count; i++){
-			cur_topic = &context->bridge->topics[i];
-			if((cur_topic->direction == bd_both || cur_topic->direction == bd_in) 
-					&& (cur_topic->remote_prefix || cur_topic->local_prefix)){
-
-				/* Topic mapping required on this topic if the message matches */
-
-				rc = mosquitto_topic_matches_sub(cur_topic->remote_topic, topic, &match);
-				if(rc){
-					_mosquitto_free(topic);
-					return rc;
-				}
-				if(match){
-					if(cur_topic->remote_prefix){
-						/* This prefix needs removing. */
-						if(!strncmp(cur_topic->remote_prefix, topic, strlen(cur_topic->remote_prefix))){
-							topic_temp = _mosquitto_strdup(topic+strlen(cur_topic->remote_prefix));
-							if(!topic_temp){
-								_mosquitto_free(topic);
-								return MOSQ_ERR_NOMEM;
-							}
-							_mosquitto_free(topic);
-							topic = topic_temp;
-						}
-					}
-
-					if(cur_topic->local_prefix){
-						/* This prefix needs adding. */
-						len = strlen(topic) + strlen(cur_topic->local_prefix)+1;
-						topic_temp = _mosquitto_calloc(len+1, sizeof(char));
-						if(!topic_temp){
-							_mosquitto_free(topic);
-							return MOSQ_ERR_NOMEM;
-						}
-						snprintf(topic_temp, len, "%s%s", cur_topic->local_prefix, topic);
-						_mosquitto_free(topic);
-						topic = topic_temp;
-					}
-					break;
-				}
+	if(context->is_bridge && qos == 0 && !strcmp(topic, MQTT3_BATCH_TOPIC)){
+		/* A batch of messages from another mosquitto bridge. */
+		_mosquitto_free(topic);
+		payloadlen = context->in_packet.remaining_length - context->in_packet.pos;
+		return mqtt3_handle_batch(db, context, &context->in_packet.payload[context->in_packet.pos], payloadlen);
+	}
+	if(context->is_bridge && qos == 0 && !strcmp(topic, MQTT3_ORIGIN_TOPIC)){
+		/* The remote bridge will tag its messages with their origin, and
+		 * expects the same from us. */
+		_mosquitto_free(topic);
+		if(!context->origin_tagging){
+			if(!context->bridge && mosquitto_acl_check(db, context, MQTT3_ORIGIN_TOPIC, MOSQ_ACL_WRITE) != MOSQ_ERR_SUCCESS){
+				_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "Denied loop detection for bridge %s.", context->id);
+				return MOSQ_ERR_SUCCESS;
 			}
+			_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Bridge %s has loop detection enabled.", context->id);
+			context->origin_tagging = true;
+		}
+		return MOSQ_ERR_SUCCESS;
+	}
+	if(context->origin_tagging && !strncmp(topic, MQTT3_ORIGIN_PREFIX, strlen(MQTT3_ORIGIN_PREFIX))){
+		if(mqtt3_bridge_origin_strip(topic, &origin_id, &origin_seq)){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_INFO,
+					"Invalid origin tag in PUBLISH from %s, disconnecting.", context->id);
+			_mosquitto_free(topic);
+			return 1;
+		}
+		tagged = true;
+	}
+#ifdef WITH_BRIDGE
+	if(context->bridge && context->bridge->topic_remapping
+			&& mqtt3_bridge_remap(context->bridge, bd_in, topic, &prefix, &suffix)){
+
+		len = (prefix?strlen(prefix):0) + strlen(suffix) + 1;
+		topic_temp = _mosquitto_malloc(len);
+		if(!topic_temp){
+			_mosquitto_free(topic);
+			return MOSQ_ERR_NOMEM;
 		}
+		snprintf(topic_temp, len, "%s%s", prefix?prefix:"", suffix);
+		_mosquitto_free(topic);
+		topic = topic_temp;
 	}
 #endif
 	if(_mosquitto_topic_wildcard_len_check(topic) != MOSQ_ERR_SUCCESS){
@@ -186,7 +193,16 @@ int mqtt3_handle_publish(struct mosquitto_db *db, struct mosquitto *context)
 	payloadlen = context->in_packet.remaining_length - context->in_packet.pos;
 #ifdef WITH_SYS_TREE
 	g_pub_bytes_received += payloadlen;
+	mqtt3_histogram_record(&g_publish_payload_size, payloadlen);
+	if(db->config->top_count){
+		mqtt3_top_publish_record(db, context->id, topic, payloadlen);
+	}
 #endif
+	if(tagged && mqtt3_bridge_origin_seen(db, origin_id, origin_seq)){
+		/* Already received over another bridge, or sent by us. */
+		_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Dropped duplicate PUBLISH from %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", context->id, dup, qos, retain, mid, topic, (long)payloadlen);
+		goto process_bad_message;
+	}
 	if(context->listener && context->listener->mount_point){
 		len = strlen(context->listener->mount_point) + strlen(topic) + 1;
 		topic_mount = _mosquitto_calloc(len, sizeof(char));
@@ -238,6 +254,10 @@ int mqtt3_handle_publish(struct mosquitto_db *db, struct mosquitto *context)
 			if(payload) _mosquitto_free(payload);
 			return 1;
 		}
+		if(tagged){
+			stored->origin_id = origin_id;
+			stored->origin_seq = origin_seq;
+		}
 	}else{
 		dup = 1;
 	}
@@ -294,3 +314,179 @@ process_bad_message:
 	return 1;
 }
 
+/* Publish each of the messages in a batch sent by a mosquitto bridge, see
+ * MQTT3_BATCH_TOPIC. The messages are checked in the same way as if they had
+ * arrived in their own PUBLISH. */
+int mqtt3_handle_batch(struct mosquitto_db *db, struct mosquitto *context, const uint8_t *payload, uint32_t payloadlen)
+{
+	const uint8_t *records;
+	uint8_t *unpacked = NULL;
+	uint32_t len;
+	uint32_t pos;
+	uint16_t topiclen;
+	uint32_t msglen;
+	uint8_t flags;
+	int qos, retain;
+	char *topic;
+	uint64_t origin_id, origin_seq;
+	bool tagged;
+	struct mosquitto_msg_store *stored;
+	int mount_len = 0;
+	int count = 0;
+	int rc = MOSQ_ERR_SUCCESS;
+#ifdef WITH_ZLIB
+	z_stream strm;
+	int zrc;
+#endif
+
+	if(payloadlen < 1) return MOSQ_ERR_PROTOCOL;
+
+	if(db->config->memory_limit && mqtt3_db_memory_stage(db) == mosq_mls_refuse){
+		/* The batch only holds QoS 0 messages, so drop it rather than
+		 * unpacking it. */
+		_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Dropped message batch from %s, memory limit reached (%ld bytes)", context->id, (long)payloadlen);
+#ifdef WITH_SYS_TREE
+		g_memory_refused++;
+#endif
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	if(payload[0] & MQTT3_BATCH_ZLIB){
+#ifdef WITH_ZLIB
+		if(payloadlen < 5) return MOSQ_ERR_PROTOCOL;
+		len = ((uint32_t)payload[1]<<24) + ((uint32_t)payload[2]<<16) + ((uint32_t)payload[3]<<8) + payload[4];
+		if(len > MQTT3_BATCH_MAX){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Oversized message batch from %s, disconnecting.", context->id);
+			return MOSQ_ERR_PROTOCOL;
+		}
+
+		unpacked = _mosquitto_malloc_typed(len+1, mosq_mt_packets);
+		if(!unpacked) return MOSQ_ERR_NOMEM;
+
+		/* inflate() never writes more than the announced length, and the
+		 * batch is rejected unless it ends exactly there. */
+		memset(&strm, 0, sizeof(strm));
+		if(inflateInit(&strm) != Z_OK){
+			_mosquitto_free(unpacked);
+			return MOSQ_ERR_NOMEM;
+		}
+		strm.next_in = (Bytef *)&payload[5];
+		strm.avail_in = payloadlen-5;
+		strm.next_out = unpacked;
+		strm.avail_out = len;
+		zrc = inflate(&strm, Z_FINISH);
+		if(zrc != Z_STREAM_END || strm.total_out != len || strm.avail_in != 0){
+			inflateEnd(&strm);
+			_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Invalid message batch from %s, disconnecting.", context->id);
+			_mosquitto_free(unpacked);
+			return MOSQ_ERR_PROTOCOL;
+		}
+		inflateEnd(&strm);
+		records = unpacked;
+#else
+		_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Dropped compressed message batch from %s, zlib support not available.", context->id);
+		return MOSQ_ERR_SUCCESS;
+#endif
+	}else{
+		records = &payload[1];
+		len = payloadlen-1;
+		if(len > MQTT3_BATCH_MAX){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Oversized message batch from %s, disconnecting.", context->id);
+			return MOSQ_ERR_PROTOCOL;
+		}
+	}
+
+	if(context->listener && context->listener->mount_point){
+		mount_len = strlen(context->listener->mount_point);
+	}
+
+	pos = 0;
+	while(pos < len){
+		if(len - pos < 2){
+			rc = MOSQ_ERR_PROTOCOL;
+			break;
+		}
+		topiclen = (records[pos]<<8) + records[pos+1];
+		pos += 2;
+		if(topiclen == 0 || len - pos < (uint32_t)topiclen + 5){
+			rc = MOSQ_ERR_PROTOCOL;
+			break;
+		}
+		topic = _mosquitto_malloc(mount_len + topiclen + 1);
+		if(!topic){
+			rc = MOSQ_ERR_NOMEM;
+			break;
+		}
+		if(mount_len){
+			memcpy(topic, context->listener->mount_point, mount_len);
+		}
+		memcpy(&topic[mount_len], &records[pos], topiclen);
+		topic[mount_len + topiclen] = '\0';
+		pos += topiclen;
+
+		tagged = false;
+		if(context->origin_tagging && !strncmp(&topic[mount_len], MQTT3_ORIGIN_PREFIX, strlen(MQTT3_ORIGIN_PREFIX))){
+			if(mqtt3_bridge_origin_strip(&topic[mount_len], &origin_id, &origin_seq)){
+				_mosquitto_free(topic);
+				rc = MOSQ_ERR_PROTOCOL;
+				break;
+			}
+			tagged = true;
+		}
+
+		flags = records[pos];
+		msglen = ((uint32_t)records[pos+1]<<24) + ((uint32_t)records[pos+2]<<16) + ((uint32_t)records[pos+3]<<8) + records[pos+4];
+		pos += 5;
+		qos = (flags & 0x06)>>1;
+		retain = (flags & 0x01);
+		if(qos == 3 || len - pos < msglen
+				|| _mosquitto_topic_wildcard_len_check(&topic[mount_len]) != MOSQ_ERR_SUCCESS){
+
+			_mosquitto_free(topic);
+			rc = MOSQ_ERR_PROTOCOL;
+			break;
+		}
+#ifdef WITH_SYS_TREE
+		g_pub_bytes_received += msglen;
+		mqtt3_histogram_record(&g_publish_payload_size, msglen);
+		if(db->config->top_count){
+			mqtt3_top_publish_record(db, context->id, topic, msglen);
+		}
+#endif
+
+		if(tagged && mqtt3_bridge_origin_seen(db, origin_id, origin_seq)){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Dropped duplicate batched PUBLISH from %s (q%d, r%d, '%s', ... (%ld bytes))", context->id, qos, retain, topic, (long)msglen);
+		}else if(db->config->message_size_limit && msglen > db->config->message_size_limit){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Dropped too large batched PUBLISH from %s (q%d, r%d, '%s', ... (%ld bytes))", context->id, qos, retain, topic, (long)msglen);
+		}else if(mosquitto_acl_check(db, context, topic, MOSQ_ACL_WRITE) == MOSQ_ERR_SUCCESS){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Received batched PUBLISH from %s (q%d, r%d, '%s', ... (%ld bytes))", context->id, qos, retain, topic, (long)msglen);
+			if(mqtt3_db_message_store(db, context->id, 0, topic, qos, msglen, &records[pos], retain, &stored, 0)){
+				_mosquitto_free(topic);
+				rc = MOSQ_ERR_NOMEM;
+				break;
+			}
+			if(tagged){
+				stored->origin_id = origin_id;
+				stored->origin_seq = origin_seq;
+			}
+			if(mqtt3_db_messages_queue(db, context->id, topic, qos, retain, stored)){
+				_mosquitto_free(topic);
+				rc = MOSQ_ERR_NOMEM;
+				break;
+			}
+			count++;
+		}else{
+			_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Denied batched PUBLISH from %s (q%d, r%d, '%s', ... (%ld bytes))", context->id, qos, retain, topic, (long)msglen);
+		}
+		_mosquitto_free(topic);
+		pos += msglen;
+	}
+	if(rc == MOSQ_ERR_PROTOCOL){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Invalid message batch from %s, disconnecting.", context->id);
+	}else{
+		_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Received batch of %d messages from %s (%ld bytes)", count, context->id, (long)payloadlen);
+	}
+
+	if(unpacked) _mosquitto_free(unpacked);
+	return rc;
+}
@@ -87,6 +87,11 @@ int mqtt3_handle_connack(struct mosquitto_db *db, struct mosquitto *context)
 					}
 				}
 				for(i=0; i<context->bridge->topic_count; i++){
+					if(context->bridge->connection_index > 0){
+						/* Only the first parallel connection receives
+						 * messages from the remote broker. */
+						break;
+					}
 					if(context->bridge->topics[i].direction == bd_in || context->bridge->topics[i].direction == bd_both){
 						if(_mosquitto_send_subscribe(context, NULL, false, context->bridge->topics[i].remote_topic, context->bridge->topics[i].qos)){
 							return 1;
@@ -100,7 +105,17 @@ int mqtt3_handle_connack(struct mosquitto_db *db, struct mosquitto *context)
 						}
 					}
 				}
+				if(context->bridge->loop_detection && context->bridge->try_private_accepted){
+					if(mqtt3_bridge_origin_announce(db, context)){
+						return 1;
+					}
+				}
 			}
+#ifdef WITH_SYS_TREE
+			if(context->bridge){
+				context->bridge->traffic.connections_total++;
+			}
+#endif
 			context->state = mosq_cs_connected;
 			return MOSQ_ERR_SUCCESS;
 		case CONNACK_REFUSED_PROTOCOL_VERSION:
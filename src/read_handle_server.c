@@ -42,6 +42,10 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #ifdef WITH_SYS_TREE
 extern unsigned int g_connection_count;
+#  ifdef WITH_TLS
+extern unsigned long g_tls_handshakes_full;
+extern unsigned long g_tls_handshakes_resumed;
+#  endif
 #endif
 
 int mqtt3_handle_connect(struct mosquitto_db *db, struct mosquitto *context)
@@ -79,6 +83,17 @@ int mqtt3_handle_connect(struct mosquitto_db *db, struct mosquitto *context)
 		return MOSQ_ERR_PROTOCOL;
 	}
 
+#if defined(WITH_SYS_TREE) && defined(WITH_TLS)
+	/* The handshake is always complete by the time CONNECT can be read. */
+	if(context->ssl){
+		if(SSL_session_reused(context->ssl)){
+			g_tls_handshakes_resumed++;
+		}else{
+			g_tls_handshakes_full++;
+		}
+	}
+#endif
+
 	if(_mosquitto_read_string(&context->in_packet, &protocol_name)){
 		mqtt3_context_disconnect(db, context);
 		return 1;
@@ -345,7 +360,7 @@ int mqtt3_handle_connect(struct mosquitto_db *db, struct mosquitto *context)
 				goto handle_connect_error;
 			}
 			name_entry = X509_NAME_get_entry(name, i);
-			context->username = _mosquitto_strdup((char *)ASN1_STRING_data(name_entry->value));
+			context->username = _mosquitto_strdup((char *)ASN1_STRING_data(X509_NAME_ENTRY_get_data(name_entry)));
 			if(!context->username){
 				rc = MOSQ_ERR_SUCCESS;
 				goto handle_connect_error;
@@ -434,6 +449,7 @@ int mqtt3_handle_connect(struct mosquitto_db *db, struct mosquitto *context)
 	context->clean_session = clean_session;
 	context->ping_t = 0;
 	context->is_dropping = false;
+	context->origin_tagging = false;
 	if((protocol_version&0x80) == 0x80){
 		context->is_bridge = true;
 	}
@@ -449,11 +465,11 @@ int mqtt3_handle_connect(struct mosquitto_db *db, struct mosquitto *context)
 				msg_tail->store->ref_count--;
 				if(msg_prev){
 					msg_prev->next = msg_tail->next;
-					_mosquitto_free(msg_tail);
+					_mosquitto_pool_free(mosq_pt_client_msg, msg_tail);
 					msg_tail = msg_prev->next;
 				}else{
 					context->msgs = context->msgs->next;
-					_mosquitto_free(msg_tail);
+					_mosquitto_pool_free(mosq_pt_client_msg, msg_tail);
 					msg_tail = context->msgs;
 				}
 			}else{
@@ -585,6 +601,7 @@ int mqtt3_handle_subscribe(struct mosquitto_db *db, struct mosquitto *context)
 	uint32_t payloadlen = 0;
 	int len;
 	char *sub_mount;
+	const char *filter;
 
 	if(!context) return MOSQ_ERR_INVAL;
 	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Received SUBSCRIBE from %s", context->id);
@@ -640,7 +657,9 @@ int mqtt3_handle_subscribe(struct mosquitto_db *db, struct mosquitto *context)
 					if(payload) _mosquitto_free(payload);
 					return MOSQ_ERR_NOMEM;
 				}
-				snprintf(sub_mount, len, "%s%s", context->listener->mount_point, sub);
+				/* The mount point goes after the group of a shared subscription. */
+				filter = mqtt3_sub_filter(sub);
+				snprintf(sub_mount, len, "%.*s%s%s", (int)(filter - sub), sub, context->listener->mount_point, filter);
 				_mosquitto_free(sub);
 				sub = sub_mount;
 
@@ -678,7 +697,11 @@ int mqtt3_handle_subscribe(struct mosquitto_db *db, struct mosquitto *context)
 			if(qos != 0x80){
 				rc2 = mqtt3_sub_add(db, context, sub, qos, &db->subs);
 				if(rc2 == MOSQ_ERR_SUCCESS){
-					if(mqtt3_retain_queue(db, context, sub, qos)) rc = 1;
+					/* Retained messages aren't sent for shared subscriptions,
+					 * or each new member of a group would receive them. */
+					if(mqtt3_sub_filter(sub) == sub){
+						if(mqtt3_retain_queue(db, context, sub, qos)) rc = 1;
+					}
 				}else if(rc2 != -1){
 					rc = rc2;
 				}
@@ -752,6 +775,7 @@ int mqtt3_handle_unsubscribe(struct mosquitto_db *db, struct mosquitto *context)
 
 			_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "\t%s", sub);
 			mqtt3_sub_remove(db, context, sub, &db->subs);
+			mqtt3_retain_cursor_remove(context, sub);
 			_mosquitto_log_printf(NULL, MOSQ_LOG_UNSUBSCRIBE, "%s %s", context->id, sub);
 			_mosquitto_free(sub);
 		}
@@ -283,7 +283,7 @@ int mosquitto_acl_check_default(struct mosquitto_db *db, struct mosquitto *conte
 			ulen = 0;
 			len = tlen + acl_root->ccount*(clen-2);
 		}
-		local_acl = malloc(len+1);
+		local_acl = _mosquitto_malloc(len+1);
 		if(!local_acl) return 1; // FIXME
 		s = local_acl;
 		for(i=0; i<tlen; i++){
@@ -714,6 +714,13 @@ int mosquitto_security_apply_default(struct mosquitto_db *db)
 	if(db->contexts){
 		for(i=0; i<db->context_count; i++){
 			if(db->contexts[i]){
+#ifdef WITH_TLS_THREADS
+				if(db->contexts[i]->tls_handshake == mosq_th_queued){
+					/* Belongs to a handshake thread, and can't have sent a
+					 * CONNECT yet anyway. */
+					continue;
+				}
+#endif
 				/* Check for anonymous clients when allow_anonymous is false */
 				if(!allow_anonymous && !db->contexts[i]->username){
 					db->contexts[i]->state = mosq_cs_disconnecting;
@@ -773,7 +780,7 @@ int mosquitto_psk_key_get_default(struct mosquitto_db *db, const char *hint, con
 int _pw_digest(const char *password, const unsigned char *salt, unsigned int salt_len, unsigned char *hash, unsigned int *hash_len)
 {
 	const EVP_MD *digest;
-	EVP_MD_CTX context;
+	EVP_MD_CTX *context;
 
 	digest = EVP_get_digestbyname("sha512");
 	if(!digest){
@@ -781,13 +788,14 @@ int _pw_digest(const char *password, const unsigned char *salt, unsigned int sal
 		return 1;
 	}
 
-	EVP_MD_CTX_init(&context);
-	EVP_DigestInit_ex(&context, digest, NULL);
-	EVP_DigestUpdate(&context, password, strlen(password));
-	EVP_DigestUpdate(&context, salt, salt_len);
+	context = EVP_MD_CTX_create();
+	if(!context) return 1;
+	EVP_DigestInit_ex(context, digest, NULL);
+	EVP_DigestUpdate(context, password, strlen(password));
+	EVP_DigestUpdate(context, salt, salt_len);
 	/* hash is assumed to be EVP_MAX_MD_SIZE bytes long. */
-	EVP_DigestFinal_ex(&context, hash, hash_len);
-	EVP_MD_CTX_cleanup(&context);
+	EVP_DigestFinal_ex(context, hash, hash_len);
+	EVP_MD_CTX_destroy(context);
 
 	return MOSQ_ERR_SUCCESS;
 }
@@ -806,7 +814,7 @@ int _base64_decode(char *in, unsigned char **decoded, unsigned int *decoded_len)
 		BIO_free_all(bmem);
 		return 1;
 	}
-	*decoded = calloc(strlen(in), 1);
+	*decoded = _mosquitto_calloc(strlen(in), 1);
 	*decoded_len =  BIO_read(b64, *decoded, strlen(in));
 	BIO_free_all(bmem);
 
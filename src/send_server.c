@@ -47,14 +47,14 @@ int _mosquitto_send_connack(struct mosquitto *context, int result)
 		}
 	}
 
-	packet = _mosquitto_calloc(1, sizeof(struct _mosquitto_packet));
+	packet = _mosquitto_pool_calloc(mosq_pt_packet, sizeof(struct _mosquitto_packet));
 	if(!packet) return MOSQ_ERR_NOMEM;
 
 	packet->command = CONNACK;
 	packet->remaining_length = 2;
 	rc = _mosquitto_packet_alloc(packet);
 	if(rc){
-		_mosquitto_free(packet);
+		_mosquitto_pool_free(mosq_pt_packet, packet);
 		return rc;
 	}
 	packet->payload[packet->pos+0] = 0;
@@ -70,14 +70,14 @@ int _mosquitto_send_suback(struct mosquitto *context, uint16_t mid, uint32_t pay
 
 	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Sending SUBACK to %s", context->id);
 
-	packet = _mosquitto_calloc(1, sizeof(struct _mosquitto_packet));
+	packet = _mosquitto_pool_calloc(mosq_pt_packet, sizeof(struct _mosquitto_packet));
 	if(!packet) return MOSQ_ERR_NOMEM;
 
 	packet->command = SUBACK;
 	packet->remaining_length = 2+payloadlen;
 	rc = _mosquitto_packet_alloc(packet);
 	if(rc){
-		_mosquitto_free(packet);
+		_mosquitto_pool_free(mosq_pt_packet, packet);
 		return rc;
 	}
 	_mosquitto_write_uint16(packet, mid);
@@ -66,91 +66,166 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include <mosquitto_broker.h>
 #include <memory_mosq.h>
+#include <time_mosq.h>
 #include <util_mosq.h>
 
+#ifdef WITH_SYS_TREE
+extern unsigned long g_memory_refused;
+extern struct _mqtt3_histogram g_latency_queue;
+#endif
+
 struct _sub_token {
 	struct _sub_token *next;
 	char *topic;
 };
 
-static int _subs_process(struct mosquitto_db *db, struct _mosquitto_subhier *hier, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored, bool set_retain)
+/* Retained messages are accounted separately from the rest of the message
+ * store while they are held as the retained message for a topic. */
+static void _retain_account(struct mosquitto_msg_store *stored, bool retain)
+{
+	if(retain){
+		_mosquitto_memory_transfer(mosq_mt_messages, mosq_mt_retained, stored->mem_charged);
+	}else{
+		_mosquitto_memory_transfer(mosq_mt_retained, mosq_mt_messages, stored->mem_charged);
+	}
+}
+
+/* Returns MOSQ_ERR_SUCCESS if the message should be sent to this subscriber,
+ * MOSQ_ERR_ACL_DENIED if it should be skipped, or an error. */
+static int _subs_leaf_check(struct mosquitto_db *db, struct _mosquitto_subleaf *leaf, const char *source_id, const char *topic)
+{
+	if(leaf->context->is_bridge && !strcmp(leaf->context->id, source_id)){
+		return MOSQ_ERR_ACL_DENIED;
+	}
+#ifdef WITH_BRIDGE
+	if(leaf->shard && !mqtt3_bridge_shard_match(leaf->context->bridge, topic)){
+		/* Sent by another of this bridge's parallel connections. */
+		return MOSQ_ERR_ACL_DENIED;
+	}
+#endif
+	/* Check for ACL topic access. */
+	return mosquitto_acl_check(db, leaf->context, topic, MOSQ_ACL_READ);
+}
+
+static int _subs_send(struct mosquitto_db *db, struct _mosquitto_subleaf *leaf, int qos, int retain, struct mosquitto_msg_store *stored)
 {
-	int rc = 0;
-	int rc2;
 	int client_qos, msg_qos;
 	uint16_t mid;
-	struct _mosquitto_subleaf *leaf;
 	bool client_retain;
 
-	leaf = hier->subs;
+	client_qos = leaf->qos;
 
-	if(retain && set_retain){
-#ifdef WITH_PERSISTENCE
-		if(strncmp(topic, "$SYS", 4)){
-			/* Retained messages count as a persistence change, but only if
-			 * they aren't for $SYS. */
-			db->persistence_changes++;
-		}
-#endif
-		if(hier->retained){
-			hier->retained->ref_count--;
-			/* FIXME - it would be nice to be able to remove the message from the store at this point if ref_count == 0 */
-			db->retained_count--;
-		}
-		if(stored->msg.payloadlen){
-			hier->retained = stored;
-			hier->retained->ref_count++;
-			db->retained_count++;
+	if(db->config->upgrade_outgoing_qos){
+		msg_qos = client_qos;
+	}else{
+		if(qos > client_qos){
+			msg_qos = client_qos;
 		}else{
-			hier->retained = NULL;
+			msg_qos = qos;
 		}
 	}
-	while(source_id && leaf){
-		if(leaf->context->is_bridge && !strcmp(leaf->context->id, source_id)){
-			leaf = leaf->next;
-			continue;
-		}
-		/* Check for ACL topic access. */
-		rc2 = mosquitto_acl_check(db, leaf->context, topic, MOSQ_ACL_READ);
-		if(rc2 == MOSQ_ERR_ACL_DENIED){
-			leaf = leaf->next;
-			continue;
-		}else if(rc2 == MOSQ_ERR_SUCCESS){
-			client_qos = leaf->qos;
+	if(msg_qos){
+		mid = _mosquitto_mid_generate(leaf->context);
+	}else{
+		mid = 0;
+	}
+	if(leaf->context->is_bridge){
+		/* If we know the client is a bridge then we should set retain
+		 * even if the message is fresh. If we don't do this, retained
+		 * messages won't be propagated. */
+		client_retain = retain;
+	}else{
+		/* Client is not a bridge and this isn't a stale message so
+		 * retain should be false. */
+		client_retain = false;
+	}
+	return mqtt3_db_message_insert(db, leaf->context, mid, mosq_md_out, msg_qos, client_retain, stored);
+}
 
-			if(db->config->upgrade_outgoing_qos){
-				msg_qos = client_qos;
-			}else{
-				if(qos > client_qos){
-					msg_qos = client_qos;
-				}else{
-					msg_qos = qos;
-				}
-			}
-			if(msg_qos){
-				mid = _mosquitto_mid_generate(leaf->context);
-			}else{
-				mid = 0;
+/* Send the message to one member of a shared subscription group. Members
+ * that are connected are preferred over those with a persistent session that
+ * are not. Among those, shared_subscription_policy chooses either the next
+ * member after the one used last time, or the member with the fewest messages
+ * waiting. */
+static int _subs_shared_process(struct mosquitto_db *db, struct _mosquitto_subshared *shared, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored)
+{
+	struct _mosquitto_subleaf *leaf, *start, *best = NULL;
+	bool best_connected = false;
+	bool connected;
+	int rc;
+
+	start = shared->cursor ? shared->cursor : shared->subs;
+	leaf = start;
+	do{
+		rc = _subs_leaf_check(db, leaf, source_id, topic);
+		if(rc == MOSQ_ERR_SUCCESS){
+			connected = (leaf->context->sock != -1);
+			if(!best || (connected && !best_connected)
+					|| (connected == best_connected
+						&& db->config->shared_subscription_policy == ssp_least_queued
+						&& leaf->context->msg_count < best->context->msg_count)){
+
+				best = leaf;
+				best_connected = connected;
 			}
-			if(leaf->context->is_bridge){
-				/* If we know the client is a bridge then we should set retain
-				 * even if the message is fresh. If we don't do this, retained
-				 * messages won't be propagated. */
-				client_retain = retain;
-			}else{
-				/* Client is not a bridge and this isn't a stale message so
-				 * retain should be false. */
-				client_retain = false;
+			if(best_connected && db->config->shared_subscription_policy == ssp_round_robin){
+				break;
 			}
-			if(mqtt3_db_message_insert(db, leaf->context, mid, mosq_md_out, msg_qos, client_retain, stored) == 1) rc = 1;
-		}else{
+		}else if(rc != MOSQ_ERR_ACL_DENIED){
+			return 1; /* Application error */
+		}
+		leaf = leaf->next ? leaf->next : shared->subs;
+	}while(leaf != start);
+
+	if(!best) return MOSQ_ERR_SUCCESS;
+	shared->cursor = best->next;
+	if(_subs_send(db, best, qos, retain, stored) == 1) return 1;
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* fan_out is incremented for each subscriber that the message is sent to. */
+static int _subs_process(struct mosquitto_db *db, struct _mosquitto_subhier *hier, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored, int *fan_out)
+{
+	int rc = 0;
+	int rc2;
+	struct _mosquitto_subleaf *leaf;
+	struct _mosquitto_subshared *shared;
+
+	leaf = hier->subs;
+
+	while(source_id && leaf){
+		rc2 = _subs_leaf_check(db, leaf, source_id, topic);
+		if(rc2 == MOSQ_ERR_SUCCESS){
+			if(_subs_send(db, leaf, qos, retain, stored) == 1) rc = 1;
+			(*fan_out)++;
+		}else if(rc2 != MOSQ_ERR_ACL_DENIED){
 			return 1; /* Application error */
 		}
 		leaf = leaf->next;
 	}
+	shared = hier->shared;
+	while(source_id && shared){
+		rc2 = _subs_shared_process(db, shared, source_id, topic, qos, retain, stored);
+		if(rc2) rc = rc2;
+		(*fan_out)++;
+		shared = shared->next;
+	}
 	return rc;
 }
 
+/* Topic tokens only live for the duration of a single publish or
+ * subscribe, so are taken from the small buffer pools. */
+static char *_sub_token_dup(const char *topic, int len)
+{
+	char *token;
+
+	token = _mosquitto_buf_malloc(len+1, mosq_mt_subscriptions);
+	if(!token) return NULL;
+	memcpy(token, topic, len);
+	token[len] = '\0';
+	return token;
+}
+
 static int _sub_topic_tokenise(const char *subtopic, struct _sub_token **topics)
 {
 	struct _sub_token *new_topic, *tail = NULL;
@@ -162,10 +237,10 @@ static int _sub_topic_tokenise(const char *subtopic, struct _sub_token **topics)
 	assert(topics);
 
 	if(subtopic[0] != '$'){
-		new_topic = _mosquitto_malloc(sizeof(struct _sub_token));
+		new_topic = _mosquitto_pool_calloc(mosq_pt_sub_token, sizeof(struct _sub_token));
 		if(!new_topic) goto cleanup;
 		new_topic->next = NULL;
-		new_topic->topic = _mosquitto_strdup("");
+		new_topic->topic = _sub_token_dup("", 0);
 		if(!new_topic->topic) goto cleanup;
 
 		if(tail){
@@ -180,10 +255,10 @@ static int _sub_topic_tokenise(const char *subtopic, struct _sub_token **topics)
 	len = strlen(subtopic);
 
 	if(subtopic[0] == '/'){
-		new_topic = _mosquitto_malloc(sizeof(struct _sub_token));
+		new_topic = _mosquitto_pool_calloc(mosq_pt_sub_token, sizeof(struct _sub_token));
 		if(!new_topic) goto cleanup;
 		new_topic->next = NULL;
-		new_topic->topic = _mosquitto_strdup("");
+		new_topic->topic = _sub_token_dup("", 0);
 		if(!new_topic->topic) goto cleanup;
 
 		if(tail){
@@ -203,18 +278,17 @@ static int _sub_topic_tokenise(const char *subtopic, struct _sub_token **topics)
 	for(i=start; i<len+1; i++){
 		if(subtopic[i] == '/' || subtopic[i] == '\0'){
 			stop = i;
-			new_topic = _mosquitto_malloc(sizeof(struct _sub_token));
+			new_topic = _mosquitto_pool_calloc(mosq_pt_sub_token, sizeof(struct _sub_token));
 			if(!new_topic) goto cleanup;
 			new_topic->next = NULL;
 
 			if(start != stop){
-				tlen = stop-start + 1;
+				tlen = stop-start;
 
-				new_topic->topic = _mosquitto_calloc(tlen, sizeof(char));
+				new_topic->topic = _sub_token_dup(&subtopic[start], tlen);
 				if(!new_topic->topic) goto cleanup;
-				memcpy(new_topic->topic, &subtopic[start], tlen-1);
 			}else{
-				new_topic->topic = _mosquitto_strdup("");
+				new_topic->topic = _sub_token_dup("", 0);
 				if(!new_topic->topic) goto cleanup;
 			}
 			if(tail){
@@ -234,47 +308,118 @@ cleanup:
 	tail = *topics;
 	*topics = NULL;
 	while(tail){
-		if(tail->topic) _mosquitto_free(tail->topic);
+		if(tail->topic) _mosquitto_buf_free(tail->topic);
 		new_topic = tail->next;
-		_mosquitto_free(tail);
+		_mosquitto_pool_free(mosq_pt_sub_token, tail);
 		tail = new_topic;
 	}
 	return 1;
 }
 
-static int _sub_add(struct mosquitto_db *db, struct mosquitto *context, int qos, struct _mosquitto_subhier *subhier, struct _sub_token *tokens)
+static int _sub_leaf_add(struct mosquitto_db *db, struct mosquitto *context, int qos, bool shard, struct _mosquitto_subleaf **subs)
 {
-	struct _mosquitto_subhier *branch, *last = NULL;
 	struct _mosquitto_subleaf *leaf, *last_leaf;
 
+	leaf = *subs;
+	last_leaf = NULL;
+	while(leaf){
+		if(!strcmp(leaf->context->id, context->id)){
+			/* Client making a second subscription to same topic. Only
+			 * need to update QoS. Return -1 to indicate this to the
+			 * calling function. */
+			leaf->qos = qos;
+			leaf->shard = shard;
+			return -1;
+		}
+		last_leaf = leaf;
+		leaf = leaf->next;
+	}
+	leaf = _mosquitto_pool_calloc(mosq_pt_subleaf, sizeof(struct _mosquitto_subleaf));
+	if(!leaf) return MOSQ_ERR_NOMEM;
+	leaf->next = NULL;
+	leaf->context = context;
+	leaf->qos = qos;
+	leaf->shard = shard;
+	if(last_leaf){
+		last_leaf->next = leaf;
+		leaf->prev = last_leaf;
+	}else{
+		*subs = leaf;
+		leaf->prev = NULL;
+	}
+	db->subscription_count++;
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int _sub_shared_add(struct mosquitto_db *db, struct mosquitto *context, int qos, struct _mosquitto_subhier *subhier, const char *group)
+{
+	struct _mosquitto_subshared *shared;
+
+	shared = subhier->shared;
+	while(shared){
+		if(!strcmp(shared->name, group)){
+			return _sub_leaf_add(db, context, qos, false, &shared->subs);
+		}
+		shared = shared->next;
+	}
+	shared = _mosquitto_calloc_typed(1, sizeof(struct _mosquitto_subshared), mosq_mt_subscriptions);
+	if(!shared) return MOSQ_ERR_NOMEM;
+	shared->name = _mosquitto_strdup_typed(group, mosq_mt_subscriptions);
+	if(!shared->name){
+		_mosquitto_free(shared);
+		return MOSQ_ERR_NOMEM;
+	}
+	shared->next = subhier->shared;
+	subhier->shared = shared;
+	return _sub_leaf_add(db, context, qos, false, &shared->subs);
+}
+
+static void _sub_shared_free(struct _mosquitto_subhier *subhier, struct _mosquitto_subshared *shared)
+{
+	struct _mosquitto_subshared *prev;
+
+	if(subhier->shared == shared){
+		subhier->shared = shared->next;
+	}else{
+		prev = subhier->shared;
+		while(prev->next != shared){
+			prev = prev->next;
+		}
+		prev->next = shared->next;
+	}
+	_mosquitto_free(shared->name);
+	_mosquitto_free(shared);
+}
+
+/* Remove leaf from a list of subscribers. cursor, if given, is moved off the
+ * leaf first. */
+static void _sub_leaf_remove(struct mosquitto_db *db, struct _mosquitto_subleaf **subs, struct _mosquitto_subleaf *leaf, struct _mosquitto_subleaf **cursor)
+{
+	db->subscription_count--;
+	if(cursor && *cursor == leaf){
+		*cursor = leaf->next;
+	}
+	if(leaf->prev){
+		leaf->prev->next = leaf->next;
+	}else{
+		*subs = leaf->next;
+	}
+	if(leaf->next){
+		leaf->next->prev = leaf->prev;
+	}
+	_mosquitto_pool_free(mosq_pt_subleaf, leaf);
+}
+
+static int _sub_add(struct mosquitto_db *db, struct mosquitto *context, int qos, bool shard, struct _mosquitto_subhier *subhier, struct _sub_token *tokens, const char *group)
+{
+	struct _mosquitto_subhier *branch, *last = NULL;
+
 	if(!tokens){
 		if(context){
-			leaf = subhier->subs;
-			last_leaf = NULL;
-			while(leaf){
-				if(!strcmp(leaf->context->id, context->id)){
-					/* Client making a second subscription to same topic. Only
-					 * need to update QoS. Return -1 to indicate this to the
-					 * calling function. */
-					leaf->qos = qos;
-					return -1;
-				}
-				last_leaf = leaf;
-				leaf = leaf->next;
+			if(group){
+				return _sub_shared_add(db, context, qos, subhier, group);
 			}
-			leaf = _mosquitto_malloc(sizeof(struct _mosquitto_subleaf));
-			if(!leaf) return MOSQ_ERR_NOMEM;
-			leaf->next = NULL;
-			leaf->context = context;
-			leaf->qos = qos;
-			if(last_leaf){
-				last_leaf->next = leaf;
-				leaf->prev = last_leaf;
-			}else{
-				subhier->subs = leaf;
-				leaf->prev = NULL;
-			}
-			db->subscription_count++;
+			return _sub_leaf_add(db, context, qos, shard, &subhier->subs);
 		}
 		return MOSQ_ERR_SUCCESS;
 	}
@@ -282,15 +427,15 @@ static int _sub_add(struct mosquitto_db *db, struct mosquitto *context, int qos,
 	branch = subhier->children;
 	while(branch){
 		if(!strcmp(branch->topic, tokens->topic)){
-			return _sub_add(db, context, qos, branch, tokens->next);
+			return _sub_add(db, context, qos, shard, branch, tokens->next, group);
 		}
 		last = branch;
 		branch = branch->next;
 	}
 	/* Not found */
-	branch = _mosquitto_calloc(1, sizeof(struct _mosquitto_subhier));
+	branch = _mosquitto_calloc_typed(1, sizeof(struct _mosquitto_subhier), mosq_mt_subscriptions);
 	if(!branch) return MOSQ_ERR_NOMEM;
-	branch->topic = _mosquitto_strdup(tokens->topic);
+	branch->topic = _mosquitto_strdup_typed(tokens->topic, mosq_mt_subscriptions);
 	if(!branch->topic){
 		_mosquitto_free(branch);
 		return MOSQ_ERR_NOMEM;
@@ -300,28 +445,40 @@ static int _sub_add(struct mosquitto_db *db, struct mosquitto *context, int qos,
 	}else{
 		last->next = branch;
 	}
-	return _sub_add(db, context, qos, branch, tokens->next);
+	return _sub_add(db, context, qos, shard, branch, tokens->next, group);
 }
 
-static int _sub_remove(struct mosquitto_db *db, struct mosquitto *context, struct _mosquitto_subhier *subhier, struct _sub_token *tokens)
+static int _sub_remove(struct mosquitto_db *db, struct mosquitto *context, struct _mosquitto_subhier *subhier, struct _sub_token *tokens, const char *group)
 {
 	struct _mosquitto_subhier *branch, *last = NULL;
+	struct _mosquitto_subshared *shared;
 	struct _mosquitto_subleaf *leaf;
 
 	if(!tokens){
+		if(group){
+			shared = subhier->shared;
+			while(shared && strcmp(shared->name, group)){
+				shared = shared->next;
+			}
+			if(!shared) return MOSQ_ERR_SUCCESS;
+
+			leaf = shared->subs;
+			while(leaf){
+				if(leaf->context==context){
+					_sub_leaf_remove(db, &shared->subs, leaf, &shared->cursor);
+					if(!shared->subs){
+						_sub_shared_free(subhier, shared);
+					}
+					return MOSQ_ERR_SUCCESS;
+				}
+				leaf = leaf->next;
+			}
+			return MOSQ_ERR_SUCCESS;
+		}
 		leaf = subhier->subs;
 		while(leaf){
 			if(leaf->context==context){
-				db->subscription_count--;
-				if(leaf->prev){
-					leaf->prev->next = leaf->next;
-				}else{
-					subhier->subs = leaf->next;
-				}
-				if(leaf->next){
-					leaf->next->prev = leaf->prev;
-				}
-				_mosquitto_free(leaf);
+				_sub_leaf_remove(db, &subhier->subs, leaf, NULL);
 				return MOSQ_ERR_SUCCESS;
 			}
 			leaf = leaf->next;
@@ -332,8 +489,8 @@ static int _sub_remove(struct mosquitto_db *db, struct mosquitto *context, struc
 	branch = subhier->children;
 	while(branch){
 		if(!strcmp(branch->topic, tokens->topic)){
-			_sub_remove(db, context, branch, tokens->next);
-			if(!branch->children && !branch->subs && !branch->retained){
+			_sub_remove(db, context, branch, tokens->next, group);
+			if(!branch->children && !branch->subs && !branch->shared){
 				if(last){
 					last->next = branch->next;
 				}else{
@@ -350,71 +507,105 @@ static int _sub_remove(struct mosquitto_db *db, struct mosquitto *context, struc
 	return MOSQ_ERR_SUCCESS;
 }
 
-static void _sub_search(struct mosquitto_db *db, struct _mosquitto_subhier *subhier, struct _sub_token *tokens, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored, bool set_retain)
+static void _sub_search(struct mosquitto_db *db, struct _mosquitto_subhier *subhier, struct _sub_token *tokens, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored, int *fan_out)
 {
 	/* FIXME - need to take into account source_id if the client is a bridge */
 	struct _mosquitto_subhier *branch;
-	bool sr;
 
 	branch = subhier->children;
 	while(branch){
-		sr = set_retain;
-
 		if(tokens && tokens->topic && (!strcmp(branch->topic, tokens->topic) || !strcmp(branch->topic, "+"))){
 			/* The topic matches this subscription.
 			 * Doesn't include # wildcards */
-			if(!strcmp(branch->topic, "+")){
-				/* Don't set a retained message where + is in the hierarchy. */
-				sr = false;
-			}
-			_sub_search(db, branch, tokens->next, source_id, topic, qos, retain, stored, sr);
+			_sub_search(db, branch, tokens->next, source_id, topic, qos, retain, stored, fan_out);
 			if(!tokens->next){
-				_subs_process(db, branch, source_id, topic, qos, retain, stored, sr);
+				_subs_process(db, branch, source_id, topic, qos, retain, stored, fan_out);
 			}
 		}else if(!strcmp(branch->topic, "#") && !branch->children){
 			/* The topic matches due to a # wildcard - process the
 			 * subscriptions but *don't* return. Although this branch has ended
 			 * there may still be other subscriptions to deal with.
 			 */
-			_subs_process(db, branch, source_id, topic, qos, retain, stored, false);
+			_subs_process(db, branch, source_id, topic, qos, retain, stored, fan_out);
 		}
 		branch = branch->next;
 	}
 }
 
-int mqtt3_sub_add(struct mosquitto_db *db, struct mosquitto *context, const char *sub, int qos, struct _mosquitto_subhier *root)
+/* Return the topic filter of a subscription. This is sub itself, or the part
+ * after the group name for a $share/<group>/<filter> subscription. Anything
+ * else starting with $share/ is treated as an ordinary subscription. */
+const char *mqtt3_sub_filter(const char *sub)
+{
+	const char *name;
+	const char *slash;
+
+	if(strncmp(sub, MQTT3_SHARE_PREFIX, strlen(MQTT3_SHARE_PREFIX))){
+		return sub;
+	}
+	name = sub + strlen(MQTT3_SHARE_PREFIX);
+	slash = strchr(name, '/');
+	if(!slash || slash == name || slash[1] == '\0'){
+		return sub;
+	}
+	return slash+1;
+}
+
+/* Split sub into its topic filter and, for a shared subscription, a copy of
+ * its group name that must be freed with _mosquitto_buf_free(). */
+static int _sub_shared_split(const char *sub, char **group, const char **filter)
+{
+	const char *name;
+
+	*group = NULL;
+	*filter = mqtt3_sub_filter(sub);
+	if(*filter == sub) return MOSQ_ERR_SUCCESS;
+
+	name = sub + strlen(MQTT3_SHARE_PREFIX);
+	*group = _sub_token_dup(name, *filter - name - 1);
+	if(!*group) return MOSQ_ERR_NOMEM;
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int _sub_add_topic(struct mosquitto_db *db, struct mosquitto *context, const char *sub, int qos, bool shard, struct _mosquitto_subhier *root)
 {
 	int rc = 0;
 	struct _mosquitto_subhier *subhier, *child;
 	struct _sub_token *tokens = NULL, *tail;
+	char *group;
 
 	assert(root);
 	assert(sub);
 
-	if(_sub_topic_tokenise(sub, &tokens)) return 1;
+	rc = _sub_shared_split(sub, &group, &sub);
+	if(rc) return rc;
+	if(_sub_topic_tokenise(sub, &tokens)){
+		if(group) _mosquitto_buf_free(group);
+		return 1;
+	}
 
 	subhier = root->children;
 	while(subhier){
 		if(!strcmp(subhier->topic, tokens->topic)){
-			rc = _sub_add(db, context, qos, subhier, tokens);
+			rc = _sub_add(db, context, qos, shard, subhier, tokens, group);
 			break;
 		}
 		subhier = subhier->next;
 	}
 	if(!subhier){
-		child = _mosquitto_malloc(sizeof(struct _mosquitto_subhier));
+		child = _mosquitto_calloc_typed(1, sizeof(struct _mosquitto_subhier), mosq_mt_subscriptions);
 		if(!child){
 			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-			return MOSQ_ERR_NOMEM;
+			rc = MOSQ_ERR_NOMEM;
+			goto cleanup;
 		}
-		child->topic = _mosquitto_strdup(tokens->topic);
+		child->topic = _mosquitto_strdup_typed(tokens->topic, mosq_mt_subscriptions);
 		if(!child->topic){
+			_mosquitto_free(child);
 			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-			return MOSQ_ERR_NOMEM;
+			rc = MOSQ_ERR_NOMEM;
+			goto cleanup;
 		}
-		child->subs = NULL;
-		child->children = NULL;
-		child->retained = NULL;
 		if(db->subs.children){
 			child->next = db->subs.children;
 		}else{
@@ -422,13 +613,15 @@ int mqtt3_sub_add(struct mosquitto_db *db, struct mosquitto *context, const char
 		}
 		db->subs.children = child;
 
-		rc = _sub_add(db, context, qos, child, tokens);
+		rc = _sub_add(db, context, qos, shard, child, tokens, group);
 	}
 
+cleanup:
+	if(group) _mosquitto_buf_free(group);
 	while(tokens){
 		tail = tokens->next;
-		_mosquitto_free(tokens->topic);
-		_mosquitto_free(tokens);
+		_mosquitto_buf_free(tokens->topic);
+		_mosquitto_pool_free(mosq_pt_sub_token, tokens);
 		tokens = tail;
 	}
 	/* We aren't worried about -1 (already subscribed) return codes. */
@@ -436,102 +629,341 @@ int mqtt3_sub_add(struct mosquitto_db *db, struct mosquitto *context, const char
 	return rc;
 }
 
+int mqtt3_sub_add(struct mosquitto_db *db, struct mosquitto *context, const char *sub, int qos, struct _mosquitto_subhier *root)
+{
+	return _sub_add_topic(db, context, sub, qos, false, root);
+}
+
+/* Add a subscription for one of a bridge's parallel connections that only
+ * receives the topics mqtt3_bridge_shard_match() assigns to it. */
+int mqtt3_sub_add_sharded(struct mosquitto_db *db, struct mosquitto *context, const char *sub, int qos, struct _mosquitto_subhier *root)
+{
+	return _sub_add_topic(db, context, sub, qos, true, root);
+}
+
 int mqtt3_sub_remove(struct mosquitto_db *db, struct mosquitto *context, const char *sub, struct _mosquitto_subhier *root)
 {
 	int rc = 0;
 	struct _mosquitto_subhier *subhier;
 	struct _sub_token *tokens = NULL, *tail;
+	char *group;
 
 	assert(root);
 	assert(sub);
 
-	if(_sub_topic_tokenise(sub, &tokens)) return 1;
+	rc = _sub_shared_split(sub, &group, &sub);
+	if(rc) return rc;
+	if(_sub_topic_tokenise(sub, &tokens)){
+		if(group) _mosquitto_buf_free(group);
+		return 1;
+	}
 
 	subhier = root->children;
 	while(subhier){
 		if(!strcmp(subhier->topic, tokens->topic)){
-			rc = _sub_remove(db, context, subhier, tokens);
+			rc = _sub_remove(db, context, subhier, tokens, group);
 			break;
 		}
 		subhier = subhier->next;
 	}
+	if(group) _mosquitto_buf_free(group);
 
 	while(tokens){
 		tail = tokens->next;
-		_mosquitto_free(tokens->topic);
-		_mosquitto_free(tokens);
+		_mosquitto_buf_free(tokens->topic);
+		_mosquitto_pool_free(mosq_pt_sub_token, tokens);
 		tokens = tail;
 	}
 
 	return rc;
 }
 
+/* Set or clear the retained message on the node for tokens, creating the
+ * branch if needed. Branches left with no retained message and no children
+ * are removed on the way back up. */
+static int _retain_node_set(struct mosquitto_db *db, struct _mosquitto_retainhier *parent, struct _sub_token *tokens, struct mosquitto_msg_store *stored)
+{
+	struct _mosquitto_retainhier *branch, *last = NULL;
+	int rc = MOSQ_ERR_SUCCESS;
+
+	branch = parent->children;
+	while(branch){
+		if(!strcmp(branch->topic, tokens->topic)) break;
+		last = branch;
+		branch = branch->next;
+	}
+	if(!branch){
+		if(!stored->msg.payloadlen) return MOSQ_ERR_SUCCESS;
+
+		branch = _mosquitto_calloc_typed(1, sizeof(struct _mosquitto_retainhier), mosq_mt_retained);
+		if(!branch) return MOSQ_ERR_NOMEM;
+		branch->topic = _mosquitto_strdup_typed(tokens->topic, mosq_mt_retained);
+		if(!branch->topic){
+			_mosquitto_free(branch);
+			return MOSQ_ERR_NOMEM;
+		}
+		branch->next = parent->children;
+		parent->children = branch;
+		last = NULL;
+	}
+
+	if(tokens->next){
+		rc = _retain_node_set(db, branch, tokens->next, stored);
+	}else{
+		if(branch->retained){
+			branch->retained->ref_count--;
+			/* FIXME - it would be nice to be able to remove the message from the store at this point if ref_count == 0 */
+			db->retained_count--;
+			_retain_account(branch->retained, false);
+			branch->retained->retained = false;
+			branch->retained = NULL;
+		}
+		if(stored->msg.payloadlen){
+			branch->retained = stored;
+			branch->retained->retained = true;
+			branch->retained->ref_count++;
+			db->retained_count++;
+			_retain_account(branch->retained, true);
+		}
+	}
+
+	if(!branch->children && !branch->retained){
+		if(last){
+			last->next = branch->next;
+		}else{
+			parent->children = branch->next;
+		}
+		_mosquitto_free(branch->topic);
+		_mosquitto_free(branch);
+	}
+	return rc;
+}
+
+static int _retain_store(struct mosquitto_db *db, struct _sub_token *tokens, const char *topic, struct mosquitto_msg_store *stored)
+{
+	if(stored->msg.payloadlen
+			&& db->config->memory_limit && mqtt3_db_memory_stage(db) == mosq_mls_refuse){
+
+		/* Don't take on any more retained messages, but still allow existing
+		 * ones to be cleared. */
+#ifdef WITH_SYS_TREE
+		g_memory_refused++;
+#endif
+		return MOSQ_ERR_SUCCESS;
+	}
+#ifdef WITH_PERSISTENCE
+	if(strncmp(topic, "$SYS", 4)){
+		/* Retained messages count as a persistence change, but only if
+		 * they aren't for $SYS. */
+		db->persistence_changes++;
+	}
+#endif
+	return _retain_node_set(db, &db->retains, tokens, stored);
+}
+
+static void _sub_tokens_free(struct _sub_token *tokens)
+{
+	struct _sub_token *tail;
+
+	while(tokens){
+		tail = tokens->next;
+		_mosquitto_buf_free(tokens->topic);
+		_mosquitto_pool_free(mosq_pt_sub_token, tokens);
+		tokens = tail;
+	}
+}
+
 int mqtt3_db_messages_queue(struct mosquitto_db *db, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored)
 {
 	int rc = 0;
 	struct _mosquitto_subhier *subhier;
-	struct _sub_token *tokens = NULL, *tail;
+	struct _sub_token *tokens = NULL;
+	/* Kept here rather than in a static, because queueing a message can
+	 * queue another one, such as a log message for a topic. */
+	int fan_out = 0;
+#ifdef WITH_SYS_TREE
+	uint64_t start = mosquitto_time_us();
+#endif
 
 	assert(db);
 	assert(topic);
 
 	if(_sub_topic_tokenise(topic, &tokens)) return 1;
 
+	if(retain){
+		rc = _retain_store(db, tokens, topic, stored);
+	}
+
 	subhier = db->subs.children;
 	while(subhier){
 		if(!strcmp(subhier->topic, tokens->topic)){
-			if(retain){
-				/* We have a message that needs to be retained, so ensure that the subscription
-				 * tree for its topic exists.
-				 */
-				_sub_add(db, NULL, 0, subhier, tokens);
-			}
-			_sub_search(db, subhier, tokens, source_id, topic, qos, retain, stored, true);
+			_sub_search(db, subhier, tokens, source_id, topic, qos, retain, stored, &fan_out);
 		}
 		subhier = subhier->next;
 	}
-	while(tokens){
-		tail = tokens->next;
-		_mosquitto_free(tokens->topic);
-		_mosquitto_free(tokens);
-		tokens = tail;
+	_sub_tokens_free(tokens);
+#ifdef WITH_SYS_TREE
+	mqtt3_histogram_record(&g_latency_queue, mosquitto_time_us() - start);
+	if(db->config->top_count && fan_out){
+		mqtt3_top_fan_out_record(db, topic, fan_out);
 	}
+#endif
 
 	return rc;
 }
 
+#ifdef WITH_SYS_TREE
+/* Replace the payload of a retained message that nothing but its topic and
+ * its $SYS metric refers to. */
+static int _sys_store_update(struct mosquitto_db *db, struct mosquitto_msg_store *stored, uint32_t payloadlen, const void *payload)
+{
+	void *new_payload;
+	int i;
+
+	if(stored->msg.payloadlen != payloadlen){
+		new_payload = _mosquitto_buf_malloc(payloadlen, mosq_mt_messages);
+		if(!new_payload) return MOSQ_ERR_NOMEM;
+
+		_retain_account(stored, false);
+		_mosquitto_buf_free(stored->msg.payload);
+		stored->msg.payload = new_payload;
+		stored->msg.payloadlen = payloadlen;
+		mqtt3_db_message_store_charged(stored);
+		_retain_account(stored, true);
+	}
+	memcpy(stored->msg.payload, payload, payloadlen);
+	/* This is a new message as far as clients are concerned, so forget who
+	 * the old one was sent to. Otherwise allow_duplicate_messages false
+	 * would stop every update after the first reaching a subscriber. */
+	if(stored->dest_ids){
+		for(i=0; i<stored->dest_id_count; i++){
+			if(stored->dest_ids[i]) _mosquitto_free(stored->dest_ids[i]);
+		}
+		_mosquitto_free(stored->dest_ids);
+		stored->dest_ids = NULL;
+	}
+	stored->dest_id_count = 0;
+	/* Bridges with loop_detection would otherwise take this as a message
+	 * they have already seen. */
+	stored->origin_seq = ++db->origin_seq;
+	stored->store_time = mosquitto_time_us();
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Publish a retained QoS 2 message for the $SYS tree. This does the same as
+ * mqtt3_db_messages_easy_queue(), but is cheaper for topics that are
+ * published again and again: the topic is only tokenised the first time, the
+ * retained message is updated in place unless a client still has it queued,
+ * and the subscription tree is only searched if anyone is subscribed to
+ * anything under $SYS. */
+int mqtt3_sys_publish(struct mosquitto_db *db, const char *topic, uint32_t payloadlen, const void *payload)
+{
+	struct _mosquitto_sys_metric *metric;
+	struct _mosquitto_subhier *subhier;
+	struct mosquitto_msg_store *stored;
+	int fan_out = 0;
+	int rc;
+
+	assert(db);
+	assert(topic);
+
+	HASH_FIND_STR(db->sys_metrics, topic, metric);
+	if(!metric){
+		metric = _mosquitto_calloc(1, sizeof(struct _mosquitto_sys_metric));
+		if(!metric) return MOSQ_ERR_NOMEM;
+		metric->topic = _mosquitto_strdup(topic);
+		if(!metric->topic || _sub_topic_tokenise(topic, &metric->tokens)){
+			if(metric->topic) _mosquitto_free(metric->topic);
+			_mosquitto_free(metric);
+			return MOSQ_ERR_NOMEM;
+		}
+		HASH_ADD_KEYPTR(hh, db->sys_metrics, metric->topic, strlen(metric->topic), metric);
+	}
+
+	stored = metric->stored;
+	if(stored && stored->retained && stored->ref_count == 2 && payloadlen){
+		rc = _sys_store_update(db, stored, payloadlen, payload);
+		if(rc) return rc;
+	}else{
+		if(stored){
+			stored->ref_count--;
+			metric->stored = NULL;
+		}
+		if(mqtt3_db_message_store(db, "", 0, topic, 2, payloadlen, payload, 1, &stored, 0)) return 1;
+		rc = _retain_store(db, metric->tokens, topic, stored);
+		if(rc) return rc;
+		stored->ref_count++;
+		metric->stored = stored;
+	}
+
+	subhier = db->subs.children;
+	while(subhier){
+		if(!strcmp(subhier->topic, metric->tokens->topic)){
+			if(subhier->children){
+				_sub_search(db, subhier, metric->tokens, "", topic, 2, 1, stored, &fan_out);
+			}
+			break;
+		}
+		subhier = subhier->next;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+void mqtt3_sys_metrics_cleanup(struct mosquitto_db *db)
+{
+	struct _mosquitto_sys_metric *metric, *metric_tmp;
+
+	HASH_ITER(hh, db->sys_metrics, metric, metric_tmp){
+		HASH_DELETE(hh, db->sys_metrics, metric);
+		if(metric->stored){
+			metric->stored->ref_count--;
+		}
+		_sub_tokens_free(metric->tokens);
+		_mosquitto_free(metric->topic);
+		_mosquitto_free(metric);
+	}
+}
+#endif
+
 static int _subs_clean_session(struct mosquitto_db *db, struct mosquitto *context, struct _mosquitto_subhier *root)
 {
 	int rc = 0;
 	struct _mosquitto_subhier *child, *last = NULL;
 	struct _mosquitto_subleaf *leaf, *next;
+	struct _mosquitto_subshared *shared, *next_shared;
 
 	if(!root) return MOSQ_ERR_SUCCESS;
 
 	leaf = root->subs;
 	while(leaf){
+		next = leaf->next;
 		if(leaf->context == context){
-			db->subscription_count--;
-			if(leaf->prev){
-				leaf->prev->next = leaf->next;
-			}else{
-				root->subs = leaf->next;
-			}
-			if(leaf->next){
-				leaf->next->prev = leaf->prev;
-			}
+			_sub_leaf_remove(db, &root->subs, leaf, NULL);
+		}
+		leaf = next;
+	}
+
+	shared = root->shared;
+	while(shared){
+		next_shared = shared->next;
+		leaf = shared->subs;
+		while(leaf){
 			next = leaf->next;
-			_mosquitto_free(leaf);
+			if(leaf->context == context){
+				_sub_leaf_remove(db, &shared->subs, leaf, &shared->cursor);
+			}
 			leaf = next;
-		}else{
-			leaf = leaf->next;
 		}
+		if(!shared->subs){
+			_sub_shared_free(root, shared);
+		}
+		shared = next_shared;
 	}
 
 	child = root->children;
 	while(child){
 		_subs_clean_session(db, context, child);
-		if(!child->children && !child->subs && !child->retained){
+		if(!child->children && !child->subs && !child->shared){
 			if(last){
 				last->next = child->next;
 			}else{
@@ -572,6 +1004,7 @@ void mqtt3_sub_tree_print(struct _mosquitto_subhier *root, int level)
 	int i;
 	struct _mosquitto_subhier *branch;
 	struct _mosquitto_subleaf *leaf;
+	struct _mosquitto_subshared *shared;
 
 	for(i=0; i<level*2; i++){
 		printf(" ");
@@ -586,8 +1019,14 @@ void mqtt3_sub_tree_print(struct _mosquitto_subhier *root, int level)
 		}
 		leaf = leaf->next;
 	}
-	if(root->retained){
-		printf(" (r)");
+	shared = root->shared;
+	while(shared){
+		leaf = shared->subs;
+		while(leaf){
+			printf(" (%s%s, %s, %d)", MQTT3_SHARE_PREFIX, shared->name, leaf->context->id, leaf->qos);
+			leaf = leaf->next;
+		}
+		shared = shared->next;
 	}
 	printf("\n");
 
@@ -622,75 +1061,201 @@ static int _retain_process(struct mosquitto_db *db, struct mosquitto_msg_store *
 	return mqtt3_db_message_insert(db, context, mid, mosq_md_out, qos, true, retained);
 }
 
-static int _retain_search(struct mosquitto_db *db, struct _mosquitto_subhier *subhier, struct _sub_token *tokens, struct mosquitto *context, const char *sub, int sub_qos, int level)
+static void _retain_cursor_free(struct _mosquitto_retain_cursor *cursor)
 {
-	struct _mosquitto_subhier *branch;
-	int flag = 0;
+	int i;
 
-	branch = subhier->children;
-	while(branch){
-		/* Subscriptions with wildcards in aren't really valid topics to publish to
-		 * so they can't have retained messages.
-		 */
+	for(i=cursor->pos; i<cursor->count; i++){
+		cursor->stores[i]->ref_count--;
+	}
+	if(cursor->stores) _mosquitto_free(cursor->stores);
+	_mosquitto_free(cursor->sub);
+	_mosquitto_free(cursor);
+}
+
+/* Send a matching retained message now if there is no cursor, or add it to
+ * the cursor to be sent later. Only running out of memory is an error; a
+ * message that can't be sent to this client is skipped. */
+static int _retain_match(struct mosquitto_db *db, struct mosquitto_msg_store *retained, struct mosquitto *context, struct _mosquitto_retain_cursor *cursor, const char *sub, int sub_qos)
+{
+	struct mosquitto_msg_store **stores;
+	int alloc;
+
+	if(!cursor){
+		if(_retain_process(db, retained, context, sub, sub_qos) == MOSQ_ERR_NOMEM){
+			return MOSQ_ERR_NOMEM;
+		}
+		return MOSQ_ERR_SUCCESS;
+	}
+	if(cursor->count == cursor->alloc){
+		alloc = cursor->alloc ? cursor->alloc*2 : 16;
+		stores = _mosquitto_realloc_typed(cursor->stores, alloc*sizeof(struct mosquitto_msg_store *), mosq_mt_subscriptions);
+		if(!stores) return MOSQ_ERR_NOMEM;
+		cursor->stores = stores;
+		cursor->alloc = alloc;
+	}
+	cursor->stores[cursor->count] = retained;
+	cursor->count++;
+	retained->ref_count++;
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Find the retained messages below node that match tokens. Wildcards are
+ * only found in the subscription, never in the retain tree. Stops at the first
+ * error. */
+static int _retain_search(struct mosquitto_db *db, struct _mosquitto_retainhier *node, struct _sub_token *tokens, struct mosquitto *context, struct _mosquitto_retain_cursor *cursor, const char *sub, int sub_qos)
+{
+	struct _mosquitto_retainhier *branch;
+	int rc = MOSQ_ERR_SUCCESS;
+
+	branch = node->children;
+	while(branch && rc == MOSQ_ERR_SUCCESS){
 		if(!strcmp(tokens->topic, "#") && !tokens->next){
-			/* Set flag to indicate that we should check for retained messages
-			 * on "foo" when we are subscribing to e.g. "foo/#" and then exit
-			 * this function and return to an earlier _retain_search().
-			 */
-			flag = -1;
 			if(branch->retained){
-				_retain_process(db, branch->retained, context, sub, sub_qos);
+				rc = _retain_match(db, branch->retained, context, cursor, sub, sub_qos);
 			}
-			if(branch->children){
-				_retain_search(db, branch, tokens, context, sub, sub_qos, level+1);
+			if(!rc && branch->children){
+				rc = _retain_search(db, branch, tokens, context, cursor, sub, sub_qos);
 			}
-		}else if(strcmp(branch->topic, "+") && (!strcmp(branch->topic, tokens->topic) || !strcmp(tokens->topic, "+"))){
+		}else if(!strcmp(branch->topic, tokens->topic) || !strcmp(tokens->topic, "+")){
 			if(tokens->next){
-				if(_retain_search(db, branch, tokens->next, context, sub, sub_qos, level+1) == -1
-						|| (!branch->next && tokens->next && !strcmp(tokens->next->topic, "#") && level>0)){
-
-					if(branch->retained){
-						_retain_process(db, branch->retained, context, sub, sub_qos);
-					}
-				}
-			}else{
-				if(branch->retained){
-					_retain_process(db, branch->retained, context, sub, sub_qos);
+				rc = _retain_search(db, branch, tokens->next, context, cursor, sub, sub_qos);
+				if(!rc && branch->retained && !strcmp(tokens->next->topic, "#") && !tokens->next->next){
+					/* "foo/#" also matches "foo". */
+					rc = _retain_match(db, branch->retained, context, cursor, sub, sub_qos);
 				}
+			}else if(branch->retained){
+				rc = _retain_match(db, branch->retained, context, cursor, sub, sub_qos);
 			}
 		}
-
 		branch = branch->next;
 	}
-	return flag;
+	return rc;
 }
 
+/* Find the retained messages matching a new subscription. With
+ * retained_delivery_batch set these are collected in a cursor on the client
+ * and queued by mqtt3_retain_feed() as the client has room for them, rather
+ * than all being queued at once. */
 int mqtt3_retain_queue(struct mosquitto_db *db, struct mosquitto *context, const char *sub, int sub_qos)
 {
-	struct _mosquitto_subhier *subhier;
-	struct _sub_token *tokens = NULL, *tail;
+	struct _mosquitto_retainhier *retainhier;
+	struct _mosquitto_retain_cursor *cursor = NULL, *tail;
+	struct _sub_token *tokens = NULL, *token;
+	int rc = MOSQ_ERR_SUCCESS;
 
 	assert(db);
 	assert(context);
 	assert(sub);
 
-	if(_sub_topic_tokenise(sub, &tokens)) return 1;
+	/* A repeated subscription starts again from the beginning. */
+	mqtt3_retain_cursor_remove(context, sub);
 
-	subhier = db->subs.children;
-	while(subhier){
-		if(!strcmp(subhier->topic, tokens->topic)){
-			_retain_search(db, subhier, tokens, context, sub, sub_qos, 0);
+	if(db->config->retained_delivery_batch > 0){
+		cursor = _mosquitto_calloc_typed(1, sizeof(struct _mosquitto_retain_cursor), mosq_mt_subscriptions);
+		if(!cursor) return MOSQ_ERR_NOMEM;
+		cursor->sub = _mosquitto_strdup_typed(sub, mosq_mt_subscriptions);
+		if(!cursor->sub){
+			_mosquitto_free(cursor);
+			return MOSQ_ERR_NOMEM;
+		}
+		cursor->qos = sub_qos;
+	}
+
+	if(_sub_topic_tokenise(sub, &tokens)){
+		if(cursor) _retain_cursor_free(cursor);
+		return 1;
+	}
+
+	/* The first level is matched exactly, so that wildcards at the start of
+	 * a subscription don't match $SYS and other topics beginning with $. */
+	retainhier = db->retains.children;
+	while(retainhier){
+		if(!strcmp(retainhier->topic, tokens->topic)){
+			if(tokens->next){
+				rc = _retain_search(db, retainhier, tokens->next, context, cursor, sub, sub_qos);
+			}else if(retainhier->retained){
+				rc = _retain_match(db, retainhier->retained, context, cursor, sub, sub_qos);
+			}
 			break;
 		}
-		subhier = subhier->next;
+		retainhier = retainhier->next;
+	}
+
+	if(cursor){
+		if(cursor->count && !rc){
+			if(context->retain_cursors){
+				tail = context->retain_cursors;
+				while(tail->next){
+					tail = tail->next;
+				}
+				tail->next = cursor;
+			}else{
+				context->retain_cursors = cursor;
+			}
+		}else{
+			_retain_cursor_free(cursor);
+		}
 	}
 	while(tokens){
-		tail = tokens->next;
-		_mosquitto_free(tokens->topic);
-		_mosquitto_free(tokens);
-		tokens = tail;
+		token = tokens->next;
+		_mosquitto_buf_free(tokens->topic);
+		_mosquitto_pool_free(mosq_pt_sub_token, tokens);
+		tokens = token;
 	}
 
-	return MOSQ_ERR_SUCCESS;
+	return rc;
+}
+
+/* Queue up to retained_delivery_batch of the retained messages waiting for a
+ * client, stopping early if it has no room in its in-flight window. Messages
+ * that have stopped being retained since the subscription was made are
+ * skipped; their replacements have already been sent as normal. */
+void mqtt3_retain_feed(struct mosquitto_db *db, struct mosquitto *context)
+{
+	struct _mosquitto_retain_cursor *cursor;
+	struct mosquitto_msg_store *stored;
+	int budget;
+
+	budget = db->config->retained_delivery_batch;
+	cursor = context->retain_cursors;
+	while(cursor && budget > 0 && !mqtt3_db_client_window_full(db, context)){
+		stored = cursor->stores[cursor->pos];
+		cursor->pos++;
+		budget--;
+		if(stored->retained){
+			_retain_process(db, stored, context, cursor->sub, cursor->qos);
+		}
+		stored->ref_count--;
+
+		if(cursor->pos == cursor->count){
+			context->retain_cursors = cursor->next;
+			_retain_cursor_free(cursor);
+			cursor = context->retain_cursors;
+		}
+	}
+}
+
+/* Discard the retained messages waiting for a client's subscription, or for
+ * all of its subscriptions if sub is NULL. */
+void mqtt3_retain_cursor_remove(struct mosquitto *context, const char *sub)
+{
+	struct _mosquitto_retain_cursor *cursor, *last = NULL, *next;
+
+	cursor = context->retain_cursors;
+	while(cursor){
+		next = cursor->next;
+		if(!sub || !strcmp(cursor->sub, sub)){
+			if(last){
+				last->next = next;
+			}else{
+				context->retain_cursors = next;
+			}
+			_retain_cursor_free(cursor);
+		}else{
+			last = cursor;
+		}
+		cursor = next;
+	}
 }
 
@@ -30,7 +30,9 @@ POSSIBILITY OF SUCH DAMAGE.
 #ifdef WITH_SYS_TREE
 
 #include <math.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <config.h>
 
@@ -52,6 +54,89 @@ unsigned long g_msgs_dropped = 0;
 int g_clients_expired = 0;
 unsigned int g_socket_connections = 0;
 unsigned int g_connection_count = 0;
+unsigned int g_memory_reads_paused = 0;
+unsigned long g_memory_qos0_dropped = 0;
+unsigned long g_memory_refused = 0;
+unsigned int g_flow_reads_paused = 0;
+unsigned int g_slow_clients_limited = 0;
+unsigned long g_slow_clients_disconnected = 0;
+unsigned long g_slow_qos0_dropped = 0;
+#ifdef WITH_TLS
+unsigned long g_tls_handshakes_full = 0;
+unsigned long g_tls_handshakes_resumed = 0;
+#endif
+#ifdef WITH_LOG_THREAD
+extern unsigned long g_log_dropped;
+#endif
+/* Reset each time they are published. Times are in microseconds. */
+struct _mqtt3_histogram g_latency_delivery;
+struct _mqtt3_histogram g_latency_loop;
+struct _mqtt3_histogram g_latency_queue;
+struct _mqtt3_histogram g_publish_payload_size;
+
+#define HISTOGRAM_SUB_COUNT (1<<MQTT3_HISTOGRAM_SUB_BITS)
+
+static int _histogram_index(uint64_t value)
+{
+	int e;
+
+	if(value < HISTOGRAM_SUB_COUNT){
+		return (int)value;
+	}
+#ifdef __GNUC__
+	e = 63 - __builtin_clzll(value);
+#else
+	e = MQTT3_HISTOGRAM_SUB_BITS;
+	while(value >> (e+1)){
+		e++;
+	}
+#endif
+	/* The top MQTT3_HISTOGRAM_SUB_BITS+1 bits of the value pick the bucket. */
+	return ((e - MQTT3_HISTOGRAM_SUB_BITS + 1) << MQTT3_HISTOGRAM_SUB_BITS)
+		+ (int)((value >> (e - MQTT3_HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_COUNT-1));
+}
+
+/* The largest value that falls in bucket index. */
+static uint64_t _histogram_value(int index)
+{
+	int shift;
+
+	if(index < HISTOGRAM_SUB_COUNT){
+		return index;
+	}
+	shift = (index >> MQTT3_HISTOGRAM_SUB_BITS) - 1;
+	return (((uint64_t)(HISTOGRAM_SUB_COUNT + (index & (HISTOGRAM_SUB_COUNT-1))) + 1) << shift) - 1;
+}
+
+void mqtt3_histogram_record(struct _mqtt3_histogram *hist, uint64_t value)
+{
+	hist->buckets[_histogram_index(value)]++;
+	hist->count++;
+	if(value > hist->max){
+		hist->max = value;
+	}
+}
+
+/* The value below which percentile percent of the recorded values fall, to
+ * within the bucket accuracy. */
+static uint64_t _histogram_percentile(struct _mqtt3_histogram *hist, double percentile)
+{
+	uint64_t target, seen = 0;
+	uint64_t value;
+	int i;
+
+	if(!hist->count) return 0;
+
+	target = (uint64_t)ceil(hist->count*percentile/100.0);
+	for(i=0; i<MQTT3_HISTOGRAM_BUCKETS; i++){
+		seen += hist->buckets[i];
+		if(seen >= target){
+			value = _histogram_value(i);
+			return value < hist->max ? value : hist->max;
+		}
+	}
+	return hist->max;
+}
 
 static void _sys_update_clients(struct mosquitto_db *db, char *buf)
 {
@@ -68,29 +153,29 @@ static void _sys_update_clients(struct mosquitto_db *db, char *buf)
 		if(client_count != value){
 			client_count = value;
 			snprintf(buf, BUFLEN, "%d", client_count);
-			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/clients/total", 2, strlen(buf), buf, 1);
+			mqtt3_sys_publish(db, "$SYS/broker/clients/total", strlen(buf), buf);
 		}
 		if(inactive_count != inactive){
 			inactive_count = inactive;
 			snprintf(buf, BUFLEN, "%d", inactive_count);
-			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/clients/inactive", 2, strlen(buf), buf, 1);
+			mqtt3_sys_publish(db, "$SYS/broker/clients/inactive", strlen(buf), buf);
 		}
 		active = client_count - inactive;
 		if(active_count != active){
 			active_count = active;
 			snprintf(buf, BUFLEN, "%d", active_count);
-			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/clients/active", 2, strlen(buf), buf, 1);
+			mqtt3_sys_publish(db, "$SYS/broker/clients/active", strlen(buf), buf);
 		}
 		if(value != client_max){
 			client_max = value;
 			snprintf(buf, BUFLEN, "%d", client_max);
-			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/clients/maximum", 2, strlen(buf), buf, 1);
+			mqtt3_sys_publish(db, "$SYS/broker/clients/maximum", strlen(buf), buf);
 		}
 	}
 	if(g_clients_expired != clients_expired){
 		clients_expired = g_clients_expired;
 		snprintf(buf, BUFLEN, "%d", clients_expired);
-		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/clients/expired", 2, strlen(buf), buf, 1);
+		mqtt3_sys_publish(db, "$SYS/broker/clients/expired", strlen(buf), buf);
 	}
 }
 
@@ -99,19 +184,392 @@ static void _sys_update_memory(struct mosquitto_db *db, char *buf)
 {
 	static unsigned long current_heap = -1;
 	static unsigned long max_heap = -1;
+	static unsigned long type_heap[mosq_mt_count];
+	static bool init = false;
+	static const char *type_topics[mosq_mt_count] = {
+		"$SYS/broker/heap/other",
+		"$SYS/broker/heap/messages",
+		"$SYS/broker/heap/retained",
+		"$SYS/broker/heap/subscriptions",
+		"$SYS/broker/heap/contexts",
+		"$SYS/broker/heap/packets",
+		"$SYS/broker/heap/tls",
+	};
 	unsigned long value_ul;
+	int i;
+
+	if(!init){
+		for(i=0; i<mosq_mt_count; i++){
+			type_heap[i] = -1;
+		}
+		init = true;
+	}
 
 	value_ul = _mosquitto_memory_used();
 	if(current_heap != value_ul){
 		current_heap = value_ul;
 		snprintf(buf, BUFLEN, "%lu", current_heap);
-		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/heap/current", 2, strlen(buf), buf, 1);
+		mqtt3_sys_publish(db, "$SYS/broker/heap/current", strlen(buf), buf);
 	}
 	value_ul =_mosquitto_max_memory_used();
 	if(max_heap != value_ul){
 		max_heap = value_ul;
 		snprintf(buf, BUFLEN, "%lu", max_heap);
-		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/heap/maximum", 2, strlen(buf), buf, 1);
+		mqtt3_sys_publish(db, "$SYS/broker/heap/maximum", strlen(buf), buf);
+	}
+	for(i=0; i<mosq_mt_count; i++){
+		value_ul = _mosquitto_memory_type_used(i);
+		if(type_heap[i] != value_ul){
+			type_heap[i] = value_ul;
+			snprintf(buf, BUFLEN, "%lu", type_heap[i]);
+			mqtt3_sys_publish(db, type_topics[i], strlen(buf), buf);
+		}
+	}
+}
+#endif
+
+static void _sys_update_pools(struct mosquitto_db *db, char *buf)
+{
+	static unsigned long in_use[mosq_pt_count];
+	static unsigned long free_count[mosq_pt_count];
+	static unsigned long slabs[mosq_pt_count];
+	static bool init = false;
+	struct mosquitto_pool_stats stats;
+	char topic[BUFLEN];
+	int i;
+
+	if(!init){
+		for(i=0; i<mosq_pt_count; i++){
+			in_use[i] = -1;
+			free_count[i] = -1;
+			slabs[i] = -1;
+		}
+		init = true;
+	}
+
+	for(i=0; i<mosq_pt_count; i++){
+		_mosquitto_pool_stats(i, &stats);
+		if(in_use[i] != stats.in_use){
+			in_use[i] = stats.in_use;
+			snprintf(topic, BUFLEN, "$SYS/broker/pools/%s/in use", stats.name);
+			snprintf(buf, BUFLEN, "%lu", in_use[i]);
+			mqtt3_sys_publish(db, topic, strlen(buf), buf);
+		}
+		if(free_count[i] != stats.free){
+			free_count[i] = stats.free;
+			snprintf(topic, BUFLEN, "$SYS/broker/pools/%s/free", stats.name);
+			snprintf(buf, BUFLEN, "%lu", free_count[i]);
+			mqtt3_sys_publish(db, topic, strlen(buf), buf);
+		}
+		if(slabs[i] != stats.slabs){
+			slabs[i] = stats.slabs;
+			snprintf(topic, BUFLEN, "$SYS/broker/pools/%s/slabs", stats.name);
+			snprintf(buf, BUFLEN, "%lu", slabs[i]);
+			mqtt3_sys_publish(db, topic, strlen(buf), buf);
+		}
+	}
+}
+
+#ifdef REAL_WITH_MEMORY_TRACKING
+static void _sys_update_memory_limit(struct mosquitto_db *db, char *buf)
+{
+	static unsigned long limit = -1;
+	static int stage = -1;
+	static unsigned int reads_paused = -1;
+	static unsigned long qos0_dropped = -1;
+	static unsigned long refused = -1;
+	int value;
+
+	if(limit != db->config->memory_limit){
+		limit = db->config->memory_limit;
+		snprintf(buf, BUFLEN, "%lu", limit);
+		mqtt3_sys_publish(db, "$SYS/broker/memory limit/bytes", strlen(buf), buf);
+	}
+	value = mqtt3_db_memory_stage(db);
+	if(stage != value){
+		stage = value;
+		snprintf(buf, BUFLEN, "%d", stage);
+		mqtt3_sys_publish(db, "$SYS/broker/memory limit/stage", strlen(buf), buf);
+	}
+	if(reads_paused != g_memory_reads_paused){
+		reads_paused = g_memory_reads_paused;
+		snprintf(buf, BUFLEN, "%u", reads_paused);
+		mqtt3_sys_publish(db, "$SYS/broker/memory limit/clients paused", strlen(buf), buf);
+	}
+	if(qos0_dropped != g_memory_qos0_dropped){
+		qos0_dropped = g_memory_qos0_dropped;
+		snprintf(buf, BUFLEN, "%lu", qos0_dropped);
+		mqtt3_sys_publish(db, "$SYS/broker/memory limit/qos0 dropped", strlen(buf), buf);
+	}
+	if(refused != g_memory_refused){
+		refused = g_memory_refused;
+		snprintf(buf, BUFLEN, "%lu", refused);
+		mqtt3_sys_publish(db, "$SYS/broker/memory limit/refused", strlen(buf), buf);
+	}
+}
+#endif
+
+static void _sys_update_flow_control(struct mosquitto_db *db, char *buf)
+{
+	static unsigned int reads_paused = -1;
+	static unsigned long queued_bytes = -1;
+
+	if(reads_paused != g_flow_reads_paused){
+		reads_paused = g_flow_reads_paused;
+		snprintf(buf, BUFLEN, "%u", reads_paused);
+		mqtt3_sys_publish(db, "$SYS/broker/flow control/clients paused", strlen(buf), buf);
+	}
+	if(queued_bytes != db->out_packet_bytes){
+		queued_bytes = db->out_packet_bytes;
+		snprintf(buf, BUFLEN, "%lu", queued_bytes);
+		mqtt3_sys_publish(db, "$SYS/broker/flow control/queued bytes", strlen(buf), buf);
+	}
+}
+
+static void _sys_update_slow_clients(struct mosquitto_db *db, char *buf)
+{
+	static unsigned int limited = -1;
+	static unsigned long disconnected = -1;
+	static unsigned long qos0_dropped = -1;
+
+	if(limited != g_slow_clients_limited){
+		limited = g_slow_clients_limited;
+		snprintf(buf, BUFLEN, "%u", limited);
+		mqtt3_sys_publish(db, "$SYS/broker/slow clients/limited", strlen(buf), buf);
+	}
+	if(disconnected != g_slow_clients_disconnected){
+		disconnected = g_slow_clients_disconnected;
+		snprintf(buf, BUFLEN, "%lu", disconnected);
+		mqtt3_sys_publish(db, "$SYS/broker/slow clients/disconnected", strlen(buf), buf);
+	}
+	if(qos0_dropped != g_slow_qos0_dropped){
+		qos0_dropped = g_slow_qos0_dropped;
+		snprintf(buf, BUFLEN, "%lu", qos0_dropped);
+		mqtt3_sys_publish(db, "$SYS/broker/slow clients/qos0 dropped", strlen(buf), buf);
+	}
+}
+
+#ifdef WITH_TLS
+static void _sys_update_tls(struct mosquitto_db *db, char *buf)
+{
+	static unsigned long handshakes_full = -1;
+	static unsigned long handshakes_resumed = -1;
+
+	if(handshakes_full != g_tls_handshakes_full){
+		handshakes_full = g_tls_handshakes_full;
+		snprintf(buf, BUFLEN, "%lu", handshakes_full);
+		mqtt3_sys_publish(db, "$SYS/broker/tls/handshakes/full", strlen(buf), buf);
+	}
+	if(handshakes_resumed != g_tls_handshakes_resumed){
+		handshakes_resumed = g_tls_handshakes_resumed;
+		snprintf(buf, BUFLEN, "%lu", handshakes_resumed);
+		mqtt3_sys_publish(db, "$SYS/broker/tls/handshakes/resumed", strlen(buf), buf);
+	}
+}
+#endif
+
+#ifdef WITH_LOG_THREAD
+static void _sys_update_log(struct mosquitto_db *db, char *buf)
+{
+	static unsigned long dropped = -1;
+
+	if(dropped != g_log_dropped){
+		dropped = g_log_dropped;
+		snprintf(buf, BUFLEN, "%lu", dropped);
+		mqtt3_sys_publish(db, "$SYS/broker/logging/dropped", strlen(buf), buf);
+	}
+}
+#endif
+
+#define HISTOGRAM_TOPICS 5
+
+/* Publish percentiles for hist as topic/p50 etc., then start it again for
+ * the next interval. Values are only published when they change; an
+ * interval with nothing recorded gives 0. */
+static void _sys_update_histogram(struct mosquitto_db *db, char *buf, const char *topic, struct _mqtt3_histogram *hist, uint64_t *published)
+{
+	static const char *names[HISTOGRAM_TOPICS] = {"p50", "p90", "p99", "p99.9", "max"};
+	static const double percentiles[HISTOGRAM_TOPICS-1] = {50.0, 90.0, 99.0, 99.9};
+	char full_topic[BUFLEN];
+	uint64_t value;
+	int i;
+
+	for(i=0; i<HISTOGRAM_TOPICS; i++){
+		if(i < HISTOGRAM_TOPICS-1){
+			value = _histogram_percentile(hist, percentiles[i]);
+		}else{
+			value = hist->max;
+		}
+		if(published[i] != value){
+			published[i] = value;
+			snprintf(full_topic, BUFLEN, "%s/%s", topic, names[i]);
+			snprintf(buf, BUFLEN, "%llu", (unsigned long long)value);
+			mqtt3_sys_publish(db, full_topic, strlen(buf), buf);
+		}
+	}
+	memset(hist, 0, sizeof(struct _mqtt3_histogram));
+}
+
+static void _sys_update_histograms(struct mosquitto_db *db, char *buf)
+{
+	static uint64_t delivery[HISTOGRAM_TOPICS] = {-1, -1, -1, -1, -1};
+	static uint64_t loop[HISTOGRAM_TOPICS] = {-1, -1, -1, -1, -1};
+	static uint64_t queue[HISTOGRAM_TOPICS] = {-1, -1, -1, -1, -1};
+	static uint64_t payload_size[HISTOGRAM_TOPICS] = {-1, -1, -1, -1, -1};
+	static uint64_t queued_messages[HISTOGRAM_TOPICS] = {-1, -1, -1, -1, -1};
+	static struct _mqtt3_histogram depth;
+	int i;
+
+	/* Queue depth is sampled now rather than recorded as it changes. */
+	for(i=0; i<db->context_count; i++){
+		if(db->contexts[i]){
+			mqtt3_histogram_record(&depth, db->contexts[i]->msg_count);
+		}
+	}
+
+	_sys_update_histogram(db, buf, "$SYS/broker/latency/delivery", &g_latency_delivery, delivery);
+	_sys_update_histogram(db, buf, "$SYS/broker/latency/loop", &g_latency_loop, loop);
+	_sys_update_histogram(db, buf, "$SYS/broker/latency/queue", &g_latency_queue, queue);
+	_sys_update_histogram(db, buf, "$SYS/broker/publish/payload size", &g_publish_payload_size, payload_size);
+	_sys_update_histogram(db, buf, "$SYS/broker/clients/queued messages", &depth, queued_messages);
+}
+
+static const struct {
+	const char *topic;
+	size_t offset;
+} traffic_topics[] = {
+	{"bytes/received", offsetof(struct _mqtt3_traffic, bytes_received)},
+	{"bytes/sent", offsetof(struct _mqtt3_traffic, bytes_sent)},
+	{"messages/received", offsetof(struct _mqtt3_traffic, msgs_received)},
+	{"messages/sent", offsetof(struct _mqtt3_traffic, msgs_sent)},
+	{"publish/messages/received", offsetof(struct _mqtt3_traffic, pub_msgs_received)},
+	{"publish/messages/sent", offsetof(struct _mqtt3_traffic, pub_msgs_sent)},
+	{"connections/total", offsetof(struct _mqtt3_traffic, connections_total)},
+	{"connections/current", offsetof(struct _mqtt3_traffic, connections)},
+	{"queued messages", offsetof(struct _mqtt3_traffic, queued_messages)},
+};
+#define TRAFFIC_TOPICS (int)(sizeof(traffic_topics)/sizeof(traffic_topics[0]))
+#define TRAFFIC_VALUE(traffic, i) (*(uint64_t *)((char *)(traffic) + traffic_topics[i].offset))
+
+/* Fill in the gauges in the listener and bridge traffic counts. Queued
+ * messages are only counted for connected clients, because a client that has
+ * disconnected no longer belongs to a listener. */
+void mqtt3_sys_traffic_update(struct mosquitto_db *db)
+{
+	struct mosquitto *context;
+	int i;
+
+	for(i=0; i<db->config->listener_count; i++){
+		db->config->listeners[i].traffic.connections = db->config->listeners[i].client_count;
+		db->config->listeners[i].traffic.queued_messages = 0;
+	}
+	for(i=0; i<db->config->bridge_count; i++){
+		db->config->bridges[i].traffic.connections = 0;
+		db->config->bridges[i].traffic.queued_messages = 0;
+	}
+	for(i=0; i<db->context_count; i++){
+		context = db->contexts[i];
+		if(!context) continue;
+
+		if(context->listener){
+			context->listener->traffic.queued_messages += context->msg_count;
+		}else if(context->bridge){
+			if(context->sock != INVALID_SOCKET && context->state == mosq_cs_connected){
+				context->bridge->traffic.connections++;
+			}
+			context->bridge->traffic.queued_messages += context->msg_count;
+		}
+	}
+}
+
+/* Publish each value in traffic as prefix/topic if it is different to the
+ * one in published. */
+static void _sys_update_traffic(struct mosquitto_db *db, char *buf, const char *prefix, struct _mqtt3_traffic *traffic, struct _mqtt3_traffic *published)
+{
+	char topic[1024];
+	int i;
+
+	for(i=0; i<TRAFFIC_TOPICS; i++){
+		if(TRAFFIC_VALUE(traffic, i) != TRAFFIC_VALUE(published, i)){
+			TRAFFIC_VALUE(published, i) = TRAFFIC_VALUE(traffic, i);
+			if(snprintf(topic, sizeof(topic), "%s/%s", prefix, traffic_topics[i].topic) >= (int)sizeof(topic)){
+				continue;
+			}
+			snprintf(buf, BUFLEN, "%llu", (unsigned long long)TRAFFIC_VALUE(traffic, i));
+			mqtt3_sys_publish(db, topic, strlen(buf), buf);
+		}
+	}
+}
+
+static void _sys_update_listeners(struct mosquitto_db *db, char *buf)
+{
+	static bool init = false;
+	struct _mqtt3_listener *listeners = db->config->listeners;
+	struct _mqtt3_traffic traffic;
+	char prefix[BUFLEN];
+	int i, j, k;
+
+	if(!init){
+		for(i=0; i<db->config->listener_count; i++){
+			memset(&listeners[i].traffic_published, 0xFF, sizeof(struct _mqtt3_traffic));
+		}
+		init = true;
+	}
+
+	for(i=0; i<db->config->listener_count; i++){
+		if(listeners[i].protocol != mp_mqtt) continue;
+
+		/* Listeners that share a port on different addresses share topics
+		 * too, so give the total for all of them. */
+		for(j=0; j<i; j++){
+			if(listeners[j].protocol == mp_mqtt && listeners[j].port == listeners[i].port) break;
+		}
+		if(j < i) continue;
+
+		traffic = listeners[i].traffic;
+		for(j=i+1; j<db->config->listener_count; j++){
+			if(listeners[j].protocol == mp_mqtt && listeners[j].port == listeners[i].port){
+				for(k=0; k<TRAFFIC_TOPICS; k++){
+					TRAFFIC_VALUE(&traffic, k) += TRAFFIC_VALUE(&listeners[j].traffic, k);
+				}
+			}
+		}
+		snprintf(prefix, BUFLEN, "$SYS/broker/listener/%d", listeners[i].port);
+		_sys_update_traffic(db, buf, prefix, &traffic, &listeners[i].traffic_published);
+	}
+}
+
+#ifdef WITH_BRIDGE
+static void _sys_update_bridges(struct mosquitto_db *db, char *buf)
+{
+	static bool init = false;
+	struct _mqtt3_bridge *bridge;
+	struct _mqtt3_traffic traffic;
+	char prefix[1024];
+	int i, j, k;
+
+	if(!init){
+		for(i=0; i<db->config->bridge_count; i++){
+			memset(&db->config->bridges[i].traffic_published, 0xFF, sizeof(struct _mqtt3_traffic));
+		}
+		init = true;
+	}
+
+	for(i=0; i<db->config->bridge_count; i++){
+		bridge = &db->config->bridges[i];
+		/* Parallel connections of a bridge follow the first one and share
+		 * its name, so give the total for all of them. */
+		if(bridge->connection_index > 0) continue;
+		if(snprintf(prefix, sizeof(prefix), "$SYS/broker/bridge/%s", bridge->name) >= (int)sizeof(prefix)){
+			continue;
+		}
+		traffic = bridge->traffic;
+		for(j=1; j<bridge->connection_count && i+j<db->config->bridge_count; j++){
+			for(k=0; k<TRAFFIC_TOPICS; k++){
+				TRAFFIC_VALUE(&traffic, k) += TRAFFIC_VALUE(&bridge[j].traffic, k);
+			}
+		}
+		_sys_update_traffic(db, buf, prefix, &traffic, &bridge->traffic_published);
 	}
 }
 #endif
@@ -123,7 +581,7 @@ static void calc_load(struct mosquitto_db *db, char *buf, const char *topic, dou
 	new_value = interval + exponent*((*current) - interval);
 	if(fabs(new_value - (*current)) >= 0.01){
 		snprintf(buf, BUFLEN, "%.2f", new_value);
-		mqtt3_db_messages_easy_queue(db, NULL, topic, 2, strlen(buf), buf, 1);
+		mqtt3_sys_publish(db, topic, strlen(buf), buf);
 	}
 	(*current) = new_value;
 }
@@ -199,7 +657,7 @@ void mqtt3_db_sys_update(struct mosquitto_db *db, int interval, time_t start_tim
 	if(interval && now - interval > last_update){
 		uptime = now - start_time;
 		snprintf(buf, BUFLEN, "%d seconds", (int)uptime);
-		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/uptime", 2, strlen(buf), buf, 1);
+		mqtt3_sys_publish(db, "$SYS/broker/uptime", strlen(buf), buf);
 
 		_sys_update_clients(db, buf);
 		if(last_update > 0){
@@ -263,77 +721,100 @@ void mqtt3_db_sys_update(struct mosquitto_db *db, int interval, time_t start_tim
 		if(db->msg_store_count != msg_store_count){
 			msg_store_count = db->msg_store_count;
 			snprintf(buf, BUFLEN, "%d", msg_store_count);
-			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/messages/stored", 2, strlen(buf), buf, 1);
+			mqtt3_sys_publish(db, "$SYS/broker/messages/stored", strlen(buf), buf);
 		}
 
 		if(db->subscription_count != subscription_count){
 			subscription_count = db->subscription_count;
 			snprintf(buf, BUFLEN, "%d", subscription_count);
-			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/subscriptions/count", 2, strlen(buf), buf, 1);
+			mqtt3_sys_publish(db, "$SYS/broker/subscriptions/count", strlen(buf), buf);
 		}
 
 		if(db->retained_count != retained_count){
 			retained_count = db->retained_count;
 			snprintf(buf, BUFLEN, "%d", retained_count);
-			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/retained messages/count", 2, strlen(buf), buf, 1);
+			mqtt3_sys_publish(db, "$SYS/broker/retained messages/count", strlen(buf), buf);
 		}
 
 #ifdef REAL_WITH_MEMORY_TRACKING
 		_sys_update_memory(db, buf);
+		if(db->config->memory_limit){
+			_sys_update_memory_limit(db, buf);
+		}
+#endif
+		_sys_update_pools(db, buf);
+		if(db->config->output_high_water || db->config->client_output_high_water){
+			_sys_update_flow_control(db, buf);
+		}
+		if(db->config->client_output_limit){
+			_sys_update_slow_clients(db, buf);
+		}
+#ifdef WITH_TLS
+		_sys_update_tls(db, buf);
+#endif
+#ifdef WITH_LOG_THREAD
+		_sys_update_log(db, buf);
+#endif
+		_sys_update_histograms(db, buf);
+		mqtt3_sys_traffic_update(db);
+		_sys_update_listeners(db, buf);
+#ifdef WITH_BRIDGE
+		_sys_update_bridges(db, buf);
 #endif
+		mqtt3_top_update(db);
 
 		if(msgs_received != g_msgs_received){
 			msgs_received = g_msgs_received;
 			snprintf(buf, BUFLEN, "%lu", msgs_received);
-			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/messages/received", 2, strlen(buf), buf, 1);
+			mqtt3_sys_publish(db, "$SYS/broker/messages/received", strlen(buf), buf);
 		}
 		
 		if(msgs_sent != g_msgs_sent){
 			msgs_sent = g_msgs_sent;
 			snprintf(buf, BUFLEN, "%lu", msgs_sent);
-			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/messages/sent", 2, strlen(buf), buf, 1);
+			mqtt3_sys_publish(db, "$SYS/broker/messages/sent", strlen(buf), buf);
 		}
 
 		if(publish_dropped != g_msgs_dropped){
 			publish_dropped = g_msgs_dropped;
 			snprintf(buf, BUFLEN, "%lu", publish_dropped);
-			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/publish/messages/dropped", 2, strlen(buf), buf, 1);
+			mqtt3_sys_publish(db, "$SYS/broker/publish/messages/dropped", strlen(buf), buf);
 		}
 
 		if(pub_msgs_received != g_pub_msgs_received){
 			pub_msgs_received = g_pub_msgs_received;
 			snprintf(buf, BUFLEN, "%lu", pub_msgs_received);
-			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/publish/messages/received", 2, strlen(buf), buf, 1);
+			mqtt3_sys_publish(db, "$SYS/broker/publish/messages/received", strlen(buf), buf);
 		}
 		
 		if(pub_msgs_sent != g_pub_msgs_sent){
 			pub_msgs_sent = g_pub_msgs_sent;
 			snprintf(buf, BUFLEN, "%lu", pub_msgs_sent);
-			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/publish/messages/sent", 2, strlen(buf), buf, 1);
+			mqtt3_sys_publish(db, "$SYS/broker/publish/messages/sent", strlen(buf), buf);
 		}
 
 		if(bytes_received != g_bytes_received){
 			bytes_received = g_bytes_received;
 			snprintf(buf, BUFLEN, "%llu", bytes_received);
-			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/bytes/received", 2, strlen(buf), buf, 1);
+			mqtt3_sys_publish(db, "$SYS/broker/bytes/received", strlen(buf), buf);
 		}
 		
 		if(bytes_sent != g_bytes_sent){
 			bytes_sent = g_bytes_sent;
 			snprintf(buf, BUFLEN, "%llu", bytes_sent);
-			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/bytes/sent", 2, strlen(buf), buf, 1);
+			mqtt3_sys_publish(db, "$SYS/broker/bytes/sent", strlen(buf), buf);
 		}
 		
 		if(pub_bytes_received != g_pub_bytes_received){
 			pub_bytes_received = g_pub_bytes_received;
 			snprintf(buf, BUFLEN, "%llu", pub_bytes_received);
-			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/publish/bytes/received", 2, strlen(buf), buf, 1);
+			mqtt3_sys_publish(db, "$SYS/broker/publish/bytes/received", strlen(buf), buf);
 		}
 
 		if(pub_bytes_sent != g_pub_bytes_sent){
 			pub_bytes_sent = g_pub_bytes_sent;
 			snprintf(buf, BUFLEN, "%llu", pub_bytes_sent);
-			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/publish/bytes/sent", 2, strlen(buf), buf, 1);
+			mqtt3_sys_publish(db, "$SYS/broker/publish/bytes/sent", strlen(buf), buf);
 		}
 
 		last_update = mosquitto_time();
@@ -0,0 +1,350 @@
+/*
+Copyright (c) 2014 Roger Light <roger@atchoo.org>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of mosquitto nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* TLS handshakes for incoming connections can be handed to a pool of worker
+ * threads, so that the public key operations for a flood of new connections
+ * don't hold up clients that are already connected.
+ *
+ * The main loop still does all of the waiting. While a client is part way
+ * through its handshake it polls the socket for whatever SSL_accept() last
+ * asked for, and when the socket is ready the client is queued for a worker.
+ * The worker runs one SSL_accept() step, which includes any certificate
+ * verification, and puts the client on the done list. It then writes a byte
+ * to a pipe that the main loop polls, which picks up the result. A client
+ * belongs to exactly one of the two sides at a time, so its SSL object is
+ * never used by two threads at once. Nothing else in the broker is touched
+ * by the workers.
+ */
+
+#ifdef WITH_TLS_THREADS
+
+#include <pthread.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <config.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include <mosquitto_broker.h>
+#include <memory_mosq.h>
+
+/* mosquitto_internal.h replaces the pthread functions with empty macros in
+ * the broker, but these really are used here. */
+#undef pthread_create
+#undef pthread_join
+#undef pthread_cancel
+#undef pthread_mutex_init
+#undef pthread_mutex_destroy
+#undef pthread_mutex_lock
+#undef pthread_mutex_unlock
+
+static pthread_t *workers = NULL;
+static int worker_count = 0;
+static bool workers_stop = false;
+
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static struct mosquitto *queue_head = NULL;
+static struct mosquitto *queue_tail = NULL;
+
+static pthread_mutex_t done_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct mosquitto *done_head = NULL;
+static struct mosquitto *done_tail = NULL;
+
+static int wake_pipe[2] = {-1, -1};
+
+/* Held for reading by a worker for each handshake step, and for writing by
+ * the main loop while it changes state that the steps use. */
+static pthread_rwlock_t handshake_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+/* Older OpenSSL versions need to be given locks to be used from more than
+ * one thread. */
+static pthread_mutex_t *tls_locks = NULL;
+static int tls_lock_count = 0;
+
+static void _tls_worker_locking(int mode, int n, const char *file, int line)
+{
+	if(mode & CRYPTO_LOCK){
+		pthread_mutex_lock(&tls_locks[n]);
+	}else{
+		pthread_mutex_unlock(&tls_locks[n]);
+	}
+}
+
+static unsigned long _tls_worker_thread_id(void)
+{
+	return (unsigned long)pthread_self();
+}
+#endif
+
+/* The main loop reads tls_handshake to see that the client is queued, so the
+ * outcome goes in tls_handshake_result until the client is handed back. */
+static void _tls_worker_handshake(struct mosquitto *context)
+{
+	int rc;
+
+	ERR_clear_error();
+	rc = SSL_accept(context->ssl);
+	if(rc == 1){
+		context->tls_handshake_result = mosq_th_none;
+		return;
+	}
+	switch(SSL_get_error(context->ssl, rc)){
+		case SSL_ERROR_WANT_READ:
+			context->tls_handshake_result = mosq_th_want_read;
+			break;
+		case SSL_ERROR_WANT_WRITE:
+			context->tls_handshake_result = mosq_th_want_write;
+			break;
+		default:
+			/* The error queue belongs to this thread, so keep the first
+			 * error for the main loop to log. */
+			context->tls_handshake_result = mosq_th_failed;
+			context->tls_error = ERR_get_error();
+			ERR_clear_error();
+			break;
+	}
+}
+
+static void *_tls_worker_main(void *arg)
+{
+	struct mosquitto *context;
+	char wake = 0;
+
+	while(1){
+		pthread_mutex_lock(&queue_mutex);
+		while(!queue_head && !workers_stop){
+			pthread_cond_wait(&queue_cond, &queue_mutex);
+		}
+		if(workers_stop){
+			pthread_mutex_unlock(&queue_mutex);
+			break;
+		}
+		context = queue_head;
+		queue_head = context->tls_handshake_next;
+		if(!queue_head) queue_tail = NULL;
+		pthread_mutex_unlock(&queue_mutex);
+
+		pthread_rwlock_rdlock(&handshake_lock);
+		_tls_worker_handshake(context);
+		pthread_rwlock_unlock(&handshake_lock);
+
+		pthread_mutex_lock(&done_mutex);
+		context->tls_handshake_next = NULL;
+		if(done_tail){
+			done_tail->tls_handshake_next = context;
+		}else{
+			done_head = context;
+		}
+		done_tail = context;
+		pthread_mutex_unlock(&done_mutex);
+
+		/* If the pipe is full the main loop already has a wake up waiting. */
+		if(write(wake_pipe[1], &wake, 1) < 0){
+		}
+	}
+	return NULL;
+}
+
+/* Start count handshake worker threads. */
+int mqtt3_tls_workers_start(int count)
+{
+	sigset_t sigblock, origsig;
+	int i;
+
+	if(count < 1) return MOSQ_ERR_SUCCESS;
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	tls_lock_count = CRYPTO_num_locks();
+	tls_locks = _mosquitto_malloc(sizeof(pthread_mutex_t)*tls_lock_count);
+	if(!tls_locks) return MOSQ_ERR_NOMEM;
+	for(i=0; i<tls_lock_count; i++){
+		pthread_mutex_init(&tls_locks[i], NULL);
+	}
+	CRYPTO_set_id_callback(_tls_worker_thread_id);
+	CRYPTO_set_locking_callback(_tls_worker_locking);
+#endif
+
+	if(pipe(wake_pipe)){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to create TLS handshake thread pipe.");
+		return MOSQ_ERR_UNKNOWN;
+	}
+	for(i=0; i<2; i++){
+		if(fcntl(wake_pipe[i], F_SETFL, fcntl(wake_pipe[i], F_GETFL, 0) | O_NONBLOCK) == -1){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to create TLS handshake thread pipe.");
+			return MOSQ_ERR_UNKNOWN;
+		}
+	}
+
+	workers = _mosquitto_malloc(sizeof(pthread_t)*count);
+	if(!workers) return MOSQ_ERR_NOMEM;
+
+	/* Signals are handled by the main thread only. */
+	sigfillset(&sigblock);
+	pthread_sigmask(SIG_SETMASK, &sigblock, &origsig);
+	workers_stop = false;
+	for(i=0; i<count; i++){
+		if(pthread_create(&workers[i], NULL, _tls_worker_main, NULL)){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to start TLS handshake thread.");
+			break;
+		}
+		worker_count++;
+	}
+	pthread_sigmask(SIG_SETMASK, &origsig, NULL);
+
+	if(worker_count < count){
+		mqtt3_tls_workers_stop();
+		return MOSQ_ERR_UNKNOWN;
+	}
+	_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Started %d TLS handshake threads.", worker_count);
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Stop the worker threads. Any clients still queued or on the done list are
+ * left with their handshake unfinished, to be freed with the other contexts. */
+void mqtt3_tls_workers_stop(void)
+{
+	int i;
+
+	pthread_mutex_lock(&queue_mutex);
+	workers_stop = true;
+	pthread_cond_broadcast(&queue_cond);
+	pthread_mutex_unlock(&queue_mutex);
+
+	for(i=0; i<worker_count; i++){
+		pthread_join(workers[i], NULL);
+	}
+	worker_count = 0;
+	if(workers){
+		_mosquitto_free(workers);
+		workers = NULL;
+	}
+	queue_head = NULL;
+	queue_tail = NULL;
+	done_head = NULL;
+	done_tail = NULL;
+
+	if(wake_pipe[0] != -1){
+		close(wake_pipe[0]);
+		close(wake_pipe[1]);
+		wake_pipe[0] = -1;
+		wake_pipe[1] = -1;
+	}
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	if(tls_locks){
+		CRYPTO_set_locking_callback(NULL);
+		CRYPTO_set_id_callback(NULL);
+		for(i=0; i<tls_lock_count; i++){
+			pthread_mutex_destroy(&tls_locks[i]);
+		}
+		_mosquitto_free(tls_locks);
+		tls_locks = NULL;
+	}
+#endif
+}
+
+/* Returns true if handshakes are being done by worker threads. */
+bool mqtt3_tls_workers_active(void)
+{
+	return worker_count > 0;
+}
+
+/* The socket the main loop polls to find out that handshakes have finished
+ * steps, or -1 if there are no workers. */
+int mqtt3_tls_workers_sock(void)
+{
+	return wake_pipe[0];
+}
+
+/* Hand a client to the workers for its next handshake step. The client
+ * mustn't be touched by the main loop until it is returned by
+ * mqtt3_tls_workers_done(). */
+void mqtt3_tls_workers_queue(struct mosquitto *context)
+{
+	context->tls_handshake = mosq_th_queued;
+	context->tls_handshake_next = NULL;
+
+	pthread_mutex_lock(&queue_mutex);
+	if(queue_tail){
+		queue_tail->tls_handshake_next = context;
+	}else{
+		queue_head = context;
+	}
+	queue_tail = context;
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_mutex);
+}
+
+/* Wait for any handshake steps in progress to finish and stop new ones
+ * starting, so that listener state used during the handshake, such as the
+ * session ticket keys, can be changed. */
+void mqtt3_tls_workers_pause(void)
+{
+	if(worker_count > 0){
+		pthread_rwlock_wrlock(&handshake_lock);
+	}
+}
+
+void mqtt3_tls_workers_resume(void)
+{
+	if(worker_count > 0){
+		pthread_rwlock_unlock(&handshake_lock);
+	}
+}
+
+/* Return the list of clients whose handshake step has finished, linked by
+ * tls_handshake_next. Each has tls_handshake set to mosq_th_none if the
+ * handshake is complete, mosq_th_failed if it failed, or the direction to
+ * wait for before the next step. */
+struct mosquitto *mqtt3_tls_workers_done(void)
+{
+	struct mosquitto *done, *context;
+	char buf[64];
+
+	while(read(wake_pipe[0], buf, sizeof(buf)) > 0){
+	}
+
+	pthread_mutex_lock(&done_mutex);
+	done = done_head;
+	done_head = NULL;
+	done_tail = NULL;
+	pthread_mutex_unlock(&done_mutex);
+
+	for(context=done; context; context=context->tls_handshake_next){
+		context->tls_handshake = context->tls_handshake_result;
+	}
+	return done;
+}
+
+#endif
@@ -0,0 +1,399 @@
+/*
+Copyright (c) 2014 Roger Light <roger@atchoo.org>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of mosquitto nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Tracking of the busiest topics and clients, enabled with top_count.
+ *
+ * Each list uses the "space saving" algorithm: a fixed number of counters,
+ * MQTT3_TOP_SLOTS per reported entry. A key that already has a counter adds
+ * to it. A new key takes over the smallest counter and adds to its count, so
+ * a count can be too high by at most the value it took over, but any key
+ * that really is busier than that is guaranteed to be in the list. The
+ * counters are kept in a min-heap so the smallest is found in O(log n), and
+ * each counter keeps its key buffer for reuse by later keys. Only one in
+ * top_sample messages is looked at, chosen at random, to bound the cost at
+ * high message rates.
+ *
+ * The lists cover the time since the $SYS tree was last updated, at which
+ * point they are published as rates and started again.
+ */
+
+#ifdef WITH_SYS_TREE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <config.h>
+
+#include <mosquitto_broker.h>
+#include <memory_mosq.h>
+#include <time_mosq.h>
+
+/* Counters kept per reported entry. */
+#define MQTT3_TOP_SLOTS 4
+
+struct _mqtt3_top_entry {
+	char *key;
+	size_t key_size;
+	uint64_t count;
+	int heap_index;
+	UT_hash_handle hh;
+};
+
+struct _mqtt3_top {
+	const char *topic;
+	const char *description;
+	struct _mqtt3_top_entry *entries;
+	struct _mqtt3_top_entry **heap;
+	struct _mqtt3_top_entry *hash;
+	int used;
+	bool published_empty;
+};
+
+enum mqtt3_top_list {
+	mtl_topic_messages = 0,
+	mtl_topic_bytes = 1,
+	mtl_topic_fan_out = 2,
+	mtl_client_messages = 3,
+	mtl_client_bytes = 4,
+	mtl_count = 5
+};
+
+static struct _mqtt3_top top_lists[mtl_count] = {
+	{"$SYS/broker/top/topics/messages", "Topics by messages/s", NULL, NULL, NULL, 0, false},
+	{"$SYS/broker/top/topics/bytes", "Topics by bytes/s", NULL, NULL, NULL, 0, false},
+	{"$SYS/broker/top/topics/fan out", "Topics by deliveries/s", NULL, NULL, NULL, 0, false},
+	{"$SYS/broker/top/clients/messages", "Clients by messages/s", NULL, NULL, NULL, 0, false},
+	{"$SYS/broker/top/clients/bytes", "Clients by bytes/s", NULL, NULL, NULL, 0, false},
+};
+
+static int top_slots = 0;
+static time_t top_start = 0;
+static uint32_t top_random = 2463534242UL;
+
+/* Empty top, keeping the key buffers for reuse. */
+static void _top_clear(struct _mqtt3_top *top)
+{
+	HASH_CLEAR(hh, top->hash);
+	top->used = 0;
+}
+
+static void _top_free(struct _mqtt3_top *top)
+{
+	int i;
+
+	_top_clear(top);
+	if(top->entries){
+		for(i=0; i<top_slots; i++){
+			_mosquitto_free(top->entries[i].key);
+		}
+		_mosquitto_free(top->entries);
+		top->entries = NULL;
+	}
+	if(top->heap){
+		_mosquitto_free(top->heap);
+		top->heap = NULL;
+	}
+}
+
+/* Make the lists match top_count, which may have changed on reload. */
+static int _top_resize(struct mosquitto_db *db)
+{
+	int slots;
+	int i;
+
+	slots = db->config->top_count * MQTT3_TOP_SLOTS;
+	for(i=0; i<mtl_count; i++){
+		_top_free(&top_lists[i]);
+	}
+	top_slots = 0;
+	if(slots){
+		for(i=0; i<mtl_count; i++){
+			top_lists[i].entries = _mosquitto_calloc(slots, sizeof(struct _mqtt3_top_entry));
+			top_lists[i].heap = _mosquitto_malloc(sizeof(struct _mqtt3_top_entry *)*slots);
+			if(!top_lists[i].entries || !top_lists[i].heap){
+				for(; i>=0; i--){
+					_top_free(&top_lists[i]);
+				}
+				return MOSQ_ERR_NOMEM;
+			}
+		}
+	}
+	top_slots = slots;
+	top_start = mosquitto_time();
+	return MOSQ_ERR_SUCCESS;
+}
+
+static bool _top_sample(struct mosquitto_db *db)
+{
+	if(top_slots != db->config->top_count * MQTT3_TOP_SLOTS){
+		if(_top_resize(db)) return false;
+	}
+	if(!top_slots) return false;
+
+	if(db->config->top_sample > 1){
+		/* xorshift32 - all that is needed is to avoid falling into step
+		 * with a regular pattern of messages. */
+		top_random ^= top_random << 13;
+		top_random ^= top_random >> 17;
+		top_random ^= top_random << 5;
+		if(top_random % db->config->top_sample){
+			return false;
+		}
+	}
+	return true;
+}
+
+static void _top_heap_swap(struct _mqtt3_top *top, int a, int b)
+{
+	struct _mqtt3_top_entry *entry;
+
+	entry = top->heap[a];
+	top->heap[a] = top->heap[b];
+	top->heap[b] = entry;
+	top->heap[a]->heap_index = a;
+	top->heap[b]->heap_index = b;
+}
+
+static void _top_heap_up(struct _mqtt3_top *top, int i)
+{
+	while(i > 0 && top->heap[i]->count < top->heap[(i-1)/2]->count){
+		_top_heap_swap(top, i, (i-1)/2);
+		i = (i-1)/2;
+	}
+}
+
+/* Counts only ever grow, so after an addition an entry can only need to move
+ * down the heap. */
+static void _top_heap_down(struct _mqtt3_top *top, int i)
+{
+	int child;
+
+	while((child = 2*i+1) < top->used){
+		if(child+1 < top->used && top->heap[child+1]->count < top->heap[child]->count){
+			child++;
+		}
+		if(top->heap[i]->count <= top->heap[child]->count) break;
+		_top_heap_swap(top, i, child);
+		i = child;
+	}
+}
+
+/* Copy key into the buffer of entry, growing it if needed. entry must not be
+ * in the hash, because the buffer may move. */
+static int _top_key_set(struct _mqtt3_top_entry *entry, const char *key, size_t len)
+{
+	char *buf;
+
+	if(len+1 > entry->key_size){
+		buf = _mosquitto_realloc(entry->key, len+1);
+		if(!buf) return MOSQ_ERR_NOMEM;
+		entry->key = buf;
+		entry->key_size = len+1;
+	}
+	memcpy(entry->key, key, len+1);
+	return MOSQ_ERR_SUCCESS;
+}
+
+static void _top_add(struct _mqtt3_top *top, const char *key, uint64_t value)
+{
+	struct _mqtt3_top_entry *entry;
+	size_t len;
+
+	len = strlen(key);
+	HASH_FIND(hh, top->hash, key, len, entry);
+	if(entry){
+		entry->count += value;
+		_top_heap_down(top, entry->heap_index);
+		return;
+	}
+
+	if(top->used < top_slots){
+		entry = &top->entries[top->used];
+		if(_top_key_set(entry, key, len)) return;
+		entry->count = value;
+		entry->heap_index = top->used;
+		top->heap[top->used] = entry;
+		top->used++;
+		_top_heap_up(top, entry->heap_index);
+	}else{
+		entry = top->heap[0];
+		HASH_DELETE(hh, top->hash, entry);
+		if(_top_key_set(entry, key, len)){
+			/* The old key is untouched if the buffer couldn't grow. */
+			HASH_ADD_KEYPTR(hh, top->hash, entry->key, strlen(entry->key), entry);
+			return;
+		}
+		entry->count += value;
+		_top_heap_down(top, 0);
+	}
+	HASH_ADD_KEYPTR(hh, top->hash, entry->key, len, entry);
+}
+
+static int _top_cmp(const void *a, const void *b)
+{
+	const struct _mqtt3_top_entry *ea = *(const struct _mqtt3_top_entry **)a;
+	const struct _mqtt3_top_entry *eb = *(const struct _mqtt3_top_entry **)b;
+
+	if(ea->count > eb->count) return -1;
+	if(ea->count < eb->count) return 1;
+	return 0;
+}
+
+/* Sort the busiest top_count entries of top to the start of sorted, and
+ * return how many there are. */
+static int _top_sort(struct mosquitto_db *db, struct _mqtt3_top *top, struct _mqtt3_top_entry **sorted)
+{
+	int i;
+
+	for(i=0; i<top->used; i++){
+		sorted[i] = &top->entries[i];
+	}
+	qsort(sorted, top->used, sizeof(struct _mqtt3_top_entry *), _top_cmp);
+	if(top->used < db->config->top_count){
+		return top->used;
+	}
+	return db->config->top_count;
+}
+
+static double _top_rate(struct mosquitto_db *db, struct _mqtt3_top_entry *entry, time_t elapsed)
+{
+	return (double)entry->count * db->config->top_sample / elapsed;
+}
+
+void mqtt3_top_publish_record(struct mosquitto_db *db, const char *client_id, const char *topic, uint32_t payloadlen)
+{
+	if(!_top_sample(db)) return;
+
+	_top_add(&top_lists[mtl_topic_messages], topic, 1);
+	_top_add(&top_lists[mtl_topic_bytes], topic, payloadlen);
+	if(client_id){
+		_top_add(&top_lists[mtl_client_messages], client_id, 1);
+		_top_add(&top_lists[mtl_client_bytes], client_id, payloadlen);
+	}
+}
+
+void mqtt3_top_fan_out_record(struct mosquitto_db *db, const char *topic, int count)
+{
+	if(!_top_sample(db)) return;
+
+	_top_add(&top_lists[mtl_topic_fan_out], topic, count);
+}
+
+/* Publish each list as one message of "rate key" lines, busiest first, then
+ * start the lists again. */
+void mqtt3_top_update(struct mosquitto_db *db)
+{
+	struct _mqtt3_top_entry **sorted;
+	char *payload;
+	int payloadlen;
+	int payload_size;
+	int count;
+	int len;
+	time_t elapsed;
+	int i, j;
+
+	if(top_slots != db->config->top_count * MQTT3_TOP_SLOTS){
+		if(_top_resize(db)) return;
+	}
+	if(!top_slots) return;
+
+	elapsed = mosquitto_time() - top_start;
+	if(elapsed < 1) elapsed = 1;
+
+	sorted = _mosquitto_malloc(sizeof(struct _mqtt3_top_entry *)*top_slots);
+	if(!sorted) return;
+
+	for(i=0; i<mtl_count; i++){
+		count = _top_sort(db, &top_lists[i], sorted);
+		payload_size = 1;
+		for(j=0; j<count; j++){
+			payload_size += strlen(sorted[j]->key) + 32;
+		}
+		payload = _mosquitto_malloc(payload_size);
+		if(!payload) break;
+
+		payloadlen = 0;
+		for(j=0; j<count; j++){
+			len = snprintf(&payload[payloadlen], payload_size-payloadlen, "%s%.2f %s",
+					j ? "\n" : "", _top_rate(db, sorted[j], elapsed), sorted[j]->key);
+			if(len < 0 || len >= payload_size-payloadlen) break;
+			payloadlen += len;
+		}
+		/* An empty list only needs publishing once. */
+		if(payloadlen || !top_lists[i].published_empty){
+			mqtt3_sys_publish(db, top_lists[i].topic, payloadlen, payload);
+			top_lists[i].published_empty = (payloadlen == 0);
+		}
+		_mosquitto_free(payload);
+		_top_clear(&top_lists[i]);
+	}
+	_mosquitto_free(sorted);
+	top_start = mosquitto_time();
+}
+
+/* Log the lists as they stand, without starting them again. */
+void mqtt3_top_print(struct mosquitto_db *db)
+{
+	struct _mqtt3_top_entry **sorted;
+	int count;
+	time_t elapsed;
+	int i, j;
+
+	if(!top_slots) return;
+
+	elapsed = mosquitto_time() - top_start;
+	if(elapsed < 1) elapsed = 1;
+
+	sorted = _mosquitto_malloc(sizeof(struct _mqtt3_top_entry *)*top_slots);
+	if(!sorted) return;
+
+	for(i=0; i<mtl_count; i++){
+		count = _top_sort(db, &top_lists[i], sorted);
+		_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "%s over the last %ld seconds:",
+				top_lists[i].description, (long)elapsed);
+		for(j=0; j<count; j++){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "  %.2f %s",
+					_top_rate(db, sorted[j], elapsed), sorted[j]->key);
+		}
+	}
+	_mosquitto_free(sorted);
+}
+
+void mqtt3_top_cleanup(void)
+{
+	int i;
+
+	for(i=0; i<mtl_count; i++){
+		_top_free(&top_lists[i]);
+	}
+	top_slots = 0;
+}
+
+#endif
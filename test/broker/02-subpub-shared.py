@@ -0,0 +1,140 @@
+#!/usr/bin/env python
+
+# Test whether messages for a shared subscription group are delivered to one
+# member each in turn, while a normal subscription to the same filter still
+# receives every message, and whether a member that unsubscribes leaves the
+# group.
+
+import subprocess
+import socket
+import struct
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+def read_packet(sock):
+    header = sock.recv(1)
+    if header == "":
+        return None
+    remaining_length = 0
+    multiplier = 1
+    while True:
+        byte = struct.unpack("!B", sock.recv(1))[0]
+        remaining_length += (byte & 127) * multiplier
+        multiplier *= 128
+        if byte & 128 == 0:
+            break
+    payload = ""
+    while len(payload) < remaining_length:
+        payload += sock.recv(remaining_length - len(payload))
+    return (struct.unpack("!B", header)[0], payload)
+
+# Return the payloads of the PUBLISH packets received until nothing more is
+# sent.
+def read_publishes(sock):
+    payloads = []
+    try:
+        while True:
+            packet = read_packet(sock)
+            if packet is None:
+                break
+            (cmd, payload) = packet
+            if cmd & 0xF0 != 0x30:
+                continue
+            tlen = struct.unpack("!H", payload[0:2])[0]
+            payloads.append(payload[2+tlen:])
+    except socket.timeout:
+        pass
+    return payloads
+
+def publish(sock, first, count):
+    for i in range(first, first+count):
+        sock.send(mosq_test.gen_publish("jobs/new", qos=0, payload=str(i)))
+    time.sleep(0.5)
+
+def check(name, got, expected):
+    if sorted(got) != sorted(expected):
+        print("FAIL: "+name+" received "+str(got)+", expected "+str(expected)+".")
+        return False
+    return True
+
+rc = 1
+keepalive = 60
+group_count = 3
+message_count = 9
+connack_packet = mosq_test.gen_connack(rc=0)
+
+mid = 5
+share_subscribe_packet = mosq_test.gen_subscribe(mid, "$share/workers/jobs/#", 0)
+share_unsubscribe_packet = mosq_test.gen_unsubscribe(mid, "$share/workers/jobs/#")
+subscribe_packet = mosq_test.gen_subscribe(mid, "jobs/#", 0)
+suback_packet = mosq_test.gen_suback(mid, 0)
+unsuback_packet = mosq_test.gen_unsuback(mid)
+
+broker = subprocess.Popen(['../../src/mosquitto', '-p', '1888'], stderr=subprocess.PIPE)
+
+members = []
+try:
+    time.sleep(0.5)
+
+    for i in range(group_count):
+        sock = mosq_test.do_client_connect(mosq_test.gen_connect("subpub-shared-%d" % (i), keepalive=keepalive), connack_packet, timeout=1)
+        members.append(sock)
+        sock.send(share_subscribe_packet)
+        if not mosq_test.expect_packet(sock, "suback", suback_packet):
+            raise ValueError
+    plain = mosq_test.do_client_connect(mosq_test.gen_connect("subpub-shared-plain", keepalive=keepalive), connack_packet, timeout=1)
+    plain.send(subscribe_packet)
+    if not mosq_test.expect_packet(plain, "suback", suback_packet):
+        raise ValueError
+    pub = mosq_test.do_client_connect(mosq_test.gen_connect("subpub-shared-pub", keepalive=keepalive), connack_packet, timeout=1)
+
+    publish(pub, 0, message_count)
+    ok = check("plain subscriber", read_publishes(plain), [str(i) for i in range(message_count)])
+    got = []
+    for sock in members:
+        payloads = read_publishes(sock)
+        if len(payloads) != message_count/group_count:
+            print("FAIL: Group member received "+str(len(payloads))+" messages.")
+            ok = False
+        got += payloads
+    ok = check("group", got, [str(i) for i in range(message_count)]) and ok
+
+    # The first member leaves, so the others share the next messages.
+    members[0].send(share_unsubscribe_packet)
+    if not mosq_test.expect_packet(members[0], "unsuback", unsuback_packet):
+        raise ValueError
+    publish(pub, message_count, 4)
+    ok = check("departed member", read_publishes(members[0]), []) and ok
+    got = []
+    for sock in members[1:]:
+        payloads = read_publishes(sock)
+        if len(payloads) != 2:
+            print("FAIL: Group member received "+str(len(payloads))+" messages after another left.")
+            ok = False
+        got += payloads
+    ok = check("group", got, [str(i) for i in range(message_count, message_count+4)]) and ok
+
+    if ok:
+        rc = 0
+
+    pub.close()
+    plain.close()
+except ValueError:
+    pass
+finally:
+    for sock in members:
+        sock.close()
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
@@ -0,0 +1,85 @@
+#!/usr/bin/env python
+
+# Test whether a client subscribed to a $SYS topic keeps receiving updates to
+# it, rather than only the first, when allow_duplicate_messages is left at
+# its default.
+
+import subprocess
+import socket
+import struct
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+def read_packet(sock):
+    header = sock.recv(1)
+    if header == "":
+        return None
+    remaining_length = 0
+    multiplier = 1
+    while True:
+        byte = struct.unpack("!B", sock.recv(1))[0]
+        remaining_length += (byte & 127) * multiplier
+        multiplier *= 128
+        if byte & 128 == 0:
+            break
+    payload = ""
+    while len(payload) < remaining_length:
+        payload += sock.recv(remaining_length - len(payload))
+    return (struct.unpack("!B", header)[0], payload)
+
+rc = 1
+mid = 11
+keepalive = 60
+connect_packet = mosq_test.gen_connect("subscribe-sys-updates-test", keepalive=keepalive)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+subscribe_packet = mosq_test.gen_subscribe(mid, "$SYS/broker/uptime", 0)
+suback_packet = mosq_test.gen_suback(mid, 0)
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '02-subscribe-sys-updates.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=2)
+    sock.send(subscribe_packet)
+
+    if mosq_test.expect_packet(sock, "suback", suback_packet):
+        # Count the updates sent live rather than as the retained message
+        # sent on subscribing.
+        updates = []
+        end = time.time() + 7
+        sock.settimeout(4)
+        try:
+            while len(updates) < 2 and time.time() < end:
+                packet = read_packet(sock)
+                if packet is None:
+                    break
+                (cmd, payload) = packet
+                if cmd & 0xF0 == 0x30 and not cmd & 0x01:
+                    tlen = struct.unpack("!H", payload[0:2])[0]
+                    updates.append(payload[2+tlen:])
+        except socket.timeout:
+            pass
+
+        if len(updates) == 2 and updates[0] != updates[1]:
+            rc = 0
+        else:
+            print("FAIL: Received updates "+str(updates)+".")
+
+    sock.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
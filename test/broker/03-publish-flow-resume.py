@@ -0,0 +1,123 @@
+#!/usr/bin/env python
+
+# Test whether reading from a publisher stops once a subscriber that isn't
+# reading passes client_output_high_water, whether it starts again once the
+# subscriber has drained to client_output_low_water, and whether every
+# message reaches the subscriber.
+
+import subprocess
+import socket
+import struct
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+def read_packet(sock):
+    header = sock.recv(1)
+    if header == "":
+        return None
+    remaining_length = 0
+    multiplier = 1
+    while True:
+        byte = struct.unpack("!B", sock.recv(1))[0]
+        remaining_length += (byte & 127) * multiplier
+        multiplier *= 128
+        if byte & 128 == 0:
+            break
+    payload = ""
+    while len(payload) < remaining_length:
+        payload += sock.recv(remaining_length - len(payload))
+    return (struct.unpack("!B", header)[0], payload)
+
+# Connect with a small receive buffer, so that the broker's output to this
+# client backs up as soon as it stops reading.
+def slow_client_connect(connect_packet, connack_packet):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+    sock.settimeout(10)
+    sock.connect(("localhost", 1888))
+    sock.send(connect_packet)
+    if not mosq_test.expect_packet(sock, "connack", connack_packet):
+        sock.close()
+        raise ValueError
+    return sock
+
+rc = 1
+mid = 21
+keepalive = 60
+max_count = 2000
+connack_packet = mosq_test.gen_connack(rc=0)
+pingreq_packet = mosq_test.gen_pingreq()
+pingresp_packet = mosq_test.gen_pingresp()
+
+sub_connect_packet = mosq_test.gen_connect("flow-resume-sub", keepalive=keepalive)
+subscribe_packet = mosq_test.gen_subscribe(mid, "flow/resume", 0)
+suback_packet = mosq_test.gen_suback(mid, 0)
+
+pub_connect_packet = mosq_test.gen_connect("flow-resume-pub", keepalive=keepalive)
+publish_packet = mosq_test.gen_publish("flow/resume", qos=0, payload="x"*10000)
+final_packet = mosq_test.gen_publish("flow/resume", qos=0, payload="final")
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '03-publish-flow-resume.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    sub = slow_client_connect(sub_connect_packet, connack_packet)
+    sub.send(subscribe_packet)
+    if not mosq_test.expect_packet(sub, "suback", suback_packet):
+        raise ValueError
+    pub = mosq_test.do_client_connect(pub_connect_packet, connack_packet, timeout=10)
+
+    # Publish until the broker stops answering PINGREQ, which means that it
+    # has stopped reading from us.
+    sent = 0
+    paused = False
+    pub.settimeout(1)
+    while sent < max_count and not paused:
+        pub.send(publish_packet)
+        sent += 1
+        pub.send(pingreq_packet)
+        try:
+            if not mosq_test.expect_packet(pub, "pingresp", pingresp_packet):
+                raise ValueError
+        except socket.timeout:
+            paused = True
+
+    if not paused:
+        print("FAIL: Publisher not paused after "+str(sent)+" messages.")
+    else:
+        # Drain the subscriber, after which the PINGRESP must arrive.
+        count = 0
+        while count < sent:
+            packet = read_packet(sub)
+            if packet is None:
+                print("FAIL: Subscriber disconnected.")
+                raise ValueError
+            if packet[0] & 0xF0 == 0x30:
+                count += 1
+
+        pub.settimeout(10)
+        if mosq_test.expect_packet(pub, "pingresp", pingresp_packet):
+            pub.send(final_packet)
+            if mosq_test.expect_packet(sub, "final publish", final_packet):
+                rc = 0
+
+    pub.close()
+    sub.close()
+except ValueError:
+    pass
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
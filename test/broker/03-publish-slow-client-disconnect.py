@@ -0,0 +1,85 @@
+#!/usr/bin/env python
+
+# Test whether a subscriber that stops reading is disconnected once it has
+# reached client_output_limit when slow_client_policy is disconnect, without
+# affecting the publisher.
+
+import subprocess
+import socket
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+# Connect with a small receive buffer, so that the broker's output to this
+# client backs up as soon as it stops reading.
+def slow_client_connect(connect_packet, connack_packet):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+    sock.settimeout(10)
+    sock.connect(("localhost", 1888))
+    sock.send(connect_packet)
+    if not mosq_test.expect_packet(sock, "connack", connack_packet):
+        sock.close()
+        raise ValueError
+    return sock
+
+rc = 1
+mid = 13
+keepalive = 60
+message_count = 2000
+connack_packet = mosq_test.gen_connack(rc=0)
+
+sub_connect_packet = mosq_test.gen_connect("slow-client-sub", keepalive=keepalive)
+subscribe_packet = mosq_test.gen_subscribe(mid, "slow/client", 0)
+suback_packet = mosq_test.gen_suback(mid, 0)
+
+pub_connect_packet = mosq_test.gen_connect("slow-client-pub", keepalive=keepalive)
+publish_packet = mosq_test.gen_publish("slow/client", qos=0, payload="x"*10000)
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '03-publish-slow-client-disconnect.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    sub = slow_client_connect(sub_connect_packet, connack_packet)
+    sub.send(subscribe_packet)
+
+    if mosq_test.expect_packet(sub, "suback", suback_packet):
+        pub = mosq_test.do_client_connect(pub_connect_packet, connack_packet, timeout=20)
+        for i in range(message_count):
+            pub.send(publish_packet)
+        # Once the PINGRESP arrives, every message has been processed.
+        pub.send(mosq_test.gen_pingreq())
+        if mosq_test.expect_packet(pub, "pingresp", mosq_test.gen_pingresp()):
+            # Whatever was written before the disconnection can still be
+            # read, then the connection must be closed.
+            received = 0
+            try:
+                while True:
+                    data = sub.recv(65536)
+                    if data == "":
+                        break
+                    received += len(data)
+                if received < message_count*len(publish_packet):
+                    rc = 0
+                else:
+                    print("FAIL: All messages were delivered.")
+            except socket.timeout:
+                print("FAIL: Slow client not disconnected.")
+        pub.close()
+
+    sub.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
@@ -0,0 +1,123 @@
+#!/usr/bin/env python
+
+# Test whether QoS 0 messages for a subscriber that has stopped reading and
+# reached client_output_limit are discarded when slow_client_policy is
+# drop_qos0, and kept for it when slow_client_policy is park. In both cases
+# the subscriber must stay connected and receive new messages once it has
+# caught up.
+
+import subprocess
+import socket
+import struct
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+def read_packet(sock):
+    header = sock.recv(1)
+    if header == "":
+        return None
+    remaining_length = 0
+    multiplier = 1
+    while True:
+        byte = struct.unpack("!B", sock.recv(1))[0]
+        remaining_length += (byte & 127) * multiplier
+        multiplier *= 128
+        if byte & 128 == 0:
+            break
+    payload = ""
+    while len(payload) < remaining_length:
+        payload += sock.recv(remaining_length - len(payload))
+    return (struct.unpack("!B", header)[0], payload)
+
+# Connect with a small receive buffer, so that the broker's output to this
+# client backs up as soon as it stops reading.
+def slow_client_connect(connect_packet, connack_packet):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+    sock.settimeout(10)
+    sock.connect(("localhost", 1888))
+    sock.send(connect_packet)
+    if not mosq_test.expect_packet(sock, "connack", connack_packet):
+        sock.close()
+        raise ValueError
+    return sock
+
+mid = 15
+keepalive = 60
+message_count = 2000
+connack_packet = mosq_test.gen_connack(rc=0)
+
+sub_connect_packet = mosq_test.gen_connect("slow-client-sub", keepalive=keepalive)
+subscribe_packet = mosq_test.gen_subscribe(mid, "slow/client", 0)
+suback_packet = mosq_test.gen_suback(mid, 0)
+
+pub_connect_packet = mosq_test.gen_connect("slow-client-pub", keepalive=keepalive)
+publish_packet = mosq_test.gen_publish("slow/client", qos=0, payload="x"*10000)
+final_packet = mosq_test.gen_publish("slow/client", qos=0, payload="final")
+
+# Flood a subscriber that isn't reading, then read what it was sent and
+# return the number of messages before the final one, or -1 on failure.
+def flood(conf):
+    received = -1
+    broker = subprocess.Popen(['../../src/mosquitto', '-c', conf], stderr=subprocess.PIPE)
+    try:
+        time.sleep(0.5)
+
+        sub = slow_client_connect(sub_connect_packet, connack_packet)
+        sub.send(subscribe_packet)
+        if mosq_test.expect_packet(sub, "suback", suback_packet):
+            pub = mosq_test.do_client_connect(pub_connect_packet, connack_packet, timeout=20)
+            for i in range(message_count):
+                pub.send(publish_packet)
+            # Once the PINGRESP arrives, every message has been processed.
+            pub.send(mosq_test.gen_pingreq())
+            if mosq_test.expect_packet(pub, "pingresp", mosq_test.gen_pingresp()):
+                count = 0
+                sub.settimeout(2)
+                try:
+                    while True:
+                        packet = read_packet(sub)
+                        if packet is None:
+                            print("FAIL: Slow client disconnected.")
+                            count = -1
+                            break
+                        if packet[0] & 0xF0 == 0x30:
+                            count += 1
+                except socket.timeout:
+                    pass
+
+                # Caught up, so new messages must be delivered again.
+                if count >= 0:
+                    sub.settimeout(10)
+                    pub.send(final_packet)
+                    if mosq_test.expect_packet(sub, "final publish", final_packet):
+                        received = count
+            pub.close()
+        sub.close()
+    finally:
+        broker.terminate()
+        broker.wait()
+        if received < 0:
+            (stdo, stde) = broker.communicate()
+            print(stde)
+    return received
+
+rc = 1
+dropped = flood('03-publish-slow-client-qos0.conf')
+if dropped >= 0:
+    parked = flood('03-publish-slow-client-qos0.conf2')
+    if dropped >= message_count:
+        print("FAIL: No messages dropped with drop_qos0.")
+    elif parked != message_count:
+        print("FAIL: Received "+str(parked)+" of "+str(message_count)+" messages with park.")
+    else:
+        rc = 0
+
+exit(rc)
@@ -0,0 +1,107 @@
+#!/usr/bin/env python
+
+# Test whether a client with a persistent session that disconnects before all
+# of the retained messages for its subscription have been queued receives the
+# rest of them when it reconnects.
+
+import subprocess
+import socket
+import struct
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+def read_packet(sock):
+    header = sock.recv(1)
+    if header == "":
+        return None
+    remaining_length = 0
+    multiplier = 1
+    while True:
+        byte = struct.unpack("!B", sock.recv(1))[0]
+        remaining_length += (byte & 127) * multiplier
+        multiplier *= 128
+        if byte & 128 == 0:
+            break
+    payload = ""
+    while len(payload) < remaining_length:
+        payload += sock.recv(remaining_length - len(payload))
+    return (struct.unpack("!B", header)[0], payload)
+
+# Read PUBLISH packets for the subscription until count distinct topics have
+# arrived or nothing more is sent. Acknowledge them if ack is set.
+def read_publishes(sock, topics, count, ack):
+    try:
+        while len(topics) < count:
+            packet = read_packet(sock)
+            if packet is None:
+                break
+            (cmd, payload) = packet
+            if cmd & 0xF0 != 0x30:
+                continue
+            tlen = struct.unpack("!H", payload[0:2])[0]
+            topics.add(payload[2:2+tlen])
+            if ack and cmd & 0x06:
+                mid = struct.unpack("!H", payload[2+tlen:4+tlen])[0]
+                sock.send(mosq_test.gen_puback(mid))
+    except socket.timeout:
+        pass
+
+rc = 1
+keepalive = 60
+message_count = 30
+
+pub_connect_packet = mosq_test.gen_connect("retain-cursor-pub", keepalive=keepalive)
+connect_packet = mosq_test.gen_connect("retain-cursor-test", keepalive=keepalive, clean_session=False)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+mid = 3
+subscribe_packet = mosq_test.gen_subscribe(mid, "retain/cursor/#", 1)
+suback_packet = mosq_test.gen_suback(mid, 1)
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '04-retain-cursor-persistent.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    pub = mosq_test.do_client_connect(pub_connect_packet, connack_packet, timeout=20)
+    for i in range(message_count):
+        pub.send(mosq_test.gen_publish("retain/cursor/%02d" % (i), qos=1, mid=i+1, payload="message", retain=True))
+        mosq_test.expect_packet(pub, "puback", mosq_test.gen_puback(i+1))
+    pub.close()
+    time.sleep(0.5)
+
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=2)
+    sock.send(subscribe_packet)
+
+    if mosq_test.expect_packet(sock, "suback", suback_packet):
+        # Don't acknowledge anything, so only the first few messages are
+        # queued before disconnecting.
+        topics = set()
+        read_publishes(sock, topics, message_count, False)
+        sock.close()
+        if len(topics) < message_count:
+            time.sleep(0.5)
+            sock = mosq_test.do_client_connect(connect_packet, mosq_test.gen_connack(rc=0), timeout=2)
+            read_publishes(sock, topics, message_count, True)
+            sock.close()
+            if len(topics) == message_count:
+                rc = 0
+            else:
+                print("FAIL: Received "+str(len(topics))+" of "+str(message_count)+" retained messages.")
+        else:
+            print("FAIL: All retained messages sent before disconnecting.")
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
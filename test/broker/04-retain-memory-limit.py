@@ -0,0 +1,103 @@
+#!/usr/bin/env python
+
+# Test whether new retained messages are refused once memory_limit has been
+# reached, whether retained messages can still be cleared at that point, and
+# whether retained messages are accepted again once memory use has fallen.
+
+import subprocess
+import socket
+import struct
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+def read_packet(sock):
+    header = sock.recv(1)
+    if header == "":
+        return None
+    remaining_length = 0
+    multiplier = 1
+    while True:
+        byte = struct.unpack("!B", sock.recv(1))[0]
+        remaining_length += (byte & 127) * multiplier
+        multiplier *= 128
+        if byte & 128 == 0:
+            break
+    payload = ""
+    while len(payload) < remaining_length:
+        payload += sock.recv(remaining_length - len(payload))
+    return (struct.unpack("!B", header)[0], payload)
+
+# Publish from a new client each time, because clients that have already
+# published aren't read from once memory use passes 80% of memory_limit.
+def publish(client_id, topic, payload):
+    sock = mosq_test.do_client_connect(mosq_test.gen_connect(client_id, keepalive=keepalive), connack_packet, timeout=10)
+    sock.send(mosq_test.gen_publish(topic, qos=1, mid=mid, payload=payload, retain=True))
+    ok = mosq_test.expect_packet(sock, "puback", mosq_test.gen_puback(mid))
+    sock.close()
+    if not ok:
+        raise ValueError
+
+# Return the topics of the retained messages matching "retain/#".
+def retained_topics():
+    sock = mosq_test.do_client_connect(mosq_test.gen_connect("retain-memory-sub", keepalive=keepalive), connack_packet, timeout=10)
+    sock.send(mosq_test.gen_subscribe(mid, "retain/#", 1))
+    topics = []
+    try:
+        while True:
+            packet = read_packet(sock)
+            if packet is None:
+                break
+            (cmd, payload) = packet
+            if cmd & 0xF0 != 0x30:
+                continue
+            tlen = struct.unpack("!H", payload[0:2])[0]
+            topics.append(payload[2:2+tlen])
+            sock.send(mosq_test.gen_puback(struct.unpack("!H", payload[2+tlen:4+tlen])[0]))
+    except socket.timeout:
+        pass
+    sock.close()
+    return topics
+
+rc = 1
+mid = 3
+keepalive = 60
+message_count = 16
+connack_packet = mosq_test.gen_connack(rc=0)
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '04-retain-memory-limit.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    # Twice memory_limit worth of retained messages.
+    for i in range(message_count):
+        publish("retain-memory-%d" % (i), "retain/%d" % (i), "x"*500000)
+    topics = retained_topics()
+    if len(topics) == 0 or len(topics) >= message_count:
+        print("FAIL: "+str(len(topics))+" of "+str(message_count)+" retained messages kept.")
+    else:
+        for i in range(message_count):
+            publish("retain-memory-clear-%d" % (i), "retain/%d" % (i), None)
+        publish("retain-memory-new", "retain/new", "x"*500000)
+        topics = retained_topics()
+        if topics != ["retain/new"]:
+            print("FAIL: Retained messages "+str(topics)+" after clearing, expected ['retain/new'].")
+        else:
+            rc = 0
+except ValueError:
+    pass
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
@@ -0,0 +1,76 @@
+#!/usr/bin/env python
+
+# Test whether a batch of messages sent by a bridge on $bridge/batch is
+# delivered as separate messages, and whether a bridge sending a batch larger
+# than the broker accepts is disconnected.
+
+import struct
+import subprocess
+import socket
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+def gen_record(topic, payload, qos=0, retain=False):
+    flags = (qos<<1) | (1 if retain else 0)
+    return struct.pack("!H"+str(len(topic))+"sBI", len(topic), topic, flags, len(payload)) + payload
+
+rc = 1
+mid = 530
+keepalive = 60
+connect_packet = mosq_test.gen_connect("batch-test", keepalive=keepalive)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+bridge_connect_packet = mosq_test.gen_connect("batch-bridge", keepalive=keepalive, proto_ver=128+3)
+
+subscribe_packet = mosq_test.gen_subscribe(mid, "batch/#", 0)
+suback_packet = mosq_test.gen_suback(mid, 0)
+
+batch = "\x00" + gen_record("batch/one", "message one") + gen_record("batch/two", "message two")
+batch_packet = mosq_test.gen_publish("$bridge/batch", qos=0, payload=batch)
+publish1_packet = mosq_test.gen_publish("batch/one", qos=0, payload="message one")
+publish2_packet = mosq_test.gen_publish("batch/two", qos=0, payload="message two")
+
+big_batch = "\x00" + gen_record("batch/big", "x"*1100000)
+big_batch_packet = mosq_test.gen_publish("$bridge/batch", qos=0, payload=big_batch)
+
+broker = subprocess.Popen(['../../src/mosquitto', '-p', '1888'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=20)
+    sock.send(subscribe_packet)
+
+    if mosq_test.expect_packet(sock, "suback", suback_packet):
+        bridge = mosq_test.do_client_connect(bridge_connect_packet, connack_packet, timeout=20)
+        bridge.send(batch_packet)
+
+        if mosq_test.expect_packet(sock, "publish 1", publish1_packet):
+            if mosq_test.expect_packet(sock, "publish 2", publish2_packet):
+                bridge.sendall(big_batch_packet)
+                bridge.settimeout(10)
+                try:
+                    if bridge.recv(1) == "":
+                        rc = 0
+                except socket.timeout:
+                    print("FAIL: Bridge not disconnected")
+                except socket.error:
+                    rc = 0
+        bridge.close()
+
+    sock.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
@@ -0,0 +1,157 @@
+#!/usr/bin/env python
+
+# Test whether packets queued for a client in one pass of the main loop share
+# TLS records on a listener with tls_coalesce_writes set, whether each packet
+# still has a record of its own on a listener without it, and whether the
+# client receives every message in both cases.
+
+import subprocess
+import socket
+import ssl
+import struct
+import sys
+import threading
+import time
+
+if sys.version < '2.7':
+    print("WARNING: SSL not supported on Python 2.6")
+    exit(0)
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+# Forward a single connection from proxy_port to port, counting the
+# application data records sent by the broker.
+class RecordCounter(threading.Thread):
+    def __init__(self, proxy_port, port):
+        threading.Thread.__init__(self)
+        self.daemon = True
+        self.port = port
+        self.records = 0
+        self.listen_sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.listen_sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.listen_sock.bind(("localhost", proxy_port))
+        self.listen_sock.listen(1)
+
+    def forward(self, src, dst):
+        try:
+            while True:
+                data = src.recv(4096)
+                if data == "":
+                    break
+                dst.sendall(data)
+        except socket.error:
+            pass
+
+    def run(self):
+        (client, address) = self.listen_sock.accept()
+        self.listen_sock.close()
+        broker_sock = socket.create_connection(("localhost", self.port))
+        upstream = threading.Thread(target=self.forward, args=(client, broker_sock))
+        upstream.daemon = True
+        upstream.start()
+
+        buf = ""
+        try:
+            while True:
+                data = broker_sock.recv(4096)
+                if data == "":
+                    break
+                client.sendall(data)
+                buf += data
+                while len(buf) >= 5:
+                    (content_type, version, length) = struct.unpack("!BHH", buf[0:5])
+                    if len(buf) < 5+length:
+                        break
+                    if content_type == 23:
+                        self.records += 1
+                    buf = buf[5+length:]
+        except socket.error:
+            pass
+
+rc = 1
+keepalive = 10
+message_count = 20
+
+pub_connect_packet = mosq_test.gen_connect("tls-coalesce-pub", keepalive=keepalive)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+mid = 9
+subscribe_packet = mosq_test.gen_subscribe(mid, "coalesce/#", 0)
+suback_packet = mosq_test.gen_suback(mid, 0)
+
+# All of the retained messages have the same length as this one.
+publish_packet = mosq_test.gen_publish("coalesce/00", qos=0, payload="message", retain=True)
+
+# Subscribe through the proxy to a TLS listener and return the number of
+# records that the CONNACK, SUBACK and retained messages arrived in, or -1 if
+# any were missing.
+def subscribe_count_records(port, proxy_port, client_id):
+    counter = RecordCounter(proxy_port, port)
+    counter.start()
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    ssock = ssl.wrap_socket(sock, ca_certs="../ssl/test-root-ca.crt", cert_reqs=ssl.CERT_REQUIRED)
+    ssock.settimeout(20)
+    ssock.connect(("localhost", proxy_port))
+    ssock.send(mosq_test.gen_connect(client_id, keepalive=keepalive))
+    if not mosq_test.expect_packet(ssock, "connack", connack_packet):
+        ssock.close()
+        return -1
+
+    ssock.send(subscribe_packet)
+    if not mosq_test.expect_packet(ssock, "suback", suback_packet):
+        ssock.close()
+        return -1
+    # Retained messages aren't sent in the order they were published.
+    expected = set()
+    for i in range(message_count):
+        expected.add(mosq_test.gen_publish("coalesce/%02d" % (i), qos=0, payload="message", retain=True))
+    received = set()
+    for i in range(message_count):
+        packet = ""
+        while len(packet) < len(publish_packet):
+            data = ssock.recv(len(publish_packet) - len(packet))
+            if data == "":
+                break
+            packet += data
+        received.add(packet)
+    ssock.close()
+    if received != expected:
+        print("FAIL: Received incorrect retained messages.")
+        return -1
+    counter.join(5)
+    return counter.records
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '08-tls-coalesce-writes.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    pub = mosq_test.do_client_connect(pub_connect_packet, connack_packet, port=1889, timeout=20)
+    for i in range(message_count):
+        pub.send(mosq_test.gen_publish("coalesce/%02d" % (i), qos=1, mid=i+1, payload="message", retain=True))
+        mosq_test.expect_packet(pub, "puback", mosq_test.gen_puback(i+1))
+    pub.close()
+
+    separate = subscribe_count_records(1890, 1891, "tls-coalesce-separate")
+    coalesced = subscribe_count_records(1888, 1892, "tls-coalesce-test")
+    if separate != message_count+2:
+        print("FAIL: "+str(separate)+" records without tls_coalesce_writes, expected "+str(message_count+2)+".")
+    elif coalesced < 0 or coalesced >= message_count/2:
+        print("FAIL: "+str(coalesced)+" records with tls_coalesce_writes.")
+    else:
+        rc = 0
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
@@ -0,0 +1,126 @@
+#!/usr/bin/env python
+
+# Test whether a metrics listener serves the broker counters over HTTP in
+# the Prometheus text format, and rejects other paths and methods.
+
+import subprocess
+import socket
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+# Make a request to the metrics listener and return the status line, the
+# headers as a dict and the body.
+def http_request(request):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    sock.settimeout(5)
+    sock.connect(("localhost", 1889))
+    sock.send(request)
+    response = ""
+    while True:
+        data = sock.recv(4096)
+        if data == "":
+            break
+        response += data
+    sock.close()
+
+    (head, body) = response.split("\r\n\r\n", 1)
+    lines = head.split("\r\n")
+    headers = {}
+    for line in lines[1:]:
+        (name, value) = line.split(":", 1)
+        headers[name.lower()] = value.strip()
+    return (lines[0], headers, body)
+
+# Return the series in a metrics page as a dict of "name{labels}" to value,
+# or None if a series appears more than once or a line is malformed.
+def parse_metrics(body):
+    series = {}
+    for line in body.split("\n"):
+        if line == "" or line.startswith("#"):
+            continue
+        (name, value) = line.rsplit(" ", 1)
+        if name in series:
+            print("FAIL: Duplicate series "+name+".")
+            return None
+        series[name] = float(value)
+    return series
+
+def check(name, got, expected):
+    if got != expected:
+        print("FAIL: "+name+" is "+str(got)+", expected "+str(expected)+".")
+        return False
+    return True
+
+rc = 1
+mid = 7
+keepalive = 60
+connect_packet = mosq_test.gen_connect("listener-metrics-test", keepalive=keepalive)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+subscribe_packet = mosq_test.gen_subscribe(mid, "metrics/test", 0)
+suback_packet = mosq_test.gen_suback(mid, 0)
+
+publish_packet = mosq_test.gen_publish("metrics/test", qos=0, payload="message")
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '10-listener-metrics.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=20)
+    sock.send(subscribe_packet)
+
+    if mosq_test.expect_packet(sock, "suback", suback_packet):
+        ok = True
+        for i in range(3):
+            sock.send(publish_packet)
+            ok = mosq_test.expect_packet(sock, "publish", publish_packet) and ok
+
+        (status, headers, body) = http_request("GET /metrics HTTP/1.0\r\n\r\n")
+        ok = check("GET status", status, "HTTP/1.0 200 OK") and ok
+        ok = check("Content-Length", headers.get("content-length"), str(len(body))) and ok
+        ok = check("Content-Type", headers.get("content-type", "").split(";")[0], "text/plain") and ok
+        series = parse_metrics(body)
+        if series is None:
+            ok = False
+        else:
+            ok = check("mosquitto_publish_messages_received_total", series.get("mosquitto_publish_messages_received_total"), 3) and ok
+            ok = check("mosquitto_publish_messages_sent_total", series.get("mosquitto_publish_messages_sent_total"), 3) and ok
+            ok = check("mosquitto_clients{state=\"active\"}", series.get("mosquitto_clients{state=\"active\"}"), 1) and ok
+            ok = check("mosquitto_subscriptions", series.get("mosquitto_subscriptions"), 1) and ok
+            ok = check("listener connections", series.get("mosquitto_listener_connections{port=\"1888\",address=\"\",protocol=\"mqtt\"}"), 1) and ok
+
+        (status, headers, body) = http_request("HEAD /metrics HTTP/1.0\r\n\r\n")
+        ok = check("HEAD status", status, "HTTP/1.0 200 OK") and ok
+        ok = check("HEAD body", body, "") and ok
+
+        (status, headers, body) = http_request("GET /other HTTP/1.0\r\n\r\n")
+        ok = check("GET /other status", status, "HTTP/1.0 404 Not Found") and ok
+
+        (status, headers, body) = http_request("POST /metrics HTTP/1.0\r\nContent-Length: 0\r\n\r\n")
+        ok = check("POST status", status, "HTTP/1.0 405 Method Not Allowed") and ok
+        ok = check("Allow", headers.get("allow"), "GET, HEAD") and ok
+
+        # The MQTT listener is unaffected by the metrics requests.
+        sock.send(publish_packet)
+        ok = mosq_test.expect_packet(sock, "publish", publish_packet) and ok
+
+        if ok:
+            rc = 0
+
+    sock.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
@@ -270,7 +270,7 @@ def gen_connack(resv=0, rc=0):
 
 def gen_publish(topic, qos, payload=None, retain=False, dup=False, mid=0):
     rl = 2+len(topic)
-    pack_format = "!BBH"+str(len(topic))+"s"
+    pack_format = "H"+str(len(topic))+"s"
     if qos > 0:
         rl = rl + 2
         pack_format = pack_format + "H"
@@ -287,6 +287,8 @@ def gen_publish(topic, qos, payload=None, retain=False, dup=False, mid=0):
     if dup:
         cmd = cmd + 8
 
+    rl = pack_remaining_length(rl)
+    pack_format = "!B"+str(len(rl))+"s"+pack_format
     if qos > 0:
         return struct.pack(pack_format, cmd, rl, len(topic), topic, mid, payload)
     else: